@@ -0,0 +1,249 @@
+/*
+    This library is free software; you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 2 of the License or ( at
+    your option ) version 3 or, at the discretion of KDE e.V. ( which shall
+    act as a proxy as in section 14 of the GPLv3 ), any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Library General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this library; see the file COPYING.LIB.  If not, write to
+    the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+    Boston, MA 02110-1301, USA.
+*/
+
+#include <kio/job.h>
+#include <kio/udsentry.h>
+
+#include <QAtomicInt>
+#include <QDebug>
+#include <QMutex>
+#include <QSemaphore>
+#include <QStandardPaths>
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QTest>
+#include <QThread>
+
+// A minimal FTP server that drops the control connection like a server
+// whose idle timeout expires: once when the first TYPE command arrives,
+// and once for the first command after a finished transfer.
+class FtpServerThread : public QThread
+{
+public:
+    FtpServerThread()
+        : m_port(0), m_connections(0), m_drops(0)
+    {
+        start();
+        m_ready.acquire();
+    }
+    ~FtpServerThread()
+    {
+        m_stop.storeRelease(1);
+        wait();
+    }
+
+    quint16 serverPort() const
+    {
+        QMutexLocker lock(&m_mutex);
+        return m_port;
+    }
+    int connectionCount() const
+    {
+        QMutexLocker lock(&m_mutex);
+        return m_connections;
+    }
+    int dropCount() const
+    {
+        QMutexLocker lock(&m_mutex);
+        return m_drops;
+    }
+    // the listing commands, each prefixed with the TYPE in effect
+    QList<QByteArray> transfers() const
+    {
+        QMutexLocker lock(&m_mutex);
+        return m_transfers;
+    }
+
+protected:
+    void run() override
+    {
+        QTcpServer server;
+        QTcpServer dataServer;
+        server.listen(QHostAddress::LocalHost);
+        dataServer.listen(QHostAddress::LocalHost);
+        {
+            QMutexLocker lock(&m_mutex);
+            m_port = server.serverPort();
+        }
+        m_ready.release();
+
+        bool typeDropped = false;
+        bool idleDropped = false;
+        while (!m_stop.loadAcquire()) {
+            if (!server.waitForNewConnection(100)) {
+                continue;
+            }
+            QTcpSocket *control = server.nextPendingConnection();
+            serve(control, &dataServer, &typeDropped, &idleDropped);
+            delete control;
+        }
+    }
+
+private:
+    void reply(QTcpSocket *control, const QByteArray &line)
+    {
+        control->write(line + "\r\n");
+        while (control->bytesToWrite() && control->waitForBytesWritten(1000)) {}
+    }
+
+    void serve(QTcpSocket *control, QTcpServer *dataServer, bool *typeDropped, bool *idleDropped)
+    {
+        {
+            QMutexLocker lock(&m_mutex);
+            ++m_connections;
+        }
+        reply(control, "220 Test server ready");
+        QByteArray type = "A";
+        bool transferred = false;
+        while (!m_stop.loadAcquire()) {
+            if (!control->canReadLine() && !control->waitForReadyRead(100)) {
+                if (control->state() != QAbstractSocket::ConnectedState) {
+                    return;
+                }
+                continue;
+            }
+            while (control->canReadLine()) {
+                const QByteArray line = control->readLine().trimmed();
+                const QByteArray verb = line.split(' ').first().toUpper();
+                if ((verb == "TYPE" && !*typeDropped) || (transferred && !*idleDropped)) {
+                    if (verb == "TYPE") {
+                        *typeDropped = true;
+                    } else {
+                        *idleDropped = true;
+                    }
+                    reply(control, "421 Timeout");
+                    control->disconnectFromHost();
+                    QMutexLocker lock(&m_mutex);
+                    ++m_drops;
+                    return;
+                }
+
+                if (verb == "USER") {
+                    reply(control, "331 Password required");
+                } else if (verb == "PASS") {
+                    reply(control, "230 Logged in");
+                } else if (verb == "SYST") {
+                    reply(control, "215 UNIX Type: L8");
+                } else if (verb == "PWD") {
+                    reply(control, "257 \"/\" is the current directory");
+                } else if (verb == "FEAT") {
+                    reply(control, "211 No features");
+                } else if (verb == "TYPE") {
+                    type = line.mid(5);
+                    reply(control, "200 Type set to " + type);
+                } else if (verb == "CWD") {
+                    reply(control, "250 Directory changed");
+                } else if (verb == "EPSV") {
+                    reply(control, "229 Entering Extended Passive Mode (|||" +
+                          QByteArray::number(dataServer->serverPort()) + "|)");
+                } else if (verb == "LIST") {
+                    if (!dataServer->waitForNewConnection(5000)) {
+                        reply(control, "425 No data connection");
+                        continue;
+                    }
+                    QTcpSocket *data = dataServer->nextPendingConnection();
+                    reply(control, "150 Here comes the listing");
+                    data->write("-rw-r--r--   1 user     group          11 Jan  1  2020 file\r\n");
+                    while (data->bytesToWrite() && data->waitForBytesWritten(1000)) {}
+                    data->disconnectFromHost();
+                    delete data;
+                    reply(control, "226 Transfer complete");
+                    transferred = true;
+                    QMutexLocker lock(&m_mutex);
+                    m_transfers.append(type + ' ' + line);
+                } else if (verb == "QUIT") {
+                    reply(control, "221 Goodbye");
+                    control->disconnectFromHost();
+                    return;
+                } else {
+                    reply(control, "502 Command not implemented");
+                }
+            }
+        }
+    }
+
+    mutable QMutex m_mutex;
+    QSemaphore m_ready;
+    QAtomicInt m_stop;
+    quint16 m_port;
+    int m_connections;
+    int m_drops;
+    QList<QByteArray> m_transfers;
+};
+
+class FTPJobTest : public QObject
+{
+    Q_OBJECT
+
+private Q_SLOTS:
+    void initTestCase();
+    void testReconnectAfterDrop();
+
+private:
+    QStringList listDir(const QUrl &url);
+};
+
+void FTPJobTest::initTestCase()
+{
+    QStandardPaths::setTestModeEnabled(true);
+
+    // To avoid a runtime dependency on klauncher
+    qputenv("KDE_FORK_SLAVES", "yes");
+}
+
+QStringList FTPJobTest::listDir(const QUrl &url)
+{
+    QStringList names;
+    KIO::ListJob *job = KIO::listDir(url, KIO::HideProgressInfo);
+    job->setUiDelegate(nullptr);
+    connect(job, &KIO::ListJob::entries, this, [&names](KIO::Job *, const KIO::UDSEntryList &entries) {
+        Q_FOREACH (const KIO::UDSEntry &entry, entries) {
+            names.append(entry.stringValue(KIO::UDSEntry::UDS_NAME));
+        }
+    });
+    if (!job->exec()) {
+        qWarning() << job->errorString();
+    }
+    return names;
+}
+
+void FTPJobTest::testReconnectAfterDrop()
+{
+    FtpServerThread server;
+    const QUrl url(QStringLiteral("ftp://127.0.0.1:%1/").arg(server.serverPort()));
+
+    // The connection breaks down while the TYPE command that goes along
+    // with EPSV is on its way; the new connection needs it again.
+    QVERIFY(listDir(url).contains(QStringLiteral("file")));
+    QCOMPARE(server.connectionCount(), 2);
+
+    // The slave is reused and finds its connection dropped, as if the
+    // server's idle timeout had expired. The new connection starts in
+    // ASCII mode, so the slave has to send TYPE I again.
+    QVERIFY(listDir(url).contains(QStringLiteral("file")));
+    QCOMPARE(server.connectionCount(), 3);
+    QCOMPARE(server.dropCount(), 2);
+
+    // Both listings went through in binary mode at the first attempt
+    const QList<QByteArray> expected = QList<QByteArray>() << "I list -la" << "I list -la";
+    QCOMPARE(server.transfers(), expected);
+}
+
+QTEST_MAIN(FTPJobTest)
+
+#include "ftp_jobtest.moc"
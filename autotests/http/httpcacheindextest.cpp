@@ -0,0 +1,170 @@
+/*
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Library General Public
+ *  License version 2 as published by the Free Software Foundation;
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Library General Public License
+ *  along with this library; see the file COPYING.LIB.  If not, write to
+ *  the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA 02110-1301, USA.
+ */
+
+#include <QtTest>
+
+#include <QCryptographicHash>
+#include <QDataStream>
+#include <QDateTime>
+#include <QTemporaryDir>
+
+#include "httpcacheindex.h"
+#include "httpcachestore.h"
+
+class HttpCacheIndexTest : public QObject
+{
+    Q_OBJECT
+
+private Q_SLOTS:
+    void init();
+    void testScan();
+    void testSaveAndLoad();
+    void testEvictionOrder();
+    void testClear();
+
+private:
+    static QString name(int i);
+    void writeCacheFile(const QString &baseName, qint32 useCount, int size);
+    QScopedPointer<QTemporaryDir> m_dir;
+};
+
+QTEST_GUILESS_MAIN(HttpCacheIndexTest)
+
+QString HttpCacheIndexTest::name(int i)
+{
+    return QString::fromLatin1(QCryptographicHash::hash(QByteArray::number(i), QCryptographicHash::Sha1).toHex());
+}
+
+void HttpCacheIndexTest::writeCacheFile(const QString &baseName, qint32 useCount, int size)
+{
+    QByteArray data;
+    QDataStream stream(&data, QIODevice::WriteOnly);
+    stream.setVersion(QDataStream::Qt_4_5);
+    stream << quint8('A') << quint8('\n') << quint8(0) << quint8(0);
+    stream << useCount;
+    data.resize(size);
+
+    QFile file(m_dir->path() + QLatin1Char('/') + baseName);
+    QVERIFY(file.open(QIODevice::WriteOnly));
+    QCOMPARE(file.write(data), qint64(size));
+}
+
+void HttpCacheIndexTest::init()
+{
+    m_dir.reset(new QTemporaryDir);
+    QVERIFY(m_dir->isValid());
+}
+
+void HttpCacheIndexTest::testScan()
+{
+    for (int i = 0; i < 10; i++) {
+        writeCacheFile(name(i), i, 100);
+    }
+    writeCacheFile(QStringLiteral("not-a-cache-file"), 0, 100);
+
+    HttpCacheIndex index(m_dir->path());
+    QVERIFY(!index.load());
+    index.startScan();
+    QVERIFY(index.isScanning());
+    while (!index.scanSlice(100)) { }
+    QVERIFY(!index.isScanning());
+    QCOMPARE(index.count(), 10);
+    QCOMPARE(index.totalSize(), qint64(1000));
+    QVERIFY(index.lastScan() > 0);
+
+    // the next scan forgets removed files, but not what was added meanwhile
+    QVERIFY(QFile::remove(m_dir->path() + QLatin1Char('/') + name(0)));
+    index.startScan();
+    index.update(name(20), 1, 0, 50);
+    while (!index.scanSlice(100)) { }
+    QCOMPARE(index.count(), 10);
+    QVERIFY(!index.contains(name(0)));
+    QVERIFY(index.contains(name(20)));
+    QCOMPARE(index.totalSize(), qint64(950));
+}
+
+void HttpCacheIndexTest::testSaveAndLoad()
+{
+    const qint64 now = QDateTime::currentMSecsSinceEpoch() / 1000;
+    {
+        HttpCacheIndex index(m_dir->path());
+        index.update(name(1), 3, now, 1000);
+        index.update(name(2), 1, now, 2000);
+        index.update(name(2), 2, now, 3000);
+        index.update(QStringLiteral("invalid"), 1, now, 1000);
+        QCOMPARE(index.count(), 2);
+        QCOMPARE(index.totalSize(), qint64(4000));
+        QVERIFY(index.isDirty());
+        QVERIFY(index.save());
+        QVERIFY(!index.isDirty());
+    }
+
+    HttpCacheIndex index(m_dir->path());
+    QVERIFY(index.load());
+    QCOMPARE(index.count(), 2);
+    QCOMPARE(index.totalSize(), qint64(4000));
+    QVERIFY(index.contains(name(1)));
+    index.remove(name(1));
+    QCOMPARE(index.totalSize(), qint64(3000));
+}
+
+void HttpCacheIndexTest::testEvictionOrder()
+{
+    const qint64 now = QDateTime::currentMSecsSinceEpoch() / 1000;
+    HttpCacheIndex index(m_dir->path());
+    for (int i = 0; i < 4; i++) {
+        writeCacheFile(name(i), 0, 100);
+    }
+    index.update(name(0), 10, now, 100); // popular
+    index.update(name(1), 0, now - 3600, 100); // old
+    index.update(name(2), 0, now, 100);
+    index.update(name(3), 0, now - 60, 100);
+
+    QVERIFY(HttpCacheIndex::score(HttpCacheIndex::Entry(), now) > 0);
+
+    index.startEviction(250);
+    QVERIFY(index.isEvicting());
+    while (!index.evictSlice(100)) { }
+    QVERIFY(!index.isEvicting());
+    QCOMPARE(index.count(), 2);
+    QVERIFY(index.contains(name(0)));
+    QVERIFY(index.contains(name(2)));
+    QVERIFY(!QFile::exists(m_dir->path() + QLatin1Char('/') + name(1)));
+    QVERIFY(!QFile::exists(m_dir->path() + QLatin1Char('/') + name(3)));
+}
+
+void HttpCacheIndexTest::testClear()
+{
+    writeCacheFile(name(1), 0, 100);
+    writeCacheFile(name(2) + QLatin1String("abc123"), 0, 100); // a temporary file
+    HttpCacheIndex index(m_dir->path());
+    index.update(name(1), 0, 0, 100);
+    QVERIFY(index.save());
+    HttpCacheStore store;
+    QVERIFY(store.open(m_dir->path() + QLatin1String("/store"), 0));
+    const QByteArray key = HttpCacheStore::keyForUrl("http://www.example.org/");
+    QVERIFY(store.insert(key, "record"));
+
+    index.clear();
+    QCOMPARE(index.count(), 0);
+    QCOMPARE(QDir(m_dir->path()).entryList(QDir::Files), QStringList());
+    // the store is emptied too, also for a slave that has it open
+    QCOMPARE(store.count(), 0);
+    QVERIFY(store.read(key).isEmpty());
+    QCOMPARE(QFileInfo(m_dir->path() + QLatin1String("/store/data.") + QString::number(quint8(key.at(0)) % HttpCacheStore::shardCount)).size(), qint64(0));
+}
+
+#include "httpcacheindextest.moc"
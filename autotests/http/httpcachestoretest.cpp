@@ -0,0 +1,191 @@
+/*
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Library General Public
+ *  License version 2 as published by the Free Software Foundation;
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Library General Public License
+ *  along with this library; see the file COPYING.LIB.  If not, write to
+ *  the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA 02110-1301, USA.
+ */
+
+#include <QtTest>
+
+#include <QTemporaryDir>
+
+#include "httpcachestore.h"
+
+class HttpCacheStoreTest : public QObject
+{
+    Q_OBJECT
+
+private Q_SLOTS:
+    void init();
+    void testInsertAndRead();
+    void testReplaceAndRemove();
+    void testPatchAndTouch();
+    void testSharedBetweenInstances();
+    void testGrowIndex();
+    void testChurnDoesNotGrowIndex();
+    void testEviction();
+
+private:
+    static QByteArray key(int i);
+    QScopedPointer<QTemporaryDir> m_dir;
+};
+
+QTEST_GUILESS_MAIN(HttpCacheStoreTest)
+
+QByteArray HttpCacheStoreTest::key(int i)
+{
+    return HttpCacheStore::keyForUrl("http://www.example.org/" + QByteArray::number(i));
+}
+
+void HttpCacheStoreTest::init()
+{
+    m_dir.reset(new QTemporaryDir);
+    QVERIFY(m_dir->isValid());
+}
+
+void HttpCacheStoreTest::testInsertAndRead()
+{
+    HttpCacheStore store;
+    QVERIFY(store.open(m_dir->path(), 0));
+    QCOMPARE(store.count(), 0);
+    QVERIFY(store.read(key(1)).isEmpty());
+
+    QVERIFY(store.insert(key(1), "first record"));
+    QVERIFY(store.insert(key(2), "second record"));
+    QCOMPARE(store.count(), 2);
+    QCOMPARE(store.totalSize(), qint64(25));
+
+    HttpCacheStore::RecordInfo info;
+    QCOMPARE(store.read(key(1), &info), QByteArray("first record"));
+    QCOMPARE(info.size, quint32(12));
+    QCOMPARE(store.read(key(2)), QByteArray("second record"));
+}
+
+void HttpCacheStoreTest::testReplaceAndRemove()
+{
+    HttpCacheStore store;
+    QVERIFY(store.open(m_dir->path(), 0));
+    QVERIFY(store.insert(key(1), "old"));
+    QVERIFY(store.insert(key(1), "replacement"));
+    QCOMPARE(store.count(), 1);
+    QCOMPARE(store.totalSize(), qint64(11));
+    QCOMPARE(store.read(key(1)), QByteArray("replacement"));
+
+    QVERIFY(store.remove(key(1)));
+    QVERIFY(!store.remove(key(1)));
+    QCOMPARE(store.count(), 0);
+    QVERIFY(store.read(key(1)).isEmpty());
+}
+
+void HttpCacheStoreTest::testPatchAndTouch()
+{
+    HttpCacheStore store;
+    QVERIFY(store.open(m_dir->path(), 0));
+    QVERIFY(store.insert(key(1), "header and payload"));
+    QVERIFY(store.patch(key(1), "HEADER"));
+    QVERIFY(!store.patch(key(1), QByteArray(100, 'x')));
+    store.touch(key(1), 3);
+
+    HttpCacheStore::RecordInfo info;
+    QCOMPARE(store.read(key(1), &info), QByteArray("HEADER and payload"));
+    QCOMPARE(info.useCount, quint32(3));
+
+    // hits are written to the index at the latest when the store is closed
+    HttpCacheStore other;
+    QVERIFY(other.open(m_dir->path(), 0));
+    store.close();
+    QCOMPARE(other.read(key(1), &info), QByteArray("HEADER and payload"));
+    QCOMPARE(info.useCount, quint32(3));
+}
+
+void HttpCacheStoreTest::testSharedBetweenInstances()
+{
+    // two instances stand in for two slave processes
+    HttpCacheStore writer;
+    HttpCacheStore reader;
+    QVERIFY(writer.open(m_dir->path(), 0));
+    QVERIFY(reader.open(m_dir->path(), 0));
+
+    QVERIFY(writer.insert(key(1), "shared"));
+    QCOMPARE(reader.read(key(1)), QByteArray("shared"));
+    QVERIFY(reader.remove(key(1)));
+    QVERIFY(writer.read(key(1)).isEmpty());
+
+    // reopening finds the persisted index
+    QVERIFY(writer.insert(key(2), "persistent"));
+    writer.close();
+    QVERIFY(writer.open(m_dir->path(), 0));
+    QCOMPARE(writer.read(key(2)), QByteArray("persistent"));
+}
+
+void HttpCacheStoreTest::testGrowIndex()
+{
+    HttpCacheStore store;
+    HttpCacheStore other;
+    QVERIFY(store.open(m_dir->path(), 0));
+    QVERIFY(other.open(m_dir->path(), 0));
+
+    const int n = 10000; // more than fit into the initial index
+    for (int i = 0; i < n; i++) {
+        QVERIFY(store.insert(key(i), QByteArray::number(i)));
+    }
+    QCOMPARE(store.count(), n);
+    // the other instance has to notice that the index was replaced
+    QCOMPARE(other.count(), n);
+    for (int i = 0; i < n; i += 97) {
+        QCOMPARE(other.read(key(i)), QByteArray::number(i));
+    }
+}
+
+void HttpCacheStoreTest::testChurnDoesNotGrowIndex()
+{
+    HttpCacheStore store;
+    QVERIFY(store.open(m_dir->path(), 0));
+    const QString indexPath = m_dir->path() + QLatin1String("/index");
+    const qint64 indexSize = QFileInfo(indexPath).size();
+
+    // few records at a time, but many more deleted slots than the index has
+    const int n = 20000;
+    for (int i = 0; i < n; i++) {
+        QVERIFY(store.insert(key(i), QByteArray::number(i)));
+        if (i >= 10) {
+            QVERIFY(store.remove(key(i - 10)));
+        }
+    }
+    QCOMPARE(store.count(), 10);
+    QCOMPARE(QFileInfo(indexPath).size(), indexSize);
+    for (int i = n - 10; i < n; i++) {
+        QCOMPARE(store.read(key(i)), QByteArray::number(i));
+    }
+}
+
+void HttpCacheStoreTest::testEviction()
+{
+    HttpCacheStore store;
+    QVERIFY(store.open(m_dir->path(), 1000));
+    const QByteArray record(100, 'r');
+    for (int i = 0; i < 10; i++) {
+        QVERIFY(store.insert(key(i), record));
+    }
+    QCOMPARE(store.count(), 10);
+
+    QVERIFY(store.insert(key(10), record));
+    QVERIFY(store.totalSize() <= 900);
+    QCOMPARE(store.records().count(), store.count());
+
+    const int remaining = store.count();
+    QCOMPARE(store.evict(0), remaining);
+    QCOMPARE(store.count(), 0);
+    QCOMPARE(store.totalSize(), qint64(0));
+}
+
+#include "httpcachestoretest.moc"
@@ -25,6 +25,9 @@
 #include <QDir>
 #include <zlib.h>
 #include "httpfilter.h"
+#if HAVE_ZSTD
+#include <zstd.h>
+#endif
 
 class HTTPFilterTest : public QObject
 {
@@ -34,6 +37,14 @@ private Q_SLOTS:
     void initTestCase();
     void test_deflateWithZlibHeader();
     void test_httpFilterGzip();
+    void test_largeOutput();
+#if HAVE_BROTLI
+    void test_httpFilterBrotli();
+#endif
+#if HAVE_ZSTD
+    void test_httpFilterZstd();
+    void test_httpFilterZstdFrames();
+#endif
 
 private:
     void test_block_write(const QString &fileName, const QByteArray &data);
@@ -145,6 +156,159 @@ void HTTPFilterTest::test_httpFilterGzip()
     }
 }
 
+void HTTPFilterTest::test_largeOutput()
+{
+    // more output than fits into the filter's buffer at once
+    QByteArray data;
+    for (int i = 0; data.size() < 200 * 1024; ++i) {
+        data += QByteArray::number(i) + ' ';
+    }
+    QByteArray compressed;
+    compressed.resize(compressBound(data.size()));
+    unsigned long compressedSize = compressed.size();
+    QCOMPARE(compress2((Bytef *)compressed.data(), &compressedSize, (const Bytef *)data.constData(), data.size(), 9), Z_OK);
+    compressed.resize(compressedSize);
+
+    HTTPFilterDeflate filter;
+    QSignalSpy spyOutput(&filter, SIGNAL(output(QByteArray)));
+    QSignalSpy spyError(&filter, SIGNAL(error(QString)));
+    filter.slotInput(compressed);
+    QCOMPARE(spyError.count(), 0);
+    QVERIFY(spyOutput.count() > 2);
+    // the spy keeps every chunk; the filter must not have overwritten them
+    QByteArray output;
+    for (int i = 0; i < spyOutput.count() - 1; ++i) {
+        output += spyOutput[i][0].toByteArray();
+    }
+    QCOMPARE(output, data);
+    QCOMPARE(spyOutput[spyOutput.count() - 1][0].toByteArray(), QByteArray());
+}
+
+#if HAVE_BROTLI
+void HTTPFilterTest::test_httpFilterBrotli()
+{
+    // testData as compressed by the brotli tool; only the decoder is a dependency
+    const QByteArray compressed = QByteArray::fromHex("8b058068656c6c6f20776f726c640a03");
+
+    // Test sending the whole data in one go
+    {
+        HTTPFilterBrotli filter;
+        QSignalSpy spyOutput(&filter, SIGNAL(output(QByteArray)));
+        QSignalSpy spyError(&filter, SIGNAL(error(QString)));
+        filter.slotInput(compressed);
+        QCOMPARE(spyOutput.count(), 2);
+        QCOMPARE(spyOutput[0][0].toByteArray(), testData);
+        QCOMPARE(spyOutput[1][0].toByteArray(), QByteArray());
+        QCOMPARE(spyError.count(), 0);
+    }
+
+    // Test sending the data byte by byte
+    {
+        m_filterOutput.clear();
+        HTTPFilterBrotli filter;
+        QSignalSpy spyOutput(&filter, SIGNAL(output(QByteArray)));
+        QSignalSpy spyError(&filter, SIGNAL(error(QString)));
+        connect(&filter, SIGNAL(output(QByteArray)), this, SLOT(slotFilterOutput(QByteArray)));
+        for (int i = 0; i < compressed.size(); ++i) {
+            filter.slotInput(QByteArray(compressed.constData() + i, 1));
+            QCOMPARE(spyError.count(), 0);
+        }
+        QCOMPARE(m_filterOutput, testData);
+        QCOMPARE(spyOutput[spyOutput.count() - 1][0].toByteArray(), QByteArray()); // last one was empty
+    }
+
+    // Test corrupt data
+    {
+        HTTPFilterBrotli filter;
+        QSignalSpy spyError(&filter, SIGNAL(error(QString)));
+        filter.slotInput(QByteArray("not brotli at all"));
+        QCOMPARE(spyError.count(), 1);
+    }
+}
+#endif
+
+#if HAVE_ZSTD
+static QByteArray zstdCompress(const QByteArray &data)
+{
+    QByteArray compressed;
+    compressed.resize(ZSTD_compressBound(data.size()));
+    const size_t compressedSize = ZSTD_compress(compressed.data(), compressed.size(), data.constData(), data.size(), 1);
+    if (ZSTD_isError(compressedSize)) {
+        return QByteArray();
+    }
+    compressed.resize(compressedSize);
+    return compressed;
+}
+
+void HTTPFilterTest::test_httpFilterZstd()
+{
+    const QByteArray compressed = zstdCompress(testData);
+    QVERIFY(!compressed.isEmpty());
+
+    m_filterOutput.clear();
+    HTTPFilterZstd filter;
+    QSignalSpy spyOutput(&filter, SIGNAL(output(QByteArray)));
+    QSignalSpy spyError(&filter, SIGNAL(error(QString)));
+    connect(&filter, SIGNAL(output(QByteArray)), this, SLOT(slotFilterOutput(QByteArray)));
+    for (int i = 0; i < compressed.size(); ++i) {
+        filter.slotInput(QByteArray(compressed.constData() + i, 1));
+        QCOMPARE(spyError.count(), 0);
+    }
+    filter.slotInput(QByteArray()); // end of the body
+    QCOMPARE(m_filterOutput, testData);
+    QCOMPARE(spyOutput[spyOutput.count() - 1][0].toByteArray(), QByteArray()); // last one was empty
+}
+
+void HTTPFilterTest::test_httpFilterZstdFrames()
+{
+    // a zstd body may consist of several concatenated frames
+    const QByteArray frame1 = zstdCompress(testData);
+    const QByteArray frame2 = zstdCompress("second frame\n");
+    QVERIFY(!frame1.isEmpty() && !frame2.isEmpty());
+    const QByteArray expected = testData + "second frame\n";
+
+    // both frames in one chunk
+    {
+        m_filterOutput.clear();
+        HTTPFilterZstd filter;
+        QSignalSpy spyOutput(&filter, SIGNAL(output(QByteArray)));
+        QSignalSpy spyError(&filter, SIGNAL(error(QString)));
+        connect(&filter, SIGNAL(output(QByteArray)), this, SLOT(slotFilterOutput(QByteArray)));
+        filter.slotInput(frame1 + frame2);
+        filter.slotInput(QByteArray());
+        QCOMPARE(spyError.count(), 0);
+        QCOMPARE(m_filterOutput, expected);
+        QCOMPARE(spyOutput[spyOutput.count() - 1][0].toByteArray(), QByteArray());
+    }
+
+    // a chunk ending exactly at the frame boundary
+    {
+        m_filterOutput.clear();
+        HTTPFilterZstd filter;
+        QSignalSpy spyOutput(&filter, SIGNAL(output(QByteArray)));
+        QSignalSpy spyError(&filter, SIGNAL(error(QString)));
+        connect(&filter, SIGNAL(output(QByteArray)), this, SLOT(slotFilterOutput(QByteArray)));
+        filter.slotInput(frame1);
+        QCOMPARE(m_filterOutput, testData);
+        filter.slotInput(frame2);
+        filter.slotInput(QByteArray());
+        QCOMPARE(spyError.count(), 0);
+        QCOMPARE(m_filterOutput, expected);
+        QCOMPARE(spyOutput[spyOutput.count() - 1][0].toByteArray(), QByteArray());
+    }
+
+    // a truncated second frame gets no end marker
+    {
+        HTTPFilterZstd filter;
+        QSignalSpy spyOutput(&filter, SIGNAL(output(QByteArray)));
+        filter.slotInput(frame1 + frame2.left(frame2.size() / 2));
+        filter.slotInput(QByteArray());
+        QVERIFY(spyOutput.count() > 0);
+        QVERIFY(!spyOutput[spyOutput.count() - 1][0].toByteArray().isEmpty());
+    }
+}
+#endif
+
 void HTTPFilterTest::slotFilterOutput(const QByteArray &data)
 {
     m_filterOutput += data;
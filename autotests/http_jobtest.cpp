@@ -19,11 +19,17 @@
 */
 
 #include <kio/job.h>
+#include <kio/filecopyjob.h>
+#include <kprotocolmanager.h>
+
+#include <KConfig>
+#include <KConfigGroup>
 
 #include <QDebug>
 #include <QTest>
 #include <QSignalSpy>
 #include <QStandardPaths>
+#include <QTemporaryDir>
 
 #include "httpserver_p.h"
 
@@ -36,6 +42,8 @@ private Q_SLOTS:
     void testBasicGet();
     void testErrorPage();
     void testMimeTypeDetermination();
+    void testSegmentedCopy_data();
+    void testSegmentedCopy();
 };
 
 void HTTPJobTest::initTestCase()
@@ -107,5 +115,54 @@ void HTTPJobTest::testMimeTypeDetermination()
     QCOMPARE(mimeTypeSpy.at(0).at(1).toString(), QStringLiteral("text/html"));
 }
 
+void HTTPJobTest::testSegmentedCopy_data()
+{
+    QTest::addColumn<bool>("serverRanges");
+
+    QTest::newRow("ranges") << true;
+    QTest::newRow("no ranges") << false; // falls back to a single connection
+}
+
+void HTTPJobTest::testSegmentedCopy()
+{
+    QFETCH(bool, serverRanges);
+    KConfig config(QStringLiteral("kioslaverc"), KConfig::NoGlobals);
+    KConfigGroup cfg = config.group(QString());
+    cfg.writeEntry("DownloadSegments", 2);
+    cfg.sync();
+    KProtocolManager::reparseConfiguration();
+
+    // large enough for two segments
+    QByteArray response(9 * 1024 * 1024, Qt::Uninitialized);
+    for (int i = 0; i < response.size(); ++i) {
+        response[i] = char(i % 251);
+    }
+    HttpServerThread server(response, serverRanges ? HttpServerThread::Ranges : HttpServerThread::Public);
+    QTemporaryDir dir;
+    const QUrl dest = QUrl::fromLocalFile(dir.path() + QLatin1String("/download"));
+
+    KIO::FileCopyJob *job = KIO::file_copy(QUrl(server.endPoint()), dest, -1, KIO::HideProgressInfo);
+    job->setUiDelegate(nullptr);
+    job->setSourceSize(response.size());
+    QVERIFY2(job->exec(), qPrintable(job->errorString()));
+
+    QFile file(dest.toLocalFile());
+    QVERIFY(file.open(QIODevice::ReadOnly));
+    QCOMPARE(file.size(), qint64(response.size()));
+    QVERIFY(file.readAll() == response);
+    QVERIFY(!QFile::exists(dest.toLocalFile() + QLatin1String(".part")));
+
+    // every segment asked for its own range
+    QCOMPARE(server.receivedRanges().count(), 2);
+    if (serverRanges) {
+        // and nothing was fetched again over a single connection
+        QCOMPARE(server.requestCount(), 2);
+    }
+
+    cfg.deleteEntry("DownloadSegments");
+    cfg.sync();
+    KProtocolManager::reparseConfiguration();
+}
+
 QTEST_MAIN(HTTPJobTest)
 #include "http_jobtest.moc"
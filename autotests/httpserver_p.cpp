@@ -97,8 +97,22 @@ static void parseAuthLine(const QString &str, Method *method, QString *headerVal
 QByteArray HttpServerThread::makeHttpResponse(const QByteArray &responseData) const
 {
     QByteArray httpResponse;
+    QByteArray body = responseData;
+    QByteArray contentRange;
+    const QByteArray range = m_headers.value("Range");
+    if ((m_features & Ranges) && range.startsWith("bytes=")) {
+        const QList<QByteArray> bounds = range.mid(6).split('-');
+        const int first = bounds.value(0).toInt();
+        const int last = bounds.value(1).isEmpty() ? responseData.size() - 1 : bounds.value(1).toInt();
+        body = responseData.mid(first, last - first + 1);
+        contentRange = "bytes " + QByteArray::number(first) + '-' + QByteArray::number(last) +
+                       '/' + QByteArray::number(responseData.size());
+    }
     if (m_features & Error404) {
         httpResponse += "HTTP/1.1 404 Not Found\r\n";
+    } else if (!contentRange.isEmpty()) {
+        httpResponse += "HTTP/1.1 206 Partial Content\r\n";
+        httpResponse += "Content-Range: " + contentRange + "\r\n";
     } else {
         httpResponse += "HTTP/1.1 200 OK\r\n";
     }
@@ -107,14 +121,14 @@ QByteArray HttpServerThread::makeHttpResponse(const QByteArray &responseData) co
     }
     httpResponse += "Mozilla/5.0 (X11; Linux x86_64) KHTML/5.20.0 (like Gecko) Konqueror/5.20\r\n";
     httpResponse += "Content-Length: ";
-    httpResponse += QByteArray::number(responseData.size());
+    httpResponse += QByteArray::number(body.size());
     httpResponse += "\r\n";
 
     // We don't support multiple connexions so let's ask the client
     // to close the connection every time.
     httpResponse += "Connection: close\r\n";
     httpResponse += "\r\n";
-    httpResponse += responseData;
+    httpResponse += body;
     return httpResponse;
 }
 
@@ -198,6 +212,10 @@ void HttpServerThread::run()
             break;    // normal exit
         }
 
+        ++m_requestCount;
+        if (m_headers.contains("Range")) {
+            m_receivedRanges.append(m_headers.value("Range"));
+        }
         lock.unlock();
 
         //qDebug() << "headers received:" << m_receivedHeaders;
@@ -39,13 +39,14 @@ public:
         Public = 0,    // HTTP with no ssl and no authentication needed
         Ssl = 1,       // HTTPS
         BasicAuth = 2,  // Requires authentication
-        Error404 = 4   // Return "404 not found"
-                   // bitfield, next item is 8
+        Error404 = 4,  // Return "404 not found"
+        Ranges = 8     // Honour "Range: bytes=first-last"
+                   // bitfield, next item is 16
     };
     Q_DECLARE_FLAGS(Features, Feature)
 
     HttpServerThread(const QByteArray &dataToSend, Features features)
-        : m_dataToSend(dataToSend), m_features(features)
+        : m_dataToSend(dataToSend), m_requestCount(0), m_features(features)
     {
         start();
         m_ready.acquire();
@@ -113,6 +114,18 @@ public:
         return m_headers.value(value);
     }
 
+    // the number of requests answered, and the "Range" headers among them
+    int requestCount() const
+    {
+        QMutexLocker lock(&m_mutex);
+        return m_requestCount;
+    }
+    QList<QByteArray> receivedRanges() const
+    {
+        QMutexLocker lock(&m_mutex);
+        return m_receivedRanges;
+    }
+
 protected:
     /* \reimp */ void run() override;
 
@@ -125,11 +138,13 @@ private:
     QByteArray m_dataToSend;
     QByteArray m_contentType;
 
-    mutable QMutex m_mutex; // protects the 4 vars below
+    mutable QMutex m_mutex; // protects the 6 vars below
     QByteArray m_receivedData;
     QByteArray m_receivedHeaders;
     QMap<QByteArray, QByteArray> m_headers;
     int m_port;
+    int m_requestCount;
+    QList<QByteArray> m_receivedRanges;
 
     Features m_features;
     BlockingHttpServer *m_server;
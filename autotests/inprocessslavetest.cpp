@@ -0,0 +1,96 @@
+/* This file is part of the KDE project
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LIB.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+*/
+
+#include <qtest.h>
+#include <QFile>
+#include <QPointer>
+#include <QSignalSpy>
+#include <QStandardPaths>
+#include <QTemporaryDir>
+
+#include <KIO/FileCopyJob>
+
+class InProcessSlaveTest : public QObject
+{
+    Q_OBJECT
+
+private Q_SLOTS:
+    void initTestCase()
+    {
+        QStandardPaths::enableTestMode(true);
+        // the file slave runs on a thread of this process
+        qputenv("KIO_ENABLE_INPROCESS_SLAVES", "1");
+        qputenv("KDE_FORK_SLAVES", "yes");
+    }
+
+    void copyFile()
+    {
+        QTemporaryDir tempDir;
+        QVERIFY(tempDir.isValid());
+        const QString src = tempDir.path() + "/src";
+        const QString dest = tempDir.path() + "/dest";
+        createFile(src, 100 * 1024);
+
+        KIO::FileCopyJob *job = KIO::file_copy(QUrl::fromLocalFile(src), QUrl::fromLocalFile(dest), -1, KIO::HideProgressInfo);
+        QVERIFY2(job->exec(), qPrintable(job->errorString()));
+        QCOMPARE(QFileInfo(dest).size(), qint64(100 * 1024));
+    }
+
+    void killCopy()
+    {
+        QTemporaryDir tempDir;
+        QVERIFY(tempDir.isValid());
+        const QString src = tempDir.path() + "/src";
+        const QString dest = tempDir.path() + "/dest";
+        // large enough that the copy is still running when the job is killed
+        createFile(src, 512 * 1024 * 1024);
+
+        QPointer<KIO::FileCopyJob> job = KIO::file_copy(QUrl::fromLocalFile(src), QUrl::fromLocalFile(dest), -1, KIO::HideProgressInfo);
+        QSignalSpy resultSpy(job.data(), SIGNAL(result(KJob*)));
+        bool killed = false;
+        connect(job.data(), &KJob::processedSize, this, [&job, &killed](KJob *, qulonglong processed) {
+            if (!killed && processed > 0 && job) {
+                killed = true;
+                job->kill();
+            }
+        });
+        QTRY_VERIFY_WITH_TIMEOUT(killed || !job, 30000);
+        if (!job) {
+            QSKIP("The copy finished before it could be killed");
+        }
+        QCOMPARE(resultSpy.count(), 0);
+
+        // the slave notices the kill, stops copying and removes the partial file
+        QTRY_VERIFY_WITH_TIMEOUT(!QFile::exists(dest), 30000);
+
+        // a new slave thread takes over afterwards
+        copyFile();
+    }
+
+private:
+    static void createFile(const QString &path, qint64 size)
+    {
+        QFile f(path);
+        QVERIFY(f.open(QIODevice::WriteOnly));
+        QVERIFY(f.resize(size));
+    }
+};
+
+QTEST_MAIN(InProcessSlaveTest)
+
+#include "inprocessslavetest.moc"
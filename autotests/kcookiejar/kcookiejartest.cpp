@@ -26,6 +26,7 @@
 #include <QtTest>
 #include <qplatformdefs.h>
 #include <qstandardpaths.h>
+#include <utime.h>
 
 #include "../../src/ioslaves/http/kcookiejar/kcookiejar.cpp"
 
@@ -34,6 +35,7 @@ static QString *lastYear;
 static QString *nextYear;
 static KConfig *config = nullptr;
 static int windowId = 1234; // random number to be used as windowId for test cookies
+static bool useJournal = false;
 
 static void FAIL(const QString &msg)
 {
@@ -75,8 +77,53 @@ static void clearCookies(bool sessionOnly = false)
     }
 }
 
+static QString snapshotFile()
+{
+    return QStandardPaths::writableLocation(QStandardPaths::GenericConfigLocation) + QLatin1Char('/') + "kcookiejar-testsnapshot";
+}
+
+static void removeSnapshot()
+{
+    const QString file = snapshotFile();
+    QFile::remove(file);
+    QFile::remove(file + QLatin1String(".journal"));
+    QFile::remove(file + QLatin1String(".journal.old"));
+}
+
+// Restarts with the snapshot and the journal; the changes since the last
+// compaction are only in the journal.
+static void reopenJournal()
+{
+    const QString file = snapshotFile();
+    if (jar->cookieJournalNeedsCompaction()) {
+        jar->finishCookieCompaction(KCookieJar::writeCookieSnapshot(file, jar->startCookieCompaction()));
+    }
+
+    delete jar;
+
+    // Add an incomplete record to the journal, just for testing robustness
+    QFile f(file + QLatin1String(".journal"));
+    f.open(QIODevice::Append);
+    f.write(QByteArray("\0\0\1\0\1", 5));
+    f.close();
+
+    jar = new KCookieJar();
+    clearConfig();
+    if (!jar->loadCookieSnapshot(file)) {
+        FAIL(QStringLiteral("Failed to load the cookie snapshot"));
+    }
+    if (!jar->openCookieJournal(file)) {
+        FAIL(QStringLiteral("Failed to open the cookie journal"));
+    }
+}
+
 static void saveCookies()
 {
+    if (useJournal) {
+        reopenJournal();
+        return;
+    }
+
     QString file = QStandardPaths::writableLocation(QStandardPaths::GenericConfigLocation) + QLatin1Char('/') + "kcookiejar-testcookies";
     QFile::remove(file);
     jar->saveCookies(file);
@@ -269,6 +316,71 @@ private Q_SLOTS:
         runRegression(fileName);
     }
 
+    void testCookieJournal()
+    {
+        removeSnapshot();
+        clearConfig();
+        QVERIFY(jar->openCookieJournal(snapshotFile()));
+        QVERIFY(jar->cookieJournalNeedsCompaction());
+        useJournal = true;
+        runRegression(QFINDTESTDATA("cookie_saving.test"));
+        useJournal = false;
+
+        // The journal was replayed on top of the snapshot, not compacted again
+        QVERIFY(!jar->cookieJournalNeedsCompaction());
+        QVERIFY(!QFile::exists(snapshotFile() + QLatin1String(".journal.old")));
+
+        delete jar;
+        jar = new KCookieJar;
+        removeSnapshot();
+    }
+
+    void testCorruptSnapshot()
+    {
+        removeSnapshot();
+        clearConfig();
+        const QString file = QStandardPaths::writableLocation(QStandardPaths::GenericConfigLocation) + QLatin1Char('/') + "kcookiejar-testcookies";
+        QFile::remove(file);
+
+        // The text file of an older version, migrated to a snapshot
+        processLine(QStringLiteral("COOKIE ASK http://w.y.z/ Set-Cookie: some_value=value1; Path=\"/\"; expires=%NEXTYEAR%"));
+        QVERIFY(jar->saveCookies(file));
+        struct utimbuf times;
+        times.actime = times.modtime = time(nullptr) - 3600;
+        QCOMPARE(utime(QFile::encodeName(file).constData(), &times), 0);
+        delete jar;
+        jar = new KCookieJar;
+        clearConfig();
+        QVERIFY(jar->loadPersistentCookies(file, snapshotFile()));
+        processLine(QStringLiteral("CHECK http://w.y.z/ Cookie: some_value=value1"));
+        QVERIFY(jar->cookieJournalNeedsCompaction());
+        jar->finishCookieCompaction(KCookieJar::writeCookieSnapshot(snapshotFile(), jar->startCookieCompaction()));
+
+        // Changes after the snapshot are only in the journal
+        processLine(QStringLiteral("COOKIE ASK http://w.y.z/ Set-Cookie: some_value=value1; Path=\"/\"; expires=%LASTYEAR%"));
+        processLine(QStringLiteral("COOKIE ASK http://d.e.f/ Set-Cookie: some_value=value2; Path=\"/\"; expires=%NEXTYEAR%"));
+        delete jar;
+
+        QFile snapshot(snapshotFile());
+        QVERIFY(snapshot.open(QIODevice::ReadWrite));
+        QVERIFY(snapshot.resize(snapshot.size() - 1));
+        snapshot.close();
+
+        // The stale text file must not bring back the removed cookie
+        jar = new KCookieJar;
+        clearConfig();
+        QVERIFY(!jar->loadCookieSnapshot(snapshotFile()));
+        QVERIFY(jar->loadPersistentCookies(file, snapshotFile()));
+        processLine(QStringLiteral("CHECK http://w.y.z/"));
+        processLine(QStringLiteral("CHECK http://d.e.f/ Cookie: some_value=value2"));
+        QVERIFY(jar->cookieJournalNeedsCompaction());
+
+        delete jar;
+        jar = new KCookieJar;
+        removeSnapshot();
+        QFile::remove(file);
+    }
+
     void testParseUrl_data()
     {
         QTest::addColumn<QString>("url");
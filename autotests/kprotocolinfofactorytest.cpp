@@ -0,0 +1,128 @@
+/*
+    This library is free software; you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 2 of the License or ( at
+    your option ) version 3 or, at the discretion of KDE e.V. ( which shall
+    act as a proxy as in section 14 of the GPLv3 ), any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Library General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this library; see the file COPYING.LIB.  If not, write to
+    the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+    Boston, MA 02110-1301, USA.
+*/
+
+#include "kprotocolinfofactory_p.h"
+
+#include <QDateTime>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QStandardPaths>
+#include <QTemporaryDir>
+#include <QTest>
+
+#include <utime.h>
+
+static const char s_fakeProtocol[] = "kprotocolinfofactorytest";
+
+class KProtocolInfoFactoryTest : public QObject
+{
+    Q_OBJECT
+
+private Q_SLOTS:
+    void initTestCase();
+    void testIndex();
+
+private:
+    QStringList indexFiles() const;
+};
+
+void KProtocolInfoFactoryTest::initTestCase()
+{
+    QStandardPaths::setTestModeEnabled(true);
+}
+
+QStringList KProtocolInfoFactoryTest::indexFiles() const
+{
+    const QDir cacheDir(QStandardPaths::writableLocation(QStandardPaths::GenericCacheLocation));
+    QStringList files;
+    Q_FOREACH (const QString &name, cacheDir.entryList(QStringList() << QStringLiteral("kio_protocolindex*"), QDir::Files)) {
+        files.append(cacheDir.filePath(name));
+    }
+    return files;
+}
+
+void KProtocolInfoFactoryTest::testIndex()
+{
+    Q_FOREACH (const QString &file, indexFiles()) {
+        QVERIFY(QFile::remove(file));
+    }
+
+    // The first factory finds the plugins and writes the index
+    const QStringList protocols = KProtocolInfoFactory().protocols();
+    QVERIFY(!protocols.contains(QLatin1String(s_fakeProtocol)));
+    QCOMPARE(indexFiles().count(), 1);
+    const QString indexFile = indexFiles().first();
+
+    // Add a protocol to the index which has no plugin, so that we can tell
+    // whether the next factory reads the index
+    QTemporaryDir tempDir;
+    QVERIFY(tempDir.isValid());
+    const QString exec = tempDir.path() + QLatin1String("/fakeslave.so");
+    QFile execFile(exec);
+    QVERIFY(execFile.open(QIODevice::WriteOnly));
+    execFile.close();
+
+    QFile file(indexFile);
+    QVERIFY(file.open(QIODevice::ReadOnly));
+    QJsonObject index = QJsonDocument::fromBinaryData(file.readAll()).object();
+    file.close();
+    QVERIFY(!index.isEmpty());
+    QJsonObject info;
+    info.insert(QStringLiteral("protocol"), QLatin1String(s_fakeProtocol));
+    info.insert(QStringLiteral("input"), QStringLiteral("none"));
+    info.insert(QStringLiteral("output"), QStringLiteral("filesystem"));
+    QJsonObject entry;
+    entry.insert(QStringLiteral("name"), QLatin1String(s_fakeProtocol));
+    entry.insert(QStringLiteral("exec"), exec);
+    entry.insert(QStringLiteral("mtime"), double(QFileInfo(exec).lastModified().toMSecsSinceEpoch()));
+    entry.insert(QStringLiteral("info"), info);
+    QJsonArray plugins = index.value(QStringLiteral("plugins")).toArray();
+    plugins.append(entry);
+    index.insert(QStringLiteral("plugins"), plugins);
+    QVERIFY(file.open(QIODevice::WriteOnly | QIODevice::Truncate));
+    file.write(QJsonDocument(index).toBinaryData());
+    file.close();
+
+    // The index is up to date, so it is used as it is
+    {
+        KProtocolInfoFactory factory;
+        QVERIFY(factory.protocols().contains(QLatin1String(s_fakeProtocol)));
+        QVERIFY(factory.findProtocol(QLatin1String(s_fakeProtocol)));
+        QCOMPARE(factory.protocols().count(), protocols.count() + 1);
+    }
+    QCOMPARE(indexFiles(), QStringList() << indexFile);
+
+    // A plugin overwritten in place makes the index outdated, even though
+    // its directory did not change
+    struct utimbuf times;
+    times.actime = times.modtime = QDateTime::currentDateTime().addSecs(-3600).toTime_t();
+    QCOMPARE(utime(QFile::encodeName(exec).constData(), &times), 0);
+    QCOMPARE(KProtocolInfoFactory().protocols().count(), protocols.count());
+
+    // ... and it gets replaced by an index without the fake protocol
+    QVERIFY(!KProtocolInfoFactory().protocols().contains(QLatin1String(s_fakeProtocol)));
+    QCOMPARE(indexFiles(), QStringList() << indexFile);
+}
+
+QTEST_MAIN(KProtocolInfoFactoryTest)
+
+#include "kprotocolinfofactorytest.moc"
@@ -477,3 +477,30 @@ void KUriFilterTest::localdomain()
     }
 }
 
+
+void KUriFilterTest::asynchronousFileChecks()
+{
+    const QString dir = QDir::tempPath();
+    const QStringList filters(QStringLiteral("kshorturifilter"));
+
+    // the first answers may be provisional, until the directory was checked in the background
+    KUriFilterData filterData;
+    for (int i = 0; i < 50; ++i) {
+        filterData.setData(dir);
+        filterData.setAsynchronousFileChecks(true);
+        QVERIFY(KUriFilter::self()->filterUri(filterData, filters));
+        if (!filterData.isProvisional()) {
+            break;
+        }
+        QTest::qWait(100);
+    }
+    QVERIFY(!filterData.isProvisional());
+    QCOMPARE(filterData.uriType(), KUriFilterData::LocalDir);
+    QCOMPARE(filterData.uri().toLocalFile(), dir);
+
+    // blocking checks are never provisional
+    filterData.setData(dir + QLatin1String("/kurifiltertest-does-not-exist"));
+    QVERIFY(KUriFilter::self()->filterUri(filterData, filters));
+    QVERIFY(!filterData.isProvisional());
+    QCOMPARE(filterData.uriType(), KUriFilterData::LocalFile);
+}
@@ -46,6 +46,7 @@ private Q_SLOTS:
     void internetKeywords_data();
     void internetKeywords();
     void localdomain();
+    void asynchronousFileChecks();
 
 private:
     QStringList minicliFilters;
@@ -0,0 +1,41 @@
+# - Try to find the brotli decoder library
+# Once done this will define
+#
+#  BROTLIDEC_FOUND - system has the brotli decoder library
+#  BrotliDec_INCLUDE_DIRS - the brotli decoder library include directory
+#  BrotliDec_LIBRARIES - the libraries needed to use the brotli decoder library
+
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions
+# are met:
+# 1. Redistributions of source code must retain the above copyright
+#    notice, this list of conditions and the following disclaimer.
+# 2. Redistributions in binary form must reproduce the above copyright
+#    notice, this list of conditions and the following disclaimer in the
+#    documentation and/or other materials provided with the distribution.
+# 3. Neither the name of the University nor the names of its contributors
+#    may be used to endorse or promote products derived from this software
+#    without specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+# IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+# ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+# FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+# DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+# OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+# HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+# LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+# OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+find_package(PkgConfig QUIET)
+pkg_check_modules(PC_BrotliDec QUIET libbrotlidec)
+
+find_path(BrotliDec_INCLUDE_DIRS NAMES brotli/decode.h HINTS ${PC_BrotliDec_INCLUDE_DIRS})
+find_library(BrotliDec_LIBRARIES NAMES brotlidec HINTS ${PC_BrotliDec_LIBRARY_DIRS})
+
+include(FindPackageHandleStandardArgs)
+find_package_handle_standard_args(BrotliDec DEFAULT_MSG BrotliDec_LIBRARIES BrotliDec_INCLUDE_DIRS)
+
+mark_as_advanced(BrotliDec_INCLUDE_DIRS BrotliDec_LIBRARIES)
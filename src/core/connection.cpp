@@ -110,6 +110,9 @@ void Connection::close()
 {
     if (d->backend) {
         d->backend->disconnect(this);
+        // the backend may be in use right now, but an in-process slave must
+        // not wait for its deletion to learn that the connection is gone
+        d->backend->closeChannel();
         d->backend->deleteLater();
         d->backend = nullptr;
     }
@@ -141,6 +144,8 @@ void Connection::connectToRemote(const QUrl &address)
         d->setBackend(new ConnectionBackend(ConnectionBackend::LocalSocketMode, this));
     } else if (scheme == QLatin1String("tcp")) {
         d->setBackend(new ConnectionBackend(ConnectionBackend::TcpSocketMode, this));
+    } else if (scheme == QLatin1String("inprocess")) {
+        d->setBackend(new ConnectionBackend(ConnectionBackend::InProcessMode, this));
     } else {
         qCWarning(KIO_CORE) << "Unknown protocol requested:" << scheme << "(" << address << ")";
         Q_ASSERT(0);
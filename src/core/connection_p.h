@@ -75,7 +75,7 @@ public:
 
     /**
      * Connects to the remote address.
-     * @param address a local:// or tcp:// URL.
+     * @param address a local://, tcp:// or inprocess: URL.
      */
     void connectToRemote(const QUrl &address);
 
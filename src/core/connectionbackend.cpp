@@ -31,11 +31,62 @@
 #include <QPointer>
 #include <QTime>
 #include <QElapsedTimer>
+#include <QHash>
+#include <QMutex>
+#include <QWaitCondition>
 
 #include "kiocoredebug.h"
 
 using namespace KIO;
 
+/**
+ * @internal
+ *
+ * The two ends of an in-process connection share one channel, which holds
+ * the tasks that have not been picked up yet. The listening end lives in the
+ * application's thread and learns about new tasks through its event loop.
+ * The connecting end is the slave, which has no event loop and blocks in
+ * waitForIncomingTask() instead.
+ */
+class KIO::InProcessChannel
+{
+public:
+    enum Side { ListeningSide = 0, ConnectingSide = 1 };
+
+    InProcessChannel()
+        : closed(false)
+    {
+        endpoints[ListeningSide] = endpoints[ConnectingSide] = nullptr;
+        notifyPending[ListeningSide] = notifyPending[ConnectingSide] = false;
+    }
+
+    // must be called with the mutex locked
+    void notify(int side)
+    {
+        if (side == ListeningSide && endpoints[side] && !notifyPending[side]) {
+            notifyPending[side] = true;
+            QMetaObject::invokeMethod(endpoints[side], "channelReadyRead", Qt::QueuedConnection);
+        }
+        taskAvailable.wakeAll();
+    }
+
+    QMutex mutex;
+    QWaitCondition taskAvailable;
+    QVector<Task> tasks[2];
+    ConnectionBackend *endpoints[2];
+    bool notifyPending[2];
+    bool closed;
+};
+
+namespace
+{
+struct InProcessRegistry {
+    QMutex mutex; // also protects the pendingChannels of the listeners
+    QHash<QString, ConnectionBackend *> listeners;
+};
+}
+Q_GLOBAL_STATIC(InProcessRegistry, s_inProcessRegistry)
+
 ConnectionBackend::ConnectionBackend(Mode m, QObject *parent)
     : QObject(parent),
       state(Idle),
@@ -43,7 +94,9 @@ ConnectionBackend::ConnectionBackend(Mode m, QObject *parent)
       len(-1),
       cmd(0),
       signalEmitted(false),
-      mode(m)
+      mode(m),
+      channelSide(InProcessChannel::ListeningSide),
+      channelSuspended(false)
 {
     localServer = nullptr;
 }
@@ -54,6 +107,32 @@ ConnectionBackend::~ConnectionBackend()
             localServer->localSocketType() == KLocalSocket::UnixSocket) {
         QFile::remove(localServer->localPath());
     }
+    if (mode == InProcessMode) {
+        InProcessRegistry *registry = s_inProcessRegistry();
+        if (state == Listening && registry) {
+            QMutexLocker locker(&registry->mutex);
+            registry->listeners.remove(address.path());
+            // don't leave slaves waiting for an application that is gone
+            for (int i = 0; i < pendingChannels.count(); ++i) {
+                QMutexLocker channelLocker(&pendingChannels.at(i)->mutex);
+                pendingChannels.at(i)->closed = true;
+                pendingChannels.at(i)->taskAvailable.wakeAll();
+            }
+        }
+        closeChannel();
+    }
+}
+
+// Closes an in-process connection right away, the other end notices it like
+// a closed socket.
+void ConnectionBackend::closeChannel()
+{
+    if (mode == InProcessMode && channel) {
+        QMutexLocker locker(&channel->mutex);
+        channel->endpoints[channelSide] = nullptr;
+        channel->closed = true;
+        channel->notify(1 - channelSide);
+    }
 }
 
 void ConnectionBackend::setSuspended(bool enable)
@@ -61,6 +140,13 @@ void ConnectionBackend::setSuspended(bool enable)
     if (state != Connected) {
         return;
     }
+    if (mode == InProcessMode) {
+        channelSuspended = enable;
+        if (!enable) {
+            QMetaObject::invokeMethod(this, "channelReadyRead", Qt::QueuedConnection);
+        }
+        return;
+    }
     Q_ASSERT(socket);
     Q_ASSERT(!localServer);     // !tcpServer as well
 
@@ -94,6 +180,10 @@ bool ConnectionBackend::connectToRemote(const QUrl &url)
     Q_ASSERT(!socket);
     Q_ASSERT(!localServer);     // !tcpServer as well
 
+    if (mode == InProcessMode) {
+        return connectToChannel(url);
+    }
+
     if (mode == LocalSocketMode) {
         KLocalSocket *sock = new KLocalSocket(this);
         QString path = url.path();
@@ -135,6 +225,10 @@ bool ConnectionBackend::listenForRemote()
     Q_ASSERT(!socket);
     Q_ASSERT(!localServer);     // !tcpServer as well
 
+    if (mode == InProcessMode) {
+        return listenForChannel();
+    }
+
     if (mode == LocalSocketMode) {
         const QString prefix = QStandardPaths::writableLocation(QStandardPaths::RuntimeLocation);
         static QBasicAtomicInt s_socketCounter = Q_BASIC_ATOMIC_INITIALIZER(1);
@@ -183,6 +277,9 @@ bool ConnectionBackend::listenForRemote()
 bool ConnectionBackend::waitForIncomingTask(int ms)
 {
     Q_ASSERT(state == Connected);
+    if (mode == InProcessMode) {
+        return waitForChannelTask(ms);
+    }
     Q_ASSERT(socket);
     if (socket->state() != QAbstractSocket::ConnectedState) {
         state = Idle;
@@ -219,6 +316,22 @@ bool ConnectionBackend::waitForIncomingTask(int ms)
 bool ConnectionBackend::sendCommand(int cmd, const QByteArray &data) const
 {
     Q_ASSERT(state == Connected);
+
+    if (mode == InProcessMode) {
+        // no header, no copy: the data is implicitly shared with the other end
+        QMutexLocker locker(&channel->mutex);
+        if (channel->closed) {
+            return false;
+        }
+        const int peer = 1 - channelSide;
+        Task task;
+        task.cmd = cmd;
+        task.data = data;
+        channel->tasks[peer].append(std::move(task));
+        channel->notify(peer);
+        return true;
+    }
+
     Q_ASSERT(socket);
 
     char buffer[HeaderSize + 2];
@@ -241,6 +354,9 @@ bool ConnectionBackend::sendCommand(int cmd, const QByteArray &data) const
 ConnectionBackend *ConnectionBackend::nextPendingConnection()
 {
     Q_ASSERT(state == Listening);
+    if (mode == InProcessMode) {
+        return nextPendingChannel();
+    }
     Q_ASSERT(localServer || tcpServer);
     Q_ASSERT(!socket);
 
@@ -338,3 +454,129 @@ void ConnectionBackend::socketReadyRead()
     } while (shouldReadAnother);
 }
 
+
+bool ConnectionBackend::connectToChannel(const QUrl &url)
+{
+    InProcessRegistry *registry = s_inProcessRegistry();
+    QMutexLocker locker(&registry->mutex);
+    ConnectionBackend *listener = registry->listeners.value(url.path());
+    if (!listener) {
+        qCDebug(KIO_CORE) << "could not connect to" << url;
+        return false;
+    }
+
+    channel = QSharedPointer<InProcessChannel>::create();
+    channelSide = InProcessChannel::ConnectingSide;
+    channel->endpoints[channelSide] = this;
+    listener->pendingChannels.append(channel);
+    QMetaObject::invokeMethod(listener, "newConnection", Qt::QueuedConnection);
+    state = Connected;
+    return true;
+}
+
+bool ConnectionBackend::listenForChannel()
+{
+    static QBasicAtomicInt s_channelCounter = Q_BASIC_ATOMIC_INITIALIZER(1);
+    const QString name = QString::number(s_channelCounter.fetchAndAddAcquire(1));
+    address.clear();
+    address.setScheme(QStringLiteral("inprocess"));
+    address.setPath(name);
+
+    InProcessRegistry *registry = s_inProcessRegistry();
+    QMutexLocker locker(&registry->mutex);
+    registry->listeners.insert(name, this);
+    state = Listening;
+    return true;
+}
+
+bool ConnectionBackend::waitForChannelTask(int ms)
+{
+    QVector<Task> tasks;
+    bool closed;
+    {
+        QMutexLocker locker(&channel->mutex);
+        QElapsedTimer timer;
+        timer.start();
+        while (channel->tasks[channelSide].isEmpty() && !channel->closed) {
+            if (ms == -1) {
+                channel->taskAvailable.wait(&channel->mutex);
+            } else {
+                const qint64 remaining = ms - timer.elapsed();
+                if (remaining <= 0 || !channel->taskAvailable.wait(&channel->mutex, ulong(remaining))) {
+                    break;
+                }
+            }
+        }
+        tasks.swap(channel->tasks[channelSide]);
+        closed = channel->closed;
+    }
+
+    signalEmitted = false;
+    deliverChannelTasks(tasks, closed);
+    return signalEmitted;
+}
+
+ConnectionBackend *ConnectionBackend::nextPendingChannel()
+{
+    QSharedPointer<InProcessChannel> newChannel;
+    {
+        QMutexLocker locker(&s_inProcessRegistry()->mutex);
+        if (pendingChannels.isEmpty()) {
+            return nullptr;
+        }
+        newChannel = pendingChannels.takeFirst();
+    }
+
+    ConnectionBackend *result = new ConnectionBackend(InProcessMode);
+    result->state = Connected;
+    result->channel = newChannel;
+    result->channelSide = InProcessChannel::ListeningSide;
+
+    QMutexLocker locker(&newChannel->mutex);
+    newChannel->endpoints[InProcessChannel::ListeningSide] = result;
+    // the slave may have sent something already
+    if (!newChannel->tasks[InProcessChannel::ListeningSide].isEmpty() || newChannel->closed) {
+        newChannel->notify(InProcessChannel::ListeningSide);
+    }
+    return result;
+}
+
+void ConnectionBackend::channelReadyRead()
+{
+    if (!channel) {
+        return;
+    }
+
+    QVector<Task> tasks;
+    bool closed;
+    {
+        QMutexLocker locker(&channel->mutex);
+        if (channelSuspended) {
+            // keep notifyPending set, setSuspended(false) will call us again
+            return;
+        }
+        channel->notifyPending[channelSide] = false;
+        tasks.swap(channel->tasks[channelSide]);
+        closed = channel->closed;
+    }
+
+    deliverChannelTasks(tasks, closed);
+}
+
+void ConnectionBackend::deliverChannelTasks(QVector<Task> &tasks, bool closed)
+{
+    QPointer<ConnectionBackend> that = this;
+    for (int i = 0; i < tasks.count(); ++i) {
+        signalEmitted = true;
+        emit commandReceived(tasks.at(i));
+        // If we're dead, better don't try anything.
+        if (that.isNull()) {
+            return;
+        }
+    }
+
+    if (closed && state == Connected) {
+        state = Idle;
+        emit disconnected();
+    }
+}
@@ -22,6 +22,8 @@
 
 #include <QUrl>
 #include <QObject>
+#include <QSharedPointer>
+#include <QVector>
 class KLocalSocketServer;
 class QTcpServer;
 class QTcpSocket;
@@ -33,6 +35,7 @@ struct Task {
     QByteArray data;
 };
 
+class InProcessChannel;
 
 class ConnectionBackend: public QObject
 {
@@ -40,7 +43,7 @@ class ConnectionBackend: public QObject
 
 public:
     enum { Idle, Listening, Connected } state;
-    enum Mode { LocalSocketMode, TcpSocketMode };
+    enum Mode { LocalSocketMode, TcpSocketMode, InProcessMode };
     QUrl address;
     QString errorString;
 
@@ -57,6 +60,12 @@ private:
     bool signalEmitted;
     quint8 mode;
 
+    // InProcessMode: the tasks are handed over in memory, see InProcessChannel
+    QSharedPointer<InProcessChannel> channel;
+    QVector<QSharedPointer<InProcessChannel> > pendingChannels;
+    int channelSide;
+    bool channelSuspended;
+
     static const int HeaderSize = 10;
     static const int StandardBufferSize = 32 * 1024;
 
@@ -75,10 +84,19 @@ public:
     bool waitForIncomingTask(int ms);
     bool sendCommand(int command, const QByteArray &data) const;
     ConnectionBackend *nextPendingConnection();
+    void closeChannel();
 
 public Q_SLOTS:
     void socketReadyRead();
     void socketDisconnected();
+    void channelReadyRead();
+
+private:
+    bool connectToChannel(const QUrl &url);
+    bool listenForChannel();
+    bool waitForChannelTask(int ms);
+    ConnectionBackend *nextPendingChannel();
+    void deliverChannelTasks(QVector<Task> &tasks, bool closed);
 };
 }
 
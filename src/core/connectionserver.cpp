@@ -63,6 +63,18 @@ void ConnectionServer::listenForRemote()
     //qDebug() << "Listening on" << d->backend->address;
 }
 
+void ConnectionServer::listenInProcess()
+{
+    d->backend = new ConnectionBackend(ConnectionBackend::InProcessMode, this);
+    if (!d->backend->listenForRemote()) {
+        delete d->backend;
+        d->backend = nullptr;
+        return;
+    }
+
+    connect(d->backend, SIGNAL(newConnection()), SIGNAL(newConnection()));
+}
+
 QUrl ConnectionServer::address() const
 {
     if (d->backend) {
@@ -52,6 +52,11 @@ public:
      * address this is listening on.
      */
     void listenForRemote();
+    /**
+     * Like listenForRemote(), but for a slave running on a thread of this
+     * process. No socket is involved, the tasks are handed over in memory.
+     */
+    void listenInProcess();
     bool isListening() const;
     /// Closes the connection.
     void close();
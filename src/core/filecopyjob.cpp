@@ -20,7 +20,10 @@
 
 #include "filecopyjob.h"
 #include "job_p.h"
+#include <QFile>
+#include <QFileInfo>
 #include <QTimer>
+#include <QVector>
 #include "kprotocolmanager.h"
 #include "scheduler.h"
 #include "slave.h"
@@ -28,6 +31,9 @@
 
 using namespace KIO;
 
+// Smaller segments aren't worth another connection
+static const KIO::filesize_t s_minimumSegmentSize = 4 * 1024 * 1024;
+
 static inline Slave *jobSlave(SimpleJob *job)
 {
     return SimpleJobPrivate::get(job)->m_slave;
@@ -41,8 +47,13 @@ public:
                        bool move, JobFlags flags)
         : m_sourceSize(filesize_t(-1)), m_src(src), m_dest(dest), m_moveJob(nullptr), m_copyJob(nullptr), m_delJob(nullptr),
           m_chmodJob(nullptr), m_getJob(nullptr), m_putJob(nullptr), m_permissions(permissions),
-          m_move(move), m_mustChmod(0), m_flags(flags)
+          m_move(move), m_mustChmod(0), m_segmentsTried(0), m_flags(flags),
+          m_segmentFile(nullptr), m_segmentsProcessed(0)
+    {
+    }
+    ~FileCopyJobPrivate()
     {
+        delete m_segmentFile;
     }
     KIO::filesize_t m_sourceSize;
     QDateTime m_modificationTime;
@@ -60,13 +71,33 @@ public:
     bool m_canResume: 1;
     bool m_resumeAnswerSent: 1;
     bool m_mustChmod: 1;
+    bool m_segmentsTried: 1;
     JobFlags m_flags;
 
+    // A segmented download: each get job fetches one byte range of the
+    // source, which is written straight into the local destination file
+    struct Segment {
+        TransferJob *job;
+        KIO::filesize_t offset; // where the next data goes
+        KIO::filesize_t end;    // one past the last byte of the range
+        bool rangeConfirmed;
+        QString modified;
+    };
+    QVector<Segment> m_segments;
+    QFile *m_segmentFile;
+    KIO::filesize_t m_segmentsProcessed;
+
     void startBestCopyMethod();
     void startCopyJob();
     void startCopyJob(const QUrl &slave_url);
     void startRenameJob(const QUrl &slave_url);
     void startDataPump();
+    bool startSegmentedDownload();
+    void abortSegmentedDownload();
+    void finishSegmentedDownload();
+    int segmentIndex(KJob *job) const;
+    void segmentResult(KJob *job);
+    void segmentDone(int i);
     void connectSubjob(SimpleJob *job);
 
     void slotStart();
@@ -97,6 +128,7 @@ public:
      * @param offset the offset to resume from
      */
     void slotCanResume(KIO::Job *job, KIO::filesize_t offset);
+    void slotSegmentData(KIO::Job *job, const QByteArray &data);
 
     Q_DECLARE_PUBLIC(FileCopyJob)
 
@@ -280,6 +312,12 @@ bool FileCopyJob::doSuspend()
         d->m_putJob->suspend();
     }
 
+    for (int i = 0; i < d->m_segments.count(); ++i) {
+        if (d->m_segments.at(i).job) {
+            d->m_segments.at(i).job->suspend();
+        }
+    }
+
     Job::doSuspend();
     return true;
 }
@@ -303,6 +341,12 @@ bool FileCopyJob::doResume()
         d->m_putJob->resume();
     }
 
+    for (int i = 0; i < d->m_segments.count(); ++i) {
+        if (d->m_segments.at(i).job) {
+            d->m_segments.at(i).job->resume();
+        }
+    }
+
     Job::doResume();
     return true;
 }
@@ -334,6 +378,10 @@ void FileCopyJobPrivate::startDataPump()
     Q_Q(FileCopyJob);
     //qDebug();
 
+    if (startSegmentedDownload()) {
+        return;
+    }
+
     m_canResume = false;
     m_resumeAnswerSent = false;
     m_getJob = nullptr; // for now
@@ -353,6 +401,249 @@ void FileCopyJobPrivate::startDataPump()
     q->addSubjob(m_putJob);
 }
 
+bool FileCopyJobPrivate::startSegmentedDownload()
+{
+    Q_Q(FileCopyJob);
+    // Only try once, a failed attempt falls back to the data pump
+    if (m_segmentsTried) {
+        return false;
+    }
+    m_segmentsTried = true;
+
+    // Positional writes need a local file, and byte ranges with a known
+    // end are only implemented by kio_http. Resuming is left to put().
+    const QString scheme = m_src.scheme();
+    if (m_sourceSize == filesize_t(-1) || !m_dest.isLocalFile() || (m_flags & Resume) ||
+            (scheme != QLatin1String("http") && scheme != QLatin1String("https"))) {
+        return false;
+    }
+    const int count = int(qMin(KIO::filesize_t(KProtocolManager::downloadSegments()),
+                               m_sourceSize / s_minimumSegmentSize));
+    if (count < 2) {
+        return false;
+    }
+
+    const QString destPath = m_dest.toLocalFile();
+    const QString partPath = destPath + QLatin1String(".part");
+    if ((!(m_flags & Overwrite) && QFileInfo::exists(destPath)) || QFileInfo::exists(partPath)) {
+        return false; // let put() ask what to do
+    }
+    m_segmentFile = new QFile(KProtocolManager::markPartial() ? partPath : destPath);
+    // Allocating the whole file up front lets each segment write at its offset
+    if (!m_segmentFile->open(QIODevice::WriteOnly) || !m_segmentFile->resize(m_sourceSize)) {
+        qCWarning(KIO_CORE) << "Cannot write" << m_segmentFile->fileName() << m_segmentFile->errorString();
+        m_segmentFile->remove();
+        delete m_segmentFile;
+        m_segmentFile = nullptr;
+        return false;
+    }
+
+    m_segmentsProcessed = 0;
+    m_segments.resize(count);
+    const KIO::filesize_t segmentSize = m_sourceSize / count;
+    for (int i = 0; i < count; ++i) {
+        Segment &segment = m_segments[i];
+        segment.offset = i * segmentSize;
+        segment.end = (i == count - 1) ? m_sourceSize : segment.offset + segmentSize;
+        // the first segment starts at 0, even a server ignoring the range sends it right
+        segment.rangeConfirmed = (i == 0);
+
+        TransferJob *job = KIO::get(m_src, NoReload, HideProgressInfo /* no GUI */);
+        job->setParentJob(q);
+        job->addMetaData(QStringLiteral("errorPage"), QStringLiteral("false"));
+        job->addMetaData(QStringLiteral("AllowCompressedPage"), QStringLiteral("false"));
+        job->addMetaData(QStringLiteral("range-start"), KIO::number(segment.offset));
+        // the end of a HTTP byte range is inclusive
+        job->addMetaData(QStringLiteral("range-end"), KIO::number(segment.end - 1));
+        segment.job = job;
+        q->addSubjob(job);
+        if (q->isSuspended()) {
+            job->suspend();
+        }
+
+        q->connect(job, SIGNAL(data(KIO::Job*,QByteArray)),
+                   SLOT(slotSegmentData(KIO::Job*,QByteArray)));
+        if (i == 0) {
+            q->connect(job, SIGNAL(mimetype(KIO::Job*,QString)),
+                       SLOT(slotMimetype(KIO::Job*,QString)));
+        }
+    }
+    //qDebug() << "downloading" << m_src << "in" << count << "segments";
+    return true;
+}
+
+void FileCopyJobPrivate::abortSegmentedDownload()
+{
+    Q_Q(FileCopyJob);
+    for (int i = 0; i < m_segments.count(); ++i) {
+        TransferJob *job = m_segments.at(i).job;
+        if (job) {
+            job->kill(FileCopyJob::Quietly);
+            q->removeSubjob(job);
+        }
+    }
+    m_segments.clear();
+    if (m_segmentFile) {
+        m_segmentFile->remove();
+        delete m_segmentFile;
+        m_segmentFile = nullptr;
+    }
+    q->setProcessedAmount(KJob::Bytes, 0);
+}
+
+int FileCopyJobPrivate::segmentIndex(KJob *job) const
+{
+    for (int i = 0; i < m_segments.count(); ++i) {
+        if (m_segments.at(i).job == job) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+void FileCopyJobPrivate::slotSegmentData(KIO::Job *job, const QByteArray &data)
+{
+    Q_Q(FileCopyJob);
+    const int i = segmentIndex(job);
+    if (i == -1 || data.isEmpty()) {
+        return;
+    }
+    Segment &segment = m_segments[i];
+    // Only a "206 Partial Content" answer carries the requested range, the
+    // meta data of the response is delivered before its first data
+    if (!segment.rangeConfirmed && job->queryMetaData(QStringLiteral("responsecode")) == QLatin1String("206")) {
+        segment.rangeConfirmed = true;
+    }
+    if (!segment.rangeConfirmed) {
+        // The server sends the file from the start, it doesn't do ranges
+        qCDebug(KIO_CORE) << m_src << "ignores byte ranges, using a single connection";
+        abortSegmentedDownload();
+        startDataPump();
+        return;
+    }
+
+    const qint64 length = qMin(qint64(data.size()), qint64(segment.end - segment.offset));
+    if (length > 0) {
+        if (!m_segmentFile->seek(segment.offset) || m_segmentFile->write(data.constData(), length) != length) {
+            const bool diskFull = (m_segmentFile->error() == QFileDevice::ResourceError);
+            const QString path = m_segmentFile->fileName();
+            abortSegmentedDownload();
+            q->setError(diskFull ? ERR_DISK_FULL : ERR_CANNOT_WRITE);
+            q->setErrorText(path);
+            q->emitResult();
+            return;
+        }
+        segment.offset += length;
+        m_segmentsProcessed += length;
+        q->setProcessedAmount(KJob::Bytes, m_segmentsProcessed);
+    }
+
+    if (length < data.size()) {
+        // More than the range, e.g. the whole file for the first segment;
+        // the rest is fetched by the other segments
+        job->kill(FileCopyJob::Quietly);
+        q->removeSubjob(job);
+        segmentDone(i);
+    }
+}
+
+void FileCopyJobPrivate::segmentResult(KJob *job)
+{
+    Q_Q(FileCopyJob);
+    q->removeSubjob(job);
+    if (job->error()) {
+        abortSegmentedDownload();
+        q->setError(job->error());
+        q->setErrorText(job->errorText());
+        q->emitResult();
+        return;
+    }
+    segmentDone(segmentIndex(job));
+}
+
+void FileCopyJobPrivate::segmentDone(int i)
+{
+    Segment &segment = m_segments[i];
+    segment.modified = segment.job->queryMetaData(QStringLiteral("modified"));
+    segment.job = nullptr;
+    for (int j = 0; j < m_segments.count(); ++j) {
+        if (m_segments.at(j).job) {
+            return; // wait for the others
+        }
+    }
+    finishSegmentedDownload();
+}
+
+void FileCopyJobPrivate::finishSegmentedDownload()
+{
+    Q_Q(FileCopyJob);
+    // Each segment must have got its whole range, and the file must not
+    // have changed on the server in between
+    bool complete = true;
+    QString modified;
+    for (int i = 0; i < m_segments.count(); ++i) {
+        const Segment &segment = m_segments.at(i);
+        if (segment.offset != segment.end) {
+            complete = false;
+        }
+        if (!segment.modified.isEmpty()) {
+            if (modified.isEmpty()) {
+                modified = segment.modified;
+            } else if (modified != segment.modified) {
+                complete = false;
+            }
+        }
+    }
+    if (!complete) {
+        qCWarning(KIO_CORE) << "Segmented download of" << m_src << "is inconsistent, using a single connection";
+        abortSegmentedDownload();
+        startDataPump();
+        return;
+    }
+
+    const QString path = m_segmentFile->fileName();
+    const bool flushed = m_segmentFile->flush();
+    m_segmentFile->close();
+    delete m_segmentFile;
+    m_segmentFile = nullptr;
+    m_segments.clear();
+    if (!flushed) {
+        q->setError(ERR_CANNOT_WRITE);
+        q->setErrorText(path);
+        q->emitResult();
+        return;
+    }
+
+    const QString destPath = m_dest.toLocalFile();
+    if (path != destPath) {
+        // put() does the same with a ".part" file
+        QFile::remove(destPath);
+        if (!QFile::rename(path, destPath)) {
+            q->setError(ERR_CANNOT_RENAME_PARTIAL);
+            q->setErrorText(path);
+            q->emitResult();
+            return;
+        }
+    }
+
+    if (m_modificationTime.isValid()) {
+        SimpleJob *job = KIO::setModificationTime(m_dest, m_modificationTime);
+        job->setParentJob(q);
+        q->addSubjob(job);
+    }
+    if (m_permissions != -1) {
+        m_chmodJob = chmod(m_dest, m_permissions);
+        q->addSubjob(m_chmodJob);
+    }
+    if (m_move) {
+        m_delJob = file_delete(m_src, HideProgressInfo/*no GUI*/);   // Delete source
+        q->addSubjob(m_delJob);
+    }
+    if (!q->hasSubjobs()) {
+        q->emitResult();
+    }
+}
+
 void FileCopyJobPrivate::slotCanResume(KIO::Job *job, KIO::filesize_t offset)
 {
     Q_Q(FileCopyJob);
@@ -488,6 +779,10 @@ void FileCopyJob::slotResult(KJob *job)
 {
     Q_D(FileCopyJob);
     //qDebug() << "this=" << this << "job=" << job;
+    if (d->segmentIndex(job) != -1) {
+        d->segmentResult(job);
+        return;
+    }
     removeSubjob(job);
     // Did job have an error ?
     if (job->error()) {
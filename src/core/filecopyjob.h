@@ -104,6 +104,7 @@ private:
     Q_PRIVATE_SLOT(d_func(), void slotTotalSize(KJob *job, qulonglong size))
     Q_PRIVATE_SLOT(d_func(), void slotPercent(KJob *job, unsigned long pct))
     Q_PRIVATE_SLOT(d_func(), void slotCanResume(KIO::Job *job, KIO::filesize_t offset))
+    Q_PRIVATE_SLOT(d_func(), void slotSegmentData(KIO::Job *job, const QByteArray &data))
 
     Q_DECLARE_PRIVATE(FileCopyJob)
 };
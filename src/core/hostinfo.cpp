@@ -24,15 +24,17 @@ License along with this library.  If not, see <http://www.gnu.org/licenses/>.
 #include <QHash>
 #include <QCache>
 #include <QMetaType>
-#include <QTime>
+#include <QDateTime>
+#include <QElapsedTimer>
 #include <QTimer>
 #include <QList>
-#include <QPair>
-#include <QThread>
 #include <QFutureWatcher>
 #include <QMetaType>
-#include <QSemaphore>
+#include <QMutex>
+#include <QRunnable>
 #include <QSharedPointer>
+#include <QThreadPool>
+#include <QWaitCondition>
 #include <QtConcurrentRun>
 #include <QHostInfo>
 
@@ -47,6 +49,10 @@ License along with this library.  If not, see <http://www.gnu.org/licenses/>.
 #endif
 
 #define TTL 300
+// names which do not exist are looked up again sooner, they may just have been added
+#define NEGATIVE_TTL 30
+// at most this many synchronous lookups run at the same time
+#define MAX_LOOKUP_THREADS 4
 
 namespace KIO
 {
@@ -58,13 +64,19 @@ public:
     virtual ~HostInfoAgentPrivate() {}
     void lookupHost(const QString &hostName, QObject *receiver, const char *member);
     QHostInfo lookupCachedHostInfoFor(const QString &hostName);
-    void cacheLookup(const QHostInfo &);
+    void cacheLookup(const QHostInfo &info)
+    {
+        cacheLookup(info.hostName(), info);
+    }
+    void cacheLookup(const QString &hostName, const QHostInfo &);
     void setCacheSize(int s)
     {
+        QMutexLocker locker(&mutex);
         dnsCache.setMaxCost(s);
     }
     void setTTL(int _ttl)
     {
+        QMutexLocker locker(&mutex);
         ttl = _ttl;
     }
 private Q_SLOTS:
@@ -72,10 +84,18 @@ private Q_SLOTS:
 private:
     class Result;
     class Query;
+    struct CacheEntry {
+        QHostInfo info;
+        QElapsedTimer age; // monotonic, unlike the wall clock
+    };
+    void checkResolvConf();
 
     QHash<QString, Query *> openQueries;
-    QCache<QString, QPair<QHostInfo, QTime> > dnsCache;
+    // the synchronous lookups use the cache from any thread
+    QMutex mutex;
+    QCache<QString, CacheEntry> dnsCache;
     QDateTime resolvConfMTime;
+    QElapsedTimer resolvConfChecked;
     int ttl;
 };
 
@@ -118,133 +138,104 @@ private:
     QString m_hostName;
 };
 
-class NameLookupThreadRequest
+// A synchronous lookup, shared by all threads waiting for the same name
+class NameLookupRequest
 {
 public:
-    NameLookupThreadRequest(const QString &hostName) : m_hostName(hostName)
-    {
-    }
-
-    QSemaphore *semaphore()
-    {
-        return &m_semaphore;
-    }
-
-    QHostInfo result() const
-    {
-        return m_hostInfo;
-    }
-
-    void setResult(const QHostInfo &hostInfo)
-    {
-        m_hostInfo = hostInfo;
-    }
-
-    QString hostName() const
+    explicit NameLookupRequest(const QString &hostName)
+        : hostName(hostName), done(false)
     {
-        return m_hostName;
     }
 
-    int lookupId() const
-    {
-        return m_lookupId;
-    }
-
-    void setLookupId(int id)
-    {
-        m_lookupId = id;
-    }
+    const QString hostName;
+    QMutex mutex;
+    QWaitCondition finished;
+    QHostInfo result;
+    bool done;
 
 private:
-    Q_DISABLE_COPY(NameLookupThreadRequest)
-    QString m_hostName;
-    QSemaphore m_semaphore;
-    QHostInfo m_hostInfo;
-    int m_lookupId;
+    Q_DISABLE_COPY(NameLookupRequest)
 };
-}
-
-Q_DECLARE_METATYPE(QSharedPointer<KIO::NameLookupThreadRequest>)
-
-namespace KIO
-{
 
-class NameLookUpThreadWorker : public QObject
+/*
+   Runs the synchronous lookups on a few threads of its own, so that a name
+   which takes long to resolve does not hold up the others. A lookup which
+   timed out for its caller still completes and ends up in the cache.
+*/
+class NameLookupPool
 {
-    Q_OBJECT
-public Q_SLOTS:
-    void lookupHost(const QSharedPointer<KIO::NameLookupThreadRequest> &request)
+public:
+    NameLookupPool()
     {
-        const QString hostName = request->hostName();
-        const int lookupId = QHostInfo::lookupHost(hostName, this, SLOT(lookupFinished(QHostInfo)));
-        request->setLookupId(lookupId);
-        m_lookups.insert(lookupId, request);
+        m_pool.setMaxThreadCount(MAX_LOOKUP_THREADS);
     }
 
-    void abortLookup(const QSharedPointer<KIO::NameLookupThreadRequest> &request)
-    {
-        QHostInfo::abortHostLookup(request->lookupId());
-        m_lookups.remove(request->lookupId());
-    }
-
-    void lookupFinished(const QHostInfo &hostInfo)
-    {
-        QMap<int, QSharedPointer<NameLookupThreadRequest> >::iterator it = m_lookups.find(hostInfo.lookupId());
-        if (it != m_lookups.end()) {
-            (*it)->setResult(hostInfo);
-            (*it)->semaphore()->release();
-            m_lookups.erase(it);
-        }
-    }
+    QSharedPointer<NameLookupRequest> lookup(const QString &hostName);
+    void finish(const QSharedPointer<NameLookupRequest> &request, const QHostInfo &hostInfo);
 
 private:
-    QMap<int, QSharedPointer<NameLookupThreadRequest> > m_lookups;
+    QMutex m_mutex;
+    QHash<QString, QSharedPointer<NameLookupRequest> > m_pending;
+    QThreadPool m_pool;
 };
 
-class NameLookUpThread : public QThread
+class NameLookupRunnable : public QRunnable
 {
-    Q_OBJECT
 public:
-    NameLookUpThread() : m_worker(nullptr)
-    {
-        qRegisterMetaType< QSharedPointer<NameLookupThreadRequest> > ();
-        start();
-    }
-
-    ~NameLookUpThread() override
-    {
-        quit();
-        wait();
-    }
-
-    NameLookUpThreadWorker *worker()
+    NameLookupRunnable(NameLookupPool *pool, const QSharedPointer<NameLookupRequest> &request)
+        : m_pool(pool), m_request(request)
     {
-        return m_worker;
-    }
-
-    QSemaphore *semaphore()
-    {
-        return &m_semaphore;
     }
 
     void run() override
     {
-        NameLookUpThreadWorker worker;
-        m_worker = &worker;
-        m_semaphore.release();
-        exec();
+        m_pool->finish(m_request, QHostInfo::fromName(m_request->hostName));
     }
 
 private:
-    NameLookUpThreadWorker *m_worker;
-    QSemaphore m_semaphore;
+    NameLookupPool *m_pool;
+    QSharedPointer<NameLookupRequest> m_request;
 };
 }
 
 using namespace KIO;
 
 Q_GLOBAL_STATIC(HostInfoAgentPrivate, hostInfoAgentPrivate)
-Q_GLOBAL_STATIC(NameLookUpThread, nameLookUpThread)
+
+// Never deleted: the destructor of the thread pool would wait for lookups
+// which are stuck in the resolver
+static NameLookupPool *nameLookupPool()
+{
+    static NameLookupPool *pool = new NameLookupPool;
+    return pool;
+}
+
+QSharedPointer<NameLookupRequest> NameLookupPool::lookup(const QString &hostName)
+{
+    QMutexLocker locker(&m_mutex);
+    QSharedPointer<NameLookupRequest> request = m_pending.value(hostName);
+    if (!request) {
+        request = QSharedPointer<NameLookupRequest>(new NameLookupRequest(hostName));
+        m_pending.insert(hostName, request);
+        m_pool.start(new NameLookupRunnable(this, request));
+    }
+    return request;
+}
+
+void NameLookupPool::finish(const QSharedPointer<NameLookupRequest> &request, const QHostInfo &hostInfo)
+{
+    if (!hostInfoAgentPrivate.isDestroyed()) {
+        hostInfoAgentPrivate()->cacheLookup(request->hostName, hostInfo);
+    }
+    {
+        QMutexLocker locker(&m_mutex);
+        m_pending.remove(request->hostName);
+    }
+    QMutexLocker locker(&request->mutex);
+    request->result = hostInfo;
+    request->done = true;
+    request->finished.wakeAll();
+}
 
 void HostInfo::lookupHost(const QString &hostName, QObject *receiver,
                           const char *member)
@@ -264,24 +255,22 @@ QHostInfo HostInfo::lookupHost(const QString &hostName, unsigned long timeout)
         return hostInfo;
     }
 
-    // Look up the name in the KIO/KHTML DNS cache...
+    // Look up the name in the KIO/KHTML DNS cache, which also knows names
+    // that recently failed to resolve...
     hostInfo = HostInfo::lookupCachedHostInfoFor(hostName);
-    if (!hostInfo.hostName().isEmpty() && hostInfo.error() == QHostInfo::NoError) {
+    if (!hostInfo.hostName().isEmpty()) {
         return hostInfo;
     }
 
-    // Failing all of the above, do the lookup...
-    QSharedPointer<NameLookupThreadRequest> request = QSharedPointer<NameLookupThreadRequest>(new NameLookupThreadRequest(hostName));
-    nameLookUpThread()->semaphore()->acquire();
-    nameLookUpThread()->semaphore()->release();
-    QMetaObject::invokeMethod(nameLookUpThread()->worker(), "lookupHost", Qt::QueuedConnection, Q_ARG(QSharedPointer<KIO::NameLookupThreadRequest>, request));
-    if (request->semaphore()->tryAcquire(1, timeout)) {
-        hostInfo = request->result();
-        if (!hostInfo.hostName().isEmpty() && hostInfo.error() == QHostInfo::NoError) {
-            HostInfo::cacheLookup(hostInfo); // cache the look up...
-        }
-    } else {
-        QMetaObject::invokeMethod(nameLookUpThread()->worker(), "abortLookup", Qt::QueuedConnection, Q_ARG(QSharedPointer<KIO::NameLookupThreadRequest>, request));
+    // Failing all of the above, do the lookup, or wait for the one already
+    // running for this name...
+    QSharedPointer<NameLookupRequest> request = nameLookupPool()->lookup(hostName);
+    QMutexLocker locker(&request->mutex);
+    if (!request->done) {
+        request->finished.wait(&request->mutex, timeout);
+    }
+    if (request->done) {
+        hostInfo = request->result;
     }
 
     //qDebug() << "Name look up succeeded for" << hostName;
@@ -321,10 +310,16 @@ HostInfoAgentPrivate::HostInfoAgentPrivate(int cacheSize)
     qRegisterMetaType<QHostInfo>();
 }
 
-void HostInfoAgentPrivate::lookupHost(const QString &hostName,
-                                      QObject *receiver, const char *member)
+// must be called with the mutex locked
+void HostInfoAgentPrivate::checkResolvConf()
 {
 #ifdef _PATH_RESCONF
+    // a stat() per lookup adds up for pages with many links; once a second is enough
+    if (resolvConfChecked.isValid() && resolvConfChecked.elapsed() < 1000) {
+        return;
+    }
+    resolvConfChecked.start();
+
     QFileInfo resolvConf(QFile::decodeName(_PATH_RESCONF));
     QDateTime currentMTime = resolvConf.lastModified();
     if (resolvConf.exists() && currentMTime != resolvConfMTime) {
@@ -334,17 +329,19 @@ void HostInfoAgentPrivate::lookupHost(const QString &hostName,
         dnsCache.clear();
     }
 #endif
+}
 
-    if (QPair<QHostInfo, QTime> *info = dnsCache.object(hostName)) {
-        if (QTime::currentTime() <= info->second.addSecs(ttl)) {
-            Result result;
-            if (receiver) {
-                QObject::connect(&result, SIGNAL(result(QHostInfo)), receiver, member);
-                emit result.result(info->first);
-            }
-            return;
+void HostInfoAgentPrivate::lookupHost(const QString &hostName,
+                                      QObject *receiver, const char *member)
+{
+    const QHostInfo cached = lookupCachedHostInfoFor(hostName);
+    if (!cached.hostName().isEmpty()) {
+        Result result;
+        if (receiver) {
+            QObject::connect(&result, SIGNAL(result(QHostInfo)), receiver, member);
+            emit result.result(cached);
         }
-        dnsCache.remove(hostName);
+        return;
     }
 
     if (Query *query = openQueries.value(hostName)) {
@@ -365,35 +362,45 @@ void HostInfoAgentPrivate::lookupHost(const QString &hostName,
 
 QHostInfo HostInfoAgentPrivate::lookupCachedHostInfoFor(const QString &hostName)
 {
-    QPair<QHostInfo, QTime> *info = dnsCache.object(hostName);
-    if (info && info->second.addSecs(ttl) >= QTime::currentTime()) {
-        return info->first;
+    QMutexLocker locker(&mutex);
+    checkResolvConf();
+
+    if (CacheEntry *entry = dnsCache.object(hostName)) {
+        const int entryTtl = entry->info.error() == QHostInfo::NoError ? ttl : qMin(ttl, NEGATIVE_TTL);
+        if (entry->age.elapsed() < qint64(entryTtl) * 1000) {
+            return entry->info;
+        }
+        dnsCache.remove(hostName);
     }
 
     return QHostInfo();
 }
 
-void HostInfoAgentPrivate::cacheLookup(const QHostInfo &info)
+void HostInfoAgentPrivate::cacheLookup(const QString &hostName, const QHostInfo &info)
 {
-    if (info.hostName().isEmpty()) {
+    if (hostName.isEmpty()) {
         return;
     }
 
-    if (info.error() != QHostInfo::NoError) {
+    // only remember that a name does not exist, other errors may be temporary
+    if (info.error() != QHostInfo::NoError && info.error() != QHostInfo::HostNotFound) {
         return;
     }
 
-    dnsCache.insert(info.hostName(), new QPair<QHostInfo, QTime>(info, QTime::currentTime()));
+    CacheEntry *entry = new CacheEntry;
+    entry->info = info;
+    entry->info.setHostName(hostName); // how the cached result is recognized
+    entry->age.start();
+
+    QMutexLocker locker(&mutex);
+    dnsCache.insert(hostName, entry);
 }
 
 void HostInfoAgentPrivate::queryFinished(const QHostInfo &info)
 {
     Query *query = static_cast<Query * >(sender());
     openQueries.remove(query->hostName());
-    if (info.error() == QHostInfo::NoError) {
-        dnsCache.insert(query->hostName(),
-                        new QPair<QHostInfo, QTime>(info, QTime::currentTime()));
-    }
+    cacheLookup(query->hostName(), info);
     query->deleteLater();
 }
 
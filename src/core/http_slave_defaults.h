@@ -21,6 +21,7 @@
 
 // CONNECTION
 #define DEFAULT_KEEP_ALIVE_TIMEOUT      60              // 60 seconds
+#define DEFAULT_MAX_PIPELINE_DEPTH      8               // Requests in flight per connection
 
 // CACHE SETTINGS
 #define DEFAULT_MAX_CACHE_SIZE          50*1024         // 50 MB
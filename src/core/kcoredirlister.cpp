@@ -860,6 +860,7 @@ void KCoreDirListerCache::slotFilesRemoved(const QList<QUrl> &fileList)
     // Group notifications by parent dirs (usually there would be only one parent dir)
     QMap<QUrl, KFileItemList> removedItemsByDir;
     QList<QUrl> deletedSubdirs;
+    QHash<QUrl, QSet<QUrl> > removedUrlsByDir;
 
     for (auto it = fileList.cbegin(), cend = fileList.end(); it != cend; ++it) {
         QUrl url(*it);
@@ -872,21 +873,38 @@ void KCoreDirListerCache::slotFilesRemoved(const QList<QUrl> &fileList)
         }
 
         const QUrl parentDir = url.adjusted(QUrl::RemoveFilename | QUrl::StripTrailingSlash);
-        dirItem = dirItemForUrl(parentDir);
+        removedUrlsByDir[parentDir].insert(url);
+    }
+
+    // Walk the items of each parent dir once for all of its removed files,
+    // a large delete is notified in batches of many files.
+    for (auto dit = removedUrlsByDir.begin(), dend = removedUrlsByDir.end(); dit != dend; ++dit) {
+        DirItem *dirItem = dirItemForUrl(dit.key());
         if (!dirItem) {
             continue;
         }
-        for (NonMovableFileItemList::iterator fit = dirItem->lstItems.begin(), fend = dirItem->lstItems.end(); fit != fend; ++fit) {
-            if ((*fit).url() == url) {
-                const KFileItem fileitem = *fit;
-                removedItemsByDir[parentDir].append(fileitem);
+        QSet<QUrl> &urls = dit.value();
+        NonMovableFileItemList &items = dirItem->lstItems;
+        NonMovableFileItemList::iterator fit = items.begin();
+        while (fit != items.end() && !urls.isEmpty()) {
+            if (!urls.contains((*fit).url())) {
+                ++fit;
+                continue;
+            }
+            // erase a run of removed items at once, the others keep their address
+            NonMovableFileItemList::iterator runEnd = fit;
+            do {
+                const KFileItem fileitem = *runEnd;
+                const QUrl url = fileitem.url();
+                urls.remove(url);
+                removedItemsByDir[dit.key()].append(fileitem);
                 // If we found a fileitem, we can test if it's a dir. If not, we'll go to deleteDir just in case.
                 if (fileitem.isNull() || fileitem.isDir()) {
                     deletedSubdirs.append(url);
                 }
-                dirItem->lstItems.erase(fit); // remove fileitem from list
-                break;
-            }
+                ++runEnd;
+            } while (runEnd != items.end() && urls.contains((*runEnd).url()));
+            fit = items.erase(fit, runEnd); // remove fileitems from list
         }
     }
 
@@ -21,6 +21,11 @@
 
 #include "kdirnotify.h"
 #include <kdbusconnectionpool.h> // HAND-EDIT
+#include <QCoreApplication>
+#include <QPointer>
+#include <QSet>
+#include <QThread>
+#include <QTimer>
 #include <QUrl>
 
 /*
@@ -36,7 +41,7 @@ OrgKdeKDirNotifyInterface::~OrgKdeKDirNotifyInterface()
 {
 }
 
-static void emitSignal(const QString &signalName, const QVariantList &args)
+static void sendSignal(const QString &signalName, const QVariantList &args)
 {
     QDBusMessage message =
         QDBusMessage::createSignal(QStringLiteral("/"), QLatin1String(org::kde::KDirNotify::staticInterfaceName()), signalName);
@@ -44,6 +49,126 @@ static void emitSignal(const QString &signalName, const QVariantList &args)
     QDBusConnection::sessionBus().send(message);
 }
 
+// FilesAdded carries one directory, FilesChanged and FilesRemoved a list of files
+static void sendBatch(const QString &signalName, const QStringList &urls)
+{
+    if (signalName == QLatin1String("FilesAdded")) {
+        Q_FOREACH (const QString &url, urls) {
+            sendSignal(signalName, QVariantList() << url);
+        }
+    } else {
+        sendSignal(signalName, QVariantList() << QVariant(urls));
+    }
+}
+
+// How long notifications are collected before they are sent, in milliseconds.
+static const int s_batchDelay = 50;
+
+/*
+ * Collects the FilesAdded, FilesChanged and FilesRemoved notifications of
+ * this process for a short while and sends each URL only once, so that a
+ * large copy or delete doesn't make every directory lister on the desktop
+ * process a storm of signals.
+ * Consecutive notifications of the same kind are merged, the order between
+ * different kinds is kept.
+ */
+class KDirNotifyBatcher : public QObject
+{
+public:
+    explicit KDirNotifyBatcher(QCoreApplication *app)
+        : QObject(app)
+    {
+        m_timer.setSingleShot(true);
+        m_timer.setInterval(s_batchDelay);
+        connect(&m_timer, &QTimer::timeout, this, &KDirNotifyBatcher::flush);
+        connect(app, &QCoreApplication::aboutToQuit, this, &KDirNotifyBatcher::flush);
+    }
+
+    ~KDirNotifyBatcher()
+    {
+        flush();
+    }
+
+    void add(const QString &signalName, const QStringList &urls)
+    {
+        if (m_pending.isEmpty() || m_pending.last().signalName != signalName) {
+            Batch batch;
+            batch.signalName = signalName;
+            m_pending.append(batch);
+        }
+        Batch &batch = m_pending.last();
+        Q_FOREACH (const QString &url, urls) {
+            if (!batch.seen.contains(url)) {
+                batch.seen.insert(url);
+                batch.urls.append(url);
+            }
+        }
+        // don't restart, a steady stream of notifications must not starve the receivers
+        if (!m_timer.isActive()) {
+            m_timer.start();
+        }
+    }
+
+    void flush()
+    {
+        m_timer.stop();
+        QList<Batch> pending;
+        pending.swap(m_pending);
+        Q_FOREACH (const Batch &batch, pending) {
+            sendBatch(batch.signalName, batch.urls);
+        }
+    }
+
+private:
+    struct Batch {
+        QString signalName;
+        QStringList urls;
+        QSet<QString> seen;
+    };
+    QList<Batch> m_pending;
+    QTimer m_timer;
+};
+
+static QPointer<KDirNotifyBatcher> s_batcher;
+
+static KDirNotifyBatcher *batcher()
+{
+    QCoreApplication *app = QCoreApplication::instance();
+    // Without an event loop running in the main thread, e.g. in a slave, a
+    // batch might never be sent.
+    if (!app || QThread::currentThread() != app->thread() || app->thread()->loopLevel() == 0) {
+        return nullptr;
+    }
+    if (!s_batcher) {
+        s_batcher = new KDirNotifyBatcher(app);
+    }
+    return s_batcher;
+}
+
+// send what was collected first, the receivers rely on the order
+static void flushBatcher()
+{
+    if (s_batcher && QThread::currentThread() == s_batcher->thread()) {
+        s_batcher->flush();
+    }
+}
+
+static void emitSignal(const QString &signalName, const QVariantList &args)
+{
+    flushBatcher();
+    sendSignal(signalName, args);
+}
+
+static void emitBatchedSignal(const QString &signalName, const QStringList &urls)
+{
+    if (KDirNotifyBatcher *b = batcher()) {
+        b->add(signalName, urls);
+    } else {
+        flushBatcher();
+        sendBatch(signalName, urls);
+    }
+}
+
 void OrgKdeKDirNotifyInterface::emitFileRenamed(const QUrl &src, const QUrl &dst)
 {
     emitSignal(QStringLiteral("FileRenamed"), QVariantList() << src.toString() << dst.toString());
@@ -63,17 +188,17 @@ void OrgKdeKDirNotifyInterface::emitFileMoved(const QUrl &src, const QUrl &dst)
 
 void OrgKdeKDirNotifyInterface::emitFilesAdded(const QUrl &directory)
 {
-    emitSignal(QStringLiteral("FilesAdded"), QVariantList() << directory.toString());
+    emitBatchedSignal(QStringLiteral("FilesAdded"), QStringList() << directory.toString());
 }
 
 void OrgKdeKDirNotifyInterface::emitFilesChanged(const QList<QUrl> &fileList)
 {
-    emitSignal(QStringLiteral("FilesChanged"), QVariantList() << QVariant(QUrl::toStringList(fileList)));
+    emitBatchedSignal(QStringLiteral("FilesChanged"), QUrl::toStringList(fileList));
 }
 
 void OrgKdeKDirNotifyInterface::emitFilesRemoved(const QList<QUrl> &fileList)
 {
-    emitSignal(QStringLiteral("FilesRemoved"), QVariantList() << QVariant(QUrl::toStringList(fileList)));
+    emitBatchedSignal(QStringLiteral("FilesRemoved"), QUrl::toStringList(fileList));
 }
 
 void OrgKdeKDirNotifyInterface::emitEnteredDirectory(const QUrl &url)
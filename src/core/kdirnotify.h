@@ -56,6 +56,11 @@ class QDBusConnection;
  *
  * The second usage is to actually emit the signals. For that emitFileRenamed() and friends are
  * to be used.
+ *
+ * Since 5.50, emitFilesAdded(), emitFilesChanged() and emitFilesRemoved() called from the
+ * main thread while its event loop runs are collected for a short while and sent as
+ * few signals, without duplicate URLs. Any other emit function sends the collected
+ * notifications first, so the order of the notifications is kept.
  */
 class KIOCORE_EXPORT OrgKdeKDirNotifyInterface: public QDBusAbstractInterface
 {
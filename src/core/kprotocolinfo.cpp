@@ -52,6 +52,8 @@ KProtocolInfoPrivate::KProtocolInfoPrivate(const QString &path)
     m_canRenameFromFile = config.readEntry("renameFromFile", false);
     m_canRenameToFile = config.readEntry("renameToFile", false);
     m_canDeleteRecursive = config.readEntry("deleteRecursive", false);
+    m_inProcess = config.readEntry("inProcess", false);
+    m_canOpenConnection = config.readEntry("openConnection", false);
     const QString fnu = config.readEntry("fileNameUsedForCopying", "FromURL");
     m_fileNameUsedForCopying = KProtocolInfo::FromUrl;
     if (fnu == QLatin1String("Name")) {
@@ -141,6 +143,8 @@ KProtocolInfoPrivate::KProtocolInfoPrivate(const QString &name, const QString &e
     m_canRenameFromFile = json.value(QStringLiteral("renameFromFile")).toBool();
     m_canRenameToFile = json.value(QStringLiteral("renameToFile")).toBool();
     m_canDeleteRecursive = json.value(QStringLiteral("deleteRecursive")).toBool();
+    m_inProcess = json.value(QStringLiteral("inProcess")).toBool();
+    m_canOpenConnection = json.value(QStringLiteral("openConnection")).toBool();
 
     // default is "FromURL"
     const QString fnu = json.value(QStringLiteral("fileNameUsedForCopying")).toString();
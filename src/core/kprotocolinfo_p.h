@@ -55,6 +55,8 @@ public:
     bool m_canRenameFromFile : 1;
     bool m_canRenameToFile : 1;
     bool m_canDeleteRecursive : 1;
+    bool m_inProcess : 1;
+    bool m_canOpenConnection : 1;
     QString m_defaultMimetype;
     QString m_icon;
     QString m_config;
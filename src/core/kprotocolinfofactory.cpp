@@ -24,7 +24,15 @@
 #include <KPluginLoader>
 #include <KPluginMetaData>
 
+#include <QCoreApplication>
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QDir>
 #include <QDirIterator>
+#include <QFileInfo>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QSaveFile>
 #include <qstandardpaths.h>
 
 #include "kiocoredebug.h"
@@ -36,8 +44,77 @@ KProtocolInfoFactory *KProtocolInfoFactory::self()
     return kProtocolInfoFactoryInstance();
 }
 
+/*
+   Finding the plugins means reading the metadata of every slave, which
+   dominates the start of short-lived programs. So the result is kept in an
+   index, a binary JSON document which is mapped into memory. It is valid as
+   long as the directories searched are the same and unmodified; installing or
+   removing a plugin or a .protocol file changes the modification time of its
+   directory. Processes searching different directories (e.g. because of
+   QT_PLUGIN_PATH or XDG_DATA_DIRS) use different index files, so that they
+   don't keep replacing each other's index.
+*/
+static const int s_protocolIndexVersion = 1;
+
+static QString protocolIndexFileName(const QJsonArray &directories)
+{
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    Q_FOREACH (const QJsonValue &value, directories) {
+        hash.addData(value.toObject().value(QStringLiteral("path")).toString().toUtf8());
+        hash.addData("\n", 1);
+    }
+    return QStandardPaths::writableLocation(QStandardPaths::GenericCacheLocation) + QLatin1String("/kio_protocolindex_")
+           + QString::fromLatin1(hash.result().toHex().left(16));
+}
+
+static double fileModificationTime(const QString &path)
+{
+    const QFileInfo info(path);
+    return info.exists() ? double(info.lastModified().toMSecsSinceEpoch()) : -1.0;
+}
+
+static QJsonArray indexedDirectories()
+{
+    // the same directories fillCache() looks at. The library paths include the
+    // directory of the application, which hardly ever contains plugins; only
+    // existing plugin directories are taken, so that the index does not depend
+    // on where the program was started from.
+    QStringList dirs;
+    Q_FOREACH (const QString &libraryPath, QCoreApplication::libraryPaths()) {
+        const QString dir = libraryPath + QLatin1String("/kf5/kio");
+        if (!dirs.contains(dir) && QFileInfo(dir).isDir()) {
+            dirs.append(dir);
+        }
+    }
+    dirs += QStandardPaths::locateAll(QStandardPaths::GenericDataLocation, QStringLiteral("kservices5"), QStandardPaths::LocateDirectory);
+
+    QJsonArray result;
+    Q_FOREACH (const QString &dir, dirs) {
+        QJsonObject entry;
+        entry.insert(QStringLiteral("path"), dir);
+        entry.insert(QStringLiteral("mtime"), fileModificationTime(dir));
+        result.append(entry);
+    }
+    return result;
+}
+
+// Plugins are often overwritten in place when installed, which does not
+// touch their directory
+static bool pluginsUnchanged(const QJsonArray &plugins)
+{
+    Q_FOREACH (const QJsonValue &value, plugins) {
+        const QJsonObject entry = value.toObject();
+        if (entry.value(QStringLiteral("mtime")).toDouble() != fileModificationTime(entry.value(QStringLiteral("exec")).toString())) {
+            return false;
+        }
+    }
+    return true;
+}
+
 KProtocolInfoFactory::KProtocolInfoFactory()
-    : m_cacheDirty(true)
+    : m_cacheDirty(true),
+      m_indexChecked(false),
+      m_cacheFromIndex(false)
 {
 }
 
@@ -77,7 +154,7 @@ KProtocolInfoPrivate *KProtocolInfoFactory::findProtocol(const QString &protocol
     const bool filled = fillCache();
 
     KProtocolInfoPrivate *info = m_cache.value(protocol);
-    if (!info && !filled) {
+    if (!info && (!filled || m_cacheFromIndex)) {
         // Unknown protocol! Maybe it just got installed and our cache is out of date?
         qCDebug(KIO_CORE) << "Refilling KProtocolInfoFactory cache in the hope to find" << protocol;
         m_cacheDirty = true;
@@ -100,6 +177,21 @@ bool KProtocolInfoFactory::fillCache()
     qDeleteAll(m_cache);
     m_cache.clear();
 
+    // a refill means that a protocol was missing, so do not trust the index then
+    const QJsonArray directories = indexedDirectories();
+    if (!m_indexChecked) {
+        m_indexChecked = true;
+        if (loadIndex(directories)) {
+            m_cacheDirty = false;
+            m_cacheFromIndex = true;
+            return true;
+        }
+    }
+    m_cacheFromIndex = false;
+
+    QJsonArray indexedPlugins;
+    QJsonArray indexedProtocolFiles;
+
     // first: search for meta data protocol info, that might be bundled with applications
     // we search in all library paths inside kf5/kio
     Q_FOREACH (const KPluginMetaData &md, KPluginLoader::findPlugins("kf5/kio")) {
@@ -119,6 +211,13 @@ bool KProtocolInfoFactory::fillCache()
             // add to cache, skip double entries
             if (!m_cache.contains(it.key())) {
                 m_cache.insert(it.key(), new KProtocolInfoPrivate(it.key(), slavePath, protocol));
+
+                QJsonObject entry;
+                entry.insert(QStringLiteral("name"), it.key());
+                entry.insert(QStringLiteral("exec"), slavePath);
+                entry.insert(QStringLiteral("mtime"), fileModificationTime(slavePath));
+                entry.insert(QStringLiteral("info"), protocol);
+                indexedPlugins.append(entry);
             }
         }
     }
@@ -133,12 +232,77 @@ bool KProtocolInfoFactory::fillCache()
                 // add to cache, skip double entries
                 if (!m_cache.contains(prot)) {
                     m_cache.insert(prot, new KProtocolInfoPrivate(file));
+                    indexedProtocolFiles.append(file);
                 }
             }
         }
     }
 
+    QJsonObject index;
+    index.insert(QStringLiteral("version"), s_protocolIndexVersion);
+    index.insert(QStringLiteral("directories"), directories);
+    index.insert(QStringLiteral("plugins"), indexedPlugins);
+    index.insert(QStringLiteral("protocolFiles"), indexedProtocolFiles);
+    saveIndex(index);
+
     // all done, don't do it again
     m_cacheDirty = false;
     return true;
 }
+
+bool KProtocolInfoFactory::loadIndex(const QJsonArray &directories)
+{
+    QFile file(protocolIndexFileName(directories));
+    if (!file.open(QIODevice::ReadOnly) || file.size() == 0) {
+        return false;
+    }
+    const qint64 size = file.size();
+    uchar *data = file.map(0, size);
+    if (!data) {
+        return false;
+    }
+
+    bool loaded = false;
+    {
+        // the document refers to the mapped data, everything taken from it is copied
+        const QJsonObject index = QJsonDocument::fromRawData(reinterpret_cast<const char *>(data), size).object();
+        const QJsonArray plugins = index.value(QStringLiteral("plugins")).toArray();
+        if (index.value(QStringLiteral("version")).toInt() == s_protocolIndexVersion
+                && index.value(QStringLiteral("directories")).toArray() == directories
+                && pluginsUnchanged(plugins)) {
+            Q_FOREACH (const QJsonValue &value, plugins) {
+                const QJsonObject entry = value.toObject();
+                const QString name = entry.value(QStringLiteral("name")).toString();
+                if (!name.isEmpty() && !m_cache.contains(name)) {
+                    m_cache.insert(name, new KProtocolInfoPrivate(name, entry.value(QStringLiteral("exec")).toString(),
+                                                                  entry.value(QStringLiteral("info")).toObject()));
+                }
+            }
+            // .protocol files are read again, they may be translated
+            Q_FOREACH (const QJsonValue &value, index.value(QStringLiteral("protocolFiles")).toArray()) {
+                const QString protocolFile = value.toString();
+                const QString prot = QFileInfo(protocolFile).baseName();
+                if (!m_cache.contains(prot)) {
+                    m_cache.insert(prot, new KProtocolInfoPrivate(protocolFile));
+                }
+            }
+            loaded = true;
+        }
+    }
+    file.unmap(data);
+
+    qCDebug(KIO_CORE) << "Protocol index" << file.fileName() << (loaded ? "used" : "outdated");
+    return loaded;
+}
+
+void KProtocolInfoFactory::saveIndex(const QJsonObject &index)
+{
+    const QString fileName = protocolIndexFileName(index.value(QStringLiteral("directories")).toArray());
+    QDir().mkpath(QFileInfo(fileName).absolutePath());
+    QSaveFile file(fileName);
+    if (!file.open(QIODevice::WriteOnly)) {
+        return;
+    }
+    file.write(QJsonDocument(index).toBinaryData());
+    file.commit();
+}
@@ -21,10 +21,14 @@
 #define kprotocolinfofactory_h
 
 #include <QHash>
+#include <QJsonArray>
+#include <QJsonObject>
 #include <QString>
 #include <QStringList>
 #include <QMutex>
 
+#include "kiocore_export.h"
+
 class KProtocolInfoPrivate;
 
 /**
@@ -34,7 +38,7 @@ class KProtocolInfoPrivate;
  * KProtocolInfo. The factory is a singleton
  * (only one instance can exist).
  */
-class KProtocolInfoFactory
+class KIOCORE_EXPORT KProtocolInfoFactory
 {
 public:
     /**
@@ -71,9 +75,18 @@ private:
      */
     bool fillCache();
 
+    /**
+     * Fill the internal cache from the protocol index, if it is up to date
+     * with @p directories.
+     */
+    bool loadIndex(const QJsonArray &directories);
+    void saveIndex(const QJsonObject &index);
+
     typedef QHash<QString, KProtocolInfoPrivate *> ProtocolCache;
     ProtocolCache m_cache;
     bool m_cacheDirty;
+    bool m_indexChecked;
+    bool m_cacheFromIndex;
     mutable QMutex m_mutex; // protects m_cache and m_allProtocolsLoaded
 };
 
@@ -57,6 +57,8 @@
 #include <kconfiggroup.h>
 #include <ksharedconfig.h>
 
+#include <memory>
+
 #include <kmimetypetrader.h>
 #include <kprotocolinfofactory_p.h>
 
@@ -131,6 +133,67 @@ public:
     QStringList proxyList;
 };
 
+/*
+    The settings read for every job and slave that is set up. A snapshot is
+    never changed once it is published, so readers get a reference to it with
+    an atomic load and don't take the mutex. reparseConfiguration() publishes
+    a new one under the mutex, and the old one is deleted when its last
+    reader is done with it.
+*/
+class KProtocolManagerSettings
+{
+public:
+    KProtocolManagerSettings(const KSharedConfig::Ptr &config, const KConfigGroup &httpConfig);
+
+    int readTimeout;
+    int connectTimeout;
+    int proxyConnectTimeout;
+    int responseTimeout;
+    KProtocolManager::ProxyType proxyType;
+    KProtocolManager::ProxyAuthMode proxyAuthMode;
+    bool useReverseProxy;
+    QString proxyConfigScript;
+    bool useCache;
+    KIO::CacheControl cacheControl;
+    QString cacheDir;
+    int maxCacheAge;
+    int maxCacheSize;
+    bool markPartial;
+    int minimumKeepSize;
+    int downloadSegments;
+    bool autoResume;
+    bool persistentConnections;
+    bool persistentProxyConnection;
+};
+
+KProtocolManagerSettings::KProtocolManagerSettings(const KSharedConfig::Ptr &config, const KConfigGroup &httpConfig)
+{
+    const KConfigGroup cg(config, QString());
+    readTimeout = qMax(MIN_TIMEOUT_VALUE, cg.readEntry("ReadTimeout", DEFAULT_READ_TIMEOUT));
+    connectTimeout = qMax(MIN_TIMEOUT_VALUE, cg.readEntry("ConnectTimeout", DEFAULT_CONNECT_TIMEOUT));
+    proxyConnectTimeout = qMax(MIN_TIMEOUT_VALUE, cg.readEntry("ProxyConnectTimeout", DEFAULT_PROXY_CONNECT_TIMEOUT));
+    responseTimeout = qMax(MIN_TIMEOUT_VALUE, cg.readEntry("ResponseTimeout", DEFAULT_RESPONSE_TIMEOUT));
+    markPartial = cg.readEntry("MarkPartial", true);
+    minimumKeepSize = cg.readEntry("MinimumKeepSize", DEFAULT_MINIMUM_KEEP_SIZE); // 5000 byte
+    downloadSegments = qMax(cg.readEntry("DownloadSegments", 1), 1);
+    autoResume = cg.readEntry("AutoResume", false);
+    persistentConnections = cg.readEntry("PersistentConnections", true);
+    persistentProxyConnection = cg.readEntry("PersistentProxyConnection", false);
+
+    const KConfigGroup proxyCg(config, "Proxy Settings");
+    proxyType = static_cast<KProtocolManager::ProxyType>(proxyCg.readEntry("ProxyType", 0));
+    proxyAuthMode = static_cast<KProtocolManager::ProxyAuthMode>(proxyCg.readEntry("AuthMode", 0));
+    useReverseProxy = proxyCg.readEntry("ReversedException", false);
+    proxyConfigScript = proxyCg.readEntry("Proxy Config Script");
+
+    useCache = httpConfig.readEntry("UseCache", true);
+    const QString cache = httpConfig.readEntry("cache");
+    cacheControl = cache.isEmpty() ? DEFAULT_CACHE_CONTROL : KIO::parseCacheControl(cache);
+    cacheDir = httpConfig.readPathEntry("CacheDir", QStandardPaths::writableLocation(QStandardPaths::GenericCacheLocation) + "/kio_http");
+    maxCacheAge = httpConfig.readEntry("MaxCacheAge", DEFAULT_MAX_CACHE_AGE);
+    maxCacheSize = httpConfig.readEntry("MaxCacheSize", DEFAULT_MAX_CACHE_SIZE);
+}
+
 class KProtocolManagerPrivate
 {
 public:
@@ -143,6 +206,7 @@ public:
     QString readNoProxyFor();
     QString proxyFor(const QString &protocol);
     QStringList getSystemProxyFor(const QUrl &url);
+    std::shared_ptr<const KProtocolManagerSettings> settings();
 
     QMutex mutex; // protects all member vars
     KSharedConfig::Ptr configPtr;
@@ -154,6 +218,9 @@ public:
     QCache<QString, KProxyData> cachedProxyData;
 
     QMap<QString /*mimetype*/, QString /*protocol*/> protocolForArchiveMimetypes;
+
+    // only accessed with std::atomic_load() and std::atomic_store()
+    std::shared_ptr<const KProtocolManagerSettings> currentSettings;
 };
 
 Q_GLOBAL_STATIC(KProtocolManagerPrivate, kProtocolManagerPrivate)
@@ -265,6 +332,9 @@ void KProtocolManagerPrivate::sync()
 #define PRIVATE_DATA \
     KProtocolManagerPrivate *d = kProtocolManagerPrivate()
 
+static KSharedConfig::Ptr config();
+static KConfigGroup http_config();
+
 void KProtocolManager::reparseConfiguration()
 {
     PRIVATE_DATA;
@@ -279,6 +349,10 @@ void KProtocolManager::reparseConfiguration()
     d->noProxyFor.clear();
     d->modifiers.clear();
     d->useragent.clear();
+    if (std::atomic_load(&d->currentSettings)) {
+        std::atomic_store(&d->currentSettings, std::shared_ptr<const KProtocolManagerSettings>(
+                              new KProtocolManagerSettings(config(), http_config())));
+    }
     lock.unlock();
 
     // Force the slave config to re-read its config...
@@ -333,42 +407,46 @@ static KConfigGroup http_config()
     return KConfigGroup(d->http_config, QString());
 }
 
+std::shared_ptr<const KProtocolManagerSettings> KProtocolManagerPrivate::settings()
+{
+    std::shared_ptr<const KProtocolManagerSettings> current = std::atomic_load(&currentSettings);
+    if (current) {
+        return current;
+    }
+    QMutexLocker lock(&mutex);
+    // another thread may have been first
+    current = std::atomic_load(&currentSettings);
+    if (!current) {
+        current.reset(new KProtocolManagerSettings(config(), http_config()));
+        std::atomic_store(&currentSettings, current);
+    }
+    return current;
+}
+
 /*=============================== TIMEOUT SETTINGS ==========================*/
 
 int KProtocolManager::readTimeout()
 {
     PRIVATE_DATA;
-    QMutexLocker lock(&d->mutex);
-    KConfigGroup cg(config(), QString());
-    int val = cg.readEntry("ReadTimeout", DEFAULT_READ_TIMEOUT);
-    return qMax(MIN_TIMEOUT_VALUE, val);
+    return d->settings()->readTimeout;
 }
 
 int KProtocolManager::connectTimeout()
 {
     PRIVATE_DATA;
-    QMutexLocker lock(&d->mutex);
-    KConfigGroup cg(config(), QString());
-    int val = cg.readEntry("ConnectTimeout", DEFAULT_CONNECT_TIMEOUT);
-    return qMax(MIN_TIMEOUT_VALUE, val);
+    return d->settings()->connectTimeout;
 }
 
 int KProtocolManager::proxyConnectTimeout()
 {
     PRIVATE_DATA;
-    QMutexLocker lock(&d->mutex);
-    KConfigGroup cg(config(), QString());
-    int val = cg.readEntry("ProxyConnectTimeout", DEFAULT_PROXY_CONNECT_TIMEOUT);
-    return qMax(MIN_TIMEOUT_VALUE, val);
+    return d->settings()->proxyConnectTimeout;
 }
 
 int KProtocolManager::responseTimeout()
 {
     PRIVATE_DATA;
-    QMutexLocker lock(&d->mutex);
-    KConfigGroup cg(config(), QString());
-    int val = cg.readEntry("ResponseTimeout", DEFAULT_RESPONSE_TIMEOUT);
-    return qMax(MIN_TIMEOUT_VALUE, val);
+    return d->settings()->responseTimeout;
 }
 
 /*========================== PROXY SETTINGS =================================*/
@@ -381,23 +459,19 @@ bool KProtocolManager::useProxy()
 bool KProtocolManager::useReverseProxy()
 {
     PRIVATE_DATA;
-    QMutexLocker lock(&d->mutex);
-    return d->useReverseProxy();
+    return d->settings()->useReverseProxy;
 }
 
 KProtocolManager::ProxyType KProtocolManager::proxyType()
 {
     PRIVATE_DATA;
-    QMutexLocker lock(&d->mutex);
-    return d->proxyType();
+    return d->settings()->proxyType;
 }
 
 KProtocolManager::ProxyAuthMode KProtocolManager::proxyAuthMode()
 {
     PRIVATE_DATA;
-    QMutexLocker lock(&d->mutex);
-    KConfigGroup cg(config(), "Proxy Settings");
-    return static_cast<ProxyAuthMode>(cg.readEntry("AuthMode", 0));
+    return d->settings()->proxyAuthMode;
 }
 
 /*========================== CACHING =====================================*/
@@ -405,40 +479,31 @@ KProtocolManager::ProxyAuthMode KProtocolManager::proxyAuthMode()
 bool KProtocolManager::useCache()
 {
     PRIVATE_DATA;
-    QMutexLocker lock(&d->mutex);
-    return http_config().readEntry("UseCache", true);
+    return d->settings()->useCache;
 }
 
 KIO::CacheControl KProtocolManager::cacheControl()
 {
     PRIVATE_DATA;
-    QMutexLocker lock(&d->mutex);
-    QString tmp = http_config().readEntry("cache");
-    if (tmp.isEmpty()) {
-        return DEFAULT_CACHE_CONTROL;
-    }
-    return KIO::parseCacheControl(tmp);
+    return d->settings()->cacheControl;
 }
 
 QString KProtocolManager::cacheDir()
 {
     PRIVATE_DATA;
-    QMutexLocker lock(&d->mutex);
-    return http_config().readPathEntry("CacheDir", QStandardPaths::writableLocation(QStandardPaths::GenericCacheLocation) + "/kio_http");
+    return d->settings()->cacheDir;
 }
 
 int KProtocolManager::maxCacheAge()
 {
     PRIVATE_DATA;
-    QMutexLocker lock(&d->mutex);
-    return http_config().readEntry("MaxCacheAge", DEFAULT_MAX_CACHE_AGE);
+    return d->settings()->maxCacheAge;
 }
 
 int KProtocolManager::maxCacheSize()
 {
     PRIVATE_DATA;
-    QMutexLocker lock(&d->mutex);
-    return http_config().readEntry("MaxCacheSize", DEFAULT_MAX_CACHE_SIZE);
+    return d->settings()->maxCacheSize;
 }
 
 QString KProtocolManager::noProxyFor()
@@ -1060,44 +1125,43 @@ QString KProtocolManager::acceptLanguagesHeader()
 bool KProtocolManager::markPartial()
 {
     PRIVATE_DATA;
-    QMutexLocker lock(&d->mutex);
-    return config()->group(QByteArray()).readEntry("MarkPartial", true);
+    return d->settings()->markPartial;
 }
 
 int KProtocolManager::minimumKeepSize()
 {
     PRIVATE_DATA;
-    QMutexLocker lock(&d->mutex);
-    return config()->group(QByteArray()).readEntry("MinimumKeepSize",
-            DEFAULT_MINIMUM_KEEP_SIZE);  // 5000 byte
+    return d->settings()->minimumKeepSize;
+}
+
+int KProtocolManager::downloadSegments()
+{
+    PRIVATE_DATA;
+    return d->settings()->downloadSegments;
 }
 
 bool KProtocolManager::autoResume()
 {
     PRIVATE_DATA;
-    QMutexLocker lock(&d->mutex);
-    return config()->group(QByteArray()).readEntry("AutoResume", false);
+    return d->settings()->autoResume;
 }
 
 bool KProtocolManager::persistentConnections()
 {
     PRIVATE_DATA;
-    QMutexLocker lock(&d->mutex);
-    return config()->group(QByteArray()).readEntry("PersistentConnections", true);
+    return d->settings()->persistentConnections;
 }
 
 bool KProtocolManager::persistentProxyConnection()
 {
     PRIVATE_DATA;
-    QMutexLocker lock(&d->mutex);
-    return config()->group(QByteArray()).readEntry("PersistentProxyConnection", false);
+    return d->settings()->persistentProxyConnection;
 }
 
 QString KProtocolManager::proxyConfigScript()
 {
     PRIVATE_DATA;
-    QMutexLocker lock(&d->mutex);
-    return config()->group("Proxy Settings").readEntry("Proxy Config Script");
+    return d->settings()->proxyConfigScript;
 }
 
 /* =========================== PROTOCOL CAPABILITIES ============== */
@@ -357,6 +357,17 @@ public:
      */
     static int minimumKeepSize();
 
+    /**
+     * Returns the maximum number of connections a single large download
+     * from a server supporting byte ranges may be split into.
+     *
+     * A value of 1, which is the default, disables segmented downloads.
+     *
+     * @return the maximum number of segments per download
+     * @since 5.50
+     */
+    static int downloadSegments();
+
     /*============================ NETWORK CONNECTIONS ==========================*/
     /**
      * Returns true if proxy connections should be persistent.
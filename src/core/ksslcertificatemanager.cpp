@@ -29,8 +29,10 @@
 
 #include <QDebug>
 #include <qstandardpaths.h>
+#include <QDateTime>
 #include <QFile>
 #include <QDir>
+#include <QSaveFile>
 #include <QDBusConnection>
 #include <QDBusReply>
 #include <QDBusConnectionInterface>
@@ -495,4 +497,29 @@ void _setAllKsslCaCertificates(KSslCertificateManager *cm, const QList<KSslCaCer
     KSslCertificateManagerPrivate::get(cm)->setAllCertificates(certsIn);
 }
 
+static QString ruleRevisionFileName()
+{
+    return QStandardPaths::writableLocation(QStandardPaths::RuntimeLocation) + QLatin1String("/kssld_rule_revision");
+}
+
+QByteArray _ksslRuleRevision()
+{
+    QFile file(ruleRevisionFileName());
+    if (!file.open(QIODevice::ReadOnly)) {
+        return QByteArray();
+    }
+    return file.readAll();
+}
+
+void _bumpKsslRuleRevision()
+{
+    // never the same value again, also not after a restart of kssld
+    const qint64 revision = qMax(_ksslRuleRevision().toLongLong() + 1, QDateTime::currentMSecsSinceEpoch());
+    QSaveFile file(ruleRevisionFileName());
+    if (file.open(QIODevice::WriteOnly)) {
+        file.write(QByteArray::number(revision));
+        file.commit();
+    }
+}
+
 #include "moc_kssld_interface.cpp"
@@ -95,4 +95,9 @@ KIOCORE_EXPORT QList<KSslCaCertificate> _allKsslCaCertificates(KSslCertificateMa
 KIOCORE_EXPORT void _setAllKsslCaCertificates(KSslCertificateManager *cm,
         const QList<KSslCaCertificate> &certsIn);
 
+// The revision of the certificate rules, which kssld bumps on every change.
+// Processes that remember what a rule allowed compare it to notice revoked rules.
+KIOCORE_EXPORT QByteArray _ksslRuleRevision();
+KIOCORE_EXPORT void _bumpKsslRuleRevision();
+
 #endif //KSSLCERTIFICATEMANAGER_P_H
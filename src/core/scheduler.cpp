@@ -26,22 +26,43 @@
 #include "slave.h"
 #include "connection_p.h"
 #include "job_p.h"
+#include "hostinfo.h"
 
 #include <kprotocolmanager.h>
 #include <kprotocolinfo.h>
+#include "kprotocolinfo_p.h"
+#include "kprotocolinfofactory_p.h"
 //#include <kjobwidgets.h>
 
 #include <QHash>
+#include <QHostAddress>
 #include <QThread>
 #include <QThreadStorage>
 #include <QCoreApplication>
 #include <QDBusConnection>
 #include <QDBusMessage>
 
+#include <climits>
+#include <cmath>
+
 #include <QDBusConnection>
 
-// Slaves may be idle for a certain time (3 minutes) before they are killed.
-static const int s_idleSlaveLifetime = 3 * 60;
+// Slaves may be idle for a certain time before they are killed: at least one
+// minute, and up to 15 minutes for connections in frequent use that are
+// expensive to set up again.
+static const int s_minIdleSlaveLifetime = 60;
+static const int s_maxIdleSlaveLifetime = 15 * 60;
+// Every use of a connection counts half as much after 5 minutes.
+static const qint64 s_usageHalfLife = 5 * 60 * 1000;
+// A connection used at least this often recently is not handed to a job for
+// another host, a new slave is started instead while within the budget.
+static const double s_busyConnectionUses = 2.0;
+// Budget for idle slaves of all protocols together, each one is a process
+// (or a thread) holding memory and maybe a connection to a server.
+static const int s_maxIdleSlaves = 16;
+// Slaves started ahead of time per protocol for queued jobs to new hosts,
+// unless the "MaxPreparedSlaves" slave config entry says otherwise.
+static const int s_defaultMaxPreparedSlaves = 2;
 
 using namespace KIO;
 
@@ -67,6 +88,8 @@ static void setupSlave(KIO::Slave *slave, const QUrl &url, const QString &protoc
 // same reason as above
 static Scheduler *scheduler();
 static Slave *heldSlaveForJob(SimpleJob *job);
+static int totalIdleSlaveCount();
+static void enforceIdleSlaveBudget();
 
 int SerialPicker::changedPrioritySerial(int oldSerial, int newPriority) const
 {
@@ -78,6 +101,7 @@ int SerialPicker::changedPrioritySerial(int oldSerial, int newPriority) const
 
 SlaveKeeper::SlaveKeeper()
 {
+    m_clock.start();
     m_grimTimer.setSingleShot(true);
     connect(&m_grimTimer, SIGNAL(timeout()), SLOT(grimReaper()));
 }
@@ -87,12 +111,76 @@ SlaveKeeper::~SlaveKeeper()
     grimReaper();
 }
 
+QString SlaveKeeper::identity(const QString &host, int port, const QString &user)
+{
+    // no port is -1 in QUrl, but the slaves use 0
+    return user + QLatin1Char('@') + host + QLatin1Char(':') + QString::number(qMax(port, 0));
+}
+
+QString SlaveKeeper::identity(Slave *slave)
+{
+    return identity(slave->host(), slave->port(), slave->user());
+}
+
+// Rough cost of setting up a slave's connection again, relative to a local
+// slave: network protocols need at least a handshake, and a login if there
+// is a user.
+int SlaveKeeper::reconnectCost(Slave *slave)
+{
+    int cost = KProtocolInfo::protocolClass(slave->protocol()) == QLatin1String(":local") ? 1 : 4;
+    if (!slave->user().isEmpty()) {
+        cost += 2;
+    }
+    return cost;
+}
+
+double SlaveKeeper::recentUses(const QString &identity) const
+{
+    QHash<QString, Usage>::ConstIterator it = m_usage.constFind(identity);
+    if (it == m_usage.constEnd()) {
+        return 0;
+    }
+    const qint64 age = m_clock.elapsed() - it->lastUse;
+    return it->uses * std::pow(0.5, double(age) / s_usageHalfLife);
+}
+
+void SlaveKeeper::recordUse(const QString &identity)
+{
+    const double uses = recentUses(identity) + 1;
+    Usage &usage = m_usage[identity];
+    usage.uses = uses;
+    usage.lastUse = m_clock.elapsed();
+}
+
+int SlaveKeeper::idleLifetime(Slave *slave) const
+{
+    const double lifetime = s_minIdleSlaveLifetime * recentUses(identity(slave)) * reconnectCost(slave);
+    return qBound(s_minIdleSlaveLifetime, int(lifetime), s_maxIdleSlaveLifetime);
+}
+
 void SlaveKeeper::returnSlave(Slave *slave)
 {
     Q_ASSERT(slave);
     slave->setIdle();
-    m_idleSlaves.insert(slave->host(), slave);
+    m_idleSlaves.insert(identity(slave), slave);
     scheduleGrimReaper();
+    enforceIdleSlaveBudget();
+}
+
+void SlaveKeeper::returnPreparedSlave(Slave *slave)
+{
+    // count it as busy, so that jobs for other hosts leave it alone
+    const QString key = identity(slave);
+    const double uses = qMax(recentUses(key), s_busyConnectionUses);
+    Usage &usage = m_usage[key];
+    usage.uses = uses;
+    usage.lastUse = m_clock.elapsed();
+    returnSlave(slave);
+}
+
+bool SlaveKeeper::hasSlaveFor(const QUrl &url) const
+{
+    return m_idleSlaves.contains(identity(url.host(), url.port(), url.userName()));
 }
 
 Slave *SlaveKeeper::takeSlaveForJob(SimpleJob *job)
@@ -102,25 +190,43 @@ Slave *SlaveKeeper::takeSlaveForJob(SimpleJob *job)
         return slave;
     }
 
-    QUrl url = SimpleJobPrivate::get(job)->m_url;
-    // TODO take port, username and password into account
-    QMultiHash<QString, Slave *>::Iterator it = m_idleSlaves.find(url.host());
-    if (it == m_idleSlaves.end()) {
-        it = m_idleSlaves.begin();
+    const QUrl url = SimpleJobPrivate::get(job)->m_url;
+    const QString key = identity(url.host(), url.port(), url.userName());
+    recordUse(key);
+    QMultiHash<QString, Slave *>::Iterator it = m_idleSlaves.find(key);
+    if (it != m_idleSlaves.end()) {
+        slave = it.value();
+        m_idleSlaves.erase(it);
+        return slave;
+    }
+
+    // Any idle slave can do the job after setupSlave() made it reconnect,
+    // but that throws away its connection. Only do that to a slave whose
+    // connection is not in demand, or when we can't afford another slave.
+    int remainingLifetime;
+    slave = leastValuableSlave(&remainingLifetime);
+    if (!slave) {
+        return nullptr;
     }
-    if (it == m_idleSlaves.end()) {
+    if (recentUses(identity(slave)) >= s_busyConnectionUses && totalIdleSlaveCount() < s_maxIdleSlaves) {
         return nullptr;
     }
-    slave = it.value();
-    m_idleSlaves.erase(it);
+    removeSlave(slave);
     return slave;
 }
 
 bool SlaveKeeper::removeSlave(Slave *slave)
 {
-    // ### performance not so great
-    QMultiHash<QString, Slave *>::Iterator it = m_idleSlaves.begin();
-    for (; it != m_idleSlaves.end(); ++it) {
+    // usually found under its identity, unless that changed while it was idle
+    const QString key = identity(slave);
+    QMultiHash<QString, Slave *>::Iterator it = m_idleSlaves.find(key);
+    for (; it != m_idleSlaves.end() && it.key() == key; ++it) {
+        if (it.value() == slave) {
+            m_idleSlaves.erase(it);
+            return true;
+        }
+    }
+    for (it = m_idleSlaves.begin(); it != m_idleSlaves.end(); ++it) {
         if (it.value() == slave) {
             m_idleSlaves.erase(it);
             return true;
@@ -139,10 +245,36 @@ QList<Slave *> SlaveKeeper::allSlaves() const
     return m_idleSlaves.values();
 }
 
+Slave *SlaveKeeper::leastValuableSlave(int *remainingLifetime) const
+{
+    Slave *result = nullptr;
+    *remainingLifetime = INT_MAX;
+    QMultiHash<QString, Slave *>::ConstIterator it = m_idleSlaves.constBegin();
+    for (; it != m_idleSlaves.constEnd(); ++it) {
+        Slave *slave = it.value();
+        const int remaining = idleLifetime(slave) - slave->idleTime();
+        if (remaining < *remainingLifetime) {
+            *remainingLifetime = remaining;
+            result = slave;
+        }
+    }
+    return result;
+}
+
+void SlaveKeeper::reapSlave(Slave *slave)
+{
+    if (!removeSlave(slave)) {
+        return;
+    }
+    slave->kill();
+    // avoid invoking slotSlaveDied() because its cleanup services are not needed
+    slave->deref();
+}
+
 void SlaveKeeper::scheduleGrimReaper()
 {
     if (!m_grimTimer.isActive()) {
-        m_grimTimer.start((s_idleSlaveLifetime / 2) * 1000);
+        m_grimTimer.start((s_minIdleSlaveLifetime / 2) * 1000);
     }
 }
 
@@ -152,7 +284,7 @@ void SlaveKeeper::grimReaper()
     QMultiHash<QString, Slave *>::Iterator it = m_idleSlaves.begin();
     while (it != m_idleSlaves.end()) {
         Slave *slave = it.value();
-        if (slave->idleTime() >= s_idleSlaveLifetime) {
+        if (slave->idleTime() >= idleLifetime(slave)) {
             it = m_idleSlaves.erase(it);
             if (slave->job()) {
                 //qDebug() << "Idle slave" << slave << "still has job" << slave->job();
@@ -164,6 +296,17 @@ void SlaveKeeper::grimReaper()
             ++it;
         }
     }
+
+    // forget about connections that have not been used for a long time
+    QHash<QString, Usage>::Iterator usage = m_usage.begin();
+    while (usage != m_usage.end()) {
+        if (recentUses(usage.key()) < 0.1) {
+            usage = m_usage.erase(usage);
+        } else {
+            ++usage;
+        }
+    }
+
     if (!m_idleSlaves.isEmpty()) {
         scheduleGrimReaper();
     }
@@ -393,9 +536,10 @@ static void verifyRunningJobsCount(QHash<QString, HostQueue> *queues, int runnin
 #endif
 }
 
-ProtoQueue::ProtoQueue(int maxSlaves, int maxSlavesPerHost)
+ProtoQueue::ProtoQueue(int maxSlaves, int maxSlavesPerHost, int maxPreparedSlaves)
     : m_maxConnectionsPerHost(maxSlavesPerHost ? maxSlavesPerHost : maxSlaves),
       m_maxConnectionsTotal(qMax(maxSlaves, maxSlavesPerHost)),
+      m_maxPreparedSlaves(maxPreparedSlaves),
       m_runningJobsCount(0)
 
 {
@@ -413,6 +557,7 @@ ProtoQueue::~ProtoQueue()
     const QList<Slave *> slaves = allSlaves();
     // Clear the idle slaves in the keeper to avoid dangling pointers
     m_slaveKeeper.clear();
+    m_connectingSlaves.clear();
     for (Slave *slave : slaves) {
         // kill the slave process, then remove the interface in our process
         slave->kill();
@@ -432,6 +577,7 @@ void ProtoQueue::queueJob(SimpleJob *job)
     SimpleJobPrivate::get(job)->m_schedSerial = m_serialPicker.next();
 
     const bool wasQueueEmpty = hq.isQueueEmpty();
+    const bool wasHostIdle = hq.isEmpty();
     hq.queueJob(job);
     // note that HostQueue::queueJob() into an empty queue changes its lowestSerial() too...
     // the queue's lowest serial job may have changed, so update the ordered list of queues.
@@ -456,9 +602,92 @@ void ProtoQueue::queueJob(SimpleJob *job)
     // just in case; startAJob() will refuse to start a job if it shouldn't.
     m_startJobTimer.start();
 
+    if (wasHostIdle) {
+        prepareConnection(job);
+    }
+
     ensureNoDuplicates(&m_queuesBySerial);
 }
 
+// The slave for a job to a host nobody is talking to has to look up the name
+// and connect before it can start, and the job may even have to wait for a
+// free slave. Get some of this going while other transfers are running: look
+// up the name right away (which the proxy lookup needs too, and which warms
+// the system resolver cache), and while all slaves are busy, start a slave
+// and have it connect to the host. The job takes it from the keeper later.
+void ProtoQueue::prepareConnection(SimpleJob *job)
+{
+    SimpleJobPrivate *jobPriv = SimpleJobPrivate::get(job);
+    const QUrl &url = jobPriv->m_url;
+    if (url.host().isEmpty() || m_slaveKeeper.hasSlaveFor(url)) {
+        return;
+    }
+    Q_FOREACH (Slave *slave, m_connectingSlaves) {
+        if (slave->host() == url.host()) {
+            return;
+        }
+    }
+    if (QHostAddress(url.host()).isNull()) {
+        HostInfo::prefetchHost(url.host());
+    }
+
+    // otherwise startAJob() creates a slave for the job anyway
+    if (m_runningJobsCount < m_maxConnectionsTotal
+            || KProtocolInfo::protocolClass(jobPriv->m_protocol) == QLatin1String(":local")) {
+        return;
+    }
+    // only slaves implementing openConnection() can connect without a job
+    KProtocolInfoPrivate *prot = KProtocolInfoFactory::self()->findProtocol(jobPriv->m_protocol);
+    if (!prot || !prot->m_canOpenConnection) {
+        return;
+    }
+    m_preparedSlaves.removeAll(QPointer<Slave>());
+    if (m_preparedSlaves.count() >= m_maxPreparedSlaves) {
+        return;
+    }
+
+    Slave *slave = createSlave(jobPriv->m_protocol, nullptr, url);
+    if (!slave) {
+        return;
+    }
+    setupSlave(slave, url, jobPriv->m_protocol, jobPriv->m_proxyList, true);
+    connect(slave, SIGNAL(connected()), SLOT(slotSlaveConnected()));
+    connect(slave, SIGNAL(error(int,QString)), SLOT(slotSlaveError(int,QString)));
+    slave->send(CMD_CONNECT);
+    m_preparedSlaves.append(slave);
+    // a job must not get the slave before it has connected
+    m_connectingSlaves.append(slave);
+}
+
+//private slot
+void ProtoQueue::slotSlaveConnected()
+{
+    Slave *slave = static_cast<Slave *>(sender());
+    disconnect(slave, nullptr, this, nullptr);
+    if (m_connectingSlaves.removeAll(slave) && slave->isAlive()) {
+        m_slaveKeeper.returnPreparedSlave(slave);
+    }
+}
+
+//private slot
+void ProtoQueue::slotSlaveError(int errorNr, const QString &errorMsg)
+{
+    Slave *slave = static_cast<Slave *>(sender());
+    //qDebug() << slave << errorNr << errorMsg;
+    Q_UNUSED(errorNr);
+    Q_UNUSED(errorMsg);
+    disconnect(slave, nullptr, this, nullptr);
+    if (!m_connectingSlaves.removeAll(slave)) {
+        return;
+    }
+    // no job is waiting for this slave, the one that needs the host reports the error itself
+    m_preparedSlaves.removeAll(slave);
+    slave->kill();
+    // can't use slave->deref() while the slave is emitting
+    slave->aboutToDelete();
+    slave->deleteLater();
+}
+
 void ProtoQueue::changeJobPriority(SimpleJob *job, int newPrio)
 {
     SimpleJobPrivate *jobPriv = SimpleJobPrivate::get(job);
@@ -556,6 +785,9 @@ Slave *ProtoQueue::createSlave(const QString &protocol, SimpleJob *job, const QU
 
 bool ProtoQueue::removeSlave(KIO::Slave *slave)
 {
+    if (m_connectingSlaves.removeAll(slave)) {
+        return true;
+    }
     const bool removedConnected = m_connectedSlaveQueue.removeSlave(slave);
     const bool removedUnconnected = m_slaveKeeper.removeSlave(slave);
     Q_ASSERT(!(removedConnected && removedUnconnected));
@@ -565,6 +797,7 @@ bool ProtoQueue::removeSlave(KIO::Slave *slave)
 QList<Slave *> ProtoQueue::allSlaves() const
 {
     QList<Slave *> ret(m_slaveKeeper.allSlaves());
+    ret.append(m_connectingSlaves);
     Q_FOREACH (const HostQueue &hq, m_queuesByHostname) {
         ret.append(hq.allSlaves());
     }
@@ -624,7 +857,9 @@ void ProtoQueue::startAJob()
         bool isNewSlave = false;
         Slave *slave = m_slaveKeeper.takeSlaveForJob(startingJob);
         SimpleJobPrivate *jobPriv = SimpleJobPrivate::get(startingJob);
-        if (!slave) {
+        if (slave) {
+            m_preparedSlaves.removeAll(slave);
+        } else {
             isNewSlave = true;
             slave = createSlave(jobPriv->m_protocol, startingJob, jobPriv->m_url);
         }
@@ -717,6 +952,38 @@ public:
     void slotSlaveConnected();
     void slotSlaveError(int error, const QString &errorMsg);
 
+    int idleSlaveCount() const
+    {
+        int count = 0;
+        Q_FOREACH (ProtoQueue *p, m_protocols) {
+            count += p->slaveKeeper()->idleSlaveCount();
+        }
+        return count;
+    }
+
+    // kill the least valuable idle slaves of any protocol until we are within budget
+    void enforceIdleSlaveBudget()
+    {
+        while (idleSlaveCount() > s_maxIdleSlaves) {
+            SlaveKeeper *keeper = nullptr;
+            Slave *slave = nullptr;
+            int lowestRemainingLifetime = INT_MAX;
+            Q_FOREACH (ProtoQueue *p, m_protocols) {
+                int remainingLifetime;
+                Slave *candidate = p->slaveKeeper()->leastValuableSlave(&remainingLifetime);
+                if (candidate && remainingLifetime < lowestRemainingLifetime) {
+                    lowestRemainingLifetime = remainingLifetime;
+                    keeper = p->slaveKeeper();
+                    slave = candidate;
+                }
+            }
+            if (!slave) {
+                break;
+            }
+            keeper->reapSlave(slave);
+        }
+    }
+
     ProtoQueue *protoQ(const QString &protocol, const QString &host)
     {
         ProtoQueue *pq = m_protocols.value(protocol, nullptr);
@@ -735,8 +1002,16 @@ public:
             if (maxSlavesPerHost == -1) {
                 maxSlavesPerHost = KProtocolInfo::maxSlavesPerHost(protocol);
             }
+            int maxPreparedSlaves = s_defaultMaxPreparedSlaves;
+            if (!host.isEmpty()) {
+                bool ok = false;
+                const int value = SlaveConfig::self()->configData(protocol, host, QStringLiteral("MaxPreparedSlaves")).toInt(&ok);
+                if (ok) {
+                    maxPreparedSlaves = qMax(value, 0);
+                }
+            }
             // Never allow maxSlavesPerHost to exceed maxSlaves.
-            pq = new ProtoQueue(maxSlaves, qMin(maxSlaves, maxSlavesPerHost));
+            pq = new ProtoQueue(maxSlaves, qMin(maxSlaves, maxSlavesPerHost), maxPreparedSlaves);
             m_protocols.insert(protocol, pq);
         }
         return pq;
@@ -776,6 +1051,18 @@ Slave *heldSlaveForJob(SimpleJob *job)
     return schedulerPrivate()->heldSlaveForJob(job);
 }
 
+//static
+int totalIdleSlaveCount()
+{
+    return schedulerPrivate()->idleSlaveCount();
+}
+
+//static
+void enforceIdleSlaveBudget()
+{
+    schedulerPrivate()->enforceIdleSlaveBudget();
+}
+
 Scheduler::Scheduler()
 {
     setObjectName(QStringLiteral("scheduler"));
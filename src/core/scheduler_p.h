@@ -18,14 +18,20 @@
 
 #ifndef SCHEDULER_P_H
 #define SCHEDULER_P_H
+#include <QElapsedTimer>
+#include <QPointer>
 #include <QSet>
+#include <QUrl>
 
 // #define SCHEDULER_DEBUG
 
 namespace KIO
 {
 
-// The slave keeper manages the list of idle slaves that can be reused
+// The slave keeper manages the list of idle slaves that can be reused.
+// Idle slaves are kept by connection identity (host, port and user); how long
+// one is kept depends on how often its connection was used recently and on
+// how expensive it is to set up again.
 class SlaveKeeper : public QObject
 {
     Q_OBJECT
@@ -33,6 +39,9 @@ public:
     SlaveKeeper();
     ~SlaveKeeper();
     void returnSlave(KIO::Slave *slave);
+    // return a slave set up ahead of time for a queued job
+    void returnPreparedSlave(KIO::Slave *slave);
+    bool hasSlaveFor(const QUrl &url) const;
     // pick suitable slave for job and return it, return null if no slave found.
     // the slave is removed from the keeper.
     KIO::Slave *takeSlaveForJob(KIO::SimpleJob *job);
@@ -41,8 +50,26 @@ public:
     // remove all slaves from keeper
     void clear();
     QList<KIO::Slave *> allSlaves() const;
+    int idleSlaveCount() const
+    {
+        return m_idleSlaves.count();
+    }
+    // the idle slave that is least worth keeping, and how many seconds it has left
+    KIO::Slave *leastValuableSlave(int *remainingLifetime) const;
+    // remove slave from keeper and kill it
+    void reapSlave(KIO::Slave *slave);
 
 private:
+    struct Usage {
+        double uses; // decays with s_usageHalfLife
+        qint64 lastUse; // msecs of m_clock
+    };
+    static QString identity(const QString &host, int port, const QString &user);
+    static QString identity(KIO::Slave *slave);
+    static int reconnectCost(KIO::Slave *slave);
+    double recentUses(const QString &identity) const;
+    void recordUse(const QString &identity);
+    int idleLifetime(KIO::Slave *slave) const;
     void scheduleGrimReaper();
 
 private Q_SLOTS:
@@ -50,6 +77,8 @@ private Q_SLOTS:
 
 private:
     QMultiHash<QString, KIO::Slave *> m_idleSlaves;
+    QHash<QString, Usage> m_usage;
+    QElapsedTimer m_clock;
     QTimer m_grimTimer;
 };
 
@@ -159,7 +188,7 @@ class ProtoQueue : public QObject
 {
     Q_OBJECT
 public:
-    ProtoQueue(int maxSlaves, int maxSlavesPerHost);
+    ProtoQueue(int maxSlaves, int maxSlavesPerHost, int maxPreparedSlaves);
     ~ProtoQueue();
 
     void queueJob(KIO::SimpleJob *job);
@@ -168,20 +197,34 @@ public:
     KIO::Slave *createSlave(const QString &protocol, KIO::SimpleJob *job, const QUrl &url);
     bool removeSlave(KIO::Slave *slave);
     QList<KIO::Slave *> allSlaves() const;
+    SlaveKeeper *slaveKeeper()
+    {
+        return &m_slaveKeeper;
+    }
     ConnectedSlaveQueue m_connectedSlaveQueue;
 
 private Q_SLOTS:
     // start max one (non-connected) job and return
     void startAJob();
+    // a slave from prepareConnection() is ready or failed to connect
+    void slotSlaveConnected();
+    void slotSlaveError(int error, const QString &errorMsg);
 
 private:
+    void prepareConnection(KIO::SimpleJob *job);
+
     SerialPicker m_serialPicker;
     QTimer m_startJobTimer;
     QMap<int, HostQueue *> m_queuesBySerial;
     QHash<QString, HostQueue> m_queuesByHostname;
     SlaveKeeper m_slaveKeeper;
+    // slaves started and connected ahead of time, until a job takes them
+    QList<QPointer<KIO::Slave> > m_preparedSlaves;
+    // prepared slaves still connecting, they join the keeper once connected
+    QList<KIO::Slave *> m_connectingSlaves;
     int m_maxConnectionsPerHost;
     int m_maxConnectionsTotal;
+    int m_maxPreparedSlaves;
     int m_runningJobsCount;
 };
 
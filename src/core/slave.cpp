@@ -23,8 +23,12 @@
 #include <qplatformdefs.h>
 #include <stdio.h>
 
+#include <QCoreApplication>
 #include <QFile>
+#include <QLibrary>
+#include <QPointer>
 #include <QStandardPaths>
+#include <QThread>
 #include <QTimer>
 #include <QProcess>
 #include <QElapsedTimer>
@@ -42,6 +46,8 @@
 #include "connectionserver.h"
 #include "kioglobal_p.h"
 #include <kprotocolinfo.h>
+#include "kprotocolinfo_p.h"
+#include "kprotocolinfofactory_p.h"
 #include <config-kiocore.h> // CMAKE_INSTALL_FULL_LIBEXECDIR_KF5
 
 #include "slaveinterface_p.h"
@@ -116,6 +122,213 @@ static bool forkSlaves()
     return bForkSlaves.load() == 1;
 }
 
+#ifdef Q_OS_UNIX
+/*
+ * When forking slaves, a few kioslave processes are started in advance.
+ * By the time one is needed it has loaded Qt and the KDE Frameworks,
+ * which is most of the startup time of a slave. It waits on stdin for the
+ * arguments, loads the slave plugin, and detaches from us like a process
+ * started with QProcess::startDetached(). (klauncher has kdeinit for this.)
+ *
+ * The pool size can be set with $KIO_PREFORK_SLAVES, 0 disables the pool.
+ */
+class PreforkPool : public QObject
+{
+public:
+    explicit PreforkPool(const QString &executable)
+        : m_executable(executable)
+    {
+        bool ok;
+        m_size = qEnvironmentVariableIntValue("KIO_PREFORK_SLAVES", &ok);
+        if (!ok) {
+            m_size = 2;
+        }
+        refill();
+    }
+
+    ~PreforkPool()
+    {
+        // only kills processes still waiting, the others are detached
+        qDeleteAll(m_processes);
+    }
+
+    bool launch(const QString &executable, const QStringList &args)
+    {
+        if (executable != m_executable) {
+            return false;
+        }
+        while (!m_idle.isEmpty()) {
+            QProcess *process = m_idle.takeFirst();
+            if (process->state() == QProcess::NotRunning || process->waitForFinished(0)) {
+                m_processes.removeOne(process);
+                delete process;
+                continue;
+            }
+            QByteArray argLines;
+            for (const QString &arg : args) {
+                argLines += QFile::encodeName(arg);
+                argLines += '\n';
+            }
+            process->write(argLines);
+            process->waitForBytesWritten(1000);
+            process->closeWriteChannel();
+            // our child exits as soon as the slave has detached
+            connect(process, static_cast<void (QProcess::*)(int, QProcess::ExitStatus)>(&QProcess::finished),
+                    this, [this, process]() {
+                        m_processes.removeOne(process);
+                        process->deleteLater();
+                    });
+            QTimer::singleShot(0, this, [this]() {
+                refill();
+            });
+            return true;
+        }
+        QTimer::singleShot(0, this, [this]() {
+            refill();
+        });
+        return false;
+    }
+
+private:
+    void refill()
+    {
+        while (m_idle.count() < m_size) {
+            QProcess *process = new QProcess;
+            process->setProcessChannelMode(QProcess::ForwardedChannels);
+            process->start(m_executable, QStringList() << QStringLiteral("--prefork"));
+            m_idle.append(process);
+            m_processes.append(process);
+        }
+    }
+
+    QString m_executable;
+    int m_size;
+    QList<QProcess *> m_idle;
+    QList<QProcess *> m_processes;
+};
+
+static QThreadStorage<PreforkPool *> s_preforkPool;
+
+static bool launchPreforkedSlave(const QString &executable, const QStringList &args)
+{
+    if (!s_preforkPool.hasLocalData()) {
+        s_preforkPool.setLocalData(new PreforkPool(executable));
+    }
+    return s_preforkPool.localData()->launch(executable, args);
+}
+#endif
+
+/*
+ * Protocols with "inProcess": true in their metadata run on a thread of the
+ * application instead of in a kioslave process, which saves the IPC for
+ * every command. The plugin has to export
+ *   extern "C" int kdemain_inprocess(int argc, char **argv)
+ * which does what kdemain() does, except creating a QCoreApplication.
+ *
+ * A crashing slave takes the application with it, so this is only meant for
+ * trusted local protocols, and only done when the application opts in by
+ * setting $KIO_ENABLE_INPROCESS_SLAVES.
+ */
+typedef int (*InProcessMain)(int, char **);
+
+class InProcessSlaveThread : public QThread
+{
+public:
+    InProcessSlaveThread(InProcessMain slaveMain, const QString &protocol, const QUrl &address)
+        : m_main(slaveMain),
+          m_protocol(protocol.toLatin1()),
+          m_address(address.toString().toLatin1())
+    {
+    }
+
+protected:
+    void run() override
+    {
+        QByteArray name = "kio_" + m_protocol;
+        QByteArray poolSocket;
+        char *argv[] = { name.data(), m_protocol.data(), poolSocket.data(), m_address.data() };
+        m_main(4, argv);
+    }
+
+private:
+    InProcessMain m_main;
+    QByteArray m_protocol;
+    QByteArray m_address;
+};
+
+// How long the application waits for each in-process slave when it quits
+static const unsigned long s_inProcessShutdownTimeout = 10 * 1000;
+
+namespace
+{
+struct InProcessSlave {
+    QPointer<KIO::Slave> slave;
+    QPointer<QThread> thread;
+};
+}
+// only used in the application's thread
+Q_GLOBAL_STATIC(QList<InProcessSlave>, s_inProcessSlaves)
+
+// A slave thread must not outlive the application, stop them all and wait
+static void stopInProcessSlaves()
+{
+    QList<InProcessSlave> slaves;
+    slaves.swap(*s_inProcessSlaves());
+    Q_FOREACH (const InProcessSlave &entry, slaves) {
+        if (entry.slave) {
+            entry.slave->kill();
+        } else if (entry.thread) {
+            entry.thread->requestInterruption();
+        }
+    }
+    Q_FOREACH (const InProcessSlave &entry, slaves) {
+        if (entry.thread && !entry.thread->wait(s_inProcessShutdownTimeout)) {
+            qCWarning(KIO_CORE) << "An in-process slave did not stop in time";
+        }
+    }
+}
+
+static void registerInProcessSlave(KIO::Slave *slave, QThread *thread)
+{
+    static bool s_postRoutineAdded = false;
+    if (!s_postRoutineAdded) {
+        qAddPostRoutine(stopInProcessSlaves);
+        s_postRoutineAdded = true;
+    }
+    QList<InProcessSlave> *slaves = s_inProcessSlaves();
+    for (int i = slaves->count() - 1; i >= 0; --i) {
+        if (!slaves->at(i).thread) {
+            slaves->removeAt(i);
+        }
+    }
+    InProcessSlave entry;
+    entry.slave = slave;
+    entry.thread = thread;
+    slaves->append(entry);
+}
+
+static InProcessMain inProcessMain(const QString &protocol)
+{
+    if (!qEnvironmentVariableIsSet("KIO_ENABLE_INPROCESS_SLAVES")) {
+        return nullptr;
+    }
+    KProtocolInfoPrivate *prot = KProtocolInfoFactory::self()->findProtocol(protocol);
+    if (!prot || !prot->m_inProcess) {
+        return nullptr;
+    }
+    const QString libPath = KPluginLoader::findPlugin(prot->m_exec);
+    if (libPath.isEmpty()) {
+        return nullptr;
+    }
+    // like kioslave, we never unload the plugin
+    QLibrary lib(libPath);
+    InProcessMain slaveMain = reinterpret_cast<InProcessMain>(lib.resolve("kdemain_inprocess"));
+    if (!slaveMain) {
+        qCWarning(KIO_CORE) << libPath << "does not export kdemain_inprocess, starting a kioslave process for" << protocol;
+    }
+    return slaveMain;
+}
+
 namespace KIO
 {
 
@@ -125,7 +338,7 @@ namespace KIO
 class SlavePrivate: public SlaveInterfacePrivate
 {
 public:
-    SlavePrivate(const QString &protocol) :
+    SlavePrivate(const QString &protocol, bool inProcess) :
         m_protocol(protocol),
         m_slaveProtocol(protocol),
         slaveconnserver(new KIO::ConnectionServer),
@@ -134,10 +347,15 @@ public:
         m_port(0),
         contacted(false),
         dead(false),
-        m_refCount(1)
+        m_refCount(1),
+        m_inProcessThread(nullptr)
     {
         contact_started.start();
-        slaveconnserver->listenForRemote();
+        if (inProcess) {
+            slaveconnserver->listenInProcess();
+        } else {
+            slaveconnserver->listenForRemote();
+        }
         if (!slaveconnserver->isListening()) {
             qCWarning(KIO_CORE) << "KIO Connection server not listening, could not connect";
         }
@@ -161,6 +379,8 @@ public:
     QElapsedTimer contact_started;
     QElapsedTimer m_idleSince;
     int m_refCount;
+    // set for a slave running on a thread of the application
+    QPointer<QThread> m_inProcessThread;
 };
 }
 
@@ -213,7 +433,12 @@ void Slave::timeout()
 }
 
 Slave::Slave(const QString &protocol, QObject *parent)
-    : SlaveInterface(*new SlavePrivate(protocol), parent)
+    : Slave(protocol, false, parent)
+{
+}
+
+Slave::Slave(const QString &protocol, bool inProcess, QObject *parent)
+    : SlaveInterface(*new SlavePrivate(protocol, inProcess), parent)
 {
     Q_D(Slave);
     d->slaveconnserver->setParent(this);
@@ -430,6 +655,13 @@ void Slave::kill()
         KIOPrivate::sendTerminateSignal(d->m_pid);
         d->m_pid = 0;
     }
+    if (d->m_inProcessThread) {
+        // There is no process to signal. The slave checks the interruption in
+        // wasKilled(), and closing the connection wakes it up if it waits for
+        // a command or makes its next send fail.
+        d->m_inProcessThread->requestInterruption();
+        d->connection->close();
+    }
 }
 
 void Slave::setHost(const QString &host, quint16 port,
@@ -471,6 +703,19 @@ Slave *Slave::createSlave(const QString &protocol, const QUrl &url, int &error,
     if (protocol == QLatin1String("data")) {
         return new DataProtocol();
     }
+    if (InProcessMain slaveMain = inProcessMain(protocol)) {
+        Slave *slave = new Slave(protocol, true);
+        const QUrl slaveAddress = slave->d_func()->slaveconnserver->address();
+        if (!slaveAddress.isEmpty()) {
+            InProcessSlaveThread *thread = new InProcessSlaveThread(slaveMain, protocol, slaveAddress);
+            connect(thread, &QThread::finished, thread, &QObject::deleteLater);
+            slave->d_func()->m_inProcessThread = thread;
+            registerInProcessSlave(slave, thread);
+            thread->start();
+            return slave;
+        }
+        delete slave;
+    }
     Slave *slave = new Slave(protocol);
     QUrl slaveAddress = slave->d_func()->slaveconnserver->address();
     if (slaveAddress.isEmpty()) {
@@ -515,6 +760,11 @@ Slave *Slave::createSlave(const QString &protocol, const QUrl &url, int &error,
             return nullptr;
 
         }
+#ifdef Q_OS_UNIX
+        if (launchPreforkedSlave(kioslaveExecutable, args)) {
+            return slave;
+        }
+#endif
         QProcess::startDetached(kioslaveExecutable, args);
 
         return slave;
@@ -240,6 +240,9 @@ Q_SIGNALS:
     void slaveDied(KIO::Slave *slave);
 
 private:
+    // inProcess: the slave runs on a thread of this process, see createSlave()
+    Slave(const QString &protocol, bool inProcess, QObject *parent = nullptr);
+
     Q_DECLARE_PRIVATE(Slave)
 };
 
@@ -38,6 +38,7 @@
 #include <QElapsedTimer>
 #include <QCoreApplication>
 #include <QDataStream>
+#include <QThread>
 
 #include <kconfig.h>
 #include <kconfiggroup.h>
@@ -102,6 +103,7 @@ public:
     Connection appConnection;
     QString poolSocket;
     bool isConnectedToApp;
+    bool inProcess;
 
     QString slaveid;
     bool resume: 1;
@@ -245,45 +247,49 @@ SlaveBase::SlaveBase(const QByteArray &protocol,
 {
     Q_ASSERT(!app_socket.isEmpty());
     d->poolSocket = QFile::decodeName(pool_socket);
-    s_protocol = protocol.data();
+    // a slave running on a thread of the application leaves the process wide state alone
+    d->inProcess = app_socket.startsWith("inprocess:");
+    if (!d->inProcess) {
+        s_protocol = protocol.data();
 #ifdef Q_OS_UNIX
-    if (qEnvironmentVariableIsEmpty("KDE_DEBUG")) {
-        ::signal(SIGSEGV, &sigsegv_handler);
-        ::signal(SIGILL, &sigsegv_handler);
-        ::signal(SIGTRAP, &sigsegv_handler);
-        ::signal(SIGABRT, &sigsegv_handler);
-        ::signal(SIGBUS, &sigsegv_handler);
-        ::signal(SIGALRM, &sigsegv_handler);
-        ::signal(SIGFPE, &sigsegv_handler);
+        if (qEnvironmentVariableIsEmpty("KDE_DEBUG")) {
+            ::signal(SIGSEGV, &sigsegv_handler);
+            ::signal(SIGILL, &sigsegv_handler);
+            ::signal(SIGTRAP, &sigsegv_handler);
+            ::signal(SIGABRT, &sigsegv_handler);
+            ::signal(SIGBUS, &sigsegv_handler);
+            ::signal(SIGALRM, &sigsegv_handler);
+            ::signal(SIGFPE, &sigsegv_handler);
 #ifdef SIGPOLL
-        ::signal(SIGPOLL, &sigsegv_handler);
+            ::signal(SIGPOLL, &sigsegv_handler);
 #endif
 #ifdef SIGSYS
-        ::signal(SIGSYS, &sigsegv_handler);
+            ::signal(SIGSYS, &sigsegv_handler);
 #endif
 #ifdef SIGVTALRM
-        ::signal(SIGVTALRM, &sigsegv_handler);
+            ::signal(SIGVTALRM, &sigsegv_handler);
 #endif
 #ifdef SIGXCPU
-        ::signal(SIGXCPU, &sigsegv_handler);
+            ::signal(SIGXCPU, &sigsegv_handler);
 #endif
 #ifdef SIGXFSZ
-        ::signal(SIGXFSZ, &sigsegv_handler);
+            ::signal(SIGXFSZ, &sigsegv_handler);
 #endif
-    }
+        }
 
-    struct sigaction act;
-    act.sa_handler = sigpipe_handler;
-    sigemptyset(&act.sa_mask);
-    act.sa_flags = 0;
-    sigaction(SIGPIPE, &act, nullptr);
+        struct sigaction act;
+        act.sa_handler = sigpipe_handler;
+        sigemptyset(&act.sa_mask);
+        act.sa_flags = 0;
+        sigaction(SIGPIPE, &act, nullptr);
 
-    ::signal(SIGINT, &genericsig_handler);
-    ::signal(SIGQUIT, &genericsig_handler);
-    ::signal(SIGTERM, &genericsig_handler);
+        ::signal(SIGINT, &genericsig_handler);
+        ::signal(SIGQUIT, &genericsig_handler);
+        ::signal(SIGTERM, &genericsig_handler);
 #endif
 
-    globalSlave = this;
+        globalSlave = this;
+    }
 
     d->isConnectedToApp = true;
 
@@ -311,8 +317,11 @@ SlaveBase::~SlaveBase()
     delete d->configGroup;
     delete d->config;
     delete d->remotefile;
+    const bool inProcess = d->inProcess;
     delete d;
-    s_protocol = "";
+    if (!inProcess) {
+        s_protocol = "";
+    }
 }
 
 void SlaveBase::dispatchLoop()
@@ -663,6 +672,7 @@ void SlaveBase::mimeType(const QString &_type)
             if (ret == -1) {
                 //qDebug() << "read error";
                 exit();
+                return;
             }
             //qDebug() << "got" << cmd;
             if (cmd == CMD_HOST) { // Ignore.
@@ -685,6 +695,12 @@ void SlaveBase::exit()
     // so let's cleanly exit dispatchLoop() instead.
     // Update: we do need to call exit(), otherwise a long download (get()) would
     // keep going until it ends, even though the application exited.
+    if (d->inProcess) {
+        // That would take the application down as well; stop what we are
+        // doing as if the slave had been killed instead.
+        d->wasKilled = true;
+        return;
+    }
     ::exit(255);
 }
 
@@ -1440,7 +1456,8 @@ int SlaveBase::readTimeout()
 
 bool SlaveBase::wasKilled() const
 {
-    return d->wasKilled;
+    // Slave::kill() interrupts the thread of an in-process slave
+    return d->wasKilled || (d->inProcess && QThread::currentThread()->isInterruptionRequested());
 }
 
 void SlaveBase::setKillFlag()
@@ -1450,6 +1467,13 @@ void SlaveBase::setKillFlag()
 
 void SlaveBase::send(int cmd, const QByteArray &arr)
 {
+    if (d->inProcess) {
+        // there is no SIGPIPE, and slaveWriteError is shared by all threads
+        if (!d->appConnection.send(cmd, arr)) {
+            exit();
+        }
+        return;
+    }
     slaveWriteError = false;
     if (!d->appConnection.send(cmd, arr))
         // Note that slaveWriteError can also be set by sigpipe_handler
@@ -26,20 +26,36 @@
 
 #include "tcpslavebase.h"
 #include "kiocoredebug.h"
+#include "hostinfo.h"
 
 #include <kconfiggroup.h>
 #include <ksslcertificatemanager.h>
+#include "ksslcertificatemanager_p.h"
 #include <ksslsettings.h>
 #include <klocalizedstring.h>
 #include <ktcpsocket.h>
 
+#include <QCryptographicHash>
 #include <QDataStream>
+#include <QDateTime>
+#include <QDir>
+#include <QEventLoop>
+#include <QFile>
+#include <QHash>
+#include <QNetworkProxy>
+#include <QSaveFile>
+#include <QStandardPaths>
 #include <QTime>
+#include <QTimer>
 #include <QTcpSocket>
 #include <QHostInfo>
 #include <QSslConfiguration>
 #include <QDBusConnection>
 
+#include <algorithm>
+#include <functional>
+#include <limits>
+
 using namespace KIO;
 //using namespace KNetwork;
 
@@ -51,8 +67,8 @@ Q_DECLARE_OPERATORS_FOR_FLAGS(TCPSlaveBase::SslResult)
 //TODO Proxy support whichever way works; KPAC reportedly does *not* work.
 //NOTE kded_proxyscout may or may not be interesting
 
-//TODO resurrect SSL session recycling; this means save the session on disconnect and look
-//for a reusable session on connect. Consider how HTTP persistent connections interact with that.
+//NOTE TLS sessions are recycled across slaves through TlsSession files in the runtime directory,
+//see loadTlsSession() and saveTlsSession(). HTTP persistent connections simply keep theirs.
 
 //TODO in case we support SSL-lessness we need static KTcpSocket::sslAvailable() and check it
 //in most places we ATM check for d->isSSL.
@@ -79,6 +95,102 @@ Q_DECLARE_OPERATORS_FOR_FLAGS(TCPSlaveBase::SslResult)
    - Would you like to accept this certificate forever: Yes/No/Current sessions only (inline)
  */
 
+// A resumable TLS session of a host, shared by all slaves of the user.
+// A resumed handshake does not transfer the peer certificates again, so the
+// verified chain and the errors found in it are kept along with the ticket.
+struct TlsSession {
+    QByteArray ticket;
+    QList<QSslCertificate> peerCertificateChain;
+    QList<KSslError> sslErrors;
+};
+
+static const quint32 s_tlsSessionVersion = 1;
+// used when the server gives no lifetime hint for its ticket
+static const int s_defaultTlsSessionLifetime = 10 * 60;
+static const int s_maxTlsSessionLifetime = 24 * 60 * 60;
+
+static QString tlsSessionFileName(const QString &host, quint16 port)
+{
+    const QByteArray key = host.toLower().toUtf8() + ':' + QByteArray::number(port);
+    return QStandardPaths::writableLocation(QStandardPaths::RuntimeLocation)
+           + QLatin1String("/kio_tls_sessions/")
+           + QString::fromLatin1(QCryptographicHash::hash(key, QCryptographicHash::Sha1).toHex());
+}
+
+static bool loadTlsSession(const QString &host, quint16 port, TlsSession *session)
+{
+    QFile file(tlsSessionFileName(host, port));
+    if (!file.open(QIODevice::ReadOnly)) {
+        return false;
+    }
+    QDataStream stream(&file);
+    stream.setVersion(QDataStream::Qt_5_6);
+    quint32 version;
+    qint64 expiry;
+    QList<QByteArray> chain;
+    QList<qint32> errors;
+    QList<qint32> errorCertificates;
+    stream >> version;
+    if (version != s_tlsSessionVersion) {
+        return false;
+    }
+    stream >> expiry >> session->ticket >> chain >> errors >> errorCertificates;
+    if (stream.status() != QDataStream::Ok || errors.count() != errorCertificates.count()) {
+        return false;
+    }
+    if (expiry <= QDateTime::currentMSecsSinceEpoch() / 1000) {
+        file.remove();
+        return false;
+    }
+
+    Q_FOREACH (const QByteArray &der, chain) {
+        session->peerCertificateChain.append(QSslCertificate(der, QSsl::Der));
+    }
+    for (int i = 0; i < errors.count(); i++) {
+        const int certIndex = errorCertificates.at(i);
+        session->sslErrors.append(KSslError(static_cast<KSslError::Error>(errors.at(i)),
+                                            certIndex >= 0 && certIndex < chain.count()
+                                            ? session->peerCertificateChain.at(certIndex) : QSslCertificate()));
+    }
+    return !session->ticket.isEmpty() && !session->peerCertificateChain.isEmpty();
+}
+
+static void saveTlsSession(const QString &host, quint16 port, const TlsSession &session, int lifetimeHint)
+{
+    const QString fileName = tlsSessionFileName(host, port);
+    QDir().mkpath(fileName.left(fileName.lastIndexOf(QLatin1Char('/'))));
+
+    QList<QByteArray> chain;
+    Q_FOREACH (const QSslCertificate &cert, session.peerCertificateChain) {
+        chain.append(cert.toDer());
+    }
+    QList<qint32> errors;
+    QList<qint32> errorCertificates;
+    Q_FOREACH (const KSslError &error, session.sslErrors) {
+        errors.append(static_cast<qint32>(error.error()));
+        errorCertificates.append(session.peerCertificateChain.indexOf(error.certificate()));
+    }
+    const int lifetime = qBound(1, lifetimeHint > 0 ? lifetimeHint : s_defaultTlsSessionLifetime,
+                                s_maxTlsSessionLifetime);
+
+    QSaveFile file(fileName);
+    if (!file.open(QIODevice::WriteOnly)) {
+        return;
+    }
+    // the ticket is a secret that lets anybody resume the session
+    file.setPermissions(QFileDevice::ReadOwner | QFileDevice::WriteOwner);
+    QDataStream stream(&file);
+    stream.setVersion(QDataStream::Qt_5_6);
+    stream << s_tlsSessionVersion << qint64(QDateTime::currentMSecsSinceEpoch() / 1000 + lifetime)
+           << session.ticket << chain << errors << errorCertificates;
+    file.commit();
+}
+
+static void removeTlsSession(const QString &host, quint16 port)
+{
+    QFile::remove(tlsSessionFileName(host, port));
+}
+
 /** @internal */
 class Q_DECL_HIDDEN TCPSlaveBase::TcpSlaveBasePrivate
 {
@@ -104,7 +216,6 @@ public:
         // those belong to the peer (==website or similar) certificate.
         for (int i = 0; i < sslErrors.count(); i++) {
             if (sslErrors[i].certificate().isNull()) {
-				const QList<QSslCertificate> peerCertificateChain = socket.peerCertificateChain();
                 sslErrors[i] = KSslError(sslErrors[i].error(),
                                          peerCertificateChain[0]);
             }
@@ -112,7 +223,7 @@ public:
 
         QString errorStr;
         // encode the two-dimensional numeric error list using '\n' and '\t' as outer and inner separators
-        Q_FOREACH (const QSslCertificate &cert, socket.peerCertificateChain()) {
+        Q_FOREACH (const QSslCertificate &cert, peerCertificateChain) {
             Q_FOREACH (const KSslError &error, sslErrors) {
                 if (error.certificate() == cert) {
                     errorStr += QString::number(static_cast<int>(error.error())) + '\t';
@@ -127,7 +238,7 @@ public:
         sslMetaData.insert(QStringLiteral("ssl_cert_errors"), errorStr);
 
         QString peerCertChain;
-        Q_FOREACH (const QSslCertificate &cert, socket.peerCertificateChain()) {
+        Q_FOREACH (const QSslCertificate &cert, peerCertificateChain) {
             peerCertChain.append(cert.toPem());
             peerCertChain.append('\x01');
         }
@@ -151,8 +262,37 @@ public:
         }
     }
 
+    void storeTlsSession()
+    {
+        // servers may send their ticket only after the handshake, so look again before
+        // the connection is closed
+        const QSslConfiguration sslConfig = socket.sslConfiguration();
+        if (sslConfig.sessionTicket().isEmpty() || sslConfig.sessionTicket() == storedSession.ticket) {
+            return;
+        }
+        storedSession.ticket = sslConfig.sessionTicket();
+        storedSession.peerCertificateChain = peerCertificateChain;
+        storedSession.sslErrors = sslErrors;
+        saveTlsSession(host, port, storedSession, sslConfig.sessionTicketLifeTimeHint());
+    }
+
+    static QByteArray verdictKey(const QSslCertificate &cert, const QString &host, const QList<KSslError> &errors)
+    {
+        QList<int> errorCodes;
+        Q_FOREACH (const KSslError &error, errors) {
+            errorCodes.append(static_cast<int>(error.error()));
+        }
+        std::sort(errorCodes.begin(), errorCodes.end());
+        QByteArray key = cert.digest(QCryptographicHash::Sha256) + host.toUtf8();
+        Q_FOREACH (int code, errorCodes) {
+            key += ' ' + QByteArray::number(code);
+        }
+        return key;
+    }
+
     SslResult startTLSInternal(KTcpSocket::SslVersion sslVersion,
                                int waitForEncryptedTimeout = -1);
+    void connectToAddresses(const QList<QHostAddress> &addresses, quint16 port, int timeout);
 
     TCPSlaveBase *q;
 
@@ -171,6 +311,15 @@ public:
     bool sslNoUi; // If true, we just drop the connection silently
     // if SSL certificate check fails in some way.
     QList<KSslError> sslErrors;
+    // the peer's chain, which is the one of the stored session if it was resumed
+    QList<QSslCertificate> peerCertificateChain;
+    // the session offered for resumption, then the one saved for this connection
+    TlsSession storedSession;
+    // errors accepted through certificate rules, valid until the rule expires
+    // or any rule changes; saves asking kiod for the rule on each connection
+    // to the same host
+    QHash<QByteArray, QDateTime> acceptedCertificates;
+    QByteArray acceptedCertificatesRevision;
 
     MetaData sslMetaData;
 };
@@ -299,6 +448,140 @@ bool TCPSlaveBase::connectToHost(const QString &/*protocol*/,
     return false;
 }
 
+/*
+   Trying the addresses of a host one after the other stalls for the whole
+   connect timeout when the first one does not answer, which is common for
+   dual-stack hosts with broken IPv6. So, as in RFC 8305 ("Happy Eyeballs"),
+   the addresses alternate between the address families and the next attempt
+   starts when the previous one has not succeeded within
+   s_connectionAttemptDelay, or right away when it failed.
+*/
+static const int s_connectionAttemptDelay = 250; // ms
+
+// the resolver already sorted the addresses by preference, RFC 6724 style
+static QList<QHostAddress> interleaveAddressFamilies(const QList<QHostAddress> &addresses)
+{
+    QList<QHostAddress> preferred;
+    QList<QHostAddress> other;
+    Q_FOREACH (const QHostAddress &address, addresses) {
+        if (address.protocol() == addresses.first().protocol()) {
+            preferred.append(address);
+        } else {
+            other.append(address);
+        }
+    }
+
+    QList<QHostAddress> result;
+    for (int i = 0; i < qMax(preferred.count(), other.count()); ++i) {
+        if (i < preferred.count()) {
+            result.append(preferred.at(i));
+        }
+        if (i < other.count()) {
+            result.append(other.at(i));
+        }
+    }
+    return result;
+}
+
+// a proxy has to resolve the name itself
+static bool isDirectConnection(const KTcpSocket &socket, const QString &host, quint16 port)
+{
+    QNetworkProxy proxy = socket.proxy();
+    if (proxy.type() == QNetworkProxy::DefaultProxy) {
+        const QList<QNetworkProxy> proxies = QNetworkProxyFactory::proxyForQuery(QNetworkProxyQuery(host, port));
+        proxy = proxies.isEmpty() ? QNetworkProxy(QNetworkProxy::NoProxy) : proxies.first();
+    }
+    return proxy.type() == QNetworkProxy::NoProxy;
+}
+
+// The socket itself makes the first attempt. If another attempt wins the
+// race, the socket connects again to that address, which is known to answer.
+void TCPSlaveBase::TcpSlaveBasePrivate::connectToAddresses(const QList<QHostAddress> &addresses, quint16 port, int timeout)
+{
+    QEventLoop loop;
+    QTimer attemptTimer;
+    attemptTimer.setSingleShot(true);
+    QTimer timeoutTimer;
+    timeoutTimer.setSingleShot(true);
+
+    QList<QTcpSocket *> attempts;
+    QTcpSocket *winner = nullptr;
+    int next = 1;
+    int failed = 0;
+
+    std::function<void()> startNextAttempt;
+    auto attemptFailed = [&]() {
+        if (++failed == addresses.count()) {
+            loop.quit();
+        } else if (!winner) {
+            startNextAttempt();
+        }
+    };
+    startNextAttempt = [&]() {
+        if (next >= addresses.count()) {
+            return;
+        }
+        QTcpSocket *attempt = new QTcpSocket;
+        attempt->setProxy(QNetworkProxy::NoProxy);
+        attempts.append(attempt);
+        QObject::connect(attempt, &QAbstractSocket::stateChanged, &loop, [&, attempt](QAbstractSocket::SocketState state) {
+            if (state == QAbstractSocket::ConnectedState) {
+                if (!winner) {
+                    winner = attempt;
+                }
+                loop.quit();
+            } else if (state == QAbstractSocket::UnconnectedState) {
+                attempt->disconnect(&loop);
+                attemptFailed();
+            }
+        });
+        attempt->connectToHost(addresses.at(next++), port);
+        attemptTimer.start(s_connectionAttemptDelay);
+    };
+
+    QObject::connect(&attemptTimer, &QTimer::timeout, &loop, [&]() {
+        startNextAttempt();
+    });
+    QObject::connect(&timeoutTimer, &QTimer::timeout, &loop, &QEventLoop::quit);
+    const QMetaObject::Connection socketConnection =
+        QObject::connect(&socket, &KTcpSocket::stateChanged, &loop, [&](KTcpSocket::State state) {
+            if (state == KTcpSocket::ConnectedState) {
+                loop.quit();
+            } else if (state == KTcpSocket::UnconnectedState) {
+                attemptFailed();
+            }
+        });
+
+    socket.connectToHost(addresses.first(), port);
+    if (socket.state() != KTcpSocket::ConnectedState && !winner && failed < addresses.count()) {
+        if (socket.state() != KTcpSocket::UnconnectedState) {
+            attemptTimer.start(s_connectionAttemptDelay);
+        }
+        if (timeout > -1) {
+            timeoutTimer.start(timeout);
+        }
+        loop.exec(QEventLoop::ExcludeUserInputEvents);
+    }
+
+    QObject::disconnect(socketConnection);
+    Q_FOREACH (QTcpSocket *attempt, attempts) {
+        attempt->disconnect(&loop);
+    }
+
+    if (socket.state() != KTcpSocket::ConnectedState) {
+        if (winner) {
+            qCDebug(KIO_CORE) << "Connecting to" << winner->peerAddress() << "instead of" << addresses.first();
+            socket.abort();
+            socket.connectToHost(winner->peerAddress(), port);
+            socket.waitForConnected(timeout);
+        } else if (socket.state() != KTcpSocket::UnconnectedState) {
+            // gives the timeout error
+            socket.waitForConnected(1);
+        }
+    }
+    qDeleteAll(attempts);
+}
+
 int TCPSlaveBase::connectToHost(const QString &host, quint16 port, QString *errorString)
 {
     d->clearSslMetaData(); //We have separate connection and SSL setup phases
@@ -357,12 +640,24 @@ int TCPSlaveBase::connectToHost(const QString &host, quint16 port, QString *erro
     KTcpSocket::SslVersions alreadyTriedSslVersions = trySslVersion;
 
     const int timeout = (connectTimeout() * 1000); // 20 sec timeout value
+
+    // a host with several addresses is connected to RFC 8305 style, see connectToAddresses()
+    QList<QHostAddress> addresses;
+    if (QHostAddress(host).isNull() && isDirectConnection(d->socket, host, port)) {
+        const QHostInfo hostInfo = HostInfo::lookupHost(host, timeout > -1 ? timeout : std::numeric_limits<unsigned long>::max());
+        addresses = interleaveAddressFamilies(hostInfo.addresses());
+    }
+
     while (true) {
         disconnectFromHost();  //Reset some state, even if we are already disconnected
         d->host = host;
 
-        d->socket.connectToHost(host, port);
-        /*const bool connectOk = */d->socket.waitForConnected(timeout > -1 ? timeout : -1);
+        if (addresses.count() > 1) {
+            d->connectToAddresses(addresses, port, timeout);
+        } else {
+            d->socket.connectToHost(host, port);
+            /*const bool connectOk = */d->socket.waitForConnected(timeout > -1 ? timeout : -1);
+        }
 
         /*qDebug() << "Socket: state=" << d->socket.state()
           << ", error=" << d->socket.error()
@@ -447,6 +742,9 @@ int TCPSlaveBase::connectToHost(const QString &host, quint16 port, QString *erro
 void TCPSlaveBase::disconnectFromHost()
 {
     //qDebug();
+    if (d->usingSSL && d->socket.encryptionMode() == KTcpSocket::SslClientMode) {
+        d->storeTlsSession();
+    }
     d->host.clear();
     d->ip.clear();
     d->usingSSL = false;
@@ -458,9 +756,6 @@ void TCPSlaveBase::disconnectFromHost()
         return;
     }
 
-    //### maybe save a session for reuse on SSL shutdown if and when QSslSocket
-    //    does that. QCA::TLS can do it apparently but that is not enough if
-    //    we want to present that as KDE API. Not a big loss in any case.
     d->socket.disconnectFromHost();
     if (d->socket.state() != KTcpSocket::UnconnectedState) {
         d->socket.waitForDisconnected(-1);    // wait for unsent data to be sent
@@ -501,13 +796,22 @@ TCPSlaveBase::SslResult TCPSlaveBase::TcpSlaveBasePrivate::startTLSInternal(KTcp
 {
     q->selectClientCertificate();
 
-    //setMetaData("ssl_session_id", d->kssl->session()->toString());
-    //### we don't support session reuse for now...
     usingSSL = true;
 
     // Set the SSL version to use...
     socket.setAdvertisedSslVersion(version);
 
+    // Offer the session of a previous connection to this host, which saves the
+    // certificate exchange and its verification
+    storedSession = TlsSession();
+    QSslConfiguration sslConfig = socket.sslConfiguration();
+    sslConfig.setSslOption(QSsl::SslOptionDisableSessionPersistence, false);
+    if (!loadTlsSession(host, port, &storedSession)) {
+        storedSession = TlsSession();
+    }
+    sslConfig.setSessionTicket(storedSession.ticket);
+    socket.setSslConfiguration(sslConfig);
+
     /* Usually ignoreSslErrors() would be called in the slot invoked by the sslErrors()
        signal but that would mess up the flow of control. We will check for errors
        anyway to decide if we want to continue connecting. Otherwise ignoreSslErrors()
@@ -519,14 +823,27 @@ TCPSlaveBase::SslResult TCPSlaveBase::TcpSlaveBasePrivate::startTLSInternal(KTcp
     //Set metadata, among other things for the "SSL Details" dialog
     KSslCipher cipher = socket.sessionCipher();
 
+    peerCertificateChain = socket.peerCertificateChain();
+    sslErrors = socket.sslErrors();
+    const QSslCertificate peerCertificate = socket.sslConfiguration().peerCertificate();
+    if (peerCertificateChain.isEmpty() && !storedSession.ticket.isEmpty()
+            && !peerCertificate.isNull() && peerCertificate == storedSession.peerCertificateChain.first()) {
+        // the session was resumed, the server did not send its chain again
+        peerCertificateChain = storedSession.peerCertificateChain;
+        sslErrors = storedSession.sslErrors;
+    }
+
     if (!encryptionStarted || socket.encryptionMode() != KTcpSocket::SslClientMode
-            || cipher.isNull() || cipher.usedBits() == 0 || socket.peerCertificateChain().isEmpty()) {
+            || cipher.isNull() || cipher.usedBits() == 0 || peerCertificateChain.isEmpty()) {
         usingSSL = false;
+        if (!storedSession.ticket.isEmpty()) {
+            removeTlsSession(host, port);
+        }
         clearSslMetaData();
         /*qDebug() << "Initial SSL handshake failed. encryptionStarted is"
           << encryptionStarted << ", cipher.isNull() is" << cipher.isNull()
           << ", cipher.usedBits() is" << cipher.usedBits()
-          << ", length of certificate chain is" << socket.peerCertificateChain().count()
+          << ", length of certificate chain is" << peerCertificateChain.count()
           << ", the socket says:" << socket.errorString()
           << "and the list of SSL errors contains"
           << socket.sslErrors().count() << "items.";*/
@@ -546,8 +863,6 @@ TCPSlaveBase::SslResult TCPSlaveBase::TcpSlaveBasePrivate::startTLSInternal(KTcp
       << " supportedBits:" << cipher.supportedBits()
       << " usedBits:" << cipher.usedBits();*/
 
-    sslErrors = socket.sslErrors();
-
     // TODO: review / rewrite / remove the comment
     // The app side needs the metadata now for the SSL error dialog (if any) but
     // the same metadata will be needed later, too. When "later" arrives the slave
@@ -563,6 +878,7 @@ TCPSlaveBase::SslResult TCPSlaveBase::TcpSlaveBasePrivate::startTLSInternal(KTcp
     SslResult rc = q->verifyServerCertificate();
     if (rc & ResultFailed) {
         usingSSL = false;
+        removeTlsSession(host, port);
         clearSslMetaData();
         //qDebug() << "server certificate verification failed.";
         socket.disconnectFromHost();     //Make the connection fail (cf. ignoreSslErrors())
@@ -570,6 +886,7 @@ TCPSlaveBase::SslResult TCPSlaveBase::TcpSlaveBasePrivate::startTLSInternal(KTcp
     } else if (rc & ResultOverridden) {
         //qDebug() << "server certificate verification failed but continuing at user's request.";
     }
+    storeTlsSession();
 
     //"warn" when starting SSL/TLS
     if (q->metaData(QStringLiteral("ssl_activate_warnings")) == QLatin1String("TRUE")
@@ -790,7 +1107,20 @@ TCPSlaveBase::SslResult TCPSlaveBase::verifyServerCertificate()
         //TODO message "sorry, fatal error, you can't override it"
         return ResultFailed;
     }
-    QList<QSslCertificate> peerCertificationChain = d->socket.peerCertificateChain();
+    QList<QSslCertificate> peerCertificationChain = d->peerCertificateChain;
+    const QByteArray ruleRevision = _ksslRuleRevision();
+    if (ruleRevision != d->acceptedCertificatesRevision) {
+        // a rule may have been revoked
+        d->acceptedCertificates.clear();
+        d->acceptedCertificatesRevision = ruleRevision;
+    }
+    const QByteArray verdictKey = TcpSlaveBasePrivate::verdictKey(peerCertificationChain.first(), d->host, d->sslErrors);
+    const QDateTime acceptedUntil = d->acceptedCertificates.value(verdictKey);
+    if (acceptedUntil.isValid() && acceptedUntil > QDateTime::currentDateTime()) {
+        return ResultOk | ResultOverridden;
+    }
+    d->acceptedCertificates.remove(verdictKey);
+
     KSslCertificateManager *const cm = KSslCertificateManager::self();
     KSslCertificateRule rule = cm->rule(peerCertificationChain.first(), d->host);
 
@@ -798,6 +1128,7 @@ TCPSlaveBase::SslResult TCPSlaveBase::verifyServerCertificate()
     QList<KSslError> remainingErrors = rule.filterErrors(d->sslErrors);
     if (remainingErrors.isEmpty()) {
         //qDebug() << "Error list empty after removing errors to be ignored. Continuing.";
+        d->acceptedCertificates.insert(verdictKey, rule.expiryDateTime());
         return ResultOk | ResultOverridden;
     }
 
@@ -855,6 +1186,7 @@ TCPSlaveBase::SslResult TCPSlaveBase::verifyServerCertificate()
     rule.setExpiryDateTime(ruleExpiry);
     rule.setIgnoredErrors(d->sslErrors);
     cm->setRule(rule);
+    d->acceptedCertificates.insert(verdictKey, ruleExpiry);
 
     return ResultOk | ResultOverridden;
 #if 0 //### need to do something like the old code about the main and subframe stuff
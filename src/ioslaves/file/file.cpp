@@ -119,6 +119,18 @@ extern "C" Q_DECL_EXPORT int kdemain(int argc, char **argv)
     return 0;
 }
 
+// Runs the slave on a thread of the application, see "inProcess" in file.json
+extern "C" Q_DECL_EXPORT int kdemain_inprocess(int argc, char **argv)
+{
+    if (argc != 4) {
+        return -1;
+    }
+
+    FileProtocol slave(argv[2], argv[3]);
+    slave.dispatchLoop();
+    return 0;
+}
+
 static QFile::Permissions modeToQFilePermissions(int mode)
 {
     QFile::Permissions perms;
@@ -428,6 +440,10 @@ void FileProtocol::get(const QUrl &url)
         processedSize(processed_size);
 
         //qDebug() << "Processed: " << KIO::number (processed_size);
+        if (wasKilled()) {
+            f.close();
+            return;
+        }
     }
 
     data(QByteArray());
@@ -710,7 +726,8 @@ void FileProtocol::put(const QUrl &url, int _mode, KIO::JobFlags _flags)
             }
         }
 
-        ::exit(255);
+        exit();
+        return;
     }
 
     if (!f.isOpen()) { // we got nothing to write out, so we never opened the file
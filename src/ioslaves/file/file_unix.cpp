@@ -327,6 +327,19 @@ void FileProtocol::copy(const QUrl &srcUrl, const QUrl &destUrl,
         }
 #endif
         processedSize(processed_size);
+
+        if (wasKilled()) {
+            // the job was cancelled, don't keep the partly copied file
+            src_file.close();
+            dest_file.close();
+#if HAVE_POSIX_ACL
+            if (acl) {
+                acl_free(acl);
+            }
+#endif
+            QFile::remove(dest);
+            return;
+        }
     }
 
     src_file.close();
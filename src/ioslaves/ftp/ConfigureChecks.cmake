@@ -7,3 +7,6 @@ check_include_files(sys/time.h    HAVE_SYS_TIME_H)
 check_include_files(sys/time.h    TIME_WITH_SYS_TIME)
 
 check_symbol_exists(strtoll         "stdlib.h"                 HAVE_STRTOLL)
+# splice() needs _GNU_SOURCE, which g++ defines
+check_cxx_symbol_exists(splice      "fcntl.h"                  HAVE_SPLICE)
+check_symbol_exists(sendfile        "sys/sendfile.h"           HAVE_SENDFILE)
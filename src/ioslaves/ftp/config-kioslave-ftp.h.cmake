@@ -1,3 +1,5 @@
 #cmakedefine01 HAVE_SYS_TIME_H
 #cmakedefine01 HAVE_STRTOLL
 #cmakedefine01 TIME_WITH_SYS_TIME
+#cmakedefine01 HAVE_SPLICE
+#cmakedefine01 HAVE_SENDFILE
@@ -25,6 +25,8 @@
       RFC  959 "File Transfer Protocol (FTP)"
       RFC 1635 "How to Use Anonymous FTP"
       RFC 2428 "FTP Extensions for IPv6 and NATs" (defines EPRT and EPSV)
+      RFC 2389 "Feature negotiation mechanism for the File Transfer Protocol" (defines FEAT and OPTS)
+      RFC 3659 "Extensions to FTP" (defines MLST and MLSD)
 */
 
 #include <config-kioslave-ftp.h>
@@ -43,6 +45,15 @@
 #include <cstdlib>
 #include <cstring>
 
+#if HAVE_SPLICE || HAVE_SENDFILE
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#endif
+#if HAVE_SENDFILE
+#include <sys/sendfile.h>
+#endif
+
 #include <QCoreApplication>
 #include <QDir>
 #include <QHostAddress>
@@ -129,6 +140,11 @@ enum buffersizes {
      * KIO slaves using the data() function
      */
     maximumIpcSize = 32 * 1024,
+    /**
+     * largest buffer size used when the data comes from or goes to a
+     * local file, i.e. doesn't have to pass through data()
+     */
+    maximumCopySize = 256 * 1024,
     /**
      * this is a reasonable value for an initial read() that a KIO slave
      * can do to obtain data via a slow network connection.
@@ -207,6 +223,7 @@ Ftp::Ftp(const QByteArray &pool, const QByteArray &app)
 
     // init other members
     m_port = 0;
+    m_bPipelining = false;
     m_socketProxyAuth = nullptr;
 }
 
@@ -240,6 +257,8 @@ void Ftp::ftpCloseControlConnection()
     m_bLoggedOn = false;    // logon needs control connction
     m_bTextMode = false;
     m_bBusy = false;
+    m_bMlsd = false;
+    m_deferredCmds.clear();
 }
 
 /**
@@ -255,6 +274,7 @@ const char *Ftp::ftpResponse(int iOffset)
     if (iOffset < 0) {
         int  iMore = 0;
         m_iRespCode = 0;
+        m_responseLines.clear();
 
         if (!pTxt) {
             return nullptr;    // avoid using a nullptr when calling atoi.
@@ -285,6 +305,12 @@ const char *Ftp::ftpResponse(int iOffset)
                 qCDebug(KIO_FTP) << "    > " << pTxt;
                 if (iCode >= 100 && iCode == iMore && pTxt[3] == ' ') {
                     iMore = 0;
+                } else {
+                    QByteArray line = m_lastControlLine;
+                    while (line.endsWith('\n') || line.endsWith('\r')) {
+                        line.chop(1);
+                    }
+                    m_responseLines.append(line);
                 }
             }
         } while (iMore != 0);
@@ -367,6 +393,7 @@ bool Ftp::ftpOpenConnection(LoginMode loginMode)
 
     m_initialPath.clear();
     m_currentPath.clear();
+    m_bPipelining = !config()->readEntry("DisablePipelining", false);
 
     if (!ftpOpenControlConnection()) {
         return false;    // error emitted by ftpOpenControlConnection
@@ -671,10 +698,29 @@ bool Ftp::ftpLogin(bool *userChanged)
     qCDebug(KIO_FTP) << "Login OK";
     infoMessage(i18n("Login OK"));
 
+    // SYST, PWD and FEAT don't depend on each other, so they are sent at once.
+    // The auto login macro may change the directory, then PWD has to wait.
+    // FEAT goes last, ftpFeatures() needs all lines of its response.
+    const bool autoLoginMacro = config()->readEntry("EnableAutoLoginMacro", false);
+    QList<QByteArray> cmds;
+    cmds << QByteArrayLiteral("SYST");
+    if (!autoLoginMacro) {
+        cmds << QByteArrayLiteral("PWD");
+    }
+    cmds << QByteArrayLiteral("FEAT");
+    QList<QByteArray> responses;
+    if (!ftpSendCmds(cmds, &responses)) {
+        qCDebug(KIO_FTP) << "Couldn't issue SYST, PWD and FEAT";
+        error(ERR_CANNOT_LOGIN, i18n("Could not login to %1.", m_host));
+        return false;
+    }
+    ftpFeatures();
+
     // Okay, we're logged in. If this is IIS 4, switch dir listing style to Unix:
     // Thanks to jk@soegaard.net (Jens Kristian Sgaard) for this hint
-    if (ftpSendCmd(QByteArrayLiteral("SYST")) && (m_iRespType == 2)) {
-        if (!qstrncmp(ftpResponse(0), "215 Windows_NT", 14)) {  // should do for any version
+    const QByteArray systResponse = responses.at(0);
+    if (systResponse.startsWith('2')) {
+        if (systResponse.startsWith("215 Windows_NT")) {  // should do for any version
             ftpSendCmd(QByteArrayLiteral("site dirstyle"));
             // Check if it was already in Unix style
             // Patch from Keith Refson <Keith.Refson@earth.ox.ac.uk>
@@ -690,19 +736,25 @@ bool Ftp::ftpLogin(bool *userChanged)
         qCWarning(KIO_FTP) << "SYST failed";
     }
 
-    if (config()->readEntry("EnableAutoLoginMacro", false)) {
+    // Get the current working directory
+    QByteArray pwdResponse;
+    if (autoLoginMacro) {
         ftpAutoLoginMacro();
-    }
 
-    // Get the current working directory
-    qCDebug(KIO_FTP) << "Searching for pwd";
-    if (!ftpSendCmd(QByteArrayLiteral("PWD")) || (m_iRespType != 2)) {
+        qCDebug(KIO_FTP) << "Searching for pwd";
+        if (ftpSendCmd(QByteArrayLiteral("PWD")) && (m_iRespType == 2)) {
+            pwdResponse = ftpResponse(0);
+        }
+    } else if (responses.at(1).startsWith('2')) {
+        pwdResponse = responses.at(1);
+    }
+    if (pwdResponse.isEmpty()) {
         qCDebug(KIO_FTP) << "Couldn't issue pwd command";
         error(ERR_CANNOT_LOGIN, i18n("Could not login to %1.", m_host));   // or anything better ?
         return false;
     }
 
-    QString sTmp = remoteEncoding()->decode(ftpResponse(3));
+    QString sTmp = remoteEncoding()->decode(pwdResponse.mid(3));
     int iBeg = sTmp.indexOf('"');
     int iEnd = sTmp.lastIndexOf('"');
     if (iBeg > 0 && iBeg < iEnd) {
@@ -775,8 +827,15 @@ bool Ftp::ftpSendCmd(const QByteArray &cmd, int maxretries)
     }
 #endif
 
-    // Send the message...
-    QByteArray buf = cmd;
+    // Send the message, along with deferred commands if there are any...
+    const QList<QByteArray> deferredCmds = m_deferredCmds;
+    m_deferredCmds.clear();
+    QByteArray buf;
+    Q_FOREACH (const QByteArray &deferredCmd, deferredCmds) {
+        buf += deferredCmd;
+        buf += "\r\n";
+    }
+    buf += cmd;
     buf += "\r\n";      // Yes, must use CR/LF - see http://cr.yp.to/ftp/request.html
     int num = m_control->write(buf);
     while (m_control->bytesToWrite() && m_control->waitForBytesWritten()) {}
@@ -785,7 +844,17 @@ bool Ftp::ftpSendCmd(const QByteArray &cmd, int maxretries)
     // attempt to read the response. Otherwise, take action to re-attempt
     // the login based on the maximum number of retries specified...
     if (num > 0) {
-        ftpResponse(-1);
+        int answered = 0;
+        for (; answered < deferredCmds.count(); ++answered) {
+            ftpResponse(-1);
+            if (m_iRespType <= 0 || m_iRespCode == 421) {
+                break;    // handled below
+            }
+            ftpDeferredCmdAnswered(deferredCmds.at(answered));
+        }
+        if (answered == deferredCmds.count()) {
+            ftpResponse(-1);
+        }
     } else {
         m_iRespType = m_iRespCode = 0;
     }
@@ -814,6 +883,18 @@ bool Ftp::ftpSendCmd(const QByteArray &cmd, int maxretries)
                 qCDebug(KIO_FTP) << "Was not able to communicate with " << m_host
                                  << "Attempting to re-establish connection.";
 
+                // The new connection needs the transfer mode and the commands
+                // sent along with this one again, the old one may have had them
+                char dataMode = m_cDataMode;
+                QList<QByteArray> redeferredCmds;
+                Q_FOREACH (const QByteArray &deferredCmd, deferredCmds) {
+                    if (deferredCmd.startsWith("TYPE ")) {
+                        dataMode = deferredCmd.at(5);
+                    } else {
+                        redeferredCmds.append(deferredCmd);
+                    }
+                }
+
                 closeConnection(); // Close the old connection...
                 openConnection();  // Attempt to re-establish a new connection...
 
@@ -828,6 +909,15 @@ bool Ftp::ftpSendCmd(const QByteArray &cmd, int maxretries)
 
                 qCDebug(KIO_FTP) << "Logged back in, re-issuing command";
 
+                Q_FOREACH (const QByteArray &deferredCmd, redeferredCmds) {
+                    if (!m_deferredCmds.contains(deferredCmd)) {
+                        m_deferredCmds.append(deferredCmd);
+                    }
+                }
+                if (dataMode && !ftpDataMode(dataMode)) {
+                    return false;
+                }
+
                 // If we were able to login, resend the command...
                 if (maxretries) {
                     maxretries--;
@@ -841,6 +931,256 @@ bool Ftp::ftpSendCmd(const QByteArray &cmd, int maxretries)
     return true;
 }
 
+bool Ftp::ftpSendCmds(const QList<QByteArray> &cmds, QList<QByteArray> *responses)
+{
+    Q_ASSERT(m_control);    // must have control connection socket
+
+    responses->clear();
+    int answered = 0;
+    if (m_bPipelining && cmds.count() > 1) {
+        QByteArray buf;
+        Q_FOREACH (const QByteArray &deferredCmd, m_deferredCmds) {
+            buf += deferredCmd;
+            buf += "\r\n";
+        }
+        Q_FOREACH (const QByteArray &cmd, cmds) {
+            Q_ASSERT(cmd.indexOf('\r') == -1 && cmd.indexOf('\n') == -1);
+            buf += cmd;
+            buf += "\r\n";
+        }
+        const QList<QByteArray> deferredCmds = m_deferredCmds;
+        m_deferredCmds.clear();
+
+        if (m_control->write(buf) > 0) {
+            while (m_control->bytesToWrite() && m_control->waitForBytesWritten()) {}
+
+            bool ok = true;
+            Q_FOREACH (const QByteArray &deferredCmd, deferredCmds) {
+                ftpResponse(-1);
+                if (m_iRespType <= 0 || m_iRespCode == 421) {
+                    ok = false;
+                    break;
+                }
+                ftpDeferredCmdAnswered(deferredCmd);
+            }
+            for (; ok && answered < cmds.count(); ++answered) {
+                ftpResponse(-1);
+                if (m_iRespType <= 0 || m_iRespCode == 421) {
+                    break;
+                }
+                responses->append(ftpResponse(0));
+            }
+        }
+        if (answered < cmds.count()) {
+            // go along with the next command, so that ftpSendCmd() sends
+            // them again on the new connection
+            m_deferredCmds = deferredCmds + m_deferredCmds;
+        }
+    }
+
+    // Either there is no pipelining or the connection broke down. ftpSendCmd()
+    // knows how to deal with the latter.
+    for (; answered < cmds.count(); ++answered) {
+        if (!ftpSendCmd(cmds.at(answered))) {
+            return false;
+        }
+        responses->append(ftpResponse(0));
+    }
+    return true;
+}
+
+void Ftp::ftpDeferCmd(const QByteArray &cmd)
+{
+    if (m_bPipelining) {
+        m_deferredCmds.append(cmd);
+    } else if (ftpSendCmd(cmd)) {
+        ftpDeferredCmdAnswered(cmd);
+    }
+}
+
+void Ftp::ftpDeferredCmdAnswered(const QByteArray &cmd)
+{
+    if (m_iRespType != 2) {
+        qCWarning(KIO_FTP) << cmd << "failed:" << m_iRespCode;
+    }
+    if (cmd.startsWith("TYPE ")) {
+        // ftpOpenCommand() checks this before the transfer starts
+        m_cDataMode = m_iRespType == 2 ? cmd.at(5) : 0;
+    }
+}
+
+/**
+ * Parses the answer to FEAT, which lists one extension per line,
+ * e.g. " MLST type*;size*;modify*;perm;UNIX.mode;" with the facts
+ * that MLST and MLSD send by default marked with '*'.
+ */
+void Ftp::ftpFeatures()
+{
+    if (m_iRespType != 2) {
+        qCDebug(KIO_FTP) << "FEAT is not supported";
+        return;
+    }
+
+    QByteArray mlstFacts;
+    Q_FOREACH (const QByteArray &line, m_responseLines) {
+        if (!line.startsWith(' ')) {
+            continue;
+        }
+        const QByteArray feature = line.trimmed();
+        const int space = feature.indexOf(' ');
+        if (qstricmp(feature.left(space).constData(), "MLST") == 0) {
+            m_extControl |= mlstSupported;
+            mlstFacts = space == -1 ? QByteArray() : feature.mid(space + 1);
+        }
+    }
+    if (!(m_extControl & mlstSupported)) {
+        return;
+    }
+    qCDebug(KIO_FTP) << "MLST facts:" << mlstFacts;
+
+    // Ask for the facts we use if the server doesn't send all of them by default
+    static const char *const s_wantedFacts[] = {
+        "type", "size", "sizd", "modify", "perm", "UNIX.mode",
+        "UNIX.owner", "UNIX.ownername", "UNIX.group", "UNIX.groupname"
+    };
+    QByteArray opts;
+    bool missing = false;
+    Q_FOREACH (QByteArray fact, mlstFacts.split(';')) {
+        const bool enabled = fact.endsWith('*');
+        if (enabled) {
+            fact.chop(1);
+        }
+        for (const char *wantedFact : s_wantedFacts) {
+            if (qstricmp(fact.constData(), wantedFact) == 0) {
+                opts += fact;
+                opts += ';';
+                missing = missing || !enabled;
+                break;
+            }
+        }
+    }
+    if (missing) {
+        ftpDeferCmd("OPTS MLST " + opts);
+    }
+}
+
+bool Ftp::ftpMlst(const QString &path, FtpEntry &ftpEnt)
+{
+    QByteArray buf = "MLST ";
+    buf += remoteEncoding()->encode(path);
+    if (!ftpSendCmd(buf)) {
+        return false;
+    }
+    if (m_iRespType != 2) {
+        if (m_iRespCode == 500 || m_iRespCode == 502) {
+            qCDebug(KIO_FTP) << "disabling use of MLST";
+            m_extControl &= ~mlstSupported;
+        }
+        return false;
+    }
+
+    // The facts come on a line of their own, starting with a space
+    bool isListedDir;
+    Q_FOREACH (const QByteArray &line, m_responseLines) {
+        if (line.startsWith(' ') && ftpParseFacts(line.mid(1), ftpEnt, &isListedDir)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool Ftp::ftpParseFacts(const QByteArray &line, FtpEntry &de, bool *isListedDir)
+{
+    // "fact=value;fact=value; name", the name may contain anything but CR/LF
+    const int nameStart = line.indexOf(' ');
+    if (nameStart == -1) {
+        return false;
+    }
+    QByteArray name = line.mid(nameStart + 1);
+    while (name.endsWith('\n') || name.endsWith('\r')) {
+        name.chop(1);
+    }
+    if (name.isEmpty()) {
+        return false;
+    }
+
+    de.name = remoteEncoding()->decode(name);
+    de.owner.clear();
+    de.group.clear();
+    de.link.clear();
+    de.size = 0;
+    de.type = S_IFREG;
+    de.access = 0;
+    de.date = QDateTime();
+    *isListedDir = false;
+
+    bool hasMode = false;
+    QByteArray perm;
+    Q_FOREACH (const QByteArray &fact, line.left(nameStart).split(';')) {
+        const int equals = fact.indexOf('=');
+        if (equals <= 0) {
+            continue;
+        }
+        const QByteArray key = fact.left(equals).toLower();
+        const QByteArray value = fact.mid(equals + 1);
+
+        if (key == "type") {
+            const QByteArray type = value.toLower();
+            if (type == "dir") {
+                de.type = S_IFDIR;
+            } else if (type == "cdir" || type == "pdir") {
+                de.type = S_IFDIR;
+                *isListedDir = true;
+            } else if (type.startsWith("os.unix=slink:")) {
+                // we don't set S_IFLNK here.  de.link says it.
+                de.link = remoteEncoding()->decode(value.mid(14));
+            }
+        } else if (key == "size" || key == "sizd") {
+            de.size = value.toULongLong();
+        } else if (key == "modify") {
+            // YYYYMMDDHHMMSS, optionally with fractions of a second, in UTC
+            QDateTime date = QDateTime::fromString(QString::fromLatin1(value.left(14)), QStringLiteral("yyyyMMddHHmmss"));
+            date.setTimeSpec(Qt::UTC);
+            de.date = date;
+        } else if (key == "unix.mode") {
+            bool ok;
+            const uint mode = value.toUInt(&ok, 8);
+            if (ok) {
+                de.access = mode & 07777;
+                hasMode = true;
+            }
+        } else if (key == "unix.ownername" || (key == "unix.owner" && de.owner.isEmpty())) {
+            de.owner = remoteEncoding()->decode(value);
+        } else if (key == "unix.groupname" || (key == "unix.group" && de.group.isEmpty())) {
+            de.group = remoteEncoding()->decode(value);
+        } else if (key == "perm") {
+            perm = value.toLower();
+        }
+    }
+
+    if (!hasMode) {
+        // perm tells what we may do, which is the best guess for the owner
+        // permissions. Everything is readable unless we know better.
+        if (perm.isEmpty()) {
+            de.access = S_IRUSR | S_IRGRP | S_IROTH;
+            if (de.type == S_IFDIR) {
+                de.access |= S_IXUSR | S_IXGRP | S_IXOTH;
+            }
+        } else {
+            if (perm.contains('r') || perm.contains('l')) {
+                de.access |= S_IRUSR;
+            }
+            if (perm.contains('w') || perm.contains('a') || perm.contains('c') || perm.contains('m') || perm.contains('p')) {
+                de.access |= S_IWUSR;
+            }
+            if (perm.contains('e')) {
+                de.access |= S_IXUSR;
+            }
+        }
+    }
+    return true;
+}
+
 /*
  * ftpOpenPASVDataConnection - set up data connection, using PASV mode
  *
@@ -1055,6 +1395,11 @@ bool Ftp::ftpOpenCommand(const char *_command, const QString &_path, char _mode,
         errCode = ERR_CANNOT_CONNECT;
     } else {
         errCode = ftpOpenDataConnection();
+        if (errCode == 0 && m_cDataMode == 0) {
+            // the deferred TYPE command failed
+            ftpCloseDataConnection();
+            errCode = ERR_CANNOT_CONNECT;
+        }
     }
 
     if (errCode != 0) {
@@ -1126,6 +1471,7 @@ bool Ftp::ftpCloseCommand()
     // first close data sockets (if opened), then read response that
     // we got for whatever was used in ftpOpenCommand ( should be 226 )
     ftpCloseDataConnection();
+    m_bMlsd = false;
 
     if (!m_bBusy) {
         return true;
@@ -1294,7 +1640,9 @@ void Ftp::ftpCreateUDSEntry(const QString &filename, const FtpEntry &ftpEnt, UDS
 
     entry.fastInsert(KIO::UDSEntry::UDS_NAME, filename);
     entry.fastInsert(KIO::UDSEntry::UDS_SIZE, ftpEnt.size);
-    entry.fastInsert(KIO::UDSEntry::UDS_MODIFICATION_TIME, ftpEnt.date.toTime_t());
+    if (ftpEnt.date.isValid()) {
+        entry.fastInsert(KIO::UDSEntry::UDS_MODIFICATION_TIME, ftpEnt.date.toTime_t());
+    }
     entry.fastInsert(KIO::UDSEntry::UDS_ACCESS, ftpEnt.access);
     entry.fastInsert(KIO::UDSEntry::UDS_USER, ftpEnt.owner);
     if (!ftpEnt.group.isEmpty()) {
@@ -1395,14 +1743,36 @@ void Ftp::stat(const QUrl &url)
     Q_ASSERT(!filename.isEmpty());
     QString search = filename;
 
+    QString sDetails = metaData(QStringLiteral("details"));
+    int details = sDetails.isEmpty() ? 2 : sDetails.toInt();
+    qCDebug(KIO_FTP) << "details=" << details;
+
+    // MLST answers everything with a single command, for files and dirs alike
+    if (m_extControl & mlstSupported) {
+        FtpEntry ftpEnt;
+        if (ftpMlst(path, ftpEnt)) {
+            if (details == 0) {
+                ftpShortStatAnswer(filename, S_ISDIR(ftpEnt.type));
+                return;
+            }
+            UDSEntry entry;
+            ftpCreateUDSEntry(filename, ftpEnt, entry, false);
+            statEntry(entry);
+            finished();
+            return;
+        }
+        if (m_iRespCode == 550) {
+            ftpStatAnswerNotFound(path, filename);
+            return;
+        }
+        // otherwise do it the old way
+    }
+
     // Try cwd into it, if it works it's a dir (and then we'll list the parent directory to get more info)
     // if it doesn't work, it's a file (and then we'll use dir filename)
     bool isDir = ftpFolder(path, false);
 
     // if we're only interested in "file or directory", we should stop here
-    QString sDetails = metaData(QStringLiteral("details"));
-    int details = sDetails.isEmpty() ? 2 : sDetails.toInt();
-    qCDebug(KIO_FTP) << "details=" << details;
     if (details == 0) {
         if (!isDir && !ftpFileExists(path)) { // ok, not a dir -> is it a file ?
             // no -> it doesn't exist at all
@@ -1552,7 +1922,8 @@ void Ftp::listDir(const QUrl &url)
         qCDebug(KIO_FTP) << ftpEnt.name;
         //Q_ASSERT( !ftpEnt.name.isEmpty() );
         if (!ftpEnt.name.isEmpty()) {
-            if (ftpEnt.name.at(0).isSpace()) {
+            // MLSD names are exact, a leading space belongs to the name
+            if (!m_bMlsd && ftpEnt.name.at(0).isSpace()) {
                 ftpValidateEntList.append(ftpEnt);
                 continue;
             }
@@ -1606,6 +1977,12 @@ bool Ftp::ftpOpenDir(const QString &path)
     // In fact we have to use -la otherwise -a removes the default -l (e.g. ftp.trolltech.com)
     // Pass KJob::NoError first because we don't want to emit error before we
     // have tried all commands.
+    // MLSD is preferred, since it has no such issues and gives exact dates.
+    m_bMlsd = (m_extControl & mlstSupported) && ftpOpenCommand("mlsd", QString(), 'I', KJob::NoError);
+    if (m_bMlsd) {
+        qCDebug(KIO_FTP) << "Starting of mlsd was ok";
+        return true;
+    }
     if (!ftpOpenCommand("list -la", QString(), 'I', KJob::NoError)) {
         if (!ftpOpenCommand("list", QString(), 'I', ERR_CANNOT_ENTER_DIRECTORY)) {
             qCWarning(KIO_FTP) << "Can't open for listing";
@@ -1631,6 +2008,14 @@ bool Ftp::ftpReadDir(FtpEntry &de)
         const char *buffer = data.data();
         qCDebug(KIO_FTP) << "dir > " << buffer;
 
+        if (m_bMlsd) {
+            bool isListedDir;
+            if (!ftpParseFacts(data, de, &isListedDir) || isListedDir || de.name.contains(QLatin1Char('/'))) {
+                continue;
+            }
+            return true;
+        }
+
         //Normally the listing looks like
         // -rw-r--r--   1 dfaure   dfaure        102 Nov  9 12:30 log
         // but on Netware servers like ftp://ci-1.ci.pwr.wroc.pl/ it looks like (#76442)
@@ -1874,6 +2259,176 @@ void Ftp::get(const QUrl &url)
     }
 }
 
+bool Ftp::ftpDataSocketIsRaw() const
+{
+    // With a proxy the descriptor belongs to the proxy connection, and
+    // whatever Qt has buffered already must not be overtaken
+    return m_data && m_data->socketDescriptor() != -1 &&
+           QNetworkProxy::applicationProxy().type() == QNetworkProxy::NoProxy &&
+           m_data->bytesAvailable() == 0 && m_data->bytesToWrite() == 0;
+}
+
+#if HAVE_SPLICE || HAVE_SENDFILE
+// Waits until the (non-blocking) data socket is ready, false on timeout
+static bool waitForSocket(int fd, short events, int msecs)
+{
+    pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = events;
+    pfd.revents = 0;
+    int ready;
+    do {
+        ready = poll(&pfd, 1, msecs);
+    } while (ready < 0 && errno == EINTR);
+    return ready > 0;
+}
+#endif
+
+bool Ftp::ftpSpliceGet(int &iError, int iCopyFile, KIO::fileoffset_t &processed_size,
+                       KIO::filesize_t bytesLeft, StatusCode &status)
+{
+#if HAVE_SPLICE
+    if (!ftpDataSocketIsRaw()) {
+        return false;
+    }
+    // splice() needs a pipe on one side, it serves as kernel buffer
+    int pipeFds[2];
+    if (pipe(pipeFds) == -1) {
+        return false;
+    }
+#ifdef F_SETPIPE_SZ
+    fcntl(pipeFds[1], F_SETPIPE_SZ, int(maximumCopySize));
+#endif
+
+    const int socketFd = m_data->socketDescriptor();
+    const bool sizeKnown = (m_size != UnknownSize);
+    // not all file systems support splice(), fall back to read() and write()
+    bool spliceToFile = true;
+    QByteArray buffer;
+    status = statusSuccess;
+
+    while (!sizeKnown || bytesLeft > 0) {
+        size_t len = maximumCopySize;
+        if (sizeKnown && bytesLeft < len) {
+            len = bytesLeft;
+        }
+        const ssize_t n = splice(socketFd, nullptr, pipeFds[1], nullptr, len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+            if (errno == EAGAIN && !waitForSocket(socketFd, POLLIN, readTimeout() * 1000)) {
+                iError = ERR_CANNOT_READ;
+                status = statusServerError;
+                break;
+            }
+            continue;
+        }
+        if (n <= 0) {
+            // this is how we detect EOF in case of unknown size
+            if (n == 0 && !sizeKnown) {
+                break;
+            }
+            // unexpected eof. Happens when the daemon gets killed.
+            iError = ERR_CANNOT_READ;
+            status = statusServerError;
+            break;
+        }
+
+        // now empty the pipe into the file
+        ssize_t left = n;
+        while (left > 0) {
+            ssize_t written;
+            if (spliceToFile) {
+                written = splice(pipeFds[0], nullptr, iCopyFile, nullptr, left, SPLICE_F_MOVE);
+                if (written < 0 && errno == EINVAL) {
+                    spliceToFile = false;
+                    continue;
+                }
+            } else {
+                buffer.resize(qMin(left, ssize_t(maximumCopySize)));
+                written = read(pipeFds[0], buffer.data(), buffer.size());
+                if (written > 0 && (iError = WriteToFile(iCopyFile, buffer.constData(), written)) != 0) {
+                    status = statusClientError;
+                    break;
+                }
+            }
+            if (written < 0 && errno == EINTR) {
+                continue;
+            }
+            if (written <= 0) {
+                iError = (errno == ENOSPC) ? ERR_DISK_FULL : ERR_CANNOT_WRITE;
+                status = statusClientError;
+                break;
+            }
+            left -= written;
+        }
+        if (status != statusSuccess) {
+            break;
+        }
+
+        processed_size += n;
+        if (sizeKnown) {
+            bytesLeft -= n;
+        }
+        processedSize(processed_size);
+    }
+
+    QT_CLOSE(pipeFds[0]);
+    QT_CLOSE(pipeFds[1]);
+    qCDebug(KIO_FTP) << "done";
+    if (status == statusSuccess) {
+        processedSize(sizeKnown ? m_size : processed_size);
+    }
+    return true;
+#else
+    Q_UNUSED(iError);
+    Q_UNUSED(iCopyFile);
+    Q_UNUSED(processed_size);
+    Q_UNUSED(bytesLeft);
+    Q_UNUSED(status);
+    return false;
+#endif
+}
+
+int Ftp::ftpSendFile(int &iError, int iCopyFile, KIO::fileoffset_t &processed_size)
+{
+#if HAVE_SENDFILE
+    if (!ftpDataSocketIsRaw()) {
+        return -2;
+    }
+    const int socketFd = m_data->socketDescriptor();
+    bool sent = false;
+    while (true) {
+        // sends from the current position of iCopyFile, which ftpPut()
+        // has moved to the resume offset
+        const ssize_t n = sendfile(socketFd, iCopyFile, nullptr, maximumCopySize);
+        if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+            if (errno == EAGAIN && !waitForSocket(socketFd, POLLOUT, readTimeout() * 1000)) {
+                iError = ERR_CANNOT_WRITE;
+                return -1;
+            }
+            continue;
+        }
+        if (n < 0) {
+            if (!sent && (errno == EINVAL || errno == ENOSYS)) {
+                return -2;
+            }
+            iError = ERR_CANNOT_WRITE;
+            return -1;
+        }
+        if (n == 0) {
+            return 0;
+        }
+        sent = true;
+        processed_size += n;
+        processedSize(processed_size);
+    }
+#else
+    Q_UNUSED(iError);
+    Q_UNUSED(iCopyFile);
+    Q_UNUSED(processed_size);
+    return -2;
+#endif
+}
+
 Ftp::StatusCode Ftp::ftpGet(int &iError, int iCopyFile, const QUrl &url, KIO::fileoffset_t llOffset)
 {
     // Calls error() by itself!
@@ -1936,28 +2491,31 @@ Ftp::StatusCode Ftp::ftpGet(int &iError, int iCopyFile, const QUrl &url, KIO::fi
     qCDebug(KIO_FTP) << "starting with offset=" << llOffset;
     KIO::fileoffset_t processed_size = llOffset;
 
+    // A local file doesn't need the data to pass through our buffers
+    StatusCode spliceStatus;
+    if (iCopyFile != -1 && ftpSpliceGet(iError, iCopyFile, processed_size, bytesLeft, spliceStatus)) {
+        return spliceStatus;
+    }
+
     QByteArray array;
-    char buffer[maximumIpcSize];
-    // start with small data chunks in case of a slow data source (modem)
-    // - unfortunately this has a negative impact on performance for large
-    // - files - so we will increase the block size after a while ...
+    // start with small data chunks in case of a slow data source (modem),
+    // and let the block size grow as long as the reads fill it. data()
+    // must not get more than maximumIpcSize, a local file takes more.
+    const int iMaxBlockSize = (iCopyFile == -1) ? maximumIpcSize : maximumCopySize;
+    QByteArray buffer(iMaxBlockSize, Qt::Uninitialized);
     int iBlockSize = initialIpcSize;
     int iBufferCur = 0;
 
     while (m_size == UnknownSize || bytesLeft > 0) {
-        // let the buffer size grow if the file is larger 64kByte ...
-        if (processed_size - llOffset > 1024 * 64) {
-            iBlockSize = maximumIpcSize;
-        }
-
         // read the data and detect EOF or error ...
-        if (iBlockSize + iBufferCur > (int)sizeof(buffer)) {
-            iBlockSize = sizeof(buffer) - iBufferCur;
-        }
+        const int iReadSize = qMin(iBlockSize, iMaxBlockSize - iBufferCur);
         if (m_data->bytesAvailable() == 0) {
             m_data->waitForReadyRead((readTimeout() * 1000));
         }
-        int n = m_data->read(buffer + iBufferCur, iBlockSize);
+        int n = m_data->read(buffer.data() + iBufferCur, iReadSize);
+        if (n == iReadSize) {
+            iBlockSize = qMin(iBlockSize * 2, iMaxBlockSize);
+        }
         if (n <= 0) {
             // this is how we detect EOF in case of unknown size
             if (m_size == UnknownSize && n == 0) {
@@ -1974,8 +2532,7 @@ Ftp::StatusCode Ftp::ftpGet(int &iError, int iCopyFile, const QUrl &url, KIO::fi
             bytesLeft -= n;
             iBufferCur += n;
             if (iBufferCur < minimumMimeSize && bytesLeft > 0) {
-                processedSize(processed_size);
-                continue;
+                continue;    // reported along with the whole chunk
             }
             n = iBufferCur;
             iBufferCur = 0;
@@ -1983,10 +2540,10 @@ Ftp::StatusCode Ftp::ftpGet(int &iError, int iCopyFile, const QUrl &url, KIO::fi
 
         // write output file or pass to data pump ...
         if (iCopyFile == -1) {
-            array = QByteArray::fromRawData(buffer, n);
+            array = QByteArray::fromRawData(buffer.constData(), n);
             data(array);
             array.clear();
-        } else if ((iError = WriteToFile(iCopyFile, buffer, n)) != 0) {
+        } else if ((iError = WriteToFile(iCopyFile, buffer.constData(), n)) != 0) {
             return statusClientError;    // client side error
         }
         processedSize(processed_size);
@@ -2181,17 +2738,21 @@ Ftp::StatusCode Ftp::ftpPut(int &iError, int iCopyFile, const QUrl &dest_url,
     KIO::fileoffset_t processed_size = offset;
 
     QByteArray buffer;
-    int result;
+    int result = -2;
+    if (iCopyFile != -1) {
+        result = ftpSendFile(iError, iCopyFile, processed_size);
+    }
     int iBlockSize = initialIpcSize;
     // Loop until we got 'dataEnd'
-    do {
+    while (result == -2 || result > 0) {
         if (iCopyFile == -1) {
             dataReq(); // Request for data
             result = readData(buffer);
         } else {
-            // let the buffer size grow if the file is larger 64kByte ...
-            if (processed_size - offset > 1024 * 64) {
-                iBlockSize = maximumIpcSize;
+            // let the buffer size grow with the file, up to what a local file
+            // can provide at once
+            if (processed_size - offset > iBlockSize * 4) {
+                iBlockSize = qMin(iBlockSize * 4, int(maximumCopySize));
             }
             buffer.resize(iBlockSize);
             result = QT_READ(iCopyFile, buffer.data(), buffer.size());
@@ -2208,7 +2769,7 @@ Ftp::StatusCode Ftp::ftpPut(int &iError, int iCopyFile, const QUrl &dest_url,
             processed_size += result;
             processedSize(processed_size);
         }
-    } while (result > 0);
+    }
 
     if (result != 0) { // error
         ftpCloseCommand();               // don't care about errors
@@ -2315,12 +2876,25 @@ bool Ftp::ftpDataMode(char cMode)
     }
 
     qCDebug(KIO_FTP) << "want" << cMode << "has" << m_cDataMode;
-    if (m_cDataMode == cMode) {
+    QByteArray buf = "TYPE ";
+    buf += cMode;
+    if (m_bPipelining) {
+        // Only the last TYPE counts. It goes out along with PASV or PORT and
+        // sets m_cDataMode once it is accepted, ftpOpenCommand() checks that.
+        for (int i = m_deferredCmds.count() - 1; i >= 0; --i) {
+            if (m_deferredCmds.at(i).startsWith("TYPE ")) {
+                m_deferredCmds.removeAt(i);
+            }
+        }
+        if (m_cDataMode != cMode) {
+            ftpDeferCmd(buf);
+        }
         return true;
     }
 
-    QByteArray buf = "TYPE ";
-    buf += cMode;
+    if (m_cDataMode == cMode) {
+        return true;
+    }
     if (!ftpSendCmd(buf) || (m_iRespType != 2)) {
         return false;
     }
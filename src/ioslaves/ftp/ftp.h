@@ -154,6 +154,46 @@ private:
      */
     bool ftpSendCmd(const QByteArray &cmd, int maxretries = 1);
 
+    /**
+     * Send all of @p cmds at once and read their responses, which saves a
+     * round trip per command. Only for commands that don't depend on each
+     * other and that are harmless to repeat; if the connection breaks down
+     * the remaining ones are sent again one by one by ftpSendCmd().
+     * Without pipelining the commands are simply sent one after the other.
+     *
+     * @param responses the (last) response line of each command
+     * @return true if all commands got a response, false on error
+     */
+    bool ftpSendCmds(const QList<QByteArray> &cmds, QList<QByteArray> *responses);
+
+    /**
+     * Send @p cmd along with the next command, if pipelining is enabled.
+     * This is for commands that are expected to succeed and on whose
+     * success the next command doesn't depend; a failure is only logged.
+     */
+    void ftpDeferCmd(const QByteArray &cmd);
+    void ftpDeferredCmdAnswered(const QByteArray &cmd);
+
+    /**
+     * Parse the answer to FEAT and ask for the MLST facts we want.
+     */
+    void ftpFeatures();
+
+    /**
+     * Use the MLST command to get the facts about @p path.
+     * @return true on success, see m_iRespCode otherwise
+     */
+    bool ftpMlst(const QString &path, FtpEntry &ftpEnt);
+
+    /**
+     * Parse a line of facts and a name sent by MLSD or MLST (RFC 3659).
+     *
+     * @param isListedDir set to true if the line is about the listed
+     *                    directory itself or its parent
+     * @return false if the line is invalid
+     */
+    bool ftpParseFacts(const QByteArray &line, FtpEntry &ftpEnt, bool *isListedDir);
+
     /**
      * Use the SIZE command to get the file size.
      * @param mode the size depends on the transfer mode, hence this arg.
@@ -230,7 +270,7 @@ private:
 
     bool ftpChmod(const QString &path, int permissions);
 
-    // used by listDir
+    // used by listDir; uses MLSD if possible, LIST otherwise
     bool ftpOpenDir(const QString &path);
     /**
       * Called to parse directory listings, call this until it returns false
@@ -301,6 +341,33 @@ private:
      */
     StatusCode ftpPut(int &iError, int iCopyFile, const QUrl &url, int permissions, KIO::JobFlags flags);
 
+    /**
+     * Used by ftpGet() to move the rest of a download straight from the
+     * data socket into a local file with splice(), without copying it
+     * through our own buffers.
+     *
+     * @param bytesLeft   the number of bytes to expect, ignored if the
+     *                    size is unknown
+     * @param status      set to the result of the transfer
+     * @return false if splice() can't be used, nothing was read then
+     */
+    bool ftpSpliceGet(int &iError, int iCopyFile, KIO::fileoffset_t &processed_size,
+                      KIO::filesize_t bytesLeft, StatusCode &status);
+
+    /**
+     * Used by ftpPut() to send the rest of a local file with sendfile().
+     *
+     * @return 0 at the end of the file, -1 on error (iError is set) and
+     *         -2 if sendfile() can't be used, nothing was sent then
+     */
+    int ftpSendFile(int &iError, int iCopyFile, KIO::fileoffset_t &processed_size);
+
+    /**
+     * Whether the descriptor of the data socket may be used directly,
+     * i.e. it is a plain TCP connection and Qt doesn't buffer anything.
+     */
+    bool ftpDataSocketIsRaw() const;
+
     /**
      * helper called from copy() to implement FILE -> FTP transfers
      *
@@ -377,9 +444,16 @@ private: // data members
      */
     int  m_iRespType;
 
+    /**
+     * the lines between the first and the last line of a multi-line
+     * response, set in ftpResponse(); FEAT and MLST answer this way
+     */
+    QList<QByteArray> m_responseLines;
+
     /**
      * This flag is maintained by ftpDataMode() and contains I or A after
-     * ftpDataMode() has successfully set the mode.
+     * ftpDataMode() has successfully set the mode. With pipelining that is
+     * only once the server accepted the deferred TYPE command.
      */
     char m_cDataMode;
 
@@ -408,6 +482,23 @@ private: // data members
 
     bool m_bPasv;
 
+    /**
+     * true if independent commands may be sent without waiting for each
+     * response, i.e. unless the "DisablePipelining" config key is set
+     */
+    bool m_bPipelining;
+
+    /**
+     * commands to be sent along with the next one, see ftpDeferCmd()
+     */
+    QList<QByteArray> m_deferredCmds;
+
+    /**
+     * true if the data connection carries the answer to MLSD, set by
+     * ftpOpenDir()
+     */
+    bool m_bMlsd;
+
     KIO::filesize_t m_size;
     static const KIO::filesize_t UnknownSize;
 
@@ -417,7 +508,8 @@ private: // data members
         eprtUnknown = 0x04,
         epsvAllSent = 0x10,
         pasvUnknown = 0x20,
-        chmodUnknown = 0x100
+        chmodUnknown = 0x100,
+        mlstSupported = 0x200 // FEAT lists MLST, which implies MLSD
     };
     int m_extControl;
 
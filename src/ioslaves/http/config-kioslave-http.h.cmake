@@ -1,2 +1,4 @@
 #cmakedefine01 HAVE_STRTOLL
+#cmakedefine01 HAVE_BROTLI
+#cmakedefine01 HAVE_ZSTD
 #define CMAKE_INSTALL_FULL_LIBEXECDIR_KF5 "${CMAKE_INSTALL_FULL_LIBEXECDIR_KF5}"
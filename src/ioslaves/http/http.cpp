@@ -44,6 +44,8 @@
 #include <QTemporaryFile>
 #include <QStandardPaths>
 #include <QDBusConnection>
+#include <QDBusError>
+#include <QDBusMessage>
 #include <QMimeDatabase>
 #include <QAuthenticator>
 #include <QNetworkProxy>
@@ -52,27 +54,26 @@
 #include <QUrl>
 #include <QCoreApplication>
 #include <QDataStream>
-#include <QThread>
+#include <QElapsedTimer>
 
 #include <QDebug>
 #include <kconfig.h>
 #include <kconfiggroup.h>
 #include <klocalizedstring.h>
 
-#include <QDBusInterface>
 #include <kremoteencoding.h>
 #include <ktcpsocket.h>
 
 #include <ioslave_defaults.h>
 #include <http_slave_defaults.h>
 
-#include <QDBusReply>
 #include <QProcess>
 #include <httpfilter.h>
 
 #include <sys/stat.h>
 
 #include "httpauthentication.h"
+#include "httpcachestore.h"
 #include "kioglobal_p.h"
 
 #include <QLoggingCategory>
@@ -102,6 +103,11 @@ static bool supportedProxyScheme(const QString &scheme)
 static const int s_hashedUrlBits = 160;   // this number should always be divisible by eight
 static const int s_hashedUrlNibbles = s_hashedUrlBits / 4;
 static const int s_MaxInMemPostBufSize = 256 * 1024;   // Write anyting over 256 KB to file...
+static const int s_MaxCacheStoreRecordSize = 8 * 1024 * 1024; // Cache store records are assembled in memory
+static const int s_cacheCleanerBatchSize = 32; // Cache cleaner commands sent in one go
+static const int s_cacheCleanerMaxQueueAge = 10000; // ms a cache cleaner command may be held back
+static const int s_cacheCleanerMaxQueueSize = 1024; // Commands kept while the cache cleaner is unreachable
+static const int s_cacheCleanerStartInterval = 30000; // ms between attempts to start the cache cleaner
 
 using namespace KIO;
 
@@ -374,6 +380,10 @@ HTTPProtocol::HTTPProtocol(const QByteArray &protocol, const QByteArray &pool,
     , m_POSTbuf(nullptr)
     , m_maxCacheAge(DEFAULT_MAX_CACHE_AGE)
     , m_maxCacheSize(DEFAULT_MAX_CACHE_SIZE)
+    , m_cacheCleanerNeedsRescan(false)
+    , m_cacheStore(nullptr)
+    , m_cookieSnapshotsEnabled(true)
+    , m_cookieServerConnected(false)
     , m_protocol(protocol)
     , m_wwwAuth(nullptr)
     , m_triedWwwCredentials(NoCredentials)
@@ -395,6 +405,12 @@ HTTPProtocol::HTTPProtocol(const QByteArray &protocol, const QByteArray &pool,
 HTTPProtocol::~HTTPProtocol()
 {
     httpClose(false);
+    flushCacheCleanerCommands();
+    if (m_cacheCleanerConnection.bytesToWrite() > 0) {
+        // not on any hot path anymore, give the last batch a chance to get out
+        m_cacheCleanerConnection.waitForBytesWritten(500);
+    }
+    delete m_cacheStore;
 }
 
 void HTTPProtocol::reparseConfiguration()
@@ -456,6 +472,27 @@ void HTTPProtocol::resetSessionSettings()
     m_request.doNotProxyAuthenticate = config()->readEntry("no-proxy-auth", noAuth);
     m_strCacheDir = config()->readPathEntry("CacheDir", QString());
     m_maxCacheAge = config()->readEntry("MaxCacheAge", DEFAULT_MAX_CACHE_AGE);
+
+    // "store" keeps all entries in a few indexed files instead of one file per URL
+    if (m_request.cacheTag.useCache && !m_strCacheDir.isEmpty() &&
+            config()->readEntry("CacheBackend", QString()) == QLatin1String("store")) {
+        const QString storeDir = m_strCacheDir + QLatin1String("/store");
+        if (!m_cacheStore || m_cacheStore->directory() != storeDir) {
+            if (!m_cacheStore) {
+                m_cacheStore = new HttpCacheStore;
+            }
+            const qint64 maxSize = qint64(config()->readEntry("MaxCacheSize", DEFAULT_MAX_CACHE_SIZE)) * 1024;
+            if (!m_cacheStore->open(storeDir, maxSize)) {
+                qCWarning(KIO_HTTP) << "Could not open the cache store in" << storeDir << ", using one file per URL";
+                delete m_cacheStore;
+                m_cacheStore = nullptr;
+            }
+        }
+    } else {
+        delete m_cacheStore;
+        m_cacheStore = nullptr;
+    }
+
     m_request.windowId = config()->readEntry("window-id");
 
     m_request.methodStringOverride = metaData(QStringLiteral("CustomHTTPMethod"));
@@ -1908,6 +1945,22 @@ bool HTTPProtocol::isOffline()
     return !m_networkConfig->isOnline();
 }
 
+static bool isCompatibleNextUrl(const QUrl &previous, const QUrl &now)
+{
+    if (previous.host() != now.host() || previous.port() != now.port()) {
+        return false;
+    }
+    if (previous.userName().isEmpty() && previous.password().isEmpty()) {
+        return true;
+    }
+    return previous.userName() == now.userName() && previous.password() == now.password();
+}
+
+static QString pipelineHostKey(const QUrl &url)
+{
+    return url.host() + QLatin1Char(':') + QString::number(url.port());
+}
+
 void HTTPProtocol::multiGet(const QByteArray &data)
 {
     QDataStream stream(data);
@@ -1938,6 +1991,8 @@ void HTTPProtocol::multiGet(const QByteArray &data)
 
         m_request.method = HTTP_GET;
         m_request.isKeepAlive = true;   //readResponseHeader clears it if necessary
+        // MultiGetJob tells the responses apart by their request-id
+        m_request.id = metaData(QStringLiteral("request-id"));
 
         QString tmp = metaData(QStringLiteral("cache"));
         if (!tmp.isEmpty()) {
@@ -1951,55 +2006,133 @@ void HTTPProtocol::multiGet(const QByteArray &data)
 
     if (m_isBusy) {
         m_request = saveRequest;
+        return;
     }
-#if 0
-    if (!m_isBusy) {
-        m_isBusy = true;
-        QMutableListIterator<HTTPRequest> it(m_requestQueue);
-        while (it.hasNext()) {
-            m_request = it.next();
-            it.remove();
-            proceedUntilResponseContent();
+
+    m_isBusy = true;
+    const int maxDepth = config()->readEntry("MaxPipelineDepth", DEFAULT_MAX_PIPELINE_DEPTH);
+    while (!m_requestQueue.isEmpty()) {
+        const QString hostKey = pipelineHostKey(m_requestQueue.first().url);
+        bool ok;
+        if (maxDepth > 1 && !m_pipeliningUnsupportedHosts.contains(hostKey)) {
+            ok = multiGetPipelined(maxDepth);
+        } else {
+            ok = multiGetSequential();
+        }
+        if (!ok) {
+            m_requestQueue.clear();
+            m_isBusy = false;
+            return;
         }
-        m_isBusy = false;
     }
-#endif
-    if (!m_isBusy) {
-        m_isBusy = true;
-        QMutableListIterator<HTTPRequest> it(m_requestQueue);
-        // send the requests
-        while (it.hasNext()) {
-            m_request = it.next();
-            sendQuery();
-            // save the request state so we can pick it up again in the collection phase
-            it.setValue(m_request);
-            qCDebug(KIO_HTTP) << "check one: isKeepAlive =" << m_request.isKeepAlive;
-            if (m_request.cacheTag.ioMode != ReadFromCache) {
-                m_server.initFrom(m_request);
+
+    finished();
+    m_isBusy = false;
+}
+
+bool HTTPProtocol::multiGetPipelined(int depth)
+{
+    // Write all the requests first. They must all go to the same server
+    // because sendQuery() would otherwise reconnect under our feet.
+    QList<HTTPRequest> inFlight;
+    // whether the requests go over a kept-alive connection the server may have dropped meanwhile
+    bool reusedConnection = false;
+    while (!m_requestQueue.isEmpty() && inFlight.count() < depth) {
+        if (!inFlight.isEmpty() && !isCompatibleNextUrl(inFlight.first().url, m_requestQueue.first().url)) {
+            break;
+        }
+        m_request = m_requestQueue.takeFirst();
+        if (inFlight.isEmpty()) {
+            reusedConnection = isConnected() && !httpShouldCloseConnection();
+        }
+        if (!sendQuery()) {
+            return false;
+        }
+        const bool fromCache = m_request.cacheTag.ioMode == ReadFromCache &&
+                               m_request.cacheTag.plan(m_maxCacheAge) == CacheTag::UseCached;
+        if (!fromCache && !isConnected()) {
+            // The keep-alive connection broke while writing, so none of the
+            // requests already written will be answered. Start over.
+            qCDebug(KIO_HTTP) << "Connection broken while pipelining to" << m_request.url.host();
+            m_requestQueue.prepend(m_request);
+            while (!inFlight.isEmpty()) {
+                m_requestQueue.prepend(inFlight.takeLast());
+            }
+            if (m_iEOFRetryCount++ >= 2) {
+                // Don't ever try to pipeline to this server again
+                m_pipeliningUnsupportedHosts.insert(pipelineHostKey(m_request.url));
             }
+            return true;
         }
-        // collect the responses
-        //### for the moment we use a hack: instead of saving and restoring request-id
-        //    we just count up like ParallelGetJobs does.
-        int requestId = 0;
-        Q_FOREACH (const HTTPRequest &r, m_requestQueue) {
-            m_request = r;
-            qCDebug(KIO_HTTP) << "check two: isKeepAlive =" << m_request.isKeepAlive;
-            setMetaData(QStringLiteral("request-id"), QString::number(requestId++));
-            sendAndKeepMetaData();
-            if (!(readResponseHeader() && readBody())) {
-                return;
+        inFlight.append(m_request);
+        if (m_request.cacheTag.ioMode != ReadFromCache) {
+            m_server.initFrom(m_request);
+        }
+    }
+
+    // Collect the responses in the order the requests were sent.
+    for (int i = 0; i < inFlight.count(); ++i) {
+        m_request = inFlight.at(i);
+        setMetaData(QStringLiteral("request-id"), m_request.id);
+        sendAndKeepMetaData();
+        const int eofRetryCount = m_iEOFRetryCount;
+        if (!readResponseHeader()) {
+            if (m_kioError) {
+                return false;
+            }
+            cacheFileClose();
+            httpCloseConnection();
+            // readResponseHeader() counts an EOF before the first byte as a
+            // keep-alive timeout. If that happens to the first response on a
+            // reused connection, the server just closed it while idle: send
+            // everything again on a new connection.
+            if (i == 0 && reusedConnection && m_iEOFRetryCount > eofRetryCount) {
+                qCDebug(KIO_HTTP) << "Kept-alive connection closed by" << m_request.url.host() << ", pipelining again";
+            } else {
+                // Either the server went away (e.g. because it does not support
+                // pipelining) or the request needs to be resent, for example with
+                // credentials. Responses still in flight are lost either way, so
+                // hand the rest over to the sequential code path.
+                qCDebug(KIO_HTTP) << "Pipelined response" << i << "unusable, falling back for" << m_request.url.host();
+                m_pipeliningUnsupportedHosts.insert(pipelineHostKey(m_request.url));
             }
-            // the "next job" signal for ParallelGetJob is data of size zero which
-            // readBody() sends without our intervention.
-            qCDebug(KIO_HTTP) << "check three: isKeepAlive =" << m_request.isKeepAlive;
-            httpClose(m_request.isKeepAlive);  //actually keep-alive is mandatory for pipelining
+            for (int j = inFlight.count() - 1; j >= i; --j) {
+                m_requestQueue.prepend(inFlight.at(j));
+            }
+            return true;
+        }
+        if (!readBody()) {
+            return false;
+        }
+        // the "next job" signal for MultiGetJob is data of size zero which
+        // readBody() sends without our intervention.
+        const bool keepAlive = m_request.isKeepAlive;
+        httpClose(keepAlive);
+        if (!keepAlive && i + 1 < inFlight.count()) {
+            // HTTP/1.0 or "Connection: close"; the remaining responses will never arrive.
+            qCDebug(KIO_HTTP) << "Server closed a pipelined connection, falling back for" << m_request.url.host();
+            m_pipeliningUnsupportedHosts.insert(pipelineHostKey(m_request.url));
+            for (int j = inFlight.count() - 1; j > i; --j) {
+                m_requestQueue.prepend(inFlight.at(j));
+            }
+            return true;
         }
+    }
+    m_iEOFRetryCount = 0;
+    return true;
+}
 
-        finished();
-        m_requestQueue.clear();
-        m_isBusy = false;
+bool HTTPProtocol::multiGetSequential()
+{
+    m_request = m_requestQueue.takeFirst();
+    m_iEOFRetryCount = 0;
+    setMetaData(QStringLiteral("request-id"), m_request.id);
+    sendAndKeepMetaData();
+    if (!proceedUntilResponseHeader() || !readBody()) {
+        return false;
     }
+    httpClose(m_request.isKeepAlive);
+    return true;
 }
 
 ssize_t HTTPProtocol::write(const void *_buf, size_t nbytes)
@@ -2119,17 +2252,6 @@ bool HTTPProtocol::readDelimitedText(char *buf, int *idx, int end, int numNewlin
     return false;
 }
 
-static bool isCompatibleNextUrl(const QUrl &previous, const QUrl &now)
-{
-    if (previous.host() != now.host() || previous.port() != now.port()) {
-        return false;
-    }
-    if (previous.userName().isEmpty() && previous.password().isEmpty()) {
-        return true;
-    }
-    return previous.userName() == now.userName() && previous.password() == now.password();
-}
-
 bool HTTPProtocol::httpShouldCloseConnection()
 {
     qCDebug(KIO_HTTP);
@@ -2554,7 +2676,7 @@ bool HTTPProtocol::sendQuery()
         header += QLatin1String("\r\n");
 
         if (m_request.allowTransferCompression) {
-            header += QLatin1String("Accept-Encoding: gzip, deflate, x-gzip, x-deflate\r\n");
+            header += QLatin1String("Accept-Encoding: ") + httpAcceptedEncodings(isEncryptedHttpVariety(m_protocol)) + QLatin1String("\r\n");
         }
 
         if (!m_request.charsets.isEmpty()) {
@@ -3611,6 +3733,14 @@ void HTTPProtocol::addEncoding(const QString &_encoding, QStringList &encs)
         encs.append(QStringLiteral("bzip2")); // Not yet supported!
     } else if ((encoding == QLatin1String("x-deflate")) || (encoding == QLatin1String("deflate"))) {
         encs.append(QStringLiteral("deflate"));
+#if HAVE_BROTLI
+    } else if (encoding == QLatin1String("br")) {
+        encs.append(QStringLiteral("br"));
+#endif
+#if HAVE_ZSTD
+    } else if (encoding == QLatin1String("zstd")) {
+        encs.append(QStringLiteral("zstd"));
+#endif
     } else {
         qCDebug(KIO_HTTP) << "Unknown encoding encountered.  " << "Please write code. Encoding =" << encoding;
     }
@@ -3988,6 +4118,26 @@ void HTTPProtocol::httpClose(bool keepAlive)
     httpCloseConnection();
 }
 
+void HTTPProtocol::openConnection()
+{
+    qCDebug(KIO_HTTP) << m_request.url.host();
+
+    // The scheduler asks for this while the job for the host is still queued.
+    // Like in sendQuery(), a connection to another server is not kept.
+    if (m_request.url.host().isEmpty()) {
+        error(ERR_UNKNOWN_HOST, i18n("No host specified."));
+        return;
+    }
+    if (httpShouldCloseConnection()) {
+        httpCloseConnection();
+    }
+    if (isConnected()) {
+        connected();
+        return;
+    }
+    httpOpenConnection(); // reports connected() or the error
+}
+
 void HTTPProtocol::closeConnection()
 {
     qCDebug(KIO_HTTP);
@@ -4001,6 +4151,7 @@ void HTTPProtocol::httpCloseConnection()
     disconnectFromHost();
     clearUnreadBuffer();
     setTimeoutSpecialCommand(-1); // Cancel any connection timeout
+    flushCacheCleanerCommands();
 }
 
 void HTTPProtocol::slave_status()
@@ -4056,11 +4207,15 @@ void HTTPProtocol::special(const QByteArray &data)
         qint64 expireDate;
         stream >> url >> no_cache >> expireDate;
         if (no_cache) {
-            QString filename = cacheFilePathFromUrl(url);
-            // there is a tiny risk of deleting the wrong file due to hash collisions here.
-            // this is an unimportant performance issue.
-            // FIXME on Windows we may be unable to delete the file if open
-            QFile::remove(filename);
+            if (m_cacheStore) {
+                m_cacheStore->remove(cacheStoreKeyFromUrl(url));
+            } else {
+                QString filename = cacheFilePathFromUrl(url);
+                // there is a tiny risk of deleting the wrong file due to hash collisions here.
+                // this is an unimportant performance issue.
+                // FIXME on Windows we may be unable to delete the file if open
+                QFile::remove(filename);
+            }
             finished();
             break;
         }
@@ -4405,11 +4560,8 @@ bool HTTPProtocol::readBody(bool dataInternal /* = false */)
 
     // decode all of the transfer encodings
     while (!m_transferEncodings.isEmpty()) {
-        QString enc = m_transferEncodings.takeLast();
-        if (enc == QLatin1String("gzip")) {
-            chain.addFilter(new HTTPFilterGZip);
-        } else if (enc == QLatin1String("deflate")) {
-            chain.addFilter(new HTTPFilterDeflate);
+        if (HTTPFilterBase *filter = createHTTPDecodingFilter(m_transferEncodings.takeLast())) {
+            chain.addFilter(filter);
         }
     }
 
@@ -4434,11 +4586,8 @@ bool HTTPProtocol::readBody(bool dataInternal /* = false */)
     // WB: of "gzip" (or even "x-gzip") and a content-type of "applications/tar"
     // WB: They shouldn't do that. We can work around that though...
     while (!m_contentEncodings.isEmpty()) {
-        QString enc = m_contentEncodings.takeLast();
-        if (enc == QLatin1String("gzip")) {
-            chain.addFilter(new HTTPFilterGZip);
-        } else if (enc == QLatin1String("deflate")) {
-            chain.addFilter(new HTTPFilterDeflate);
+        if (HTTPFilterBase *filter = createHTTPDecodingFilter(m_contentEncodings.takeLast())) {
+            chain.addFilter(filter);
         }
     }
 
@@ -4561,25 +4710,151 @@ void HTTPProtocol::error(int _err, const QString &_text)
     m_kioError = _err;
 }
 
+static const int s_maxCookieSnapshotHosts = 64;
+static const int s_maxCookieSnapshotsPerHost = 64;
+
+// Plain messages instead of a QDBusInterface, which would introspect
+// the cookie server with a blocking call every time it is created.
+static QDBusMessage cookieServerCall(const QString &method)
+{
+    return QDBusMessage::createMethodCall(QStringLiteral("org.kde.kcookiejar5"),
+                                          QStringLiteral("/modules/kcookiejar"),
+                                          QStringLiteral("org.kde.KCookieServer"),
+                                          method);
+}
+
+// Whether cookies of @p domain (".example.org", "example.org" or a host name) can be sent to @p host
+static bool cookieDomainCovers(const QString &domain, const QString &host)
+{
+    const QStringRef name = domain.startsWith(QLatin1Char('.')) ? domain.midRef(1) : domain.midRef(0);
+    return host == name || (host.endsWith(name) && host.at(host.length() - name.length() - 1) == QLatin1Char('.'));
+}
+
 void HTTPProtocol::addCookies(const QString &url, const QByteArray &cookieHeader)
 {
     qlonglong windowId = m_request.windowId.toLongLong();
-    QDBusInterface kcookiejar(QStringLiteral("org.kde.kcookiejar5"), QStringLiteral("/modules/kcookiejar"), QStringLiteral("org.kde.KCookieServer"));
-    (void)kcookiejar.call(QDBus::NoBlock, QStringLiteral("addCookies"), url,
-                          cookieHeader, windowId);
+    QDBusMessage call = cookieServerCall(QStringLiteral("addCookies"));
+    call << url << cookieHeader << windowId;
+    QDBusConnection::sessionBus().send(call);
+
+    // kcookiejar's change notification would arrive too late for the next
+    // request, which is often a redirect to the same site.
+    dropCookieSnapshots(QUrl(url).host());
+}
+
+void HTTPProtocol::dropCookieSnapshots(const QString &host)
+{
+    if (host.isEmpty()) {
+        return;
+    }
+    // The new cookies may be for any parent domain of host; the public
+    // suffix is not known here, so be generous and take the last two labels.
+    QString domain = host;
+    const int lastDot = host.lastIndexOf(QLatin1Char('.'));
+    if (lastDot > 0) {
+        const int secondLastDot = host.lastIndexOf(QLatin1Char('.'), lastDot - 1);
+        if (secondLastDot >= 0) {
+            domain = host.mid(secondLastDot + 1);
+        }
+    }
+
+    QMutableHashIterator<QString, QHash<QString, CookieSnapshot> > it(m_cookieSnapshots);
+    while (it.hasNext()) {
+        it.next();
+        if (cookieDomainCovers(domain, it.key())) {
+            it.remove();
+        }
+    }
+}
+
+void HTTPProtocol::slotCookiesChanged(const QStringList &domains, qulonglong version)
+{
+    QMutableHashIterator<QString, QHash<QString, CookieSnapshot> > it(m_cookieSnapshots);
+    while (it.hasNext()) {
+        it.next();
+        bool affected = domains.isEmpty(); // all of them
+        for (int i = 0; !affected && i < domains.count(); ++i) {
+            affected = cookieDomainCovers(domains.at(i), it.key());
+        }
+        if (!affected) {
+            continue;
+        }
+        // Snapshots taken after the change are up to date
+        QMutableHashIterator<QString, CookieSnapshot> snapshotIt(it.value());
+        while (snapshotIt.hasNext()) {
+            if (snapshotIt.next().value().version < version) {
+                snapshotIt.remove();
+            }
+        }
+        if (it.value().isEmpty()) {
+            it.remove();
+        }
+    }
 }
 
 QString HTTPProtocol::findCookies(const QString &url)
 {
     qlonglong windowId = m_request.windowId.toLongLong();
-    QDBusInterface kcookiejar(QStringLiteral("org.kde.kcookiejar5"), QStringLiteral("/modules/kcookiejar"), QStringLiteral("org.kde.KCookieServer"));
-    QDBusReply<QString> reply = kcookiejar.call(QStringLiteral("findCookies"), url, windowId);
 
-    if (!reply.isValid()) {
+    if (m_cookieSnapshotsEnabled && !m_cookieServerConnected) {
+        m_cookieServerConnected = true;
+        if (!QDBusConnection::sessionBus().connect(QStringLiteral("org.kde.kcookiejar5"),
+                QStringLiteral("/modules/kcookiejar"),
+                QStringLiteral("org.kde.KCookieServer"),
+                QStringLiteral("cookiesChanged"),
+                this, SLOT(slotCookiesChanged(QStringList,qulonglong)))) {
+            m_cookieSnapshotsEnabled = false;
+        }
+    }
+
+    const QUrl parsedUrl(url);
+    const QString host = parsedUrl.host();
+    // The query doesn't matter for cookies
+    const QString key = QString::number(windowId) + QLatin1Char(' ') +
+                        parsedUrl.adjusted(QUrl::RemoveQuery | QUrl::RemoveFragment).toString();
+
+    if (m_cookieSnapshotsEnabled) {
+        // There is no event loop in slaves; deliver change notifications
+        // that came in meanwhile, and nothing else.
+        QCoreApplication::sendPostedEvents(this, QEvent::MetaCall);
+
+        const QHash<QString, CookieSnapshot> snapshots = m_cookieSnapshots.value(host);
+        QHash<QString, CookieSnapshot>::ConstIterator it = snapshots.constFind(key);
+        if (it != snapshots.constEnd() &&
+            (it->nextExpiry == 0 || it->nextExpiry >= QDateTime::currentMSecsSinceEpoch() / 1000)) {
+            return it->cookies;
+        }
+    }
+
+    QDBusMessage call = cookieServerCall(m_cookieSnapshotsEnabled ? QStringLiteral("findCookiesSnapshot")
+                                                                  : QStringLiteral("findCookies"));
+    call << url << windowId;
+    const QDBusMessage reply = QDBusConnection::sessionBus().call(call);
+
+    if (reply.type() != QDBusMessage::ReplyMessage || reply.arguments().isEmpty()) {
+        if (m_cookieSnapshotsEnabled && QDBusError(reply).type() == QDBusError::UnknownMethod) {
+            qCDebug(KIO_HTTP) << "kded_kcookiejar doesn't support snapshots";
+            m_cookieSnapshotsEnabled = false;
+            return findCookies(url);
+        }
         qCWarning(KIO_HTTP) << "Can't communicate with kded_kcookiejar!";
         return QString();
     }
-    return reply;
+
+    const QList<QVariant> args = reply.arguments();
+    const QString cookies = args.at(0).toString();
+    if (m_cookieSnapshotsEnabled && args.count() == 3 && args.at(1).toULongLong() != 0) {
+        if (m_cookieSnapshots.count() >= s_maxCookieSnapshotHosts && !m_cookieSnapshots.contains(host)) {
+            m_cookieSnapshots.clear();
+        }
+        QHash<QString, CookieSnapshot> &snapshots = m_cookieSnapshots[host];
+        if (snapshots.count() >= s_maxCookieSnapshotsPerHost) {
+            snapshots.clear();
+        }
+        const CookieSnapshot snapshot = { cookies, args.at(1).toULongLong(), args.at(2).toLongLong() };
+        snapshots.insert(key, snapshot);
+    }
+    return cookies;
 }
 
 /******************************* CACHING CODE ****************************/
@@ -4622,6 +4897,7 @@ struct BinaryCacheFileHeader {
     quint8 version[2];
     quint8 compression; // for now fixed to 0
     quint8 reserved;    // for now; also alignment
+    static const int useCountOffset = 4;
     qint32 useCount;
     qint64 servedDate;
     qint64 lastModifiedDate;
@@ -4635,7 +4911,11 @@ struct BinaryCacheFileHeader {
 enum CacheCleanerCommandCode {
     InvalidCommand = 0,
     CreateFileNotificationCommand,
-    UpdateFileCommand
+    UpdateFileCommand,
+    // like UpdateFileCommand, but the use count field holds the number of uses to add
+    UpdateFileBatchCommand,
+    // commands were lost, walk the cache directory to find all files again
+    RescanCommand
 };
 
 // illustration for cache cleaner update "commands"
@@ -4740,7 +5020,7 @@ static void writeLine(QIODevice *dev, const QByteArray &line)
 
 void HTTPProtocol::cacheFileWriteTextHeader()
 {
-    QFile *&file = m_request.cacheTag.file;
+    QIODevice *&file = m_request.cacheTag.file;
     Q_ASSERT(file);
     Q_ASSERT(file->openMode() & QIODevice::WriteOnly);
 
@@ -4768,7 +5048,7 @@ static bool readLineChecked(QIODevice *dev, QByteArray *line)
 
 bool HTTPProtocol::cacheFileReadTextHeader1(const QUrl &desiredUrl)
 {
-    QFile *&file = m_request.cacheTag.file;
+    QIODevice *&file = m_request.cacheTag.file;
     Q_ASSERT(file);
     Q_ASSERT(file->openMode() == QIODevice::ReadOnly);
 
@@ -4787,7 +5067,7 @@ bool HTTPProtocol::cacheFileReadTextHeader1(const QUrl &desiredUrl)
 
 bool HTTPProtocol::cacheFileReadTextHeader2()
 {
-    QFile *&file = m_request.cacheTag.file;
+    QIODevice *&file = m_request.cacheTag.file;
     Q_ASSERT(file);
     Q_ASSERT(file->openMode() == QIODevice::ReadOnly);
 
@@ -4834,19 +5114,32 @@ QString HTTPProtocol::cacheFilePathFromUrl(const QUrl &url) const
     return filePath;
 }
 
+QByteArray HTTPProtocol::cacheStoreKeyFromUrl(const QUrl &url) const
+{
+    return HttpCacheStore::keyForUrl(storableUrl(url).toEncoded());
+}
+
 bool HTTPProtocol::cacheFileOpenRead()
 {
     qCDebug(KIO_HTTP);
-    QString filename = cacheFilePathFromUrl(m_request.url);
+    QIODevice *&file = m_request.cacheTag.file;
+    Q_ASSERT(!file);
 
-    QFile *&file = m_request.cacheTag.file;
-    if (file) {
-        qCDebug(KIO_HTTP) << "File unexpectedly open; old file is" << file->fileName() << "new name is" << filename;
-        Q_ASSERT(file->fileName() == filename);
+    if (m_cacheStore) {
+        // one index lookup and one read for the whole entry
+        QBuffer *buffer = new QBuffer;
+        buffer->setData(m_cacheStore->read(cacheStoreKeyFromUrl(m_request.url)));
+        if (!buffer->data().isEmpty()) {
+            buffer->open(QIODevice::ReadOnly);
+        }
+        file = buffer;
+    } else {
+        QString filename = cacheFilePathFromUrl(m_request.url);
+        file = new QFile(filename);
+        file->open(QIODevice::ReadOnly);
     }
-    Q_ASSERT(!file);
-    file = new QFile(filename);
-    if (file->open(QIODevice::ReadOnly)) {
+
+    if (file->isOpen()) {
         QByteArray header = file->read(BinaryCacheFileHeader::size);
         if (!m_request.cacheTag.deserialize(header)) {
             qCDebug(KIO_HTTP) << "Cache file header is invalid.";
@@ -4873,21 +5166,33 @@ bool HTTPProtocol::cacheFileOpenWrite()
 
     // if we open a cache file for writing while we have a file open for reading we must have
     // found out that the old cached content is obsolete, so delete the file.
-    QFile *&file = m_request.cacheTag.file;
+    QIODevice *&file = m_request.cacheTag.file;
     if (file) {
         // ensure that the file is in a known state - either open for reading or null
         Q_ASSERT(!qobject_cast<QTemporaryFile *>(file));
         Q_ASSERT((file->openMode() & QIODevice::WriteOnly) == 0);
-        Q_ASSERT(file->fileName() == filename);
         qCDebug(KIO_HTTP) << "deleting expired cache entry and recreating.";
-        file->remove();
+        if (m_cacheStore) {
+            m_cacheStore->remove(cacheStoreKeyFromUrl(m_request.url));
+        } else {
+            QFile *oldFile = static_cast<QFile *>(file);
+            Q_ASSERT(oldFile->fileName() == filename);
+            oldFile->remove();
+        }
         delete file;
         file = nullptr;
     }
 
-    // note that QTemporaryFile will automatically append random chars to filename
-    file = new QTemporaryFile(filename);
-    file->open(QIODevice::WriteOnly);
+    if (m_cacheStore) {
+        // the record is only added to the store when complete, see cacheFileClose()
+        file = new QBuffer;
+        file->open(QIODevice::WriteOnly);
+        file->write(QByteArray(BinaryCacheFileHeader::size, 0));
+    } else {
+        // note that QTemporaryFile will automatically append random chars to filename
+        file = new QTemporaryFile(filename);
+        file->open(QIODevice::WriteOnly);
+    }
 
     // if we have started a new file we have not initialized some variables from disk data.
     m_request.cacheTag.fileUseCount = 0;  // the file has not been *read* yet
@@ -4895,7 +5200,7 @@ bool HTTPProtocol::cacheFileOpenWrite()
 
     if ((file->openMode() & QIODevice::WriteOnly) == 0) {
         qCDebug(KIO_HTTP) << "Could not open file for writing: QTemporaryFile(" << filename << ")"
-                          << "due to error" << file->error();
+                          << "due to error" << file->errorString();
         cacheFileClose();
         return false;
     }
@@ -4913,7 +5218,7 @@ static QByteArray makeCacheCleanerCommand(const HTTPProtocol::CacheTag &cacheTag
     // append the command code
     stream << quint32(cmd);
     // append the filename
-    QString fileName = cacheTag.file->fileName();
+    QString fileName = static_cast<QFile *>(cacheTag.file)->fileName();
     int basenameStart = fileName.lastIndexOf(QLatin1Char('/')) + 1;
     QByteArray baseName = fileName.mid(basenameStart, s_hashedUrlNibbles).toLatin1();
     stream.writeRawData(baseName.constData(), baseName.size());
@@ -4927,13 +5232,37 @@ void HTTPProtocol::cacheFileClose()
 {
     qCDebug(KIO_HTTP);
 
-    QFile *&file = m_request.cacheTag.file;
+    QIODevice *&file = m_request.cacheTag.file;
     if (!file) {
         return;
     }
 
     m_request.cacheTag.ioMode = NoCache;
 
+    if (m_cacheStore) {
+        const QByteArray key = cacheStoreKeyFromUrl(m_request.url);
+        QBuffer *buffer = qobject_cast<QBuffer *>(file);
+        Q_ASSERT(buffer);
+        if (file->openMode() & QIODevice::WriteOnly) {
+            if (m_request.cacheTag.bytesCached && !m_kioError) {
+                QByteArray record = buffer->data();
+                record.replace(0, BinaryCacheFileHeader::size, m_request.cacheTag.serialize());
+                m_cacheStore->insert(key, record);
+            }
+        } else if (file->openMode() == QIODevice::ReadOnly) {
+            // the store keeps the usage statistics, the record only needs to change
+            // if e.g. the expire date was updated
+            const QByteArray header = m_request.cacheTag.serialize();
+            if (!buffer->data().startsWith(header)) {
+                m_cacheStore->patch(key, header);
+            }
+            m_cacheStore->touch(key);
+        }
+        delete file;
+        file = nullptr;
+        return;
+    }
+
     QByteArray ccCommand;
     QTemporaryFile *tempFile = qobject_cast<QTemporaryFile *>(file);
 
@@ -4972,7 +5301,7 @@ void HTTPProtocol::cacheFileClose()
         }
     } else if (file->openMode() == QIODevice::ReadOnly) {
         Q_ASSERT(!tempFile);
-        ccCommand = makeCacheCleanerCommand(m_request.cacheTag, UpdateFileCommand);
+        ccCommand = makeCacheCleanerCommand(m_request.cacheTag, UpdateFileBatchCommand);
     }
     delete file;
     file = nullptr;
@@ -4988,50 +5317,141 @@ void HTTPProtocol::sendCacheCleanerCommand(const QByteArray &command)
     if (!qEnvironmentVariableIsEmpty("KIO_DISABLE_CACHE_CLEANER")) // for autotests
         return;
     Q_ASSERT(command.size() == BinaryCacheFileHeader::size + s_hashedUrlNibbles + sizeof(quint32));
-    if (m_cacheCleanerConnection.state() != QLocalSocket::ConnectedState) {
+
+    // Commands are queued and sent in batches so that reading from the cache never waits
+    // for the cache cleaner. Use count updates are only statistics; they are coalesced per
+    // file and the batched command carries the number of uses instead of the use count.
+    const QByteArray baseName = command.right(s_hashedUrlNibbles);
+    quint32 code;
+    {
+        QDataStream stream(command);
+        stream.setVersion(QDataStream::Qt_4_5);
+        stream.skipRawData(BinaryCacheFileHeader::size);
+        stream >> code;
+    }
+
+    if (m_cacheCleanerQueue.isEmpty()) {
+        m_cacheCleanerQueueAge.start();
+    }
+
+    if (code == UpdateFileBatchCommand) {
+        const int queued = m_cacheCleanerUpdates.value(baseName, -1);
+        qint32 uses = 1;
+        if (queued >= 0) {
+            QDataStream stream(m_cacheCleanerQueue.at(queued));
+            stream.setVersion(QDataStream::Qt_4_5);
+            stream.skipRawData(BinaryCacheFileHeader::useCountOffset);
+            qint32 queuedUses;
+            stream >> queuedUses;
+            uses += queuedUses;
+        }
+
+        // take the rest of the header from the newest command, it may have e.g. a new expire date
+        QByteArray batched = command;
+        {
+            QDataStream stream(&batched, QIODevice::ReadWrite);
+            stream.setVersion(QDataStream::Qt_4_5);
+            stream.skipRawData(BinaryCacheFileHeader::useCountOffset);
+            stream << uses;
+        }
+
+        if (queued >= 0) {
+            m_cacheCleanerQueue[queued] = batched;
+        } else {
+            m_cacheCleanerUpdates.insert(baseName, m_cacheCleanerQueue.size());
+            m_cacheCleanerQueue.append(batched);
+        }
+    } else {
+        m_cacheCleanerQueue.append(command);
+    }
+
+    if (m_cacheCleanerQueue.size() >= s_cacheCleanerBatchSize ||
+        m_cacheCleanerQueueAge.hasExpired(s_cacheCleanerMaxQueueAge)) {
+        flushCacheCleanerCommands();
+    }
+}
+
+void HTTPProtocol::flushCacheCleanerCommands()
+{
+    if (m_cacheCleanerQueue.isEmpty()) {
+        return;
+    }
+
+    if (m_cacheCleanerConnection.state() == QLocalSocket::UnconnectedState) {
         QString socketFileName = QStandardPaths::writableLocation(QStandardPaths::RuntimeLocation) + QLatin1Char('/') + QLatin1String("kio_http_cache_cleaner");
         m_cacheCleanerConnection.connectToServer(socketFileName, QIODevice::WriteOnly);
 
         if (m_cacheCleanerConnection.state() == QLocalSocket::UnconnectedState) {
-            // An error happened.
-            // Most likely the cache cleaner is not running, let's start it.
-
-            // search paths
-            const QStringList searchPaths = QStringList()
-                << QCoreApplication::applicationDirPath() // then look where our application binary is located
-                << QLibraryInfo::location(QLibraryInfo::LibraryExecutablesPath) // look where libexec path is (can be set in qt.conf)
-                << QFile::decodeName(CMAKE_INSTALL_FULL_LIBEXECDIR_KF5); // look at our installation location
-            const QString exe = QStandardPaths::findExecutable(QStringLiteral("kio_http_cache_cleaner"), searchPaths);
-            if (exe.isEmpty()) {
-                qCWarning(KIO_HTTP) << "kio_http_cache_cleaner not found in" << searchPaths;
-                return;
-            }
-            qCDebug(KIO_HTTP) << "starting" << exe;
-            QProcess::startDetached(exe, QStringList());
-
-            for (int i = 0 ; i < 30 && m_cacheCleanerConnection.state() == QLocalSocket::UnconnectedState; ++i) {
-                // Server is not listening yet; let's hope it does so under 3 seconds
-                QThread::msleep(100);
-                m_cacheCleanerConnection.connectToServer(socketFileName, QIODevice::WriteOnly);
-                if (m_cacheCleanerConnection.state() != QLocalSocket::UnconnectedState) {
-                    break; // connecting or connected, sounds good
-                }
-            }
+            // Most likely the cache cleaner is not running. Start it, but don't wait for
+            // it to come up; the queued commands go out with a later batch.
+            startCacheCleaner();
         }
+    }
 
-        if (!m_cacheCleanerConnection.waitForConnected(1500)) {
-            // updating the stats is not vital, so we just give up.
-            qCDebug(KIO_HTTP) << "Could not connect to cache cleaner, not updating stats of this cache file.";
-            return;
-        }
-        qCDebug(KIO_HTTP) << "Successfully connected to cache cleaner.";
+    if (m_cacheCleanerConnection.state() == QLocalSocket::ConnectingState) {
+        // there is no event loop to finish the connection for us; poll, don't block
+        m_cacheCleanerConnection.waitForConnected(0);
+    }
+
+    if (m_cacheCleanerConnection.state() != QLocalSocket::ConnectedState) {
+        if (m_cacheCleanerQueue.size() > s_cacheCleanerMaxQueueSize) {
+            // updating the stats is not vital, so we just give up on them.
+            qCDebug(KIO_HTTP) << "Could not connect to cache cleaner, dropping" << m_cacheCleanerQueue.size() << "commands.";
+            m_cacheCleanerQueue.clear();
+            m_cacheCleanerUpdates.clear();
+            // but the cleaner can't know about files it was never told of, so it
+            // has to look for them or it lets the cache grow beyond its size
+            m_cacheCleanerNeedsRescan = true;
+        }
+        // retry once the queue has aged again
+        m_cacheCleanerQueueAge.start();
+        return;
+    }
+
+    QByteArray batch;
+    batch.reserve((m_cacheCleanerQueue.size() + 1) * m_cacheCleanerQueue.first().size());
+    if (m_cacheCleanerNeedsRescan) {
+        QByteArray rescan(m_cacheCleanerQueue.first().size(), '\0');
+        QDataStream stream(&rescan, QIODevice::ReadWrite);
+        stream.setVersion(QDataStream::Qt_4_5);
+        stream.skipRawData(BinaryCacheFileHeader::size);
+        stream << quint32(RescanCommand);
+        batch += rescan;
+        m_cacheCleanerNeedsRescan = false;
     }
+    for (int i = 0; i < m_cacheCleanerQueue.size(); ++i) {
+        batch += m_cacheCleanerQueue.at(i);
+    }
+    m_cacheCleanerQueue.clear();
+    m_cacheCleanerUpdates.clear();
 
-    Q_ASSERT(m_cacheCleanerConnection.state() == QLocalSocket::ConnectedState);
-    m_cacheCleanerConnection.write(command);
+    // flush() writes as much as the socket takes without blocking, the rest stays
+    // buffered and is written by the next flush.
+    m_cacheCleanerConnection.write(batch);
     m_cacheCleanerConnection.flush();
 }
 
+void HTTPProtocol::startCacheCleaner()
+{
+    if (m_cacheCleanerLastStart.isValid() && !m_cacheCleanerLastStart.hasExpired(s_cacheCleanerStartInterval)) {
+        return;
+    }
+    m_cacheCleanerLastStart.start();
+
+    // search paths
+    const QStringList searchPaths = QStringList()
+        << QCoreApplication::applicationDirPath() // then look where our application binary is located
+        << QLibraryInfo::location(QLibraryInfo::LibraryExecutablesPath) // look where libexec path is (can be set in qt.conf)
+        << QFile::decodeName(CMAKE_INSTALL_FULL_LIBEXECDIR_KF5); // look at our installation location
+    const QString exe = QStandardPaths::findExecutable(QStringLiteral("kio_http_cache_cleaner"), searchPaths);
+    if (exe.isEmpty()) {
+        qCWarning(KIO_HTTP) << "kio_http_cache_cleaner not found in" << searchPaths;
+        return;
+    }
+    qCDebug(KIO_HTTP) << "starting" << exe;
+    QProcess::startDetached(exe, QStringList());
+}
+
 QByteArray HTTPProtocol::cacheFileReadPayload(int maxLength)
 {
     Q_ASSERT(m_request.cacheTag.file);
@@ -5066,6 +5486,13 @@ void HTTPProtocol::cacheFileWritePayload(const QByteArray &d)
         cacheFileClose();
     }
 
+    if (m_cacheStore && m_request.cacheTag.bytesCached + d.size() > s_MaxCacheStoreRecordSize) {
+        qCDebug(KIO_HTTP) << "Caching disabled because content is too big for the cache store.";
+        m_request.cacheTag.bytesCached = 0; // discard what we have
+        cacheFileClose();
+        return;
+    }
+
     //TODO: abort if file grows too big!
 
     // write the variable length text header as soon as we start writing to the file
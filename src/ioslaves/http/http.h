@@ -26,8 +26,11 @@
 #define HTTP_H
 
 #include <QList>
+#include <QSet>
 #include <QStringList>
 #include <QDateTime>
+#include <QElapsedTimer>
+#include <QHash>
 #include <QLocalSocket>
 #include <QUrl>
 
@@ -44,6 +47,7 @@ class AuthInfo;
 }
 
 class HeaderTokenizer;
+class HttpCacheStore;
 class KAbstractHttpAuthentication;
 
 class HTTPProtocol : public QObject, public KIO::TCPSlaveBase
@@ -105,7 +109,9 @@ public:
         quint32 fileUseCount;
         quint32 bytesCached;
         QString etag; // entity tag header as described in the HTTP standard.
-        QFile *file; // file on disk - either a QTemporaryFile (write) or QFile (read)
+        // file on disk - either a QTemporaryFile (write) or QFile (read), or a
+        // QBuffer holding a whole record of the cache store
+        QIODevice *file;
         QDateTime servedDate; // Date when the resource was served by the origin server
         QDateTime lastModifiedDate; // Last modified.
         QDateTime expireDate; // Date when the cache entry will expire
@@ -270,6 +276,12 @@ public:
 
     void reparseConfiguration() override;
 
+    /**
+     * Connects to the host given by setHost() ahead of the first request,
+     * which then reuses the connection
+     */
+    void openConnection() override;
+
     /**
      * Forced close of connection
      */
@@ -279,6 +291,22 @@ public:
     void multiGet(const QByteArray &data) override;
     bool maybeSetRequestUrl(const QUrl &);
 
+    /**
+     * Sends up to @p depth queued GET requests for the same host on the
+     * current connection before reading any response, then reads the responses
+     * in order. Requests whose responses are lost because the server closed the
+     * connection or misbehaved are put back at the head of m_requestQueue.
+     *
+     * Returns false if an unrecoverable error occurred and error() was called.
+     */
+    bool multiGetPipelined(int depth);
+    /**
+     * Handles the first request of m_requestQueue without pipelining.
+     *
+     * Returns false if an unrecoverable error occurred and error() was called.
+     */
+    bool multiGetSequential();
+
     /**
      * Generate and send error message based on response code.
      */
@@ -300,6 +328,7 @@ protected Q_SLOTS:
     void error(int errid, const QString &text);
     void proxyAuthenticationForSocket(const QNetworkProxy &, QAuthenticator *);
     void saveProxyAuthenticationForSocket();
+    void slotCookiesChanged(const QStringList &domains, qulonglong version);
 
 protected:
     int readChunked();    ///< Read a chunk
@@ -412,16 +441,34 @@ protected:
 
     /**
      * Look for cookies in the cookiejar
+     *
+     * Results are kept per host and reused until kcookiejar announces a
+     * change for the host's domain or one of the cookies expires.
      */
     QString findCookies(const QString &url);
 
+    /**
+     * Forget the cookies kept for @p host and hosts that may share its cookies
+     */
+    void dropCookieSnapshots(const QString &host);
+
     void cacheParseResponseHeader(const HeaderTokenizer &tokenizer);
 
     QString cacheFilePathFromUrl(const QUrl &url) const;
+    QByteArray cacheStoreKeyFromUrl(const QUrl &url) const;
     bool cacheFileOpenRead();
     bool cacheFileOpenWrite();
     void cacheFileClose();
+    /**
+     * Queue @p command for the cache cleaner, it is sent with the next batch.
+     */
     void sendCacheCleanerCommand(const QByteArray &command);
+    /**
+     * Send the queued cache cleaner commands if the cache cleaner is reachable
+     * without waiting for it.
+     */
+    void flushCacheCleanerCommands();
+    void startCacheCleaner();
 
     QByteArray cacheFileReadPayload(int maxLength);
     void cacheFileWritePayload(const QByteArray &d);
@@ -533,6 +580,7 @@ protected:
     HTTPServerState m_server;
     HTTPRequest m_request;
     QList<HTTPRequest> m_requestQueue;
+    QSet<QString> m_pipeliningUnsupportedHosts; ///< host:port of servers that broke a pipeline
 
     // Processing related
     KIO::filesize_t m_iSize; ///< Expected size of message
@@ -580,6 +628,22 @@ protected:
     long m_maxCacheSize; ///< Maximum cache size in Kb.
     QString m_strCacheDir; ///< Location of the cache.
     QLocalSocket m_cacheCleanerConnection; ///< Connection to the cache cleaner process
+    QList<QByteArray> m_cacheCleanerQueue; ///< Commands not yet sent to the cache cleaner
+    QHash<QByteArray, int> m_cacheCleanerUpdates; ///< Cache file name -> queued use count update
+    QElapsedTimer m_cacheCleanerQueueAge; ///< Started when the first command was queued
+    QElapsedTimer m_cacheCleanerLastStart; ///< Last attempt to start the cache cleaner
+    bool m_cacheCleanerNeedsRescan; ///< Commands were dropped, the cache cleaner's index is incomplete
+    HttpCacheStore *m_cacheStore; ///< Single-file cache store, if used instead of one file per URL
+
+    // Cookie related
+    struct CookieSnapshot {
+        QString cookies;
+        qulonglong version; ///< Version of the cookie jar the cookies were taken from
+        qint64 nextExpiry; ///< Seconds since the epoch, 0 if none of the cookies expires
+    };
+    QHash<QString, QHash<QString, CookieSnapshot> > m_cookieSnapshots; ///< Host -> window id and URL -> cookies
+    bool m_cookieSnapshotsEnabled; ///< False if kcookiejar doesn't support snapshots
+    bool m_cookieServerConnected; ///< Whether we listen to kcookiejar's change notifications
 
     // Operation mode
     QByteArray m_protocol;
@@ -30,8 +30,9 @@ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 
 #include <QDateTime>
 #include <QDir>
+#include <QElapsedTimer>
 #include <QString>
-#include <QTime>
+#include <QTimer>
 #include <QDBusConnection>
 #include <QLocalServer>
 #include <QLocalSocket>
@@ -48,13 +49,18 @@ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #include <QDBusError>
 #include <QDataStream>
 
-QDateTime g_currentDate;
+#include "httpcacheindex.h"
+
 int g_maxCacheAge;
 qint64 g_maxCacheSize;
 
 static const char appFullName[] = "org.kio5.kio_http_cache_cleaner";
 static const char appName[] = "kio_http_cache_cleaner";
 
+static const int s_sliceDuration = 100; // ms of cleaning between serving ioslaves
+static const int s_saveInterval = 5 * 60 * 1000; // ms between writing out a changed index
+static const qint64 s_rescanInterval = 7 * 24 * 60 * 60; // s between walks of the cache directory
+
 // !START OF SYNC!
 // Keep the following in sync with the cache code in http.cpp
 
@@ -85,13 +91,11 @@ struct SerializedCacheFileInfo {
 };
 
 struct MiniCacheFileInfo {
-// data from cache entry file, or from scoreboard file
+// data from cache entry file
     qint32 useCount;
 // from filesystem
     QDateTime lastUsedDate;
     qint64 sizeOnDisk;
-    // we want to delete the least "useful" files and we'll have to sort a list for that...
-    bool operator<(const MiniCacheFileInfo &other) const;
     void debugPrint() const
     {
         // qDebug() << "useCount:" << useCount
@@ -134,18 +138,6 @@ struct CacheFileInfo : MiniCacheFileInfo {
     }
 };
 
-bool MiniCacheFileInfo::operator<(const MiniCacheFileInfo &other) const
-{
-    const int thisUseful = useCount / qMax(lastUsedDate.secsTo(g_currentDate), qint64(1));
-    const int otherUseful = other.useCount / qMax(other.lastUsedDate.secsTo(g_currentDate), qint64(1));
-    return thisUseful < otherUseful;
-}
-
-bool CacheFileInfoPtrLessThan(const CacheFileInfo *cf1, const CacheFileInfo *cf2)
-{
-    return *cf1 < *cf2;
-}
-
 enum OperationMode {
     CleanCache = 0,
     DeleteCache,
@@ -252,7 +244,11 @@ static bool readTextHeader(QFile *file, CacheFileInfo *fi, OperationMode mode)
 enum CacheCleanerCommand {
     InvalidCommand = 0,
     CreateFileNotificationCommand,
-    UpdateFileCommand
+    UpdateFileCommand,
+    // like UpdateFileCommand, but the use count field holds the number of uses to add
+    UpdateFileBatchCommand,
+    // a slave had to drop commands, the index may be missing files
+    RescanCommand
 };
 
 static bool readCacheFile(const QString &baseName, CacheFileInfo *fi, OperationMode mode)
@@ -277,90 +273,6 @@ static bool readCacheFile(const QString &baseName, CacheFileInfo *fi, OperationM
     return true;
 }
 
-class Scoreboard;
-
-class CacheIndex
-{
-public:
-    explicit CacheIndex(const QString &baseName)
-    {
-        QByteArray ba = baseName.toLatin1();
-        const int sz = ba.size();
-        const char *input = ba.constData();
-        Q_ASSERT(sz == s_hashedUrlNibbles);
-
-        int translated = 0;
-        for (int i = 0; i < sz; i++) {
-            int c = input[i];
-
-            if (c >= '0' && c <= '9') {
-                translated |= c - '0';
-            } else if (c >= 'a' && c <= 'f') {
-                translated |= c - 'a' + 10;
-            } else {
-                Q_ASSERT(false);
-            }
-
-            if (i & 1) {
-                // odd index
-                m_index[i >> 1] = translated;
-                translated = 0;
-            } else  {
-                translated = translated << 4;
-            }
-        }
-
-        computeHash();
-    }
-
-    bool operator==(const CacheIndex &other) const
-    {
-        const bool isEqual = memcmp(m_index, other.m_index, s_hashedUrlBytes) == 0;
-        if (isEqual) {
-            Q_ASSERT(m_hash == other.m_hash);
-        }
-        return isEqual;
-    }
-
-private:
-    explicit CacheIndex(const QByteArray &index)
-    {
-        Q_ASSERT(index.length() >= s_hashedUrlBytes);
-        memcpy(m_index, index.constData(), s_hashedUrlBytes);
-        computeHash();
-    }
-
-    void computeHash()
-    {
-        uint hash = 0;
-        const int ints = s_hashedUrlBytes / sizeof(uint);
-        for (int i = 0; i < ints; i++) {
-            hash ^= reinterpret_cast<uint *>(&m_index[0])[i];
-        }
-        if (const int bytesLeft = s_hashedUrlBytes % sizeof(uint)) {
-            // dead code until a new url hash algorithm or architecture with sizeof(uint) != 4 appears.
-            // we have the luxury of ignoring endianness because the hash is never written to disk.
-            // just merge the bits into the hash in some way.
-            const int offset = ints * sizeof(uint);
-            for (int i = 0; i < bytesLeft; i++) {
-                hash ^= static_cast<uint>(m_index[offset + i]) << (i * 8);
-            }
-        }
-        m_hash = hash;
-    }
-
-    friend uint qHash(const CacheIndex &);
-    friend class Scoreboard;
-
-    quint8 m_index[s_hashedUrlBytes]; // packed binary version of the hexadecimal name
-    uint m_hash;
-};
-
-uint qHash(const CacheIndex &ci)
-{
-    return ci.m_hash;
-}
-
 static CacheCleanerCommand readCommand(const QByteArray &cmd, CacheFileInfo *fi)
 {
     readBinaryHeader(cmd, fi);
@@ -376,213 +288,81 @@ static CacheCleanerCommand readCommand(const QByteArray &cmd, CacheFileInfo *fi)
     Q_ASSERT(stream.atEnd());
     fi->baseName = QString::fromLatin1(baseName);
 
-    Q_ASSERT(ret == CreateFileNotificationCommand || ret == UpdateFileCommand);
+    Q_ASSERT(ret == CreateFileNotificationCommand || ret == UpdateFileCommand ||
+             ret == UpdateFileBatchCommand || ret == RescanCommand);
     return static_cast<CacheCleanerCommand>(ret);
 }
 
-// never istantiated, on-disk format only
-struct ScoreboardEntry {
-// from scoreboard file
-    quint8 index[s_hashedUrlBytes];
-    static const int indexSize = s_hashedUrlBytes;
-    qint32 useCount;
-// from scoreboard file, but compared with filesystem to see if scoreboard has current data
-    qint64 lastUsedDate;
-    qint32 sizeOnDisk;
-    static const int size = 36;
-    // we want to delete the least "useful" files and we'll have to sort a list for that...
-    bool operator<(const MiniCacheFileInfo &other) const;
-};
-
-class Scoreboard
+// execute a command from an ioslave and bring the index up to date
+static void runCommand(HttpCacheIndex *index, const QByteArray &cmd)
 {
-public:
-    Scoreboard()
-    {
-        // read in the scoreboard...
-        QFile sboard(filePath(QStringLiteral("scoreboard")));
-        if (sboard.open(QIODevice::ReadOnly)) {
-            while (true) {
-                QByteArray baIndex = sboard.read(ScoreboardEntry::indexSize);
-                QByteArray baRest = sboard.read(ScoreboardEntry::size - ScoreboardEntry::indexSize);
-                if (baIndex.size() + baRest.size() != ScoreboardEntry::size) {
-                    break;
-                }
-
-                const QString entryBasename = QString::fromLatin1(baIndex.toHex());
-                MiniCacheFileInfo mcfi;
-                if (readAndValidateMcfi(baRest, entryBasename, &mcfi)) {
-                    m_scoreboard.insert(CacheIndex(baIndex), mcfi);
-                }
-            }
+    Q_ASSERT(cmd.size() == 80);
+    CacheFileInfo fi;
+    const CacheCleanerCommand ccc = readCommand(cmd, &fi);
+    if (ccc == RescanCommand) {
+        if (!index->isScanning()) {
+            index->startScan();
         }
+        return;
     }
+    QString fileName = filePath(fi.baseName);
 
-    void writeOut()
-    {
-        // write out the scoreboard
-        QFile sboard(filePath(QStringLiteral("scoreboard")));
-        if (!sboard.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+    switch (ccc) {
+    case CreateFileNotificationCommand: {
+        // qDebug() << "CreateNotificationCommand for" << fi.baseName;
+        QFileInfo fileInfo(fileName);
+        if (!readBinaryHeader(cmd, &fi) || !fileInfo.exists()) {
             return;
         }
-        QDataStream stream(&sboard);
-
-        QHash<CacheIndex, MiniCacheFileInfo>::ConstIterator it = m_scoreboard.constBegin();
-        for (; it != m_scoreboard.constEnd(); ++it) {
-            const char *indexData = reinterpret_cast<const char *>(it.key().m_index);
-            stream.writeRawData(indexData, s_hashedUrlBytes);
-
-            stream << it.value().useCount;
-            stream << it.value().lastUsedDate;
-            stream << it.value().sizeOnDisk;
-        }
-    }
-
-    bool fillInfo(const QString &baseName, MiniCacheFileInfo *mcfi)
-    {
-        QHash<CacheIndex, MiniCacheFileInfo>::ConstIterator it =
-            m_scoreboard.constFind(CacheIndex(baseName));
-        if (it == m_scoreboard.constEnd()) {
-            return false;
-        }
-        *mcfi = it.value();
-        return true;
+        fi.lastUsedDate = fileInfo.lastModified();
+        fi.sizeOnDisk = fileInfo.size();
+        break;
     }
 
-    qint64 runCommand(const QByteArray &cmd)
-    {
-        // execute the command; return number of bytes if a new file was created, zero otherwise.
-        Q_ASSERT(cmd.size() == 80);
-        CacheFileInfo fi;
-        const CacheCleanerCommand ccc = readCommand(cmd, &fi);
-        QString fileName = filePath(fi.baseName);
-
-        switch (ccc) {
-        case CreateFileNotificationCommand:
-            // qDebug() << "CreateNotificationCommand for" << fi.baseName;
-            if (!readBinaryHeader(cmd, &fi)) {
-                return 0;
-            }
-            break;
-
-        case UpdateFileCommand: {
-            // qDebug() << "UpdateFileCommand for" << fi.baseName;
-            QFile file(fileName);
-            file.open(QIODevice::ReadWrite);
-
-            CacheFileInfo fiFromDisk;
-            QByteArray header = file.read(SerializedCacheFileInfo::size);
-            if (!readBinaryHeader(header, &fiFromDisk) || fiFromDisk.bytesCached != fi.bytesCached) {
-                return 0;
-            }
-
-            // adjust the use count, to make sure that we actually count up. (slaves read the file
-            // asynchronously...)
-            const quint32 newUseCount = fiFromDisk.useCount + 1;
-            QByteArray newHeader = cmd.mid(0, SerializedCacheFileInfo::size);
-            {
-                QDataStream stream(&newHeader, QIODevice::WriteOnly);
-                stream.skipRawData(SerializedCacheFileInfo::useCountOffset);
-                stream << newUseCount;
-            }
-
-            file.seek(0);
-            file.write(newHeader);
-            file.close();
+    case UpdateFileCommand:
+    case UpdateFileBatchCommand: {
+        // qDebug() << "UpdateFileCommand for" << fi.baseName;
+        QFile file(fileName);
+        file.open(QIODevice::ReadWrite);
 
-            if (!readBinaryHeader(newHeader, &fi)) {
-                return 0;
-            }
-            break;
+        CacheFileInfo fiFromDisk;
+        QByteArray header = file.read(SerializedCacheFileInfo::size);
+        if (!readBinaryHeader(header, &fiFromDisk) || fiFromDisk.bytesCached != fi.bytesCached) {
+            return;
         }
 
-        default:
-            // qDebug() << "received invalid command";
-            return 0;
+        // adjust the use count, to make sure that we actually count up. (slaves read the file
+        // asynchronously...) Slaves batch their updates, then the command says how often
+        // the file was used since the last batch.
+        const quint32 uses = ccc == UpdateFileBatchCommand ? qMax(fi.useCount, 1) : 1;
+        const quint32 newUseCount = fiFromDisk.useCount + uses;
+        QByteArray newHeader = cmd.mid(0, SerializedCacheFileInfo::size);
+        {
+            QDataStream stream(&newHeader, QIODevice::WriteOnly);
+            stream.skipRawData(SerializedCacheFileInfo::useCountOffset);
+            stream << newUseCount;
         }
 
-        QFileInfo fileInfo(fileName);
-        fi.lastUsedDate = fileInfo.lastModified();
-        fi.sizeOnDisk = fileInfo.size();
-        fi.debugPrint();
-        // a CacheFileInfo is-a MiniCacheFileInfo which enables the following assignment...
-        add(fi);
-        // finally, return cache dir growth (only relevant if a file was actually created!)
-        return ccc == CreateFileNotificationCommand ? fi.sizeOnDisk : 0;
-    }
-
-    void add(const CacheFileInfo &fi)
-    {
-        m_scoreboard[CacheIndex(fi.baseName)] = fi;
-    }
-
-    void remove(const QString &basename)
-    {
-        m_scoreboard.remove(CacheIndex(basename));
-    }
+        file.seek(0);
+        file.write(newHeader);
 
-    // keep memory usage reasonably low - otherwise entries of nonexistent files don't hurt.
-    void maybeRemoveStaleEntries(const QList<CacheFileInfo *> &fiList)
-    {
-        // don't bother when there are a few bogus entries
-        if (m_scoreboard.count() < fiList.count() + 100) {
+        if (!readBinaryHeader(newHeader, &fi)) {
             return;
         }
-        // qDebug() << "we have too many fake/stale entries, cleaning up...";
-        QSet<CacheIndex> realFiles;
-        Q_FOREACH (CacheFileInfo *fi, fiList) {
-            realFiles.insert(CacheIndex(fi->baseName));
-        }
-        QHash<CacheIndex, MiniCacheFileInfo>::Iterator it = m_scoreboard.begin();
-        while (it != m_scoreboard.end()) {
-            if (realFiles.contains(it.key())) {
-                ++it;
-            } else {
-                it = m_scoreboard.erase(it);
-            }
-        }
+        // we just wrote the file, no need to ask the filesystem for the time
+        fi.lastUsedDate = QDateTime::currentDateTime();
+        fi.sizeOnDisk = file.size();
+        break;
     }
 
-private:
-    bool readAndValidateMcfi(const QByteArray &rawData, const QString &basename, MiniCacheFileInfo *mcfi)
-    {
-        QDataStream stream(rawData);
-        stream >> mcfi->useCount;
-        // check those against filesystem
-        stream >> mcfi->lastUsedDate;
-        stream >> mcfi->sizeOnDisk;
-
-        QFileInfo fileInfo(filePath(basename));
-        if (!fileInfo.exists()) {
-            return false;
-        }
-        bool ok = true;
-        ok = ok && fileInfo.lastModified() == mcfi->lastUsedDate;
-        ok = ok && fileInfo.size() == mcfi->sizeOnDisk;
-        if (!ok) {
-            // size or last-modified date not consistent with entry file; reload useCount
-            // note that avoiding to open the file is the whole purpose of the scoreboard - we only
-            // open the file if we really have to.
-            QFile entryFile(fileInfo.absoluteFilePath());
-            if (!entryFile.open(QIODevice::ReadOnly)) {
-                return false;
-            }
-            if (entryFile.size() < SerializedCacheFileInfo::size) {
-                return false;
-            }
-            QDataStream stream(&entryFile);
-            stream.skipRawData(SerializedCacheFileInfo::useCountOffset);
-
-            stream >> mcfi->useCount;
-            mcfi->lastUsedDate = fileInfo.lastModified();
-            mcfi->sizeOnDisk = fileInfo.size();
-            ok = true;
-        }
-        return ok;
+    default:
+        // qDebug() << "received invalid command";
+        return;
     }
 
-    QHash<CacheIndex, MiniCacheFileInfo> m_scoreboard;
-};
+    fi.debugPrint();
+    index->update(fi.baseName, fi.useCount, fi.lastUsedDate.toMSecsSinceEpoch() / 1000, fi.sizeOnDisk);
+}
 
 // Keep the above in sync with the cache code in http.cpp
 // !END OF SYNC!
@@ -603,111 +383,10 @@ static void removeOldFiles()
         cacheRootDir.rmdir(dirName);
     }
     QFile::remove(filePath(QStringLiteral("cleaned")));
+    // replaced by the index of HttpCacheIndex
+    QFile::remove(filePath(QStringLiteral("scoreboard")));
 }
 
-class CacheCleaner
-{
-public:
-    CacheCleaner(const QDir &cacheDir)
-        : m_totalSizeOnDisk(0)
-    {
-        // qDebug();
-        m_fileNameList = cacheDir.entryList();
-    }
-
-    // Delete some of the files that need to be deleted. Return true when done, false otherwise.
-    // This makes interleaved cleaning / serving ioslaves possible.
-    bool processSlice(Scoreboard *scoreboard = nullptr)
-    {
-        QTime t;
-        t.start();
-        // phase one: gather information about cache files
-        if (!m_fileNameList.isEmpty()) {
-            while (t.elapsed() < 100 && !m_fileNameList.isEmpty()) {
-                QString baseName = m_fileNameList.takeFirst();
-                // check if the filename is of the $s_hashedUrlNibbles letters, 0...f type
-                if (baseName.length() < s_hashedUrlNibbles) {
-                    continue;
-                }
-                bool nameOk = true;
-                for (int i = 0; i < s_hashedUrlNibbles && nameOk; i++) {
-                    QChar c = baseName[i];
-                    nameOk = (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f');
-                }
-                if (!nameOk) {
-                    continue;
-                }
-                if (baseName.length() > s_hashedUrlNibbles) {
-                    if (QFileInfo(filePath(baseName)).lastModified().secsTo(g_currentDate) > 15 * 60) {
-                        // it looks like a temporary file that hasn't been touched in > 15 minutes...
-                        QFile::remove(filePath(baseName));
-                    }
-                    // the temporary file might still be written to, leave it alone
-                    continue;
-                }
-
-                CacheFileInfo *fi = new CacheFileInfo();
-                fi->baseName = baseName;
-
-                bool gotInfo = false;
-                if (scoreboard) {
-                    gotInfo = scoreboard->fillInfo(baseName, fi);
-                }
-                if (!gotInfo) {
-                    gotInfo = readCacheFile(baseName, fi, CleanCache);
-                    if (gotInfo && scoreboard) {
-                        scoreboard->add(*fi);
-                    }
-                }
-                if (gotInfo) {
-                    m_fiList.append(fi);
-                    m_totalSizeOnDisk += fi->sizeOnDisk;
-                } else {
-                    delete fi;
-                }
-            }
-            // qDebug() << "total size of cache files is" << m_totalSizeOnDisk;
-
-            if (m_fileNameList.isEmpty()) {
-                // final step of phase one
-                std::sort(m_fiList.begin(), m_fiList.end(), CacheFileInfoPtrLessThan);
-            }
-            return false;
-        }
-
-        // phase two: delete files until cache is under maximum allowed size
-
-        // TODO: delete files larger than allowed for a single file
-        while (t.elapsed() < 100) {
-            if (m_totalSizeOnDisk <= g_maxCacheSize || m_fiList.isEmpty()) {
-                // qDebug() << "total size of cache files after cleaning is" << m_totalSizeOnDisk;
-                if (scoreboard) {
-                    scoreboard->maybeRemoveStaleEntries(m_fiList);
-                    scoreboard->writeOut();
-                }
-                qDeleteAll(m_fiList);
-                m_fiList.clear();
-                return true;
-            }
-            CacheFileInfo *fi = m_fiList.takeFirst();
-            QString filename = filePath(fi->baseName);
-            if (QFile::remove(filename)) {
-                m_totalSizeOnDisk -= fi->sizeOnDisk;
-                if (scoreboard) {
-                    scoreboard->remove(fi->baseName);
-                }
-            }
-            delete fi;
-        }
-        return false;
-    }
-
-private:
-    QStringList m_fileNameList;
-    QList<CacheFileInfo *> m_fiList;
-    qint64 m_totalSizeOnDisk;
-};
-
 int main(int argc, char **argv)
 {
     QCoreApplication app(argc, argv);
@@ -755,7 +434,6 @@ int main(int argc, char **argv)
         }
     }
 
-    g_currentDate = QDateTime::currentDateTime();
     g_maxCacheAge = KProtocolManager::maxCacheAge();
     g_maxCacheSize = mode == DeleteCache ? -1 : KProtocolManager::maxCacheSize() * 1024;
 
@@ -769,13 +447,10 @@ int main(int argc, char **argv)
 
     removeOldFiles();
 
+    HttpCacheIndex index(cacheDirName);
+
     if (mode == DeleteCache) {
-        QTime t;
-        t.start();
-        cacheDir.refresh();
-        //qDebug() << "time to refresh the cacheDir QDir:" << t.elapsed();
-        CacheCleaner cleaner(cacheDir);
-        while (!cleaner.processSlice()) { }
+        index.clear();
         return 0;
     }
 
@@ -787,14 +462,21 @@ int main(int argc, char **argv)
         qWarning() << "Error listening on" << socketFileName;
     }
     QList<QLocalSocket *> sockets;
-    qint64 newBytesCounter = LLONG_MAX;  // force cleaner run on startup
 
-    Scoreboard scoreboard;
-    CacheCleaner *cleaner = nullptr;
+    // the persisted index is trusted; the cache directory is only walked if there is
+    // none or the last walk is long ago, and then in slices while serving ioslaves.
+    if (!index.load() || index.lastScan() < QDateTime::currentMSecsSinceEpoch() / 1000 - s_rescanInterval) {
+        index.startScan();
+    }
+    QElapsedTimer lastSave;
+    lastSave.start();
+    // wakes up the event loop to write out the index even if no ioslave talks to us
+    QTimer saveTimer;
+    saveTimer.start(s_saveInterval);
+
     while (true) {
-        g_currentDate = QDateTime::currentDateTime();
-        if (cleaner) {
-            QCoreApplication::processEvents(QEventLoop::AllEvents, 100);
+        if (index.isScanning() || index.isEvicting()) {
+            QCoreApplication::processEvents(QEventLoop::AllEvents, s_sliceDuration);
         } else {
             // We will not immediately know when a socket was disconnected. Causes:
             // - WaitForMoreEvents does not make processEvents() return when a socket disconnects
@@ -823,27 +505,28 @@ int main(int argc, char **argv)
                 continue;
             }
             sock->waitForReadyRead(0);
-            while (true) {
+            // slaves send commands in batches which may arrive in pieces; leave
+            // an incomplete command in the socket until the rest is there
+            while (sock->bytesAvailable() >= 80) {
                 QByteArray recv = sock->read(80);
-                if (recv.isEmpty()) {
-                    break;
-                }
                 Q_ASSERT(recv.size() == 80);
-                newBytesCounter += scoreboard.runCommand(recv);
+                runCommand(&index, recv);
             }
         }
 
         // interleave cleaning with serving ioslaves to reduce "garbage collection pauses"
-        if (cleaner) {
-            if (cleaner->processSlice(&scoreboard)) {
-                // that was the last slice, done
-                delete cleaner;
-                cleaner = nullptr;
-            }
-        } else if (newBytesCounter > (g_maxCacheSize / 8)) {
-            cacheDir.refresh();
-            cleaner = new CacheCleaner(cacheDir);
-            newBytesCounter = 0;
+        bool done = false;
+        if (index.isScanning()) {
+            done = index.scanSlice(s_sliceDuration);
+        } else if (index.isEvicting()) {
+            done = index.evictSlice(s_sliceDuration);
+        } else if (index.totalSize() > g_maxCacheSize) {
+            // leave some room so that not every new file starts another eviction
+            index.startEviction(g_maxCacheSize / 10 * 9);
+        }
+        if (index.isDirty() && (done || lastSave.hasExpired(s_saveInterval))) {
+            index.save();
+            lastSave.restart();
         }
     }
     return 0;
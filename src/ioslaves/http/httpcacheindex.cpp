@@ -0,0 +1,411 @@
+/*
+   This file is part of the KDE libraries
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License version 2 as published by the Free Software Foundation.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LIB.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+*/
+
+#include "httpcacheindex.h"
+#include "httpcachestore.h"
+
+#include <QDataStream>
+#include <QDateTime>
+#include <QDirIterator>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QFileInfo>
+#include <QSaveFile>
+
+#include <algorithm>
+
+static const char s_indexFileName[] = "cleanerindex";
+static const quint32 s_indexMagic = 0x4b484349; // "KHCI"
+static const quint32 s_indexVersion = 1;
+static const int s_indexHeaderSize = 20;
+static const int s_indexEntrySize = HttpCacheIndex::keySize + 20;
+
+// Keep the following in sync with the cache code in http.cpp
+static const int s_binaryHeaderSize = 36;
+static const int s_useCountOffset = 4;
+static const char s_version[] = "A\n";
+
+static qint64 currentSecs()
+{
+    return QDateTime::currentMSecsSinceEpoch() / 1000;
+}
+
+HttpCacheIndex::HttpCacheIndex(const QString &cacheDir)
+    : m_cacheDir(cacheDir),
+      m_totalSize(0),
+      m_lastScan(0),
+      m_dirty(false),
+      m_scanIterator(nullptr),
+      m_scanGeneration(0),
+      m_evicting(false),
+      m_evictionTarget(0)
+{
+    if (m_cacheDir.endsWith(QLatin1Char('/'))) {
+        m_cacheDir.chop(1);
+    }
+}
+
+HttpCacheIndex::~HttpCacheIndex()
+{
+    delete m_scanIterator;
+}
+
+bool HttpCacheIndex::keyFromFileName(const QString &baseName, Key *key)
+{
+    if (baseName.length() != keySize * 2) {
+        return false;
+    }
+    const QChar *input = baseName.constData();
+    for (int i = 0; i < keySize * 2; i++) {
+        const ushort c = input[i].unicode();
+        int nibble;
+        if (c >= '0' && c <= '9') {
+            nibble = c - '0';
+        } else if (c >= 'a' && c <= 'f') {
+            nibble = c - 'a' + 10;
+        } else {
+            return false;
+        }
+        if (i & 1) {
+            key->bytes[i >> 1] |= nibble;
+        } else {
+            key->bytes[i >> 1] = nibble << 4;
+        }
+    }
+    return true;
+}
+
+QString HttpCacheIndex::indexPath() const
+{
+    return m_cacheDir + QLatin1Char('/') + QLatin1String(s_indexFileName);
+}
+
+QString HttpCacheIndex::filePath(const Key &key) const
+{
+    const QByteArray hex = QByteArray::fromRawData(reinterpret_cast<const char *>(key.bytes), keySize).toHex();
+    return m_cacheDir + QLatin1Char('/') + QString::fromLatin1(hex);
+}
+
+bool HttpCacheIndex::load()
+{
+    QFile file(indexPath());
+    if (!file.open(QIODevice::ReadOnly)) {
+        return false;
+    }
+    // one read; parsing from memory is a lot faster than from the file
+    const QByteArray data = file.readAll();
+    QDataStream stream(data);
+    stream.setVersion(QDataStream::Qt_4_5);
+
+    quint32 magic, version, entryCount;
+    qint64 lastScan;
+    stream >> magic >> version >> lastScan >> entryCount;
+    if (stream.status() != QDataStream::Ok || magic != s_indexMagic || version != s_indexVersion ||
+        data.size() != s_indexHeaderSize + qint64(entryCount) * s_indexEntrySize) {
+        return false;
+    }
+
+    m_entries.clear();
+    m_entries.reserve(entryCount);
+    m_totalSize = 0;
+    for (quint32 i = 0; i < entryCount; i++) {
+        Key key;
+        Entry entry;
+        stream.readRawData(reinterpret_cast<char *>(key.bytes), keySize);
+        stream >> entry.useCount >> entry.lastUsed >> entry.size;
+        entry.scanMark = m_scanGeneration;
+        m_entries.insert(key, entry);
+        m_totalSize += entry.size;
+    }
+    m_lastScan = lastScan;
+    m_dirty = false;
+    return true;
+}
+
+bool HttpCacheIndex::save()
+{
+    QSaveFile file(indexPath());
+    if (!file.open(QIODevice::WriteOnly)) {
+        return false;
+    }
+    QByteArray data;
+    data.reserve(s_indexHeaderSize + m_entries.count() * s_indexEntrySize);
+    {
+        QDataStream stream(&data, QIODevice::WriteOnly);
+        stream.setVersion(QDataStream::Qt_4_5);
+        stream << s_indexMagic << s_indexVersion << m_lastScan << quint32(m_entries.count());
+        QHash<Key, Entry>::ConstIterator it = m_entries.constBegin();
+        for (; it != m_entries.constEnd(); ++it) {
+            stream.writeRawData(reinterpret_cast<const char *>(it.key().bytes), keySize);
+            stream << it.value().useCount << it.value().lastUsed << it.value().size;
+        }
+    }
+    if (file.write(data) != data.size() || !file.commit()) {
+        return false;
+    }
+    m_dirty = false;
+    return true;
+}
+
+bool HttpCacheIndex::isDirty() const
+{
+    return m_dirty;
+}
+
+void HttpCacheIndex::update(const QString &baseName, qint32 useCount, qint64 lastUsed, qint64 size)
+{
+    Key key;
+    if (!keyFromFileName(baseName, &key)) {
+        return;
+    }
+    Entry &entry = m_entries[key];
+    m_totalSize += size - entry.size;
+    entry.useCount = useCount;
+    entry.lastUsed = lastUsed;
+    entry.size = size;
+    // a running scan must not forget about it
+    entry.scanMark = m_scanGeneration;
+    m_dirty = true;
+}
+
+void HttpCacheIndex::remove(const QString &baseName)
+{
+    Key key;
+    if (!keyFromFileName(baseName, &key)) {
+        return;
+    }
+    QHash<Key, Entry>::Iterator it = m_entries.find(key);
+    if (it != m_entries.end()) {
+        m_totalSize -= it->size;
+        m_entries.erase(it);
+        m_dirty = true;
+    }
+}
+
+bool HttpCacheIndex::contains(const QString &baseName) const
+{
+    Key key;
+    return keyFromFileName(baseName, &key) && m_entries.contains(key);
+}
+
+int HttpCacheIndex::count() const
+{
+    return m_entries.count();
+}
+
+qint64 HttpCacheIndex::totalSize() const
+{
+    return m_totalSize;
+}
+
+bool HttpCacheIndex::readEntry(const QString &path, Entry *entry) const
+{
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly)) {
+        return false;
+    }
+    const QByteArray header = file.read(s_binaryHeaderSize);
+    if (header.size() < s_binaryHeaderSize || !header.startsWith(s_version)) {
+        return false;
+    }
+    QDataStream stream(header);
+    stream.setVersion(QDataStream::Qt_4_5);
+    stream.skipRawData(s_useCountOffset);
+    stream >> entry->useCount;
+    entry->size = file.size();
+    entry->lastUsed = QFileInfo(file).lastModified().toMSecsSinceEpoch() / 1000;
+    return true;
+}
+
+void HttpCacheIndex::startScan()
+{
+    delete m_scanIterator;
+    m_scanIterator = new QDirIterator(m_cacheDir, QDir::Files);
+    m_scanGeneration++;
+}
+
+bool HttpCacheIndex::isScanning() const
+{
+    return m_scanIterator != nullptr;
+}
+
+qint64 HttpCacheIndex::lastScan() const
+{
+    return m_lastScan;
+}
+
+bool HttpCacheIndex::scanSlice(int msecs)
+{
+    if (!m_scanIterator) {
+        return true;
+    }
+    QElapsedTimer t;
+    t.start();
+    const qint64 now = currentSecs();
+
+    while (m_scanIterator->hasNext()) {
+        if (t.elapsed() >= msecs) {
+            return false;
+        }
+        m_scanIterator->next();
+        const QString baseName = m_scanIterator->fileName();
+        Key key;
+        if (baseName.length() > keySize * 2) {
+            if (keyFromFileName(baseName.left(keySize * 2), &key) &&
+                m_scanIterator->fileInfo().lastModified().toMSecsSinceEpoch() / 1000 < now - 15 * 60) {
+                // it looks like a temporary file that hasn't been touched in > 15 minutes...
+                QFile::remove(m_scanIterator->filePath());
+            }
+            // the temporary file might still be written to, leave it alone
+            continue;
+        }
+        if (!keyFromFileName(baseName, &key)) {
+            continue;
+        }
+
+        QHash<Key, Entry>::Iterator it = m_entries.find(key);
+        if (it != m_entries.end()) {
+            it->scanMark = m_scanGeneration;
+            continue;
+        }
+        // a file nobody told us about; only these need to be opened
+        Entry entry;
+        if (!readEntry(m_scanIterator->filePath(), &entry)) {
+            QFile::remove(m_scanIterator->filePath());
+            continue;
+        }
+        entry.scanMark = m_scanGeneration;
+        m_entries.insert(key, entry);
+        m_totalSize += entry.size;
+        m_dirty = true;
+    }
+
+    // forget about files that are gone
+    QHash<Key, Entry>::Iterator it = m_entries.begin();
+    while (it != m_entries.end()) {
+        if (it->scanMark == m_scanGeneration) {
+            ++it;
+        } else {
+            m_totalSize -= it->size;
+            it = m_entries.erase(it);
+        }
+    }
+
+    delete m_scanIterator;
+    m_scanIterator = nullptr;
+    m_lastScan = now;
+    m_dirty = true;
+    return true;
+}
+
+double HttpCacheIndex::score(const Entry &entry, qint64 now)
+{
+    const qint64 age = qMax(now - entry.lastUsed, qint64(1));
+    int sizeBucket = 1;
+    for (qint64 size = entry.size >> 12; size; size >>= 1) {
+        sizeBucket++;
+    }
+    return double(qMax(entry.useCount, 0) + 1) / (double(age) * sizeBucket);
+}
+
+bool HttpCacheIndex::candidateGreater(const Candidate &c1, const Candidate &c2)
+{
+    return c1.score > c2.score;
+}
+
+void HttpCacheIndex::startEviction(qint64 targetSize)
+{
+    const qint64 now = currentSecs();
+    m_evicting = true;
+    m_evictionTarget = targetSize;
+    m_candidates.clear();
+    m_candidates.reserve(m_entries.count());
+    QHash<Key, Entry>::ConstIterator it = m_entries.constBegin();
+    for (; it != m_entries.constEnd(); ++it) {
+        const Candidate candidate = { score(it.value(), now), it.value().lastUsed, it.key() };
+        m_candidates.append(candidate);
+    }
+    // building the heap is linear, unlike sorting all entries
+    std::make_heap(m_candidates.begin(), m_candidates.end(), candidateGreater);
+}
+
+bool HttpCacheIndex::isEvicting() const
+{
+    return m_evicting;
+}
+
+bool HttpCacheIndex::evictSlice(int msecs)
+{
+    QElapsedTimer t;
+    t.start();
+    while (m_totalSize > m_evictionTarget && !m_candidates.isEmpty()) {
+        if (t.elapsed() >= msecs) {
+            return false;
+        }
+        std::pop_heap(m_candidates.begin(), m_candidates.end(), candidateGreater);
+        const Candidate candidate = m_candidates.last();
+        m_candidates.removeLast();
+
+        QHash<Key, Entry>::Iterator it = m_entries.find(candidate.key);
+        if (it == m_entries.end() || it->lastUsed != candidate.lastUsed) {
+            // removed or used since the heap was built
+            continue;
+        }
+        const QString path = filePath(candidate.key);
+        if (QFile::remove(path) || !QFile::exists(path)) {
+            m_totalSize -= it->size;
+            m_entries.erase(it);
+            m_dirty = true;
+        }
+    }
+    m_candidates.clear();
+    m_candidates.squeeze();
+    m_evicting = false;
+    return true;
+}
+
+void HttpCacheIndex::clear()
+{
+    delete m_scanIterator;
+    m_scanIterator = nullptr;
+    m_candidates.clear();
+    m_evicting = false;
+
+    QDirIterator it(m_cacheDir, QDir::Files);
+    while (it.hasNext()) {
+        it.next();
+        Key key;
+        // also catches temporary files
+        if (keyFromFileName(it.fileName().left(keySize * 2), &key)) {
+            QFile::remove(it.filePath());
+        }
+    }
+    QFile::remove(indexPath());
+    // records of the "store" cache backend, see HttpCacheStore
+    const QString storeDir = m_cacheDir + QLatin1String("/store");
+    if (QFile::exists(storeDir)) {
+        HttpCacheStore store;
+        if (store.open(storeDir, 0)) {
+            store.clear();
+        }
+    }
+    m_entries.clear();
+    m_totalSize = 0;
+    m_lastScan = 0;
+    m_dirty = false;
+}
@@ -0,0 +1,157 @@
+/*
+   This file is part of the KDE libraries
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License version 2 as published by the Free Software Foundation.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LIB.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+*/
+
+#ifndef HTTPCACHEINDEX_H
+#define HTTPCACHEINDEX_H
+
+#include <QHash>
+#include <QString>
+#include <QVector>
+
+#include <string.h>
+
+class QDirIterator;
+
+/**
+ * Resident index of the per-URL HTTP cache files, kept by kio_http_cache_cleaner.
+ *
+ * The index lives in memory and is written to the cache directory from time to
+ * time. It is trusted when it is loaded again; the cache directory is only walked
+ * if there is no usable index or the last walk is long ago, and then in bounded
+ * slices. A walk picks up files the cleaner was not told about and forgets files
+ * that are gone.
+ *
+ * Eviction takes the entries with the lowest score() from a heap and deletes
+ * their files, also in bounded slices so that the cleaner keeps serving slaves.
+ */
+class HttpCacheIndex
+{
+public:
+    static const int keySize = 20; // binary version of the hexadecimal file name
+
+    struct Key {
+        quint8 bytes[keySize];
+        bool operator==(const Key &other) const
+        {
+            return memcmp(bytes, other.bytes, keySize) == 0;
+        }
+    };
+
+    struct Entry {
+        Entry() : useCount(0), lastUsed(0), size(0), scanMark(0) {}
+        qint32 useCount;
+        qint64 lastUsed; // seconds since the epoch
+        qint64 size;
+        quint32 scanMark; // scan that last saw the file, not persisted
+    };
+
+    explicit HttpCacheIndex(const QString &cacheDir);
+    ~HttpCacheIndex();
+
+    /**
+     * Parse a cache file name, 40 lowercase hexadecimal digits.
+     */
+    static bool keyFromFileName(const QString &baseName, Key *key);
+
+    /**
+     * Load the index written by save(). Returns false if there is no usable
+     * index; a scan is needed to fill it then.
+     */
+    bool load();
+    bool save();
+    bool isDirty() const;
+
+    void update(const QString &baseName, qint32 useCount, qint64 lastUsed, qint64 size);
+    void remove(const QString &baseName);
+    bool contains(const QString &baseName) const;
+    int count() const;
+    qint64 totalSize() const;
+
+    void startScan();
+    bool isScanning() const;
+    /**
+     * Time of the last complete scan in seconds since the epoch, zero if unknown.
+     */
+    qint64 lastScan() const;
+    /**
+     * Walk the cache directory for about @p msecs milliseconds.
+     * Returns true when the scan is complete.
+     */
+    bool scanSlice(int msecs);
+
+    /**
+     * Prepare evicting entries until the cache is below @p targetSize bytes.
+     */
+    void startEviction(qint64 targetSize);
+    bool isEvicting() const;
+    /**
+     * Delete files for about @p msecs milliseconds. Returns true when the
+     * target size is reached or nothing is left to evict.
+     */
+    bool evictSlice(int msecs);
+
+    /**
+     * Delete all cache files and the persisted index.
+     */
+    void clear();
+
+    /**
+     * Entries with lower scores are evicted first. Recently and often used
+     * entries score high and large ones low; sizes are bucketed by powers of
+     * two so that small differences in size don't matter.
+     */
+    static double score(const Entry &entry, qint64 now);
+
+private:
+    struct Candidate {
+        double score;
+        qint64 lastUsed;
+        Key key;
+    };
+    static bool candidateGreater(const Candidate &c1, const Candidate &c2);
+
+    QString indexPath() const;
+    QString filePath(const Key &key) const;
+    bool readEntry(const QString &path, Entry *entry) const;
+
+    QString m_cacheDir;
+    QHash<Key, Entry> m_entries;
+    qint64 m_totalSize;
+    qint64 m_lastScan;
+    bool m_dirty;
+
+    QDirIterator *m_scanIterator;
+    quint32 m_scanGeneration;
+
+    bool m_evicting;
+    qint64 m_evictionTarget;
+    QVector<Candidate> m_candidates; // a min-heap ordered by score
+};
+
+inline uint qHash(const HttpCacheIndex::Key &key, uint seed = 0)
+{
+    // the key is a SHA1 hash, any part of it is as good as the whole
+    uint hash;
+    memcpy(&hash, key.bytes, sizeof(hash));
+    return hash ^ seed;
+}
+
+Q_DECLARE_TYPEINFO(HttpCacheIndex::Key, Q_PRIMITIVE_TYPE);
+Q_DECLARE_TYPEINFO(HttpCacheIndex::Entry, Q_PRIMITIVE_TYPE);
+
+#endif // HTTPCACHEINDEX_H
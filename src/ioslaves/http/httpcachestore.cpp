@@ -0,0 +1,805 @@
+/*
+   This file is part of the KDE libraries
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License version 2 as published by the Free Software Foundation.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LIB.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+*/
+
+#include "httpcachestore.h"
+
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QDir>
+#include <QFile>
+
+#include <qplatformdefs.h>
+
+#include <algorithm>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifndef Q_OS_WIN
+#include <sys/file.h>
+#include <sys/mman.h>
+#endif
+
+static const char s_magic[4] = { 'K', 'H', 'C', 'S' };
+static const quint32 s_version = 1;
+static const quint32 s_staleFlag = 1;
+static const quint32 s_initialSlotCount = 4096;
+// a shard is compacted when at least this much of it, and more than half, is dead
+static const qint64 s_minCompactableDeadSize = 4 * 1024 * 1024;
+// cache hits are written to the index once this many are pending, or this many seconds after the first
+static const int s_maxPendingTouches = 64;
+static const qint64 s_maxTouchDelay = 30;
+
+// Everything below is only ever accessed in place in the mapped index file,
+// so the layout must not change without bumping s_version.
+struct HttpCacheStore::IndexHeader {
+    char magic[4];
+    quint32 version;
+    quint32 flags;      // s_staleFlag once a rebuilt index has replaced this one
+    quint32 slotCount;
+    quint32 liveCount;
+    quint32 usedCount;  // live plus deleted slots; a deleted slot still lengthens probe chains
+    qint64 totalSize;   // bytes in live records
+    quint32 shardGeneration[shardCount]; // bumped when a shard is rewritten by compaction
+    qint64 shardSize[shardCount];
+    qint64 shardDead[shardCount];
+};
+
+struct HttpCacheStore::IndexSlot {
+    enum State {
+        Empty = 0,
+        Live,
+        Deleted
+    };
+    uchar key[keySize];
+    quint8 state;
+    quint8 shard;
+    quint16 reserved;
+    quint32 useCount;
+    quint32 size;
+    qint64 offset;
+    qint64 lastUsed;
+};
+
+class HttpCacheStore::Locker
+{
+public:
+    Locker(int fd, bool exclusive)
+        : m_fd(fd)
+    {
+#ifndef Q_OS_WIN
+        while (::flock(m_fd, exclusive ? LOCK_EX : LOCK_SH) == -1 && errno == EINTR) {
+        }
+#else
+        Q_UNUSED(exclusive);
+#endif
+    }
+    ~Locker()
+    {
+#ifndef Q_OS_WIN
+        ::flock(m_fd, LOCK_UN);
+#endif
+    }
+private:
+    int m_fd;
+};
+
+static bool readAll(int fd, char *buf, qint64 size, qint64 offset)
+{
+#ifndef Q_OS_WIN
+    while (size > 0) {
+        const ssize_t n = ::pread(fd, buf, size, offset);
+        if (n <= 0) {
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        buf += n;
+        size -= n;
+        offset += n;
+    }
+    return true;
+#else
+    Q_UNUSED(fd); Q_UNUSED(buf); Q_UNUSED(size); Q_UNUSED(offset);
+    return false;
+#endif
+}
+
+static bool writeAll(int fd, const char *buf, qint64 size, qint64 offset)
+{
+#ifndef Q_OS_WIN
+    while (size > 0) {
+        const ssize_t n = ::pwrite(fd, buf, size, offset);
+        if (n <= 0) {
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        buf += n;
+        size -= n;
+        offset += n;
+    }
+    return true;
+#else
+    Q_UNUSED(fd); Q_UNUSED(buf); Q_UNUSED(size); Q_UNUSED(offset);
+    return false;
+#endif
+}
+
+qint64 HttpCacheStore::indexFileSize(quint32 slotCount)
+{
+    Q_STATIC_ASSERT(sizeof(IndexSlot) == 48);
+    return sizeof(IndexHeader) + qint64(slotCount) * sizeof(IndexSlot);
+}
+
+static qint64 now()
+{
+    return QDateTime::currentMSecsSinceEpoch() / 1000;
+}
+
+HttpCacheStore::HttpCacheStore()
+    : m_maxSize(0)
+    , m_lockFd(-1)
+    , m_indexFd(-1)
+    , m_map(nullptr)
+    , m_mapSize(0)
+    , m_firstPendingTouch(0)
+{
+    for (int i = 0; i < shardCount; i++) {
+        m_shardFds[i] = -1;
+        m_shardGenerations[i] = 0;
+    }
+}
+
+HttpCacheStore::~HttpCacheStore()
+{
+    close();
+}
+
+bool HttpCacheStore::open(const QString &directory, qint64 maxSize)
+{
+    close();
+#ifdef Q_OS_WIN
+    // needs flock(), pread() and mmap()
+    Q_UNUSED(directory);
+    Q_UNUSED(maxSize);
+    return false;
+#else
+    if (!QDir().mkpath(directory)) {
+        return false;
+    }
+    m_directory = directory;
+    m_maxSize = maxSize;
+
+    m_lockFd = QT_OPEN(QFile::encodeName(m_directory + QLatin1String("/lock")).constData(),
+                       O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (m_lockFd == -1) {
+        close();
+        return false;
+    }
+
+    Locker locker(m_lockFd, true);
+    const QByteArray indexPath = QFile::encodeName(m_directory + QLatin1String("/index"));
+    const int fd = QT_OPEN(indexPath.constData(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        close();
+        return false;
+    }
+    IndexHeader existing;
+    const bool valid = readAll(fd, reinterpret_cast<char *>(&existing), sizeof(existing), 0) &&
+                       memcmp(existing.magic, s_magic, sizeof(s_magic)) == 0 &&
+                       existing.version == s_version;
+    if (!valid) {
+        // new or incompatible store; start from scratch
+        for (int i = 0; i < shardCount; i++) {
+            QFile::remove(m_directory + QLatin1String("/data.") + QString::number(i));
+        }
+        if (!initIndex(fd, s_initialSlotCount)) {
+            QT_CLOSE(fd);
+            close();
+            return false;
+        }
+    }
+    QT_CLOSE(fd);
+
+    if (!mapIndex()) {
+        close();
+        return false;
+    }
+    return true;
+#endif
+}
+
+void HttpCacheStore::close()
+{
+    if (isOpen() && !m_pendingTouches.isEmpty()) {
+        Locker locker(m_lockFd, true);
+        if (ensureCurrentIndex()) {
+            applyTouchesLocked();
+        }
+    }
+    m_pendingTouches.clear();
+    unmapIndex();
+    for (int i = 0; i < shardCount; i++) {
+        if (m_shardFds[i] != -1) {
+            QT_CLOSE(m_shardFds[i]);
+            m_shardFds[i] = -1;
+        }
+    }
+    if (m_lockFd != -1) {
+        QT_CLOSE(m_lockFd);
+        m_lockFd = -1;
+    }
+    m_directory.clear();
+}
+
+bool HttpCacheStore::isOpen() const
+{
+    return m_map != nullptr;
+}
+
+QString HttpCacheStore::directory() const
+{
+    return m_directory;
+}
+
+QByteArray HttpCacheStore::keyForUrl(const QByteArray &storableUrl)
+{
+    return QCryptographicHash::hash(storableUrl, QCryptographicHash::Sha1);
+}
+
+bool HttpCacheStore::initIndex(int fd, quint32 slotCount)
+{
+    if (QT_FTRUNCATE(fd, 0) == -1 || QT_FTRUNCATE(fd, indexFileSize(slotCount)) == -1) {
+        return false;
+    }
+    // the file is sparse and zero-filled now, i.e. all slots are empty
+    IndexHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, s_magic, sizeof(s_magic));
+    header.version = s_version;
+    header.slotCount = slotCount;
+    return writeAll(fd, reinterpret_cast<const char *>(&header), sizeof(header), 0);
+}
+
+bool HttpCacheStore::mapIndex()
+{
+#ifndef Q_OS_WIN
+    Q_ASSERT(!m_map);
+    m_indexFd = QT_OPEN(QFile::encodeName(m_directory + QLatin1String("/index")).constData(), O_RDWR | O_CLOEXEC);
+    if (m_indexFd == -1) {
+        return false;
+    }
+    QT_STATBUF st;
+    if (QT_FSTAT(m_indexFd, &st) == -1 || st.st_size < qint64(sizeof(IndexHeader))) {
+        unmapIndex();
+        return false;
+    }
+    void *map = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, m_indexFd, 0);
+    if (map == MAP_FAILED) {
+        unmapIndex();
+        return false;
+    }
+    m_map = static_cast<uchar *>(map);
+    m_mapSize = st.st_size;
+    if (m_mapSize < indexFileSize(header()->slotCount)) {
+        unmapIndex();
+        return false;
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+void HttpCacheStore::unmapIndex()
+{
+#ifndef Q_OS_WIN
+    if (m_map) {
+        munmap(m_map, m_mapSize);
+        m_map = nullptr;
+        m_mapSize = 0;
+    }
+#endif
+    if (m_indexFd != -1) {
+        QT_CLOSE(m_indexFd);
+        m_indexFd = -1;
+    }
+}
+
+// Must be called with the lock held.
+bool HttpCacheStore::ensureCurrentIndex()
+{
+    if (!m_map) {
+        return false;
+    }
+    if (header()->flags & s_staleFlag) {
+        // another process has rebuilt the index
+        unmapIndex();
+        return mapIndex();
+    }
+    return true;
+}
+
+HttpCacheStore::IndexHeader *HttpCacheStore::header() const
+{
+    return reinterpret_cast<IndexHeader *>(m_map);
+}
+
+HttpCacheStore::IndexSlot *HttpCacheStore::slotTable() const
+{
+    return reinterpret_cast<IndexSlot *>(m_map + sizeof(IndexHeader));
+}
+
+HttpCacheStore::IndexSlot *HttpCacheStore::findSlot(IndexSlot *table, quint32 slotCount,
+                                                    const uchar *key, bool forInsert)
+{
+    // the key is a SHA1 hash, any part of it is a good hash value
+    quint32 hash;
+    memcpy(&hash, key, sizeof(hash));
+    IndexSlot *firstDeleted = nullptr;
+    for (quint32 i = 0; i < slotCount; i++) {
+        IndexSlot *slot = &table[(hash + i) % slotCount];
+        switch (slot->state) {
+        case IndexSlot::Empty:
+            if (forInsert) {
+                return firstDeleted ? firstDeleted : slot;
+            }
+            return nullptr;
+        case IndexSlot::Deleted:
+            if (!firstDeleted) {
+                firstDeleted = slot;
+            }
+            break;
+        default:
+            if (memcmp(slot->key, key, keySize) == 0) {
+                return slot;
+            }
+            break;
+        }
+    }
+    return forInsert ? firstDeleted : nullptr;
+}
+
+HttpCacheStore::IndexSlot *HttpCacheStore::findSlot(const QByteArray &key, bool forInsert) const
+{
+    Q_ASSERT(key.size() == keySize);
+    return findSlot(slotTable(), header()->slotCount, reinterpret_cast<const uchar *>(key.constData()), forInsert);
+}
+
+// Must be called with the exclusive lock held. Writes a new index with
+// @p newSlotCount slots holding only the live records, which also gets rid
+// of the deleted slots.
+bool HttpCacheStore::rebuildIndex(quint32 newSlotCount)
+{
+#ifndef Q_OS_WIN
+    const IndexHeader *oldHeader = header();
+    const QString newPath = m_directory + QLatin1String("/index.new");
+
+    const int fd = QT_OPEN(QFile::encodeName(newPath).constData(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        return false;
+    }
+    if (!initIndex(fd, newSlotCount)) {
+        QT_CLOSE(fd);
+        return false;
+    }
+    void *map = mmap(nullptr, indexFileSize(newSlotCount), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    QT_CLOSE(fd);
+    if (map == MAP_FAILED) {
+        QFile::remove(newPath);
+        return false;
+    }
+
+    IndexHeader *newHeader = static_cast<IndexHeader *>(map);
+    IndexSlot *newSlots = reinterpret_cast<IndexSlot *>(static_cast<uchar *>(map) + sizeof(IndexHeader));
+    memcpy(newHeader, oldHeader, sizeof(IndexHeader));
+    newHeader->slotCount = newSlotCount;
+    newHeader->usedCount = oldHeader->liveCount;
+
+    const IndexSlot *oldSlots = slotTable();
+    for (quint32 i = 0; i < oldHeader->slotCount; i++) {
+        if (oldSlots[i].state == IndexSlot::Live) {
+            IndexSlot *slot = findSlot(newSlots, newSlotCount, oldSlots[i].key, true);
+            *slot = oldSlots[i];
+        }
+    }
+    munmap(map, indexFileSize(newSlotCount));
+
+    if (::rename(QFile::encodeName(newPath).constData(),
+                 QFile::encodeName(m_directory + QLatin1String("/index")).constData()) == -1) {
+        QFile::remove(newPath);
+        return false;
+    }
+    // tell everybody who still has the old index mapped to pick up the new one
+    header()->flags |= s_staleFlag;
+    unmapIndex();
+    return mapIndex();
+#else
+    return false;
+#endif
+}
+
+int HttpCacheStore::shardFd(int shard)
+{
+    const quint32 generation = header()->shardGeneration[shard];
+    if (m_shardFds[shard] != -1 && m_shardGenerations[shard] != generation) {
+        // the shard has been compacted, i.e. replaced, since we opened it
+        QT_CLOSE(m_shardFds[shard]);
+        m_shardFds[shard] = -1;
+    }
+    if (m_shardFds[shard] == -1) {
+        const QString path = m_directory + QLatin1String("/data.") + QString::number(shard);
+        m_shardFds[shard] = QT_OPEN(QFile::encodeName(path).constData(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+        m_shardGenerations[shard] = generation;
+    }
+    return m_shardFds[shard];
+}
+
+QByteArray HttpCacheStore::read(const QByteArray &key, RecordInfo *info)
+{
+    if (!isOpen()) {
+        return QByteArray();
+    }
+    Locker locker(m_lockFd, false);
+    if (!ensureCurrentIndex()) {
+        return QByteArray();
+    }
+    const IndexSlot *slot = findSlot(key);
+    if (!slot) {
+        return QByteArray();
+    }
+    const int fd = shardFd(slot->shard);
+    if (fd == -1) {
+        return QByteArray();
+    }
+    QByteArray record(slot->size, Qt::Uninitialized);
+    if (!readAll(fd, record.data(), slot->size, slot->offset)) {
+        return QByteArray();
+    }
+    if (info) {
+        // include our hits that are not written yet
+        const PendingTouch touch = m_pendingTouches.value(key);
+        info->useCount = slot->useCount + touch.hits;
+        info->lastUsed = qMax(slot->lastUsed, touch.lastUsed);
+        info->size = slot->size;
+    }
+    return record;
+}
+
+bool HttpCacheStore::insert(const QByteArray &key, const QByteArray &record)
+{
+    if (!isOpen() || record.isEmpty()) {
+        return false;
+    }
+    Locker locker(m_lockFd, true);
+    if (!ensureCurrentIndex()) {
+        return false;
+    }
+    applyTouchesLocked();
+    // Keep the load factor below 3/4. Deleted slots count too, so with
+    // records coming and going the index fills up with them although the
+    // number of records stays the same; then it is rebuilt at the same size.
+    const IndexHeader *current = header();
+    if ((current->usedCount + 1) * quint64(4) > current->slotCount * quint64(3)) {
+        const bool mostlyDeleted = (current->liveCount + 1) * quint64(2) <= current->slotCount;
+        if (!rebuildIndex(mostlyDeleted ? current->slotCount : current->slotCount * 2)) {
+            return false;
+        }
+    }
+
+    IndexSlot *slot = findSlot(key, true);
+    if (!slot) {
+        return false;
+    }
+    if (slot->state == IndexSlot::Live) {
+        releaseRecord(slot);
+        slot->state = IndexSlot::Deleted;
+    }
+
+    IndexHeader *h = header();
+    const int shard = quint8(key.at(0)) % shardCount;
+    const int fd = shardFd(shard);
+    const qint64 offset = h->shardSize[shard];
+    if (fd == -1 || !writeAll(fd, record.constData(), record.size(), offset)) {
+        return false;
+    }
+
+    if (slot->state == IndexSlot::Empty) {
+        h->usedCount++;
+    }
+    memcpy(slot->key, key.constData(), keySize);
+    slot->shard = shard;
+    slot->useCount = 0;
+    slot->size = record.size();
+    slot->offset = offset;
+    slot->lastUsed = now();
+    slot->state = IndexSlot::Live;
+    h->liveCount++;
+    h->totalSize += record.size();
+    h->shardSize[shard] += record.size();
+
+    if (m_maxSize > 0 && h->totalSize > m_maxSize) {
+        // evict a bit more than needed so that we don't have to do it on every insertion
+        evictLocked(m_maxSize - m_maxSize / 10);
+    } else {
+        maybeCompactShard(shard);
+    }
+    return true;
+}
+
+bool HttpCacheStore::patch(const QByteArray &key, const QByteArray &data)
+{
+    if (!isOpen()) {
+        return false;
+    }
+    Locker locker(m_lockFd, true);
+    if (!ensureCurrentIndex()) {
+        return false;
+    }
+    const IndexSlot *slot = findSlot(key);
+    if (!slot || quint32(data.size()) > slot->size) {
+        return false;
+    }
+    const int fd = shardFd(slot->shard);
+    return fd != -1 && writeAll(fd, data.constData(), data.size(), slot->offset);
+}
+
+bool HttpCacheStore::remove(const QByteArray &key)
+{
+    if (!isOpen()) {
+        return false;
+    }
+    Locker locker(m_lockFd, true);
+    if (!ensureCurrentIndex()) {
+        return false;
+    }
+    m_pendingTouches.remove(key);
+    IndexSlot *slot = findSlot(key);
+    if (!slot) {
+        return false;
+    }
+    releaseRecord(slot);
+    slot->state = IndexSlot::Deleted;
+    maybeCompactShard(slot->shard);
+    return true;
+}
+
+bool HttpCacheStore::clear()
+{
+    if (!isOpen()) {
+        return false;
+    }
+    Locker locker(m_lockFd, true);
+    if (!ensureCurrentIndex()) {
+        return false;
+    }
+    m_pendingTouches.clear();
+    IndexSlot *s = slotTable();
+    for (quint32 i = 0; i < header()->slotCount; i++) {
+        if (s[i].state == IndexSlot::Live) {
+            releaseRecord(&s[i]);
+            s[i].state = IndexSlot::Deleted;
+        }
+    }
+    if (!rebuildIndex(s_initialSlotCount)) {
+        return false;
+    }
+    IndexHeader *h = header();
+    for (int shard = 0; shard < shardCount; shard++) {
+        QFile::resize(m_directory + QLatin1String("/data.") + QString::number(shard), 0);
+        h->shardSize[shard] = 0;
+        h->shardDead[shard] = 0;
+        h->shardGeneration[shard]++;
+    }
+    return true;
+}
+
+void HttpCacheStore::touch(const QByteArray &key, quint32 hits)
+{
+    if (!isOpen()) {
+        return;
+    }
+    // taking the exclusive lock for every hit would serialize all readers
+    const qint64 time = now();
+    if (m_pendingTouches.isEmpty()) {
+        m_firstPendingTouch = time;
+    }
+    PendingTouch &touch = m_pendingTouches[key];
+    touch.hits += hits;
+    touch.lastUsed = time;
+    if (m_pendingTouches.count() < s_maxPendingTouches && time - m_firstPendingTouch < s_maxTouchDelay) {
+        return;
+    }
+    Locker locker(m_lockFd, true);
+    if (ensureCurrentIndex()) {
+        applyTouchesLocked();
+    }
+}
+
+// Must be called with the exclusive lock held.
+void HttpCacheStore::applyTouchesLocked()
+{
+    QHash<QByteArray, PendingTouch>::ConstIterator it = m_pendingTouches.constBegin();
+    for (; it != m_pendingTouches.constEnd(); ++it) {
+        if (IndexSlot *slot = findSlot(it.key())) {
+            slot->useCount += it->hits;
+            slot->lastUsed = qMax(slot->lastUsed, it->lastUsed);
+        }
+    }
+    m_pendingTouches.clear();
+}
+
+int HttpCacheStore::evict(qint64 targetSize)
+{
+    if (!isOpen()) {
+        return 0;
+    }
+    Locker locker(m_lockFd, true);
+    if (!ensureCurrentIndex()) {
+        return 0;
+    }
+    applyTouchesLocked();
+    return evictLocked(targetSize);
+}
+
+qint64 HttpCacheStore::totalSize()
+{
+    if (!isOpen()) {
+        return 0;
+    }
+    Locker locker(m_lockFd, false);
+    return ensureCurrentIndex() ? header()->totalSize : 0;
+}
+
+int HttpCacheStore::count()
+{
+    if (!isOpen()) {
+        return 0;
+    }
+    Locker locker(m_lockFd, false);
+    return ensureCurrentIndex() ? header()->liveCount : 0;
+}
+
+QVector<QPair<QByteArray, HttpCacheStore::RecordInfo> > HttpCacheStore::records()
+{
+    QVector<QPair<QByteArray, RecordInfo> > ret;
+    if (!isOpen()) {
+        return ret;
+    }
+    Locker locker(m_lockFd, false);
+    if (!ensureCurrentIndex()) {
+        return ret;
+    }
+    ret.reserve(header()->liveCount);
+    const IndexSlot *s = slotTable();
+    for (quint32 i = 0; i < header()->slotCount; i++) {
+        if (s[i].state == IndexSlot::Live) {
+            RecordInfo info;
+            info.useCount = s[i].useCount;
+            info.lastUsed = s[i].lastUsed;
+            info.size = s[i].size;
+            ret.append(qMakePair(QByteArray(reinterpret_cast<const char *>(s[i].key), keySize), info));
+        }
+    }
+    return ret;
+}
+
+void HttpCacheStore::releaseRecord(IndexSlot *slot)
+{
+    Q_ASSERT(slot->state == IndexSlot::Live);
+    IndexHeader *h = header();
+    h->liveCount--;
+    h->totalSize -= slot->size;
+    h->shardDead[slot->shard] += slot->size;
+}
+
+// Must be called with the exclusive lock held.
+int HttpCacheStore::evictLocked(qint64 targetSize)
+{
+    IndexHeader *h = header();
+    IndexSlot *s = slotTable();
+
+    QVector<QPair<qint64, quint32> > byAge;
+    byAge.reserve(h->liveCount);
+    for (quint32 i = 0; i < h->slotCount; i++) {
+        if (s[i].state == IndexSlot::Live) {
+            byAge.append(qMakePair(s[i].lastUsed, i));
+        }
+    }
+    std::sort(byAge.begin(), byAge.end());
+
+    int evicted = 0;
+    for (int i = 0; i < byAge.count() && h->totalSize > targetSize; i++) {
+        IndexSlot *slot = &s[byAge.at(i).second];
+        releaseRecord(slot);
+        slot->state = IndexSlot::Deleted;
+        evicted++;
+    }
+    for (int shard = 0; shard < shardCount; shard++) {
+        maybeCompactShard(shard);
+    }
+    return evicted;
+}
+
+void HttpCacheStore::maybeCompactShard(int shard)
+{
+    const IndexHeader *h = header();
+    if (h->shardDead[shard] >= s_minCompactableDeadSize && h->shardDead[shard] * 2 > h->shardSize[shard]) {
+        compactShard(shard);
+    }
+}
+
+// Must be called with the exclusive lock held. Copies the live records of a
+// shard into a new file and makes that the shard.
+bool HttpCacheStore::compactShard(int shard)
+{
+    IndexHeader *h = header();
+    IndexSlot *s = slotTable();
+    const int oldFd = shardFd(shard);
+    if (oldFd == -1) {
+        return false;
+    }
+
+    const QString path = m_directory + QLatin1String("/data.") + QString::number(shard);
+    const QString newPath = path + QLatin1String(".new");
+    const int newFd = QT_OPEN(QFile::encodeName(newPath).constData(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (newFd == -1) {
+        return false;
+    }
+
+    // copy in file order to keep the reads sequential
+    QVector<QPair<qint64, quint32> > byOffset;
+    for (quint32 i = 0; i < h->slotCount; i++) {
+        if (s[i].state == IndexSlot::Live && s[i].shard == shard) {
+            byOffset.append(qMakePair(s[i].offset, i));
+        }
+    }
+    std::sort(byOffset.begin(), byOffset.end());
+
+    QVector<qint64> newOffsets(byOffset.count());
+    qint64 newSize = 0;
+    QByteArray buffer;
+    for (int i = 0; i < byOffset.count(); i++) {
+        const IndexSlot &slot = s[byOffset.at(i).second];
+        buffer.resize(slot.size);
+        if (!readAll(oldFd, buffer.data(), slot.size, slot.offset) ||
+                !writeAll(newFd, buffer.constData(), slot.size, newSize)) {
+            QT_CLOSE(newFd);
+            QFile::remove(newPath);
+            return false;
+        }
+        newOffsets[i] = newSize;
+        newSize += slot.size;
+    }
+    QT_CLOSE(newFd);
+
+    if (::rename(QFile::encodeName(newPath).constData(), QFile::encodeName(path).constData()) == -1) {
+        QFile::remove(newPath);
+        return false;
+    }
+    for (int i = 0; i < byOffset.count(); i++) {
+        s[byOffset.at(i).second].offset = newOffsets.at(i);
+    }
+    h->shardSize[shard] = newSize;
+    h->shardDead[shard] = 0;
+    h->shardGeneration[shard]++;
+    return true;
+}
@@ -0,0 +1,151 @@
+/*
+   This file is part of the KDE libraries
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License version 2 as published by the Free Software Foundation.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LIB.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+*/
+
+#ifndef HTTPCACHESTORE_H
+#define HTTPCACHESTORE_H
+
+#include <QByteArray>
+#include <QHash>
+#include <QPair>
+#include <QString>
+#include <QVector>
+
+/**
+ * Single-directory HTTP cache storage shared by all kio_http slaves.
+ *
+ * Instead of one file per URL, cache entries ("records") are appended to a
+ * small, fixed number of shard files and located through a memory-mapped
+ * open addressing hash table (the index). A record has exactly the layout of
+ * a classic per-URL cache file: binary header, text header, payload.
+ *
+ * Layout of the store directory:
+ *   lock     - advisory lock, taken shared for lookups and exclusive for changes
+ *   index    - IndexHeader followed by IndexHeader::slotCount IndexSlots
+ *   data.N   - append-only shard files, N < shardCount
+ *
+ * The index also keeps the use count, last use time and total size of the
+ * records so that eviction can be done without looking at the data files.
+ * Space of replaced or removed records is reclaimed by compacting a shard
+ * once most of it is dead.
+ */
+class HttpCacheStore
+{
+public:
+    static const int keySize = 20; // SHA1 of the storable URL
+    static const int shardCount = 16;
+
+    struct RecordInfo {
+        RecordInfo() : useCount(0), lastUsed(0), size(0) {}
+        quint32 useCount;
+        qint64 lastUsed; // seconds since the epoch
+        quint32 size;
+    };
+
+    HttpCacheStore();
+    ~HttpCacheStore();
+
+    /**
+     * Open or create the store in @p directory. @p maxSize is the size in
+     * bytes the records may use before the least recently used ones are evicted.
+     */
+    bool open(const QString &directory, qint64 maxSize);
+    void close();
+    bool isOpen() const;
+    QString directory() const;
+
+    static QByteArray keyForUrl(const QByteArray &storableUrl);
+
+    /**
+     * Read the complete record for @p key with one index probe and one pread.
+     * Returns an empty array if there is no such record.
+     */
+    QByteArray read(const QByteArray &key, RecordInfo *info = nullptr);
+    /**
+     * Store @p record for @p key, replacing any previous record.
+     */
+    bool insert(const QByteArray &key, const QByteArray &record);
+    /**
+     * Overwrite the first @p data.size() bytes of the existing record in place.
+     * The record must not grow.
+     */
+    bool patch(const QByteArray &key, const QByteArray &data);
+    bool remove(const QByteArray &key);
+    /**
+     * Remove all records. Other processes using the store notice it like a
+     * rebuilt index or compacted shards.
+     */
+    bool clear();
+    /**
+     * Note a cache hit: bump the use count by @p hits and refresh the last use time.
+     * Hits are collected and written to the index in batches.
+     */
+    void touch(const QByteArray &key, quint32 hits = 1);
+
+    /**
+     * Evict least recently used records until the store is below @p targetSize bytes.
+     * Returns the number of records evicted.
+     */
+    int evict(qint64 targetSize);
+
+    qint64 totalSize();
+    int count();
+    /**
+     * Snapshot of all live records, for the benefit of cache cleaning tools.
+     */
+    QVector<QPair<QByteArray, RecordInfo> > records();
+
+private:
+    struct IndexHeader;
+    struct IndexSlot;
+    class Locker;
+    struct PendingTouch {
+        PendingTouch() : hits(0), lastUsed(0) {}
+        quint32 hits;
+        qint64 lastUsed;
+    };
+
+    static qint64 indexFileSize(quint32 slotCount);
+    bool initIndex(int fd, quint32 slotCount);
+    bool mapIndex();
+    void unmapIndex();
+    bool ensureCurrentIndex();
+    IndexHeader *header() const;
+    IndexSlot *slotTable() const;
+    static IndexSlot *findSlot(IndexSlot *table, quint32 slotCount, const uchar *key, bool forInsert);
+    IndexSlot *findSlot(const QByteArray &key, bool forInsert = false) const;
+    bool rebuildIndex(quint32 newSlotCount);
+    void applyTouchesLocked();
+    int shardFd(int shard);
+    void releaseRecord(IndexSlot *slot);
+    void maybeCompactShard(int shard);
+    bool compactShard(int shard);
+    int evictLocked(qint64 targetSize);
+
+    QString m_directory;
+    qint64 m_maxSize;
+    int m_lockFd;
+    int m_indexFd;
+    uchar *m_map;
+    qint64 m_mapSize;
+    int m_shardFds[shardCount];
+    quint32 m_shardGenerations[shardCount];
+    QHash<QByteArray, PendingTouch> m_pendingTouches;
+    qint64 m_firstPendingTouch;
+};
+
+#endif // HTTPCACHESTORE_H
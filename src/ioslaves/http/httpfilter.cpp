@@ -26,8 +26,19 @@
 
 #include <stdio.h>
 
+#if HAVE_BROTLI
+#include <brotli/decode.h>
+#endif
+#if HAVE_ZSTD
+#include <zstd.h>
+#endif
+
 Q_LOGGING_CATEGORY(KIO_HTTP_FILTER, "kf5.kio.kio_http.filter")
 
+// Decoders emit at most this much at once, from an array that is reused
+// as long as the receivers don't keep it.
+static const int s_outBufferSize = 64 * 1024;
+
 /*
 Testcases:
  - http://david.fullrecall.com/browser-http-compression-test?compression=deflate-http (bug 160289)
@@ -173,16 +184,18 @@ HTTPFilterGZip::slotInput(const QByteArray &d)
     m_gzipFilter->setInBuffer(d.constData(), d.size());
 
     while (!m_gzipFilter->inBufferEmpty() && !m_finished) {
-        char buf[8192];
-        m_gzipFilter->setOutBuffer(buf, sizeof(buf));
+        // no allocation unless a receiver held on to the previous output
+        m_outBuffer.resize(s_outBufferSize);
+        m_gzipFilter->setOutBuffer(m_outBuffer.data(), m_outBuffer.size());
         KFilterBase::Result result = m_gzipFilter->uncompress();
         //qDebug() << "uncompress returned" << result;
         switch (result) {
         case KFilterBase::Ok:
         case KFilterBase::End: {
-            const int bytesOut = sizeof(buf) - m_gzipFilter->outBufferAvailable();
+            const int bytesOut = m_outBuffer.size() - m_gzipFilter->outBufferAvailable();
             if (bytesOut) {
-                emit output(QByteArray(buf, bytesOut));
+                m_outBuffer.resize(bytesOut);
+                emit output(m_outBuffer);
             }
             if (result == KFilterBase::End) {
                 //qDebug() << "done, bHasFinished=true";
@@ -205,4 +218,142 @@ HTTPFilterDeflate::HTTPFilterDeflate()
 {
 }
 
+#if HAVE_BROTLI
+HTTPFilterBrotli::HTTPFilterBrotli()
+    : m_finished(false),
+      m_decoder(BrotliDecoderCreateInstance(nullptr, nullptr, nullptr))
+{
+}
+
+HTTPFilterBrotli::~HTTPFilterBrotli()
+{
+    BrotliDecoderDestroyInstance(m_decoder);
+}
+
+void
+HTTPFilterBrotli::slotInput(const QByteArray &d)
+{
+    if (d.isEmpty() || m_finished) {
+        return;
+    }
+
+    size_t availableIn = d.size();
+    const uint8_t *nextIn = reinterpret_cast<const uint8_t *>(d.constData());
+    while (true) {
+        m_outBuffer.resize(s_outBufferSize);
+        size_t availableOut = m_outBuffer.size();
+        uint8_t *nextOut = reinterpret_cast<uint8_t *>(m_outBuffer.data());
+        const BrotliDecoderResult result =
+            BrotliDecoderDecompressStream(m_decoder, &availableIn, &nextIn, &availableOut, &nextOut, nullptr);
+        if (result == BROTLI_DECODER_RESULT_ERROR) {
+            qCDebug(KIO_HTTP_FILTER) << "Error from brotli:"
+                                     << BrotliDecoderErrorString(BrotliDecoderGetErrorCode(m_decoder));
+            emit error(i18n("Receiving corrupt data."));
+            m_finished = true;
+            return;
+        }
+        const int bytesOut = m_outBuffer.size() - availableOut;
+        if (bytesOut) {
+            m_outBuffer.resize(bytesOut);
+            emit output(m_outBuffer);
+        }
+        if (result == BROTLI_DECODER_RESULT_SUCCESS) {
+            emit output(QByteArray());
+            m_finished = true;
+            return;
+        }
+        if (result == BROTLI_DECODER_RESULT_NEEDS_MORE_INPUT) {
+            return;
+        }
+        // BROTLI_DECODER_RESULT_NEEDS_MORE_OUTPUT: go on with an empty buffer
+    }
+}
+#endif
+
+#if HAVE_ZSTD
+HTTPFilterZstd::HTTPFilterZstd()
+    : m_finished(false),
+      m_frameComplete(false),
+      m_stream(ZSTD_createDStream())
+{
+    ZSTD_initDStream(m_stream);
+}
+
+HTTPFilterZstd::~HTTPFilterZstd()
+{
+    ZSTD_freeDStream(m_stream);
+}
+
+void
+HTTPFilterZstd::slotInput(const QByteArray &d)
+{
+    if (m_finished) {
+        return;
+    }
+    if (d.isEmpty()) {
+        // The body may consist of several frames, so it only ends when the
+        // chain is flushed. A truncated frame gets no end marker, like gzip.
+        if (m_frameComplete) {
+            emit output(QByteArray());
+        }
+        m_finished = true;
+        return;
+    }
+
+    ZSTD_inBuffer in = { d.constData(), size_t(d.size()), 0 };
+    while (true) {
+        m_outBuffer.resize(s_outBufferSize);
+        ZSTD_outBuffer out = { m_outBuffer.data(), size_t(m_outBuffer.size()), 0 };
+        const size_t ret = ZSTD_decompressStream(m_stream, &out, &in);
+        if (ZSTD_isError(ret)) {
+            qCDebug(KIO_HTTP_FILTER) << "Error from zstd:" << ZSTD_getErrorName(ret);
+            emit error(i18n("Receiving corrupt data."));
+            m_finished = true;
+            return;
+        }
+        if (out.pos) {
+            m_outBuffer.resize(out.pos);
+            emit output(m_outBuffer);
+        }
+        // after the end of a frame the stream goes on with the next one
+        m_frameComplete = ret == 0;
+        if (in.pos == in.size && out.pos < out.size) {
+            return;
+        }
+    }
+}
+#endif
+
+HTTPFilterBase *createHTTPDecodingFilter(const QString &encoding)
+{
+    if (encoding == QLatin1String("gzip")) {
+        return new HTTPFilterGZip;
+    } else if (encoding == QLatin1String("deflate")) {
+        return new HTTPFilterDeflate;
+#if HAVE_BROTLI
+    } else if (encoding == QLatin1String("br")) {
+        return new HTTPFilterBrotli;
+#endif
+#if HAVE_ZSTD
+    } else if (encoding == QLatin1String("zstd")) {
+        return new HTTPFilterZstd;
+#endif
+    }
+    return nullptr;
+}
+
+QString httpAcceptedEncodings(bool encrypted)
+{
+    QString encodings = QStringLiteral("gzip, deflate, x-gzip, x-deflate");
+    if (encrypted) {
+#if HAVE_BROTLI
+        encodings += QLatin1String(", br");
+#endif
+#if HAVE_ZSTD
+        encodings += QLatin1String(", zstd");
+#endif
+    }
+    return encodings;
+}
+
 #include "moc_httpfilter.cpp"
@@ -21,6 +21,8 @@
 #ifndef _HTTPFILTER_H_
 #define _HTTPFILTER_H_
 
+#include <config-kioslave-http.h>
+
 class KFilterBase;
 #include <QBuffer>
 
@@ -43,6 +45,10 @@ public Q_SLOTS:
     virtual void slotInput(const QByteArray &d) = 0;
 
 Q_SIGNALS:
+    /**
+     * Decoding filters reuse the array they emit for the next chunk of output.
+     * Receivers that keep the data keep a copy, thanks to implicit sharing.
+     */
     void output(const QByteArray &d);
     void error(const QString &);
 
@@ -95,6 +101,7 @@ private:
     bool m_firstData;
     bool m_finished;
     KFilterBase *m_gzipFilter;
+    QByteArray m_outBuffer;
 };
 
 class HTTPFilterDeflate : public HTTPFilterGZip
@@ -104,4 +111,58 @@ public:
     HTTPFilterDeflate();
 };
 
+#if HAVE_BROTLI
+struct BrotliDecoderStateStruct;
+
+// no Q_OBJECT, moc must not depend on the build configuration
+class HTTPFilterBrotli : public HTTPFilterBase
+{
+public:
+    HTTPFilterBrotli();
+    ~HTTPFilterBrotli();
+
+public Q_SLOTS:
+    void slotInput(const QByteArray &d) override;
+
+private:
+    bool m_finished;
+    BrotliDecoderStateStruct *m_decoder;
+    QByteArray m_outBuffer;
+};
+#endif
+
+#if HAVE_ZSTD
+struct ZSTD_DCtx_s;
+
+// no Q_OBJECT either, see HTTPFilterBrotli
+class HTTPFilterZstd : public HTTPFilterBase
+{
+public:
+    HTTPFilterZstd();
+    ~HTTPFilterZstd();
+
+public Q_SLOTS:
+    void slotInput(const QByteArray &d) override;
+
+private:
+    bool m_finished;
+    bool m_frameComplete;
+    ZSTD_DCtx_s *m_stream;
+    QByteArray m_outBuffer;
+};
+#endif
+
+/**
+ * Create the decoding filter for the content or transfer coding @p encoding
+ * as normalized by HTTPProtocol::addEncoding(), or nullptr if it is not supported.
+ */
+HTTPFilterBase *createHTTPDecodingFilter(const QString &encoding);
+
+/**
+ * The codings we can decode, for the Accept-Encoding request header.
+ * Brotli and zstd are only announced on encrypted connections, where
+ * intermediaries can't mangle them.
+ */
+QString httpAcceptedEncodings(bool encrypted);
+
 #endif
@@ -42,13 +42,18 @@
 #include <QDebug>
 
 #include <QString>
+#include <QDataStream>
+#include <QtEndian>
 #include <QFile>
+#include <QFileInfo>
 #include <QDir>
 #include <QRegExp>
 #include <QTextStream>
 #include <QLocale>
 #include <QUrl>
 
+#include <algorithm>
+
 Q_LOGGING_CATEGORY(KIO_COOKIEJAR, "kf5.kio.cookiejar")
 
 // BR87227
@@ -60,7 +65,9 @@ Q_LOGGING_CATEGORY(KIO_COOKIEJAR, "kf5.kio.cookiejar")
 #undef MAX_COOKIE_LIMIT
 
 #define MAX_COOKIES_PER_HOST 25
+#define MAX_CACHED_DOMAIN_LISTS 4096
 #define READ_BUFFER_SIZE 8192
+#define MIN_JOURNAL_COMPACTION_SIZE (256 * 1024)
 #define IP_ADDRESS_EXPRESSION "(?:(?:25[0-5]|2[0-4][0-9]|[01]?[0-9][0-9]?)\\.){3}(?:25[0-5]|2[0-4][0-9]|[01]?[0-9][0-9]?)"
 
 // Note with respect to QLatin1String( )....
@@ -69,6 +76,16 @@ Q_LOGGING_CATEGORY(KIO_COOKIEJAR, "kf5.kio.cookiejar")
 #define QL1S(x)   QLatin1String(x)
 #define QL1C(x)   QLatin1Char(x)
 
+// Snapshot and journal of the persistent cookies, see openCookieJournal()
+static const quint32 s_snapshotMagic = 0x4b434a53; // "KCJS"
+static const quint32 s_snapshotVersion = 1;
+
+enum JournalOp {
+    JournalAddCookie = 1,
+    JournalRemoveCookie,
+    JournalRemoveDomain
+};
+
 static QString removeWeekday(const QString &value)
 {
     const int index = value.indexOf(QL1C(' '));
@@ -197,7 +214,9 @@ KHttpCookie::KHttpCookie(const QString &_host,
     mCrossDomain(false),
     mHttpOnly(_httpOnly),
     mExplicitPath(_explicitPath),
-    mUserSelectedAdvice(KCookieDunno)
+    mUserSelectedAdvice(KCookieDunno),
+    mHostAdvice(KCookieDunno),
+    mHostAdviceGeneration(0)
 {
 }
 
@@ -309,6 +328,8 @@ KCookieJar::KCookieJar()
     m_globalAdvice = KCookieDunno;
     m_configChanged = false;
     m_cookiesChanged = false;
+    m_adviceGeneration = 1;
+    m_snapshotSize = -1;
 
     KConfig cfg(QStringLiteral("kf5/kcookiejar/domain_info"), KConfig::NoGlobals, QStandardPaths::GenericDataLocation);
     KConfigGroup group(&cfg, QString());
@@ -328,7 +349,7 @@ KCookieJar::~KCookieJar()
 }
 
 // cookiePtr is modified: the window ids of the existing cookie in the list are added to it
-static void removeDuplicateFromList(KHttpCookieList *list, KHttpCookie &cookiePtr, bool nameMatchOnly = false, bool updateWindowId = false)
+static bool removeDuplicateFromList(KHttpCookieList *list, KHttpCookie &cookiePtr, bool nameMatchOnly = false, bool updateWindowId = false)
 {
     QString domain1 = cookiePtr.domain();
     if (domain1.isEmpty()) {
@@ -353,9 +374,10 @@ static void removeDuplicateFromList(KHttpCookieList *list, KHttpCookie &cookiePt
                 }
             }
             cookieIterator.remove();
-            break;
+            return true;
         }
     }
+    return false;
 }
 
 //
@@ -363,7 +385,8 @@ static void removeDuplicateFromList(KHttpCookieList *list, KHttpCookie &cookiePt
 // Returned is a string containing all appropriate cookies in a format
 // which can be added to a HTTP-header without any additional processing.
 //
-QString KCookieJar::findCookies(const QString &_url, bool useDOMFormat, WId windowId, KHttpCookieList *pendingCookies)
+QString KCookieJar::findCookies(const QString &_url, bool useDOMFormat, WId windowId, KHttpCookieList *pendingCookies,
+                                qint64 *nextExpiry)
 {
     QString cookieStr, fqdn, path;
     QStringList domains;
@@ -373,6 +396,9 @@ QString KCookieJar::findCookies(const QString &_url, bool useDOMFormat, WId wind
         return cookieStr;
     }
 
+    eatExpiredCookies();
+    const qint64 currentDate = epoch();
+
     const bool secureRequest = (_url.startsWith(QL1S("https://"), Qt::CaseInsensitive) ||
                                 _url.startsWith(QL1S("webdavs://"), Qt::CaseInsensitive));
     if (port == -1) {
@@ -422,7 +448,7 @@ QString KCookieJar::findCookies(const QString &_url, bool useDOMFormat, WId wind
             }
 
             // Do not send expired cookies.
-            if (cookie.isExpired()) {
+            if (cookie.isExpired(currentDate)) {
                 // NOTE: there is no need to delete the cookie here because the
                 // cookieserver will invoke its saveCookieJar function as a result
                 // of the state change below. This will then result in the cookie
@@ -448,10 +474,17 @@ QString KCookieJar::findCookies(const QString &_url, bool useDOMFormat, WId wind
     }
 
     int protVersion = 0;
+    qint64 expiry = 0;
     Q_FOREACH (const KHttpCookie &cookie, allCookies) {
         if (cookie.protocolVersion() > protVersion) {
             protVersion = cookie.protocolVersion();
         }
+        if (cookie.expireDate() != 0 && (expiry == 0 || cookie.expireDate() < expiry)) {
+            expiry = cookie.expireDate();
+        }
+    }
+    if (nextExpiry) {
+        *nextExpiry = expiry;
     }
 
     if (!allCookies.isEmpty()) {
@@ -615,9 +648,26 @@ bool KCookieJar::parseUrl(const QString &_url, QString &_fqdn, QString &_path, i
     return true;
 }
 
-// not static because it uses m_twoLevelTLD
 void KCookieJar::extractDomains(const QString &_fqdn,
                                 QStringList &_domains) const
+{
+    // This is needed for every cookie that is added or looked up, and
+    // the result never changes; remember it.
+    QHash<QString, QStringList>::ConstIterator it = m_domainCache.constFind(_fqdn);
+    if (it == m_domainCache.constEnd()) {
+        if (m_domainCache.count() >= MAX_CACHED_DOMAIN_LISTS) {
+            m_domainCache.clear();
+        }
+        QStringList domains;
+        computeDomains(_fqdn, domains);
+        it = m_domainCache.insert(_fqdn, domains);
+    }
+    _domains += it.value();
+}
+
+// not static because it uses m_twoLevelTLD
+void KCookieJar::computeDomains(const QString &_fqdn,
+                                QStringList &_domains) const
 {
     if (_fqdn.isEmpty()) {
         _domains.append(QStringLiteral("localhost"));
@@ -922,6 +972,12 @@ static bool compareCookies(const KHttpCookie &item1, const KHttpCookie &item2)
     return item1.path().length() > item2.path().length();
 }
 
+// The soonest expiring cookie goes to the top of the expiry queue
+bool KCookieJar::expiresLater(const ExpiringCookie &item1, const ExpiringCookie &item2)
+{
+    return item1.expireDate > item2.expireDate;
+}
+
 #ifdef MAX_COOKIE_LIMIT
 static void makeRoom(KHttpCookieList *cookieList, KHttpCookiePtr &cookiePtr)
 {
@@ -961,21 +1017,7 @@ void KCookieJar::addCookie(KHttpCookie &cookie)
         }
     }
 
-    QStringListIterator it(domains);
-    while (it.hasNext()) {
-        const QString &key = it.next();
-        KHttpCookieList *list;
-
-        if (key.isNull()) {
-            list = m_cookieDomains.value(QL1S(""));
-        } else {
-            list = m_cookieDomains.value(key);
-        }
-
-        if (list) {
-            removeDuplicateFromList(list, cookie, false, true);
-        }
-    }
+    const bool replaced = removeDuplicates(cookie, domains);
 
     const QString domain = stripDomain(cookie);
     KHttpCookieList *cookieList;
@@ -1008,15 +1050,106 @@ void KCookieJar::addCookie(KHttpCookie &cookie)
             makeRoom(cookieList, cookie);    // Delete a cookie
         }
 #endif
-        cookieList->push_back(cookie);
-        // Use a stable sort so that unit tests are reliable.
-        // In practice it doesn't matter though.
-        qStableSort(cookieList->begin(), cookieList->end(), compareCookies);
+        // The list is kept sorted, so inserting behind all cookies with at
+        // least as long a path is the same as a stable sort after appending.
+        // This keeps unit tests reliable; in practice it doesn't matter though.
+        cookieList->insert(std::upper_bound(cookieList->begin(), cookieList->end(), cookie, compareCookies), cookie);
+
+        if (cookie.expireDate() != 0) {
+            const ExpiringCookie expiring = { cookie.expireDate(), domain,
+                                              cookie.host(), cookie.domain(), cookie.path(), cookie.name()
+                                            };
+            m_expiryQueue.append(expiring);
+            std::push_heap(m_expiryQueue.begin(), m_expiryQueue.end(), expiresLater);
+        }
 
         m_cookiesChanged = true;
+        if (cookieIsPersistent(cookie)) {
+            recordCookie(JournalAddCookie, cookie);
+            return;
+        }
+    }
+    if (replaced) {
+        // The cookie may have replaced one that is on disk
+        recordCookie(JournalRemoveCookie, cookie);
+    }
+}
+
+//
+// Remove the cookies that @p cookie replaces from the lists of @p domains,
+// the domains of its host; returns whether there were any. The window ids
+// of the removed cookies are added to @p cookie.
+//
+bool KCookieJar::removeDuplicates(KHttpCookie &cookie, const QStringList &domains)
+{
+    bool removed = false;
+    QStringListIterator it(domains);
+    while (it.hasNext()) {
+        const QString &key = it.next();
+        KHttpCookieList *list;
+
+        if (key.isNull()) {
+            list = m_cookieDomains.value(QL1S(""));
+        } else {
+            list = m_cookieDomains.value(key);
+        }
+
+        if (list && removeDuplicateFromList(list, cookie, false, true)) {
+            removed = true;
+        }
+    }
+    return removed;
+}
+
+//
+// Eat the cookies at the top of the expiry queue.
+//
+void KCookieJar::eatExpiredCookies()
+{
+    const qint64 currentDate = epoch();
+    while (!m_expiryQueue.isEmpty() && m_expiryQueue.first().expireDate < currentDate) {
+        std::pop_heap(m_expiryQueue.begin(), m_expiryQueue.end(), expiresLater);
+        const ExpiringCookie expiring = m_expiryQueue.last();
+        m_expiryQueue.removeLast();
+
+        // The cookie may have been eaten or replaced meanwhile
+        KHttpCookieList *cookieList = m_cookieDomains.value(expiring.listDomain);
+        if (!cookieList) {
+            continue;
+        }
+        for (KHttpCookieList::iterator it = cookieList->begin(), itEnd = cookieList->end(); it != itEnd; ++it) {
+            if (it->expireDate() == expiring.expireDate && it->name() == expiring.name &&
+                    it->path() == expiring.path && it->domain() == expiring.domain && it->host() == expiring.host) {
+                eatCookie(it); // This might delete cookieList!
+                m_cookiesChanged = true;
+                break;
+            }
+        }
     }
 }
 
+//
+// Start over with the cookies currently in the jar, dropping entries
+// of cookies that are gone.
+//
+void KCookieJar::rebuildExpiryQueue()
+{
+    m_expiryQueue.clear();
+    QHash<QString, KHttpCookieList *>::ConstIterator it = m_cookieDomains.constBegin();
+    for (; it != m_cookieDomains.constEnd(); ++it) {
+        Q_FOREACH (const KHttpCookie &cookie, *it.value()) {
+            if (cookie.expireDate() != 0) {
+                const ExpiringCookie expiring = { cookie.expireDate(), it.key(),
+                                                  cookie.host(), cookie.domain(), cookie.path(), cookie.name()
+                                                };
+                m_expiryQueue.append(expiring);
+            }
+        }
+    }
+    // building the heap is linear, unlike pushing the entries one by one
+    std::make_heap(m_expiryQueue.begin(), m_expiryQueue.end(), expiresLater);
+}
+
 //
 // This function advices whether a single KHttpCookie object should
 // be added to the cookie jar.
@@ -1035,14 +1168,29 @@ KCookieAdvice KCookieJar::cookieAdvice(const KHttpCookie &cookie) const
         return KCookieAccept;
     }
 
+    // This is asked for every cookie sent back to a server, so the
+    // cookie remembers the advice for its host until the policy changes.
+    if (cookie.mHostAdviceGeneration != m_adviceGeneration) {
+        cookie.mHostAdvice = hostAdvice(cookie.host());
+        cookie.mHostAdviceGeneration = m_adviceGeneration;
+    }
+    return cookie.mHostAdvice;
+}
+
+//
+// The advice for cookies from _fqdn, going from the most specific
+// domain to the global advice.
+//
+KCookieAdvice KCookieJar::hostAdvice(const QString &_fqdn) const
+{
     QStringList domains;
-    extractDomains(cookie.host(), domains);
+    extractDomains(_fqdn, domains);
 
     KCookieAdvice advice = KCookieDunno;
     QStringListIterator it(domains);
     while (advice == KCookieDunno && it.hasNext()) {
         const QString &domain = it.next();
-        if (domain.startsWith(QL1C('.')) || cookie.host() == domain) {
+        if (domain.startsWith(QL1C('.')) || _fqdn == domain) {
             KHttpCookieList *cookieList = m_cookieDomains.value(domain);
             if (cookieList) {
                 advice = cookieList->getAdvice();
@@ -1101,6 +1249,7 @@ KCookieAdvice KCookieJar::getDomainAdvice(const QString &_domain) const
 //
 void KCookieJar::setDomainAdvice(const QString &_domain, KCookieAdvice _advice)
 {
+    m_adviceGeneration++;
     QString domain(_domain);
     KHttpCookieList *cookieList = m_cookieDomains.value(domain);
 
@@ -1149,6 +1298,7 @@ void KCookieJar::setGlobalAdvice(KCookieAdvice _advice)
 {
     if (m_globalAdvice != _advice) {
         m_configChanged = true;
+        m_adviceGeneration++;
     }
     m_globalAdvice = _advice;
 }
@@ -1189,6 +1339,9 @@ void KCookieJar::eatCookie(KHttpCookieList::iterator cookieIterator)
     KHttpCookieList *cookieList = m_cookieDomains.value(domain);
 
     if (cookieList) {
+        if (cookie.expireDate() != 0 && !cookie.isExpired()) {
+            recordCookie(JournalRemoveCookie, cookie);
+        }
         // This deletes cookie!
         cookieList->erase(cookieIterator);
 
@@ -1209,6 +1362,7 @@ void KCookieJar::eatCookiesForDomain(const QString &domain)
     }
 
     cookieList->clear();
+    recordDomainRemoval(domain);
     if (cookieList->getAdvice() == KCookieDunno) {
         // This deletes cookieList!
         delete m_cookieDomains.take(domain);
@@ -1233,6 +1387,7 @@ void KCookieJar::eatAllCookies()
     Q_FOREACH (const QString &domain, m_domainList) {
         eatCookiesForDomain(domain);    // This might remove domain from m_domainList!
     }
+    m_expiryQueue.clear();
 }
 
 void KCookieJar::eatSessionCookies(const QString &fqdn, WId windowId,
@@ -1270,6 +1425,10 @@ void KCookieJar::eatSessionCookies(const QString &fqdn, WId windowId,
             if (!ids.removeAll(windowId) || !ids.isEmpty()) {
                 continue;
             }
+            if (cookie.expireDate() != 0) {
+                // It was persistent under a previous policy
+                recordCookie(JournalRemoveCookie, cookie);
+            }
             cookieIterator.remove();
         }
     }
@@ -1357,6 +1516,10 @@ bool KCookieJar::saveCookies(const QString &_filename)
         }
     }
 
+    // Expired cookies are gone now, and so should be queue entries of
+    // cookies that were replaced or eaten since the last save.
+    rebuildExpiryQueue();
+
     if (cookieFile.commit()) {
         QFile::setPermissions(_filename, QFile::ReadUser | QFile::WriteUser);
         return true;
@@ -1525,6 +1688,368 @@ bool KCookieJar::loadCookies(const QString &_filename)
     return success;
 }
 
+static void writeCookie(QDataStream &stream, const KHttpCookie &cookie)
+{
+    stream << cookie.host() << cookie.domain() << cookie.path() << cookie.name() << cookie.value()
+           << cookie.expireDate() << qint32(cookie.protocolVersion())
+           << quint8((cookie.isSecure() ? 1 : 0) + (cookie.isHttpOnly() ? 2 : 0) + (cookie.hasExplicitPath() ? 4 : 0))
+           << cookie.ports();
+}
+
+KHttpCookie KCookieJar::readCookie(QDataStream &stream)
+{
+    QString host, domain, path, name, value;
+    qint64 expireDate;
+    qint32 protocolVersion;
+    quint8 flags;
+    QList<int> ports;
+    stream >> host >> domain >> path >> name >> value >> expireDate >> protocolVersion >> flags >> ports;
+
+    KHttpCookie cookie(host, domain, path, name, value, expireDate, protocolVersion,
+                       flags & 1, flags & 2, flags & 4);
+    cookie.mPorts = ports;
+    return cookie;
+}
+
+//
+// Loads the cookies from the binary snapshot '_filename'.
+// The snapshot holds the cookie lists in the order they are kept in
+// memory, so the cookies are appended to the lists without any lookups.
+//
+bool KCookieJar::loadCookieSnapshot(const QString &_filename)
+{
+    QFile file(_filename);
+    if (!file.open(QIODevice::ReadOnly)) {
+        return false;
+    }
+    // one read; parsing from memory is a lot faster than from the file
+    const QByteArray data = file.readAll();
+    QDataStream stream(data);
+    stream.setVersion(QDataStream::Qt_4_5);
+
+    quint32 magic, version;
+    stream >> magic >> version;
+    if (stream.status() != QDataStream::Ok || magic != s_snapshotMagic || version != s_snapshotVersion) {
+        return false;
+    }
+
+    const qint64 currentTime = epoch();
+    while (!stream.atEnd() && stream.status() == QDataStream::Ok) {
+        QString domain;
+        quint32 count;
+        stream >> domain >> count;
+
+        KHttpCookieList *cookieList = m_cookieDomains.value(domain);
+        if (!cookieList) {
+            cookieList = new KHttpCookieList();
+            cookieList->setAdvice(KCookieDunno);
+            m_cookieDomains.insert(domain, cookieList);
+            m_domainList.append(domain);
+        }
+        for (quint32 i = 0; i < count && stream.status() == QDataStream::Ok; i++) {
+            const KHttpCookie cookie = readCookie(stream);
+            if (!cookie.isExpired(currentTime)) {
+                cookieList->append(cookie);
+            }
+        }
+
+        if (cookieList->isEmpty() && cookieList->getAdvice() == KCookieDunno) {
+            delete m_cookieDomains.take(domain);
+            m_domainList.removeAll(domain);
+        }
+    }
+
+    if (stream.status() != QDataStream::Ok) {
+        qCWarning(KIO_COOKIEJAR) << "Corrupt cookie snapshot" << _filename;
+        // Don't go on with half of the cookies
+        eatAllCookies();
+        return false;
+    }
+
+    rebuildExpiryQueue();
+    m_snapshotSize = data.size();
+    m_cookiesChanged = false;
+    return true;
+}
+
+//
+// Writes a snapshot made by startCookieCompaction() to '_filename'.
+// On success 'true' is returned.
+// On failure 'false' is returned.
+bool KCookieJar::writeCookieSnapshot(const QString &_filename, const QByteArray &data)
+{
+    QSaveFile file(_filename);
+    if (!file.open(QIODevice::WriteOnly)) {
+        return false;
+    }
+    if (file.write(data) != data.size() || !file.commit()) {
+        return false;
+    }
+    QFile::setPermissions(_filename, QFile::ReadUser | QFile::WriteUser);
+    return true;
+}
+
+//
+// The journal is a sequence of records, each of them a big endian
+// 32 bit size followed by a JournalOp and its arguments. It only ever
+// grows at the end, so a crash can leave at most one incomplete record
+// behind, which is dropped.
+//
+// Compaction moves the journal aside to '.journal.old' and starts a new
+// one; the old one is deleted once the snapshot that covers it is written.
+// If the snapshot can't be written, the next compaction appends the
+// journal to the old one again. Replaying a journal that is already
+// covered by the snapshot is harmless, every record puts the cookie it
+// is about in the state it had at that time.
+//
+bool KCookieJar::openCookieJournal(const QString &_filename)
+{
+    const QString journalName = _filename + QL1S(".journal");
+    const QString oldJournalName = journalName + QL1S(".old");
+
+    if (QFile::exists(oldJournalName)) {
+        replayCookieJournal(oldJournalName);
+        // The last compaction did not finish, try again
+        m_snapshotSize = -1;
+    }
+    replayCookieJournal(journalName);
+
+    m_journal.close();
+    m_journal.setFileName(journalName);
+    if (!m_journal.open(QIODevice::WriteOnly | QIODevice::Append | QIODevice::Unbuffered)) {
+        qCWarning(KIO_COOKIEJAR) << "Could not open" << journalName << m_journal.errorString();
+        return false;
+    }
+    QFile::setPermissions(journalName, QFile::ReadUser | QFile::WriteUser);
+
+    m_snapshotFilename = _filename;
+    m_cookiesChanged = false;
+    return true;
+}
+
+//
+// Loads the persistent cookies at startup: the snapshot '_snapshotFilename'
+// with its journal, or the text file '_filename' of older versions if there
+// is no usable snapshot.
+//
+// The text file is only written while the journal can't be used, so next
+// to a corrupt snapshot it is current only if it is newer than that.
+// An older one is stale: the journal removes cookies relative to the
+// snapshot and would leave the ones removed before it in the jar. Without
+// it, the cookies that were in the snapshot and never touched since are
+// lost, but no removed cookie comes back. Journals older than a text file
+// that is loaded are covered by it and deleted.
+//
+bool KCookieJar::loadPersistentCookies(const QString &_filename, const QString &_snapshotFilename)
+{
+    if (loadCookieSnapshot(_snapshotFilename)) {
+        return openCookieJournal(_snapshotFilename);
+    }
+
+    const QFileInfo fileInfo(_filename);
+    const QFileInfo snapshotInfo(_snapshotFilename);
+    if (fileInfo.exists() && (!snapshotInfo.exists() || fileInfo.lastModified() > snapshotInfo.lastModified())) {
+        loadCookies(_filename);
+        const QString journalName = _snapshotFilename + QL1S(".journal");
+        const QStringList journalNames = QStringList() << journalName + QL1S(".old") << journalName;
+        Q_FOREACH (const QString &name, journalNames) {
+            const QFileInfo journalInfo(name);
+            if (journalInfo.exists() && journalInfo.lastModified() < fileInfo.lastModified()) {
+                QFile::remove(name);
+            }
+        }
+    } else if (fileInfo.exists()) {
+        qCWarning(KIO_COOKIEJAR) << "Ignoring" << _filename << "which is older than the corrupt snapshot";
+    }
+    return openCookieJournal(_snapshotFilename);
+}
+
+void KCookieJar::replayCookieJournal(const QString &_filename)
+{
+    QFile file(_filename);
+    if (!file.open(QIODevice::ReadOnly)) {
+        return;
+    }
+    const QByteArray data = file.readAll();
+    file.close();
+
+    QDataStream stream(data);
+    stream.setVersion(QDataStream::Qt_4_5);
+    const qint64 currentTime = epoch();
+    qint64 validSize = 0;
+
+    while (!stream.atEnd()) {
+        quint32 size;
+        stream >> size;
+        if (stream.status() != QDataStream::Ok || size > data.size() - validSize - 4) {
+            break;
+        }
+        QDataStream record(data.mid(int(validSize) + 4, int(size)));
+        record.setVersion(QDataStream::Qt_4_5);
+        stream.skipRawData(size);
+
+        quint8 op;
+        record >> op;
+        if (op == JournalAddCookie || op == JournalRemoveCookie) {
+            KHttpCookie cookie = readCookie(record);
+            if (record.status() != QDataStream::Ok) {
+                break;
+            }
+            if (op == JournalAddCookie && !cookie.isExpired(currentTime) && cookieIsPersistent(cookie)) {
+                addCookie(cookie);
+            } else {
+                QStringList domains;
+                extractDomains(cookie.host(), domains);
+                removeDuplicates(cookie, domains);
+            }
+        } else if (op == JournalRemoveDomain) {
+            QString domain;
+            record >> domain;
+            if (record.status() != QDataStream::Ok) {
+                break;
+            }
+            eatCookiesForDomain(domain);
+        }
+        // Unknown records are skipped
+
+        validSize += 4 + size;
+    }
+
+    if (validSize < data.size()) {
+        qCWarning(KIO_COOKIEJAR) << "Dropping incomplete record at the end of" << _filename;
+        QFile::resize(_filename, validSize);
+    }
+}
+
+bool KCookieJar::cookieJournalNeedsCompaction() const
+{
+    if (m_snapshotFilename.isEmpty()) {
+        return false;
+    }
+    // A journal that could not be written to is caught up with by the next snapshot
+    return m_snapshotSize < 0 || !m_journal.isOpen() ||
+           m_journal.size() > qMax(qint64(MIN_JOURNAL_COMPACTION_SIZE), m_snapshotSize);
+}
+
+QByteArray KCookieJar::startCookieCompaction()
+{
+    const qint64 currentTime = epoch();
+    QByteArray data;
+    {
+        QDataStream stream(&data, QIODevice::WriteOnly);
+        stream.setVersion(QDataStream::Qt_4_5);
+        stream << s_snapshotMagic << s_snapshotVersion;
+
+        QVector<const KHttpCookie *> cookies;
+        QStringListIterator it(m_domainList);
+        while (it.hasNext()) {
+            const QString &domain = it.next();
+            const KHttpCookieList *cookieList = m_cookieDomains.value(domain);
+            if (!cookieList) {
+                continue;
+            }
+
+            // Only save cookies that are not "session-only cookies"
+            cookies.clear();
+            KHttpCookieList::ConstIterator cookieIt = cookieList->constBegin();
+            for (; cookieIt != cookieList->constEnd(); ++cookieIt) {
+                if (!cookieIt->isExpired(currentTime) && cookieIsPersistent(*cookieIt)) {
+                    cookies.append(&*cookieIt);
+                }
+            }
+            if (cookies.isEmpty()) {
+                continue;
+            }
+            stream << domain << quint32(cookies.count());
+            Q_FOREACH (const KHttpCookie *cookie, cookies) {
+                writeCookie(stream, *cookie);
+            }
+        }
+    }
+    // Drop queue entries of cookies that were replaced or eaten meanwhile
+    rebuildExpiryQueue();
+
+    const QString journalName = m_journal.fileName();
+    const QString oldJournalName = journalName + QL1S(".old");
+    m_journal.close();
+    if (QFile::exists(oldJournalName)) {
+        // The last compaction failed, keep everything since the snapshot before
+        QFile oldJournal(oldJournalName);
+        QFile journal(journalName);
+        if (oldJournal.open(QIODevice::WriteOnly | QIODevice::Append) && journal.open(QIODevice::ReadOnly)) {
+            const QByteArray records = journal.readAll();
+            if (oldJournal.write(records) == records.size()) {
+                journal.remove();
+            }
+        }
+    } else {
+        QFile::rename(journalName, oldJournalName);
+    }
+    // Starts a new journal, or goes on with the current one if it could not
+    // be moved aside; that is correct as well, just longer to replay.
+    if (m_journal.open(QIODevice::WriteOnly | QIODevice::Append | QIODevice::Unbuffered)) {
+        QFile::setPermissions(journalName, QFile::ReadUser | QFile::WriteUser);
+    } else {
+        qCWarning(KIO_COOKIEJAR) << "Could not open" << journalName << m_journal.errorString();
+    }
+
+    m_snapshotSize = data.size();
+    m_cookiesChanged = false;
+    return data;
+}
+
+void KCookieJar::finishCookieCompaction(bool success)
+{
+    if (success) {
+        QFile::remove(m_journal.fileName() + QL1S(".old"));
+    } else {
+        qCWarning(KIO_COOKIEJAR) << "Could not write" << m_snapshotFilename;
+        m_snapshotSize = -1;
+    }
+}
+
+void KCookieJar::recordCookie(quint8 op, const KHttpCookie &cookie)
+{
+    if (!m_journal.isOpen()) {
+        return;
+    }
+    QByteArray record;
+    {
+        QDataStream stream(&record, QIODevice::WriteOnly);
+        stream.setVersion(QDataStream::Qt_4_5);
+        stream << quint32(0) << op;
+        writeCookie(stream, cookie);
+    }
+    appendToJournal(record);
+}
+
+void KCookieJar::recordDomainRemoval(const QString &domain)
+{
+    if (!m_journal.isOpen()) {
+        return;
+    }
+    QByteArray record;
+    {
+        QDataStream stream(&record, QIODevice::WriteOnly);
+        stream.setVersion(QDataStream::Qt_4_5);
+        stream << quint32(0) << quint8(JournalRemoveDomain) << domain;
+    }
+    appendToJournal(record);
+}
+
+// @p record starts with room for its size
+void KCookieJar::appendToJournal(QByteArray &record)
+{
+    qToBigEndian<quint32>(record.size() - 4, reinterpret_cast<uchar *>(record.data()));
+
+    const qint64 size = m_journal.size();
+    if (m_journal.write(record) != record.size()) {
+        qCWarning(KIO_COOKIEJAR) << "Could not write to" << m_journal.fileName() << m_journal.errorString();
+        m_journal.resize(size);
+        m_journal.close();
+    }
+}
+
 //
 // Save the cookie configuration
 //
@@ -1576,6 +2101,7 @@ void KCookieJar::loadConfig(KConfig *_config, bool reparse)
     m_rejectCrossDomainCookies = policyGroup.readEntry("RejectCrossDomainCookies", true);
     m_autoAcceptSessionCookies = policyGroup.readEntry("AcceptSessionCookies", true);
     m_globalAdvice = strToAdvice(policyGroup.readEntry("CookieGlobalAdvice", QStringLiteral("Accept")));
+    m_adviceGeneration++;
 
     // Reset current domain settings first.
     Q_FOREACH (const QString &domain, m_domainList) {
@@ -27,13 +27,16 @@
 
 #include <QString>
 #include <QStringList>
+#include <QFile>
 #include <QHash>
 #include <QSet>
+#include <QVector>
 #include <qwindowdefs.h> //WId
 
 #include <QLoggingCategory>
 Q_DECLARE_LOGGING_CATEGORY(KIO_COOKIEJAR)
 
+class QDataStream;
 class KConfig;
 class KCookieJar;
 class KHttpCookie;
@@ -70,6 +73,9 @@ protected:
     QList<WId> mWindowIds;
     QList<int> mPorts;
     KCookieAdvice mUserSelectedAdvice;
+    // Advice for mHost, valid as long as the jar's policy is unchanged
+    mutable KCookieAdvice mHostAdvice;
+    mutable int mHostAdviceGeneration;
 
     QString cookieStr(bool useDOMFormat) const;
 
@@ -221,6 +227,42 @@ public:
      */
     bool loadCookies(const QString &_filename);
 
+    /**
+     * Load the cookies from a snapshot written by writeCookieSnapshot().
+     * This is a lot faster than loadCookies() for large jars.
+     * Returns false if there is no usable snapshot.
+     */
+    bool loadCookieSnapshot(const QString &_filename);
+
+    /**
+     * Replay the journal of the snapshot @p _filename and keep recording
+     * all further additions and removals of persistent cookies in it, so
+     * that they are on disk right away.
+     *
+     * The journal grows until it is compacted into a new snapshot: call
+     * startCookieCompaction() when cookieJournalNeedsCompaction() says so,
+     * write the returned data with writeCookieSnapshot(), which may be done
+     * in another thread, and call finishCookieCompaction() with the result.
+     */
+    bool openCookieJournal(const QString &_filename);
+
+    /**
+     * Load the persistent cookies at startup from the snapshot
+     * @p _snapshotFilename and its journal, or from the text file
+     * @p _filename of older versions if that is newer than an unusable
+     * snapshot. Returns the result of openCookieJournal().
+     */
+    bool loadPersistentCookies(const QString &_filename, const QString &_snapshotFilename);
+    bool cookieJournalNeedsCompaction() const;
+    QByteArray startCookieCompaction();
+    void finishCookieCompaction(bool success);
+
+    /**
+     * Atomically replace the snapshot @p _filename with @p data.
+     * This doesn't touch the jar and is safe to call from any thread.
+     */
+    static bool writeCookieSnapshot(const QString &_filename, const QByteArray &data);
+
     /**
      * Save the cookie configuration
      */
@@ -241,8 +283,11 @@ public:
      * @p pendingCookies contains a list of cookies that have not been
      * approved yet by the user but that will be included in the result
      * none the less.
+     * If @p nextExpiry is given, it is set to the earliest expiration date of
+     * the returned cookies, or to 0 if none of them expires.
      */
-    QString findCookies(const QString &_url, bool useDOMFormat, WId windowId, KHttpCookieList *pendingCookies = nullptr);
+    QString findCookies(const QString &_url, bool useDOMFormat, WId windowId, KHttpCookieList *pendingCookies = nullptr,
+                        qint64 *nextExpiry = nullptr);
 
     /**
      * This function parses cookie_headers and returns a linked list of
@@ -269,6 +314,12 @@ public:
      */
     void addCookie(KHttpCookie &cookie);
 
+    /**
+     * Remove & delete all cookies that have expired. Only the expired
+     * cookies are looked at, so this is cheap to call often.
+     */
+    void eatExpiredCookies();
+
     /**
      * This function tells whether a single KHttpCookie object should
      * be considered persistent. Persistent cookies do not get deleted
@@ -456,6 +507,25 @@ public:
 protected:
     void stripDomain(const QString &_fqdn, QString &_domain) const;
     QString stripDomain(const KHttpCookie &cookie) const;
+    void computeDomains(const QString &_fqdn, QStringList &_domainList) const;
+    KCookieAdvice hostAdvice(const QString &_fqdn) const;
+    void rebuildExpiryQueue();
+    bool removeDuplicates(KHttpCookie &cookie, const QStringList &domains);
+    void replayCookieJournal(const QString &_filename);
+    void recordCookie(quint8 op, const KHttpCookie &cookie);
+    void recordDomainRemoval(const QString &domain);
+    void appendToJournal(QByteArray &record);
+    static KHttpCookie readCookie(QDataStream &stream);
+
+    struct ExpiringCookie {
+        qint64 expireDate;
+        QString listDomain; // key in m_cookieDomains
+        QString host;
+        QString domain;
+        QString path;
+        QString name;
+    };
+    static bool expiresLater(const ExpiringCookie &item1, const ExpiringCookie &item2);
 
 protected:
     QStringList m_domainList;
@@ -463,6 +533,12 @@ protected:
     QHash<QString, KHttpCookieList *> m_cookieDomains;
     QSet<QString> m_twoLevelTLD;
     QSet<QString> m_gTLDs;
+    mutable QHash<QString, QStringList> m_domainCache; // fqdn -> extractDomains()
+    int m_adviceGeneration; // bumped whenever any advice changes
+    QVector<ExpiringCookie> m_expiryQueue; // a min-heap ordered by expiration date
+    QString m_snapshotFilename; // empty unless changes are journaled
+    QFile m_journal;
+    qint64 m_snapshotSize; // -1 if the snapshot is missing or outdated
 
     bool m_configChanged;
     bool m_cookiesChanged;
@@ -31,6 +31,9 @@ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #include <QTimer>
 #include <QFile>
 #include <QDBusConnection>
+#include <QDateTime>
+#include <QFutureWatcher>
+#include <QtConcurrentRun>
 
 #include <kconfig.h>
 #include <QDebug>
@@ -91,6 +94,7 @@ public:
     QDBusMessage reply;
     QString url;
     bool DOM;
+    bool snapshot;
     qlonglong windowId;
 };
 
@@ -113,17 +117,42 @@ KCookieServer::KCookieServer(QObject *parent, const QList<QVariant> &)
     mTimer = new QTimer();
     mTimer->setSingleShot(true);
     connect(mTimer, SIGNAL(timeout()), SLOT(slotSave()));
+    mChangeTimer = new QTimer(this);
+    mChangeTimer->setSingleShot(true);
+    mChangeTimer->setInterval(0);
+    connect(mChangeTimer, SIGNAL(timeout()), SLOT(slotEmitCookiesChanged()));
+    mAllDomainsChanged = false;
+    // Start with the current time so that versions keep growing when kded
+    // is restarted while slaves still hold results from before.
+    mVersion = QDateTime::currentMSecsSinceEpoch();
     mConfig = new KConfig(QStringLiteral("kcookiejarrc"));
     mCookieJar->loadConfig(mConfig);
-    mFilename = getOrCreateCookieJarDir().absoluteFilePath(QStringLiteral("cookies"));
-    mCookieJar->loadCookies(mFilename);
+    const QDir cookieJarDir = getOrCreateCookieJarDir();
+    mFilename = cookieJarDir.absoluteFilePath(QStringLiteral("cookies"));
+    mSnapshotFilename = cookieJarDir.absoluteFilePath(QStringLiteral("cookies.snapshot"));
+    mCompacting = false;
+    mSnapshotWatcher = new QFutureWatcher<bool>(this);
+    connect(mSnapshotWatcher, SIGNAL(finished()), SLOT(slotSnapshotWritten()));
+    // The text file of older versions, the first snapshot replaces it
+    mUseJournal = mCookieJar->loadPersistentCookies(mFilename, mSnapshotFilename);
+    if (mCookieJar->cookieJournalNeedsCompaction()) {
+        saveCookieJar();
+    }
     connect(this, SIGNAL(windowUnregistered(qlonglong)),
             this, SLOT(slotDeleteSessionCookies(qlonglong)));
 }
 
 KCookieServer::~KCookieServer()
 {
+    if (mCompacting) {
+        mSnapshotWatcher->waitForFinished();
+        slotSnapshotWritten();
+    }
     slotSave();
+    if (mCompacting) {
+        mSnapshotWatcher->waitForFinished();
+        slotSnapshotWritten();
+    }
     delete mCookieJar;
     delete mTimer;
     delete mPendingCookies;
@@ -203,6 +232,7 @@ void KCookieServer::checkCookies(KHttpCookieList *cookieList, qlonglong windowId
         switch (advice) {
         case KCookieAccept:
         case KCookieAcceptForSession:
+            cookiesChangedFor(cookie);
             mCookieJar->addCookie(cookie);
             cookieIterator.remove();
             break;
@@ -245,6 +275,8 @@ void KCookieServer::checkCookies(KHttpCookieList *cookieList, qlonglong windowId
     delete kw;
     // Save the cookie config if it has changed
     mCookieJar->saveConfig(mConfig);
+    // The user may have changed the policy of any domain
+    cookiesChangedFor(QString());
 
     // Apply the user's choice to all cookies that are currently
     // queued for this host (or just the first one, if the user asks for that).
@@ -290,7 +322,13 @@ void KCookieServer::checkCookies(KHttpCookieList *cookieList, qlonglong windowId
         if (!cookiesPending(request->url)) {
             const QString res = mCookieJar->findCookies(request->url, request->DOM, request->windowId);
 
-            QDBusConnection::sessionBus().send(request->reply.createReply(res));
+            QVariantList replyArgs;
+            replyArgs << res;
+            if (request->snapshot) {
+                // not to be reused, the answer comes in late
+                replyArgs << QVariant::fromValue(qulonglong(0)) << QVariant::fromValue(qlonglong(0));
+            }
+            QDBusConnection::sessionBus().send(request->reply.createReply(replyArgs));
             delete request;
             requestIterator.remove();
         }
@@ -301,9 +339,29 @@ void KCookieServer::checkCookies(KHttpCookieList *cookieList, qlonglong windowId
 
 void KCookieServer::slotSave()
 {
-    if (mCookieJar->changed()) {
-        mCookieJar->saveCookies(mFilename);
+    if (!mUseJournal) {
+        if (mCookieJar->changed()) {
+            mCookieJar->saveCookies(mFilename);
+        }
+        return;
+    }
+    // All changes are in the journal already, the snapshot only keeps
+    // it short. It is written in another thread, large jars take a while.
+    if (mCompacting || !mCookieJar->cookieJournalNeedsCompaction()) {
+        return;
+    }
+    mCompacting = true;
+    mSnapshotWatcher->setFuture(QtConcurrent::run(&KCookieJar::writeCookieSnapshot, mSnapshotFilename,
+                                                  mCookieJar->startCookieCompaction()));
+}
+
+void KCookieServer::slotSnapshotWritten()
+{
+    if (!mCompacting) {
+        return;
     }
+    mCompacting = false;
+    mCookieJar->finishCookieCompaction(mSnapshotWatcher->result());
 }
 
 void KCookieServer::saveCookieJar()
@@ -315,6 +373,31 @@ void KCookieServer::saveCookieJar()
     mTimer->start(1000 * 60 * SAVE_DELAY);
 }
 
+void KCookieServer::cookiesChangedFor(const QString &domain)
+{
+    mVersion++;
+    if (domain.isEmpty()) {
+        mAllDomainsChanged = true;
+        mChangedDomains.clear();
+    } else if (!mAllDomainsChanged && !mChangedDomains.contains(domain)) {
+        mChangedDomains.append(domain);
+    }
+    mChangeTimer->start();
+}
+
+void KCookieServer::cookiesChangedFor(const KHttpCookie &cookie)
+{
+    cookiesChangedFor(cookie.domain().isEmpty() ? cookie.host() : cookie.domain());
+}
+
+void KCookieServer::slotEmitCookiesChanged()
+{
+    // An empty list stands for all domains
+    Q_EMIT cookiesChanged(mChangedDomains, mVersion);
+    mChangedDomains.clear();
+    mAllDomainsChanged = false;
+}
+
 void KCookieServer::putCookie(QStringList &out, const KHttpCookie &cookie,
                               const QList<int> &fields)
 {
@@ -375,6 +458,7 @@ QString KCookieServer::findCookies(const QString &url, qlonglong windowId)
         request->reply = message();
         request->url = url;
         request->DOM = false;
+        request->snapshot = false;
         request->windowId = windowId;
         mRequestList->append(request);
         return QString(); // Talk to you later :-)
@@ -385,6 +469,31 @@ QString KCookieServer::findCookies(const QString &url, qlonglong windowId)
     return cookies;
 }
 
+// DBUS function
+QString KCookieServer::findCookiesSnapshot(const QString &url, qlonglong windowId, qulonglong &version, qlonglong &nextExpiry)
+{
+    version = 0;
+    nextExpiry = 0;
+    if (cookiesPending(url)) {
+        CookieRequest *request = new CookieRequest;
+        message().setDelayedReply(true);
+        request->reply = message();
+        request->url = url;
+        request->DOM = false;
+        request->snapshot = true;
+        request->windowId = windowId;
+        mRequestList->append(request);
+        return QString();
+    }
+
+    qint64 expiry = 0;
+    QString cookies = mCookieJar->findCookies(url, false, windowId, nullptr, &expiry);
+    saveCookieJar();
+    version = mVersion;
+    nextExpiry = expiry;
+    return cookies;
+}
+
 // DBUS function
 QStringList
 KCookieServer::findDomains()
@@ -484,6 +593,7 @@ KCookieServer::deleteCookie(const QString &domain, const QString &fqdn,
         KHttpCookieList::Iterator itEnd = cookieList->end();
         for (KHttpCookieList::Iterator it = cookieList->begin(); it != itEnd; ++it) {
             if (cookieMatches(*it, domain, fqdn, path, name)) {
+                cookiesChangedFor(*it);
                 mCookieJar->eatCookie(it);
                 saveCookieJar();
                 break;
@@ -497,6 +607,7 @@ void
 KCookieServer::deleteCookiesFromDomain(const QString &domain)
 {
     mCookieJar->eatCookiesForDomain(domain);
+    cookiesChangedFor(domain);
     saveCookieJar();
 }
 
@@ -512,6 +623,7 @@ void
 KCookieServer::deleteSessionCookies(qlonglong windowId)
 {
     mCookieJar->eatSessionCookies(windowId);
+    cookiesChangedFor(QString());
     saveCookieJar();
 }
 
@@ -519,6 +631,8 @@ void
 KCookieServer::deleteSessionCookiesFor(const QString &fqdn, qlonglong windowId)
 {
     mCookieJar->eatSessionCookies(fqdn, windowId);
+    // this covers the whole domain of fqdn
+    cookiesChangedFor(QString());
     saveCookieJar();
 }
 
@@ -527,6 +641,7 @@ void
 KCookieServer::deleteAllCookies()
 {
     mCookieJar->eatAllCookies();
+    cookiesChangedFor(QString());
     saveCookieJar();
 }
 
@@ -551,6 +666,7 @@ KCookieServer::setDomainAdvice(const QString &url, const QString &advice)
                                     KCookieJar::strToAdvice(advice));
         // Save the cookie config if it has changed
         mCookieJar->saveConfig(mConfig);
+        cookiesChangedFor(QString());
         return true;
     }
     return false;
@@ -589,6 +705,7 @@ void
 KCookieServer::reloadPolicy()
 {
     mCookieJar->loadConfig(mConfig, true);
+    cookiesChangedFor(QString());
 }
 
 // DBUS function
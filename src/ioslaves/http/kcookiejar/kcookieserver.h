@@ -34,6 +34,7 @@ class KHttpCookieList;
 class KCookieJar;
 class KHttpCookie;
 class QTimer;
+template <typename T> class QFutureWatcher;
 class RequestList;
 class KConfig;
 
@@ -57,6 +58,15 @@ public Q_SLOTS:
     // KDE5 TODO: don't overload names here, it prevents calling e.g. findCookies from the command-line using qdbus.
     QString listCookies(const QString &url);
     QString findCookies(const QString &url, qlonglong windowId);
+    /**
+     * Same as findCookies(), but also returns the version of the cookie jar
+     * the result was computed from and the earliest expiration date of the
+     * returned cookies (0 if none of them expires). Callers may reuse the
+     * result until cookiesChanged() announces a newer version for the domain
+     * or a cookie expires. A version of 0 means that the result must not be
+     * reused, e.g. because the user was asked about some cookies meanwhile.
+     */
+    QString findCookiesSnapshot(const QString &url, qlonglong windowId, qulonglong &version, qlonglong &nextExpiry);
     QStringList findDomains();
     // KDE5: rename
     QStringList findCookies(const QList<int> &fields, const QString &domain, const QString &fqdn, const QString &path, const QString &name);
@@ -80,6 +90,15 @@ public Q_SLOTS:
     void reloadPolicy();
     void shutdown();
 
+Q_SIGNALS:
+    /**
+     * Emitted when cookies for @p domains were added, removed or are subject
+     * to a different policy now. An empty list means that all domains are
+     * affected. @p version is the version of the cookie jar after the change.
+     * Changes that happen in a row are announced in one signal.
+     */
+    void cookiesChanged(const QStringList &domains, qulonglong version);
+
 public:
     bool cookiesPending(const QString &url, KHttpCookieList *cookieList = nullptr);
     void addCookies(const QString &url, const QByteArray &cookieHeader,
@@ -92,6 +111,8 @@ public:
 private Q_SLOTS:
     void slotSave();
     void slotDeleteSessionCookies(qlonglong windowId);
+    void slotEmitCookiesChanged();
+    void slotSnapshotWritten();
 
 private:
     KCookieJar *mCookieJar;
@@ -101,6 +122,14 @@ private:
     bool mAdvicePending;
     KConfig *mConfig;
     QString mFilename;
+    QString mSnapshotFilename;
+    bool mUseJournal;
+    bool mCompacting;
+    QFutureWatcher<bool> *mSnapshotWatcher;
+    QTimer *mChangeTimer;
+    QStringList mChangedDomains;
+    bool mAllDomainsChanged;
+    qulonglong mVersion;
 
 private:
     virtual int newInstance(QList<QByteArray>)
@@ -110,6 +139,8 @@ private:
     bool cookieMatches(const KHttpCookie &, const QString &, const QString &, const QString &, const QString &);
     void putCookie(QStringList &, const KHttpCookie &, const QList<int> &);
     void saveCookieJar();
+    void cookiesChangedFor(const QString &domain);
+    void cookiesChangedFor(const KHttpCookie &cookie);
 };
 
 #endif
@@ -46,6 +46,41 @@
 #endif
 #endif
 
+#ifdef Q_OS_UNIX
+#include <unistd.h>
+
+/*
+ * Started in advance by KIO::Slave with "--prefork": wait until we are
+ * told on stdin, one argument per line, which slave to become. Then
+ * detach from the application like QProcess::startDetached() does.
+ */
+static bool waitForPreforkArguments(QByteArray *args, int count)
+{
+    for (int i = 0; i < count; ++i) {
+        QByteArray *arg = &args[i];
+        char line[4096];
+        if (!fgets(line, sizeof(line), stdin)) {
+            return false; // the application doesn't need us anymore
+        }
+        *arg = line;
+        if (arg->endsWith('\n')) {
+            arg->chop(1);
+        }
+    }
+
+    const pid_t pid = fork();
+    if (pid > 0) {
+        _exit(0);
+    }
+    // if fork() failed, we run attached, which works as well
+    setsid();
+    if (!freopen("/dev/null", "r", stdin)) {
+        fprintf(stderr, "could not reopen stdin\n");
+    }
+    return true;
+}
+#endif
+
 #ifndef Q_OS_WIN
 /* These are to link libkio even if 'smart' linker is used */
 #include <kio/authinfo.h>
@@ -57,8 +92,26 @@ extern "C" KIO::AuthInfo *_kioslave_init_kio()
 
 int main(int argc, char **argv)
 {
+#ifdef Q_OS_UNIX
+    // the same arguments as below, sent later
+    QByteArray preforkArgs[4];
+    char *preforkArgv[6];
+    if (argc == 2 && qstrcmp(argv[1], "--prefork") == 0) {
+        if (!waitForPreforkArguments(preforkArgs, 4)) {
+            return 0;
+        }
+        preforkArgv[0] = argv[0];
+        for (int i = 0; i < 4; ++i) {
+            preforkArgv[i + 1] = preforkArgs[i].data();
+        }
+        preforkArgv[5] = nullptr;
+        argc = 5;
+        argv = preforkArgv;
+    }
+#endif
     if (argc < 5) {
-        fprintf(stderr, "Usage: kioslave <slave-lib> <protocol> <klauncher-socket> <app-socket>\n\nThis program is part of KDE.\n");
+        fprintf(stderr, "Usage: kioslave <slave-lib> <protocol> <klauncher-socket> <app-socket>\n"
+                        "       kioslave --prefork\n\nThis program is part of KDE.\n");
         return 1;
     }
 #ifndef _WIN32_WCE
@@ -49,6 +49,11 @@ K_PLUGIN_FACTORY_WITH_JSON(ProxyScoutFactory,
 
 namespace KPAC
 {
+// How long the proxies found for a host or URL are used without asking the
+// script again; the script may resolve host names, which change as well.
+static const int s_resultLifetime = 120;
+static const int s_maxCachedResults = 4096;
+
 enum ProxyType {
     Unknown = -1,
     Proxy,
@@ -168,6 +173,8 @@ void ProxyScout::reset()
     delete m_watcher;
     m_watcher = nullptr;
     m_blackList.clear();
+    m_resultCache.clear();
+    Script::clearDnsCache();
     m_suspendTime = 0;
     KProtocolManager::reparseConfiguration();
 }
@@ -252,6 +259,7 @@ void ProxyScout::downloadResult(bool success)
 #endif
     }
 
+    m_resultCache.clear();
     if (success) {
         for (RequestQueue::Iterator it = m_requestQueue.begin(), itEnd = m_requestQueue.end(); it != itEnd; ++it) {
             if ((*it).sendAll) {
@@ -294,11 +302,34 @@ void ProxyScout::proxyScriptFileChanged(const QString &path)
     m_downloader->download(QUrl::fromLocalFile(path));
 }
 
+QString ProxyScout::evaluate(const QUrl &url)
+{
+    const QString key = m_script->cacheKey(url);
+    if (key.isEmpty()) {
+        return m_script->evaluate(url).trimmed();
+    }
+
+    const qint64 now = std::time(nullptr);
+    QHash<QString, CachedResult>::ConstIterator it = m_resultCache.constFind(key);
+    if (it != m_resultCache.constEnd() && it->expiry > now) {
+        return it->result;
+    }
+
+    CachedResult cached;
+    cached.result = m_script->evaluate(url).trimmed();
+    cached.expiry = now + s_resultLifetime;
+    if (m_resultCache.count() >= s_maxCachedResults) {
+        m_resultCache.clear();
+    }
+    m_resultCache.insert(key, cached);
+    return cached.result;
+}
+
 QStringList ProxyScout::handleRequest(const QUrl &url)
 {
     try {
         QStringList proxyList;
-        const QString result = m_script->evaluate(url).trimmed();
+        const QString result = evaluate(url);
         const QStringList proxies = result.split(QLatin1Char(';'), QString::SkipEmptyParts);
         const int size = proxies.count();
 
@@ -23,6 +23,7 @@
 #include <kdedmodule.h>
 
 #include <QUrl>
+#include <QHash>
 #include <QMap>
 #include <QDBusMessage>
 
@@ -57,6 +58,7 @@ private Q_SLOTS:
 private:
     bool startDownload();
     QStringList handleRequest(const QUrl &url);
+    QString evaluate(const QUrl &url);
 
     QString m_componentName;
     Downloader *m_downloader;
@@ -73,6 +75,13 @@ private:
     typedef QList< QueuedRequest > RequestQueue;
     RequestQueue m_requestQueue;
 
+    // Results of the script, see Script::cacheKey()
+    struct CachedResult {
+        QString result;
+        qint64 expiry;
+    };
+    QHash<QString, CachedResult> m_resultCache;
+
     typedef QMap< QString, qint64 > BlackList;
     BlackList m_blackList;
     qint64 m_suspendTime;
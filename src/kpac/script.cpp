@@ -23,6 +23,7 @@
 #include <QString>
 #include <QRegExp>
 #include <QDateTime>
+#include <QHash>
 #include <QTimer>
 #include <QEventLoop>
 #include <QUrl>
@@ -39,6 +40,8 @@
 #include <klocalizedstring.h>
 #include <kio/hostinfo.h>
 
+#include <ctime>
+
 #define QL1S(x)    QLatin1String(x)
 
 namespace
@@ -150,6 +153,20 @@ static QString addressListToString(const QList<QHostAddress> &addressList,
     return result;
 }
 
+// PAC scripts tend to resolve the same few hosts for every URL, and hosts
+// which cannot be resolved at all would block the script until the lookup
+// times out each time. So both answers are remembered for a while.
+static const int s_resolvedHostLifetime = 300;
+static const int s_unresolvableHostLifetime = 30;
+static const int s_maxResolvedHosts = 1024;
+
+struct ResolvedHost {
+    QList<QHostAddress> addresses;
+    qint64 expiry;
+};
+typedef QHash<QString, ResolvedHost> ResolvedHosts;
+Q_GLOBAL_STATIC(ResolvedHosts, s_resolvedHosts)
+
 class Address
 {
 public:
@@ -180,12 +197,28 @@ private:
         // needless reverse lookup
         QHostAddress address(host);
         if (address.isNull()) {
+            const QString key = host.toLower();
+            const qint64 now = std::time(nullptr);
+            ResolvedHosts::ConstIterator it = s_resolvedHosts()->constFind(key);
+            if (it != s_resolvedHosts()->constEnd() && it->expiry > now) {
+                m_addressList = it->addresses;
+                return;
+            }
+
             QHostInfo hostInfo = KIO::HostInfo::lookupCachedHostInfoFor(host);
-            if (hostInfo.hostName().isEmpty() || hostInfo.error() != QHostInfo::NoError) {
+            if (hostInfo.hostName().isEmpty()) { // names known not to exist are cached too
                 hostInfo = QHostInfo::fromName(host);
                 KIO::HostInfo::cacheLookup(hostInfo);
             }
             m_addressList = hostInfo.addresses();
+
+            if (s_resolvedHosts()->count() >= s_maxResolvedHosts) {
+                s_resolvedHosts()->clear();
+            }
+            ResolvedHost resolved;
+            resolved.addresses = m_addressList;
+            resolved.expiry = now + (m_addressList.isEmpty() ? s_unresolvableHostLifetime : s_resolvedHostLifetime);
+            s_resolvedHosts()->insert(key, resolved);
         } else {
             m_addressList.clear();
             m_addressList.append(address);
@@ -721,11 +754,47 @@ void registerFunctions(QScriptEngine *engine)
     value.setProperty(QStringLiteral("sortIpAddressList"), engine->newFunction(SortIpAddressList));
     value.setProperty(QStringLiteral("getClientVersion"), engine->newFunction(GetClientVersion));
 }
+
+static QScriptValue findProxyFunction(QScriptEngine *engine)
+{
+    QScriptValue func = engine->globalObject().property(QStringLiteral("FindProxyForURL"));
+    if (!func.isValid()) {
+        func = engine->globalObject().property(QStringLiteral("FindProxyForURLEx"));
+    }
+    return func;
+}
+
+// @returns true if the source of @p func, a function(url, host), never uses
+// its first argument
+static bool ignoresUrlArgument(const QString &func)
+{
+    QRegExp signature(QStringLiteral("^\\s*function\\s*[\\w$]*\\s*\\(\\s*([\\w$]+)\\s*,\\s*[\\w$]+\\s*\\)"));
+    if (signature.indexIn(func) == -1) {
+        return false;
+    }
+    const QString body = func.mid(signature.matchedLength());
+    // the arguments object gives access to the URL under any name
+    QRegExp uses(QStringLiteral("(^|[^\\w$.])(%1|arguments|eval)($|[^\\w$])").arg(QRegExp::escape(signature.cap(1))));
+    return uses.indexIn(body) == -1;
+}
+
+static QUrl cleanedUrl(const QUrl &url)
+{
+    QUrl cleanUrl = url;
+    cleanUrl.setUserInfo(QString());
+    if (cleanUrl.scheme() == QLatin1String("https")) {
+        cleanUrl.setPath(QString());
+        cleanUrl.setQuery(QString());
+    }
+    return cleanUrl;
+}
 }
 
 namespace KPAC
 {
 Script::Script(const QString &code)
+    : m_hostOnly(false),
+      m_timeDependent(false)
 {
     m_engine = new QScriptEngine;
     registerFunctions(m_engine);
@@ -735,6 +804,13 @@ Script::Script(const QString &code)
     if (m_engine->hasUncaughtException() || result.isError()) {
         throw Error(m_engine->uncaughtException().toString());
     }
+
+    // Results are only reused if the script gives the same answer for the
+    // same host or URL, i.e. it does not look at the clock.
+    m_timeDependent = code.contains(QRegExp(QStringLiteral("\\b(weekdayRange|dateRange|timeRange|Date)\\b")));
+    const QScriptValue func = findProxyFunction(m_engine);
+    m_hostOnly = func.isFunction() && ignoresUrlArgument(func.toString());
+    clearDnsCache();
 }
 
 Script::~Script()
@@ -744,22 +820,13 @@ Script::~Script()
 
 QString Script::evaluate(const QUrl &url)
 {
-    QScriptValue func = m_engine->globalObject().property(QStringLiteral("FindProxyForURL"));
-
+    const QScriptValue func = findProxyFunction(m_engine);
     if (!func.isValid()) {
-        func = m_engine->globalObject().property(QStringLiteral("FindProxyForURLEx"));
-        if (!func.isValid()) {
-            throw Error(i18n("Could not find 'FindProxyForURL' or 'FindProxyForURLEx'"));
-            return QString();
-        }
+        throw Error(i18n("Could not find 'FindProxyForURL' or 'FindProxyForURLEx'"));
+        return QString();
     }
 
-    QUrl cleanUrl = url;
-    cleanUrl.setUserInfo(QString());
-    if (cleanUrl.scheme() == QLatin1String("https")) {
-        cleanUrl.setPath(QString());
-        cleanUrl.setQuery(QString());
-    }
+    const QUrl cleanUrl = cleanedUrl(url);
 
     QScriptValueList args;
     args << cleanUrl.url();
@@ -772,5 +839,20 @@ QString Script::evaluate(const QUrl &url)
 
     return result.toString();
 }
+
+QString Script::cacheKey(const QUrl &url) const
+{
+    if (m_timeDependent) {
+        return QString();
+    }
+    if (m_hostOnly) {
+        return url.host().toLower();
+    }
+    return cleanedUrl(url).url();
 }
 
+void Script::clearDnsCache()
+{
+    s_resolvedHosts()->clear();
+}
+}
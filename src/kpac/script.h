@@ -49,8 +49,22 @@ public:
     ~Script();
     QString evaluate(const QUrl &);
 
+    /**
+     * @returns the key under which the result of evaluate() for @p url can
+     * be reused, or an empty string if it must not be reused. The key is the
+     * host alone if FindProxyForURL never looks at the URL.
+     */
+    QString cacheKey(const QUrl &url) const;
+
+    /**
+     * Forgets the host names resolved for the helper functions.
+     */
+    static void clearDnsCache();
+
 private:
     QScriptEngine *m_engine;
+    bool m_hostOnly;
+    bool m_timeDependent;
 };
 }
 
@@ -39,6 +39,7 @@
 
 #include <QPushButton>
 #include <QTimer>
+#include <algorithm>
 #include <ctime>
 
 static QLoggingCategory category("org.kde.kio.kpasswdserver");
@@ -75,6 +76,7 @@ KPasswdServer::KPasswdServer(QObject* parent, const QList<QVariant>&)
     m_seqNr = 0;
     m_wallet = nullptr;
     m_walletDisabled = false;
+    m_walletOpening = false;
 
     KPasswdServerAdaptor *adaptor = new KPasswdServerAdaptor(this);
     // connect signals to the adaptor
@@ -105,12 +107,17 @@ KPasswdServer::~KPasswdServer()
     qDeleteAll(m_authRetryInProgress);
 
 #ifdef HAVE_KF5WALLET
+    qDeleteAll(m_walletWait);
     delete m_wallet;
 #endif
 }
 
 #ifdef HAVE_KF5WALLET
 
+// How long a wallet key found missing is not asked for again, in seconds.
+static const int s_missingWalletKeyTimeout = 60;
+static const int s_maxMissingWalletKeys = 1000;
+
 // Helper - returns the wallet key to use for read/store/checking for existence.
 static QString makeWalletKey( const QString& key, const QString& realm )
 {
@@ -160,44 +167,31 @@ static bool storeInWallet( KWallet::Wallet* wallet, const QString& key, const KI
     return true;
 }
 
-static bool readFromWallet( KWallet::Wallet* wallet, const QString& key, const QString& realm, QString& username, QString& password, bool userReadOnly, QMap<QString,QString>& knownLogins )
+static void readLogins( const QMap<QString,QString>& map, QString& username, QString& password, bool userReadOnly, QMap<QString,QString>& knownLogins )
 {
-    //qCDebug(category) << "key =" << key << " username =" << username << " password =" /*<< password*/ << " userReadOnly =" << userReadOnly << " realm =" << realm;
-    if ( wallet->hasFolder( KWallet::Wallet::PasswordFolder() ) )
-    {
-        wallet->setFolder( KWallet::Wallet::PasswordFolder() );
-
-        QMap<QString,QString> map;
-        if ( wallet->readMap( makeWalletKey( key, realm ), map ) == 0 )
-        {
-            typedef QMap<QString,QString> Map;
-            int entryNumber = 1;
-            Map::ConstIterator end = map.constEnd();
-            Map::ConstIterator it = map.constFind( QStringLiteral("login") );
-            while ( it != end ) {
-                //qCDebug(category) << "found " << it.key() << "=" << it.value();
-                Map::ConstIterator pwdIter = map.constFind( makeMapKey( "password", entryNumber ) );
-                if ( pwdIter != end ) {
-                    if ( it.value() == username )
-                        password = pwdIter.value();
-                    knownLogins.insert( it.value(), pwdIter.value() );
-                }
-
-                it = map.constFind( QStringLiteral( "login-" ) + QString::number( ++entryNumber ) );
-            }
-            //qCDebug(category) << knownLogins.count() << " known logins";
+    typedef QMap<QString,QString> Map;
+    int entryNumber = 1;
+    Map::ConstIterator end = map.constEnd();
+    Map::ConstIterator it = map.constFind( QStringLiteral("login") );
+    while ( it != end ) {
+        //qCDebug(category) << "found " << it.key() << "=" << it.value();
+        Map::ConstIterator pwdIter = map.constFind( makeMapKey( "password", entryNumber ) );
+        if ( pwdIter != end ) {
+            if ( it.value() == username )
+                password = pwdIter.value();
+            knownLogins.insert( it.value(), pwdIter.value() );
+        }
 
-            if ( !userReadOnly && !knownLogins.isEmpty() && username.isEmpty() ) {
-                // Pick one, any one...
-                username = knownLogins.begin().key();
-                password = knownLogins.begin().value();
-                //qCDebug(category) << "picked the first one:" << username;
-            }
+        it = map.constFind( QStringLiteral( "login-" ) + QString::number( ++entryNumber ) );
+    }
+    //qCDebug(category) << knownLogins.count() << " known logins";
 
-            return true;
-        }
+    if ( !userReadOnly && !knownLogins.isEmpty() && username.isEmpty() ) {
+        // Pick one, any one...
+        username = knownLogins.begin().key();
+        password = knownLogins.begin().value();
+        //qCDebug(category) << "picked the first one:" << username;
     }
-    return false;
 }
 
 #endif
@@ -257,18 +251,14 @@ QByteArray KPasswdServer::checkAuthInfo(const QByteArray &data, qlonglong window
         if (!result &&
             !m_walletDisabled &&
             (info.username.isEmpty() || info.password.isEmpty()) &&
-            !KWallet::Wallet::keyDoesNotExist(KWallet::Wallet::NetworkWallet(),
-                                              KWallet::Wallet::PasswordFolder(),
-                                              makeWalletKey(key, info.realmValue)))
+            mayHaveWalletEntry(key, info.realmValue))
         {
             QMap<QString, QString> knownLogins;
-            if (openWallet(windowId)) {
-                if (readFromWallet(m_wallet, key, info.realmValue, info.username,
-                                   info.password, info.readOnly, knownLogins))
-                {
-                    info.setModified(true);
-                            // fall through
-                }
+            if (readWalletEntry(windowId, key, info.realmValue, info.username,
+                                info.password, info.readOnly, knownLogins))
+            {
+                info.setModified(true);
+                        // fall through
             }
         } else {
             info.setModified(false);
@@ -323,19 +313,36 @@ qlonglong KPasswdServer::checkAuthInfoAsync(KIO::AuthInfo info, qlonglong window
         if (!result &&
             !m_walletDisabled &&
             (info.username.isEmpty() || info.password.isEmpty()) &&
-            !KWallet::Wallet::keyDoesNotExist(KWallet::Wallet::NetworkWallet(),
-                                              KWallet::Wallet::PasswordFolder(),
-                                              makeWalletKey(key, info.realmValue)))
+            mayHaveWalletEntry(key, info.realmValue))
         {
             QMap<QString, QString> knownLogins;
-            if (openWallet(windowId)) {
-                if (readFromWallet(m_wallet, key, info.realmValue, info.username,
-                                   info.password, info.readOnly, knownLogins))
+            if (readFromWalletCache(key, info.realmValue, info.username,
+                                    info.password, info.readOnly, knownLogins))
+            {
+                info.setModified(true);
+            }
+            else if (isWalletOpen())
+            {
+                if (readWalletEntry(windowId, key, info.realmValue, info.username,
+                                    info.password, info.readOnly, knownLogins))
                 {
                     info.setModified(true);
                             // fall through
                 }
             }
+            else
+            {
+                // Opening the wallet may have to ask the user, answer once it is open.
+                Request *walletCheck = new Request;
+                walletCheck->isAsync = true;
+                walletCheck->requestId = requestId;
+                walletCheck->key = key;
+                walletCheck->info = info;
+                walletCheck->windowId = windowId;
+                m_walletWait.append(walletCheck);
+                openWalletAsync(windowId);
+                return 0; // ignored as we already sent a reply
+            }
         } else {
             info.setModified(false);
         }
@@ -445,6 +452,7 @@ KPasswdServer::addAuthInfo(const KIO::AuthInfo &info, qlonglong windowId)
 
 #ifdef HAVE_KF5WALLET
     if (!m_walletDisabled && openWallet(windowId) && storeInWallet(m_wallet, key, info)) {
+        forgetWalletEntries(key, info.realmValue);
         // Since storing the password in the wallet succeeded, make sure the
         // password information is stored in memory only for the duration the
         // windows associated with it are still around.
@@ -501,16 +509,177 @@ KPasswdServer::removeAuthInfo(const QString& host, const QString& protocol, cons
 bool
 KPasswdServer::openWallet( qlonglong windowId )
 {
-    if ( m_wallet && !m_wallet->isOpen() ) { // forced closed
+    if ( m_wallet && !m_wallet->isOpen() ) { // forced closed, or still opening
         delete m_wallet;
         m_wallet = nullptr;
     }
-    if ( !m_wallet )
+    if ( !m_wallet ) {
         m_wallet = KWallet::Wallet::openWallet(
             KWallet::Wallet::NetworkWallet(), (WId)(windowId));
+        if ( m_wallet )
+            watchWallet();
+    }
+    if ( m_walletOpening ) {
+        // The asynchronous open was given up, answer the checks waiting for it.
+        QMetaObject::invokeMethod(this, "walletOpened", Qt::QueuedConnection,
+                                  Q_ARG(bool, m_wallet != nullptr));
+    }
     return m_wallet != nullptr;
 }
+
+void
+KPasswdServer::openWalletAsync( qlonglong windowId )
+{
+    if ( m_walletOpening )
+        return;
+
+    delete m_wallet;
+    m_wallet = KWallet::Wallet::openWallet(
+        KWallet::Wallet::NetworkWallet(), (WId)(windowId), KWallet::Wallet::Asynchronous);
+    m_walletOpening = true;
+    if ( m_wallet ) {
+        connect(m_wallet, SIGNAL(walletOpened(bool)), this, SLOT(walletOpened(bool)));
+        watchWallet();
+    } else {
+        QMetaObject::invokeMethod(this, "walletOpened", Qt::QueuedConnection, Q_ARG(bool, false));
+    }
+}
+
+void
+KPasswdServer::watchWallet()
+{
+    // Entries read from the wallet are only kept while it is open and unchanged.
+    connect(m_wallet, SIGNAL(walletClosed()), this, SLOT(walletChanged()));
+    connect(m_wallet, SIGNAL(folderUpdated(QString)), this, SLOT(walletChanged()));
+}
+
+bool
+KPasswdServer::isWalletOpen() const
+{
+    return m_wallet && !m_walletOpening && m_wallet->isOpen();
+}
+
+// Checks whether the wallet has an entry for the key without opening it.
+bool
+KPasswdServer::mayHaveWalletEntry( const QString &key, const QString &realm )
+{
+    const QString walletKey = makeWalletKey( key, realm );
+    if ( m_walletCache.value( key ).contains( walletKey ) )
+        return true;
+
+    const qint64 now = time(nullptr);
+    QHash<QString, qint64>::iterator missing = m_missingWalletKeys.find( walletKey );
+    if ( missing != m_missingWalletKeys.end() ) {
+        if ( now - missing.value() < s_missingWalletKeyTimeout )
+            return false;
+        m_missingWalletKeys.erase( missing );
+    }
+
+    if ( KWallet::Wallet::keyDoesNotExist( KWallet::Wallet::NetworkWallet(),
+                                           KWallet::Wallet::PasswordFolder(), walletKey ) ) {
+        if ( m_missingWalletKeys.count() >= s_maxMissingWalletKeys )
+            m_missingWalletKeys.clear();
+        m_missingWalletKeys.insert( walletKey, now );
+        return false;
+    }
+    return true;
+}
+
+// Reads the entries of every realm of the key at once, the open wallet is
+// usually asked for the other realms of a host soon.
+void
+KPasswdServer::fetchWalletEntries( const QString &key, const QString &walletKey )
+{
+    WalletEntries &entries = m_walletCache[key];
+    if ( !m_wallet->hasFolder( KWallet::Wallet::PasswordFolder() ) )
+        return;
+    m_wallet->setFolder( KWallet::Wallet::PasswordFolder() );
+
+    WalletEntries found;
+    if ( m_wallet->readMapList( key + QLatin1Char('*'), found ) == 0 ) {
+        for ( WalletEntries::const_iterator it = found.constBegin(); it != found.constEnd(); ++it ) {
+            // the pattern also matches other hosts starting with this one
+            if ( it.key() == key || it.key().startsWith( key + QLatin1Char('-') ) )
+                entries.insert( it.key(), it.value() );
+        }
+    }
+    if ( !entries.contains( walletKey ) ) {
+        // the key may contain characters that are special in the pattern
+        QMap<QString,QString> map;
+        if ( m_wallet->readMap( walletKey, map ) == 0 )
+            entries.insert( walletKey, map );
+    }
+}
+
+void
+KPasswdServer::forgetWalletEntries( const QString &key, const QString &realm )
+{
+    m_walletCache.remove( key );
+    m_missingWalletKeys.remove( makeWalletKey( key, realm ) );
+}
+
+bool
+KPasswdServer::readFromWalletCache( const QString &key, const QString &realm, QString &username, QString &password, bool userReadOnly, QMap<QString,QString> &knownLogins )
+{
+    QHash<QString, WalletEntries>::const_iterator it = m_walletCache.constFind( key );
+    if ( it == m_walletCache.constEnd() )
+        return false;
+    WalletEntries::const_iterator entry = it.value().constFind( makeWalletKey( key, realm ) );
+    if ( entry == it.value().constEnd() )
+        return false;
+    readLogins( entry.value(), username, password, userReadOnly, knownLogins );
+    return true;
+}
+
+bool
+KPasswdServer::readWalletEntry( qlonglong windowId, const QString &key, const QString &realm, QString &username, QString &password, bool userReadOnly, QMap<QString,QString> &knownLogins )
+{
+    if ( readFromWalletCache( key, realm, username, password, userReadOnly, knownLogins ) )
+        return true;
+    if ( !openWallet( windowId ) )
+        return false;
+    fetchWalletEntries( key, makeWalletKey( key, realm ) );
+    return readFromWalletCache( key, realm, username, password, userReadOnly, knownLogins );
+}
+#endif
+
+void
+KPasswdServer::walletOpened(bool success)
+{
+#ifdef HAVE_KF5WALLET
+    m_walletOpening = false;
+    if (!success && m_wallet) {
+        m_wallet->deleteLater();
+        m_wallet = nullptr;
+    }
+
+    const QList<Request*> checks = m_walletWait;
+    m_walletWait.clear();
+    Q_FOREACH(Request *request, checks) {
+        KIO::AuthInfo &info = request->info;
+        QMap<QString, QString> knownLogins;
+        if (success &&
+            readWalletEntry(request->windowId, request->key, info.realmValue, info.username,
+                            info.password, info.readOnly, knownLogins))
+        {
+            info.setModified(true);
+        }
+        emit checkAuthInfoAsyncResult(request->requestId, m_seqNr, info);
+        delete request;
+    }
+#else
+    Q_UNUSED(success);
+#endif
+}
+
+void
+KPasswdServer::walletChanged()
+{
+#ifdef HAVE_KF5WALLET
+    m_walletCache.clear();
+    m_missingWalletKeys.clear();
 #endif
+}
 
 void
 KPasswdServer::processRequest()
@@ -652,10 +821,11 @@ KPasswdServer::findAuthInfoItem(const QString &key, const KIO::AuthInfo &info)
    if (authList)
    {
       QString path2 = info.url.path().left(info.url.path().indexOf('/')+1);
+      const qulonglong now = static_cast<qulonglong>(time(nullptr));
       Q_FOREACH(AuthInfoContainer *current, *authList)
       {
           if (current->expire == AuthInfoContainer::expTime &&
-              static_cast<qulonglong>(time(nullptr)) > current->expireTime)
+              now > current->expireTime)
           {
               authList->removeOne(current);
               delete current;
@@ -744,8 +914,9 @@ KPasswdServer::addAuthInfoItem(const QString &key, const KIO::AuthInfo &info, ql
    updateAuthExpire(key, authItem, windowId, (info.keepPassword && !canceled));
 
    // Insert into list, keep the list sorted "longest path" first.
-   authList->append(authItem);
-   std::sort(authList->begin(), authList->end(), AuthInfoContainer::Sorter());
+   // Inserting after the equal ones keeps the order the full sort gave.
+   authList->insert(std::upper_bound(authList->begin(), authList->end(), authItem,
+                                     AuthInfoContainer::Sorter()), authItem);
 }
 
 void
@@ -819,11 +990,10 @@ void KPasswdServer::showPasswordDialog (KPasswdServer::Request* request)
     if ( !bypassCacheAndKWallet
         && ( username.isEmpty() || password.isEmpty() )
         && !m_walletDisabled
-        && !KWallet::Wallet::keyDoesNotExist(KWallet::Wallet::NetworkWallet(), KWallet::Wallet::PasswordFolder(), makeWalletKey( request->key, info.realmValue )) )
+        && mayHaveWalletEntry( request->key, info.realmValue ) )
     {
         // no login+pass provided, check if kwallet has one
-        if ( openWallet( request->windowId ) )
-            hasWalletData = readFromWallet( m_wallet, request->key, info.realmValue, username, password, info.readOnly, knownLogins );
+        hasWalletData = readWalletEntry( request->windowId, request->key, info.realmValue, username, password, info.readOnly, knownLogins );
     }
 #endif
 
@@ -1026,6 +1196,7 @@ void KPasswdServer::passwordDialogDone(int result)
 #ifdef HAVE_KF5WALLET
                 const bool skipAutoCaching = info.getExtraField(AUTHINFO_EXTRAFIELD_SKIP_CACHING_ON_QUERY).toBool();
                 if (!skipAutoCaching && info.keepPassword && openWallet(request->windowId)) {
+                    forgetWalletEntries( request->key, info.realmValue );
                     if ( storeInWallet( m_wallet, request->key, info ) )
                         // password is in wallet, don't keep it in memory after window is closed
                         info.keepPassword = false;
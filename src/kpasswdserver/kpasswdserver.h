@@ -27,6 +27,7 @@
 
 #include <QHash>
 #include <QList>
+#include <QMap>
 #include <QWidget>
 #include <QDBusContext>
 #include <QDBusMessage>
@@ -72,6 +73,8 @@ private Q_SLOTS:
   void passwordDialogDone(int);
   void retryDialogDone(int);
   void windowRemoved(WId);
+  void walletOpened(bool);
+  void walletChanged();
 
 private:
   struct AuthInfoContainer {
@@ -113,6 +116,14 @@ private:
 
 #ifdef HAVE_KF5WALLET
   bool openWallet( qlonglong windowId );
+  void openWalletAsync( qlonglong windowId );
+  void watchWallet();
+  bool isWalletOpen() const;
+  bool mayHaveWalletEntry( const QString &key, const QString &realm );
+  void fetchWalletEntries( const QString &key, const QString &walletKey );
+  void forgetWalletEntries( const QString &key, const QString &realm );
+  bool readFromWalletCache( const QString &key, const QString &realm, QString &username, QString &password, bool userReadOnly, QMap<QString,QString> &knownLogins );
+  bool readWalletEntry( qlonglong windowId, const QString &key, const QString &realm, QString &username, QString &password, bool userReadOnly, QMap<QString,QString> &knownLogins );
 #endif
 
   bool hasPendingQuery(const QString &key, const KIO::AuthInfo &info);
@@ -131,6 +142,14 @@ private:
   QStringList m_authPrompted;
   KWallet::Wallet* m_wallet;
   bool m_walletDisabled;
+  bool m_walletOpening;
+  // checks waiting for the wallet to open
+  QList<Request*> m_walletWait;
+  // the entries of the open wallet read so far, by cache key, then wallet key
+  typedef QMap<QString, QMap<QString, QString> > WalletEntries;
+  QHash<QString, WalletEntries> m_walletCache;
+  // wallet keys known not to exist, with the time of the check
+  QHash<QString, qint64> m_missingWalletKeys;
   qlonglong m_seqNr;
 };
 
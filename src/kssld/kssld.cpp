@@ -23,6 +23,7 @@
 #include "kssld.h"
 
 #include "ksslcertificatemanager.h"
+#include "ksslcertificatemanager_p.h"
 #include "kssld_adaptor.h"
 
 #include <kconfig.h>
@@ -30,9 +31,20 @@
 #include <QFile>
 
 #include <QDate>
+#include <QPair>
+#include <QTimer>
+#include <QVector>
 #include <kpluginfactory.h>
 #include <kpluginloader.h>
 
+#include <algorithm>
+#include <functional>
+
+// delay before changed rules are written to disk, in milliseconds
+static const int s_syncDelay = 500;
+// longest single wait of the expiry timer, in milliseconds
+static const int s_maxExpiryInterval = 24 * 60 * 60 * 1000;
+
 K_PLUGIN_FACTORY_WITH_JSON(KSSLDFactory, "kssld.json", registerPlugin<KSSLD>();)
 
 class KSSLDPrivate
@@ -68,23 +80,178 @@ public:
             stringToSslError.insert(s, e);
             sslErrorToString.insert(e, s);
         }
+
+        syncTimer.setSingleShot(true);
+        syncTimer.setInterval(s_syncDelay);
+        expiryTimer.setSingleShot(true);
     }
 
+    struct Rule {
+        QDateTime expiryDateTime;
+        bool isRejected;
+        QList<KSslError::Error> ignoredErrors;
+    };
+    // the hex digest of the certificate and the host name or wildcard pattern
+    typedef QPair<QByteArray, QString> RuleKey;
+    typedef QPair<qint64, RuleKey> Expiry;
+
+    void loadRules();
+    bool parseRule(QStringList sl, Rule *rule) const;
+    void insertRule(const RuleKey &key, const Rule &rule);
+    void removeRule(const RuleKey &key);
+    void expireRules();
+    void scheduleExpiry();
+    void scheduleSync();
+
     KConfig config;
     QHash<QString, KSslError::Error> stringToSslError;
     QHash<KSslError::Error, QString> sslErrorToString;
+    // all rules of the config file, so that lookups don't have to parse it
+    QHash<RuleKey, Rule> rules;
+    // min-heap of the expiry times; entries of replaced or removed rules are skipped
+    QVector<Expiry> expiryQueue;
+    QTimer expiryTimer;
+    QTimer syncTimer;
 };
 
+void KSSLDPrivate::loadRules()
+{
+    // be careful about iterating over KConfig(Group) while changing it
+    foreach (const QString &groupName, config.groupList()) {
+        const QByteArray certDigest = groupName.toLatin1();
+        KConfigGroup group = config.group(groupName);
+        foreach (const QString &key, group.keyList()) {
+            if (key == QLatin1String("CertificatePEM")) {
+                continue;
+            }
+            Rule rule;
+            if (parseRule(group.readEntry(key, QStringList()), &rule)) {
+                insertRule(qMakePair(certDigest, key), rule);
+            } else {
+                //the entry is malformed so we remove it
+                removeRule(qMakePair(certDigest, key));
+            }
+        }
+    }
+}
+
+bool KSSLDPrivate::parseRule(QStringList sl, Rule *rule) const
+{
+    //parse entry of the format "ExpireUTC <date>, Reject" or
+    //"ExpireUTC <date>, HostNameMismatch, ExpiredCertificate, ..."
+    QDateTime expiryDt;
+    // the rule is well-formed if it contains at least the expire date and one directive
+    if (sl.size() >= 2) {
+        QString dtString = sl.takeFirst();
+        if (dtString.startsWith(QLatin1String("ExpireUTC "))) {
+            dtString.remove(0, 10/* length of "ExpireUTC " */);
+            expiryDt = QDateTime::fromString(dtString, Qt::ISODate);
+        }
+    }
+    if (!expiryDt.isValid()) {
+        return false;
+    }
+
+    QList<KSslError::Error> ignoredErrors;
+    bool isRejected = false;
+    foreach (const QString &s, sl) {
+        if (s == QLatin1String("Reject")) {
+            isRejected = true;
+            ignoredErrors.clear();
+            break;
+        }
+        if (!stringToSslError.contains(s)) {
+            continue;
+        }
+        ignoredErrors.append(stringToSslError.value(s));
+    }
+
+    rule->expiryDateTime = expiryDt;
+    rule->isRejected = isRejected;
+    rule->ignoredErrors = ignoredErrors;
+    return true;
+}
+
+void KSSLDPrivate::insertRule(const RuleKey &key, const Rule &rule)
+{
+    rules.insert(key, rule);
+
+    // drop the entries of replaced rules once they make up most of the queue
+    if (expiryQueue.size() > 2 * rules.size() + 16) {
+        expiryQueue.clear();
+        for (QHash<RuleKey, Rule>::const_iterator it = rules.constBegin(); it != rules.constEnd(); ++it) {
+            expiryQueue.append(qMakePair(it.value().expiryDateTime.toMSecsSinceEpoch(), it.key()));
+        }
+        std::make_heap(expiryQueue.begin(), expiryQueue.end(), std::greater<Expiry>());
+    } else {
+        expiryQueue.append(qMakePair(rule.expiryDateTime.toMSecsSinceEpoch(), key));
+        std::push_heap(expiryQueue.begin(), expiryQueue.end(), std::greater<Expiry>());
+    }
+    scheduleExpiry();
+}
+
+void KSSLDPrivate::removeRule(const RuleKey &key)
+{
+    rules.remove(key);
+
+    KConfigGroup group = config.group(key.first);
+    group.deleteEntry(key.second);
+    //the group is useless once only the CertificatePEM entry left
+    if (group.keyList().size() < 2) {
+        group.deleteGroup();
+    }
+    scheduleSync();
+}
+
+void KSSLDPrivate::expireRules()
+{
+    const qint64 now = QDateTime::currentMSecsSinceEpoch();
+    while (!expiryQueue.isEmpty() && expiryQueue.first().first < now) {
+        const Expiry expiry = expiryQueue.first();
+        std::pop_heap(expiryQueue.begin(), expiryQueue.end(), std::greater<Expiry>());
+        expiryQueue.removeLast();
+
+        QHash<RuleKey, Rule>::const_iterator it = rules.constFind(expiry.second);
+        if (it != rules.constEnd() && it.value().expiryDateTime.toMSecsSinceEpoch() == expiry.first) {
+            removeRule(expiry.second);
+        }
+    }
+    scheduleExpiry();
+}
+
+void KSSLDPrivate::scheduleExpiry()
+{
+    if (expiryQueue.isEmpty()) {
+        expiryTimer.stop();
+        return;
+    }
+    // a rule is expired once its expiry time has passed
+    const qint64 wait = expiryQueue.first().first + 1 - QDateTime::currentMSecsSinceEpoch();
+    expiryTimer.start(int(qBound(qint64(0), wait, qint64(s_maxExpiryInterval))));
+}
+
+void KSSLDPrivate::scheduleSync()
+{
+    // coalesce the writes of a burst of changes
+    if (!syncTimer.isActive()) {
+        syncTimer.start();
+    }
+}
+
 KSSLD::KSSLD(QObject *parent, const QVariantList &)
     : KDEDModule(parent),
       d(new KSSLDPrivate())
 {
     new KSSLDAdaptor(this);
+    connect(&d->syncTimer, &QTimer::timeout, this, [this]() { d->config.sync(); });
+    connect(&d->expiryTimer, &QTimer::timeout, this, [this]() { d->expireRules(); });
+    d->loadRules();
     pruneExpiredRules();
 }
 
 KSSLD::~KSSLD()
 {
+    d->config.sync();
     delete d;
 }
 
@@ -93,7 +260,8 @@ void KSSLD::setRule(const KSslCertificateRule &rule)
     if (rule.hostName().isEmpty()) {
         return;
     }
-    KConfigGroup group = d->config.group(rule.certificate().digest().toHex());
+    const QByteArray certDigest = rule.certificate().digest().toHex();
+    KConfigGroup group = d->config.group(certDigest);
 
     QStringList sl;
 
@@ -118,7 +286,18 @@ void KSSLD::setRule(const KSslCertificateRule &rule)
     }
 #endif
     group.writeEntry(rule.hostName(), sl);
-    group.sync();
+    d->scheduleSync();
+
+    // keep exactly what a later read of the entry would give
+    const KSSLDPrivate::RuleKey key = qMakePair(certDigest, rule.hostName());
+    KSSLDPrivate::Rule r;
+    if (d->parseRule(sl, &r)) {
+        d->insertRule(key, r);
+    } else {
+        d->removeRule(key);
+    }
+    // slaves drop the verdicts they remember
+    _bumpKsslRuleRevision();
 }
 
 void KSSLD::clearRule(const KSslCertificateRule &rule)
@@ -128,27 +307,13 @@ void KSSLD::clearRule(const KSslCertificateRule &rule)
 
 void KSSLD::clearRule(const QSslCertificate &cert, const QString &hostName)
 {
-    KConfigGroup group = d->config.group(cert.digest().toHex());
-    group.deleteEntry(hostName);
-    if (group.keyList().size() < 2) {
-        group.deleteGroup();
-    }
-    group.sync();
+    d->removeRule(qMakePair(cert.digest().toHex(), hostName));
+    _bumpKsslRuleRevision();
 }
 
 void KSSLD::pruneExpiredRules()
 {
-    // expired rules are deleted when trying to load them, so we just try to load all rules.
-    // be careful about iterating over KConfig(Group) while changing it
-    foreach (const QString &groupName, d->config.groupList()) {
-        QByteArray certDigest = groupName.toLatin1();
-        foreach (const QString &key, d->config.group(groupName).keyList()) {
-            if (key == QLatin1String("CertificatePEM")) {
-                continue;
-            }
-            KSslCertificateRule r = rule(QSslCertificate(certDigest), key);
-        }
-    }
+    d->expireRules();
 }
 
 // check a domain name with subdomains for well-formedness and count the dot-separated parts
@@ -184,7 +349,7 @@ static QString normalizeSubdomains(const QString &hostName, int *namePartsCount)
 KSslCertificateRule KSSLD::rule(const QSslCertificate &cert, const QString &hostName) const
 {
     const QByteArray certDigest = cert.digest().toHex();
-    KConfigGroup group = d->config.group(certDigest);
+    QHash<KSSLDPrivate::RuleKey, KSSLDPrivate::Rule>::const_iterator it;
 
     KSslCertificateRule ret(cert, hostName);
     bool foundHostName = false;
@@ -193,7 +358,8 @@ KSslCertificateRule KSSLD::rule(const QSslCertificate &cert, const QString &host
     QString needle = normalizeSubdomains(hostName, &needlePartsCount);
 
     // Find a rule for the hostname, either...
-    if (group.hasKey(needle)) {
+    it = d->rules.constFind(qMakePair(certDigest, needle));
+    if (it != d->rules.constEnd()) {
         // directly (host, site.tld, a.site.tld etc)
         if (needlePartsCount >= 1) {
             foundHostName = true;
@@ -207,7 +373,8 @@ KSslCertificateRule KSSLD::rule(const QSslCertificate &cert, const QString &host
             Q_ASSERT(dotIndex > 0); // if this fails normalizeSubdomains() failed
             needle.remove(0, dotIndex - 1);
             needle[0] = QChar::fromLatin1('*');
-            if (group.hasKey(needle)) {
+            it = d->rules.constFind(qMakePair(certDigest, needle));
+            if (it != d->rules.constEnd()) {
                 foundHostName = true;
                 break;
             }
@@ -220,48 +387,18 @@ KSslCertificateRule KSSLD::rule(const QSslCertificate &cert, const QString &host
         return KSslCertificateRule(cert, hostName);
     }
 
-    //parse entry of the format "ExpireUTC <date>, Reject" or
-    //"ExpireUTC <date>, HostNameMismatch, ExpiredCertificate, ..."
-    QStringList sl = group.readEntry(needle, QStringList());
-
-    QDateTime expiryDt;
-    // the rule is well-formed if it contains at least the expire date and one directive
-    if (sl.size() >= 2) {
-        QString dtString = sl.takeFirst();
-        if (dtString.startsWith(QLatin1String("ExpireUTC "))) {
-            dtString.remove(0, 10/* length of "ExpireUTC " */);
-            expiryDt = QDateTime::fromString(dtString, Qt::ISODate);
-        }
-    }
-
-    if (!expiryDt.isValid() || expiryDt < QDateTime::currentDateTime()) {
-        //the entry is malformed or expired so we remove it
-        group.deleteEntry(needle);
-        //the group is useless once only the CertificatePEM entry left
-        if (group.keyList().size() < 2) {
-            group.deleteGroup();
-        }
+    const KSSLDPrivate::Rule r = it.value();
+    if (r.expiryDateTime < QDateTime::currentDateTime()) {
+        //the entry is expired so we remove it
+        const KSSLDPrivate::RuleKey key = it.key();
+        d->removeRule(key);
         return ret;
     }
 
-    QList<KSslError::Error> ignoredErrors;
-    bool isRejected = false;
-    foreach (const QString &s, sl) {
-        if (s == QLatin1String("Reject")) {
-            isRejected = true;
-            ignoredErrors.clear();
-            break;
-        }
-        if (!d->stringToSslError.contains(s)) {
-            continue;
-        }
-        ignoredErrors.append(d->stringToSslError.value(s));
-    }
-
     //Everything is checked and we can make ret valid
-    ret.setExpiryDateTime(expiryDt);
-    ret.setRejected(isRejected);
-    ret.setIgnoredErrors(ignoredErrors);
+    ret.setExpiryDateTime(r.expiryDateTime);
+    ret.setRejected(r.isRejected);
+    ret.setIgnoredErrors(r.ignoredErrors);
     return ret;
 }
 
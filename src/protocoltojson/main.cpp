@@ -83,7 +83,8 @@ int main (int argc, char *argv[])
         << QStringLiteral("opening") << QStringLiteral("copyFromFile")
         << QStringLiteral("copyToFile") << QStringLiteral("renameFromFile")
         << QStringLiteral("renameToFile") << QStringLiteral("deleteRecursive")
-        << QStringLiteral("determineMimetypeFromExtension") << QStringLiteral("ShowPreviews");
+        << QStringLiteral("determineMimetypeFromExtension") << QStringLiteral("ShowPreviews")
+        << QStringLiteral("inProcess") << QStringLiteral("openConnection");
 
     QStringList intAttributes;
     intAttributes << QStringLiteral("maxInstances") << QStringLiteral("maxInstancesPerHost");
@@ -40,6 +40,17 @@ SearchProvider::SearchProvider(const QString &servicePath)
     m_charset = group.readEntry(QStringLiteral("Charset"));
 }
 
+SearchProvider::SearchProvider(const QString &desktopEntryName, const QString &name, const QStringList &keys,
+                               const QString &query, const QString &charset)
+               : m_query(query),
+                 m_charset(charset),
+                 m_dirty(false)
+{
+    setDesktopEntryName(desktopEntryName);
+    KUriFilterSearchProvider::setName(name);
+    KUriFilterSearchProvider::setKeys(keys);
+}
+
 SearchProvider::~SearchProvider()
 {
 }
@@ -27,6 +27,8 @@ class SearchProvider : public KUriFilterSearchProvider
 public:
     SearchProvider() : m_dirty(false) {}
     explicit SearchProvider(const QString &servicePath);
+    SearchProvider(const QString &desktopEntryName, const QString &name, const QStringList &keys,
+                   const QString &query, const QString &charset);
     ~SearchProvider();
 
     const QString& charset() const { return m_charset; }
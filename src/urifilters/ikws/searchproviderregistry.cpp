@@ -23,17 +23,78 @@
 #include "searchprovider.h"
 
 #include <QStandardPaths>
+#include <QDateTime>
 #include <QDir>
+#include <QFileInfo>
+#include <QJsonDocument>
+#include <QLocale>
+#include <QSaveFile>
 #include <QDebug>
 
+/*
+   Every process using the web shortcuts filter used to parse all search
+   provider desktop files, a few hundred of them, before the first lookup.
+   Now what they contain is kept in an index, a binary JSON document with the
+   providers by desktop file name and the keywords pointing to them. It is
+   mapped into memory and a provider is only created when it is looked up.
+   The index is valid as long as the directories searched are the same and
+   unmodified; adding, removing or saving a desktop file (which KConfig does
+   by renaming) changes the modification time of its directory. A file
+   written in place only changes its own, so that is checked for every
+   provider too. The names are translated, so the language is checked as well.
+*/
+static const int s_searchProviderIndexVersion = 2;
+
+static QString searchProviderIndexFileName()
+{
+    return QStandardPaths::writableLocation(QStandardPaths::GenericCacheLocation) + QLatin1String("/kio_searchproviders_index");
+}
+
+static QString indexLanguage()
+{
+    return QLocale().name() + QLatin1Char(':') + QString::fromLocal8Bit(qgetenv("LANGUAGE"));
+}
+
+static double fileModificationTime(const QString &path)
+{
+    const QFileInfo info(path);
+    return info.exists() ? double(info.lastModified().toMSecsSinceEpoch()) : -1.0;
+}
+
+static QJsonArray indexedDirectories(const QStringList &dirs)
+{
+    QJsonArray result;
+    for (const QString &dir : dirs) {
+        QJsonObject entry;
+        entry.insert(QStringLiteral("path"), dir);
+        entry.insert(QStringLiteral("mtime"), fileModificationTime(dir));
+        result.append(entry);
+    }
+    return result;
+}
+
+static bool providersUnchanged(const QJsonObject &providers)
+{
+    for (QJsonObject::ConstIterator it = providers.constBegin(); it != providers.constEnd(); ++it) {
+        const QJsonObject entry = it.value().toObject();
+        if (entry.value(QStringLiteral("mtime")).toDouble() != fileModificationTime(entry.value(QStringLiteral("path")).toString())) {
+            return false;
+        }
+    }
+    return true;
+}
+
 SearchProviderRegistry::SearchProviderRegistry()
+    : m_allLoaded(false),
+      m_indexData(nullptr)
 {
     reload();
 }
 
 SearchProviderRegistry::~SearchProviderRegistry()
 {
-    qDeleteAll(m_searchProviders);
+    qDeleteAll(m_searchProvidersByDesktopName);
+    unloadIndex();
 }
 
 QStringList SearchProviderRegistry::directories() const
@@ -47,11 +108,21 @@ QStringList SearchProviderRegistry::directories() const
 void SearchProviderRegistry::reload()
 {
     m_searchProvidersByKey.clear();
+    qDeleteAll(m_searchProvidersByDesktopName);
     m_searchProvidersByDesktopName.clear();
-    qDeleteAll(m_searchProviders);
     m_searchProviders.clear();
+    m_allLoaded = false;
+    unloadIndex();
 
     const QStringList servicesDirs = directories();
+    const QJsonArray indexDirs = indexedDirectories(servicesDirs);
+    if (loadIndex(indexDirs)) {
+        return;
+    }
+
+    QJsonObject indexedProviders;
+    QJsonObject indexedKeys;
+    QJsonArray indexedOrder;
     for (const QString &dirPath : servicesDirs) {
         QDir dir(dirPath);
         for (const QString &file : dir.entryList({QStringLiteral("*.desktop")}, QDir::Files)) {
@@ -62,23 +133,147 @@ void SearchProviderRegistry::reload()
                 m_searchProviders.append(provider);
                 for (const QString &key : provider->keys()) {
                     m_searchProvidersByKey.insert(key, provider);
+                    indexedKeys.insert(key, file);
                 }
+
+                QJsonObject entry;
+                entry.insert(QStringLiteral("name"), provider->name());
+                entry.insert(QStringLiteral("keys"), QJsonArray::fromStringList(provider->keys()));
+                entry.insert(QStringLiteral("query"), provider->query());
+                entry.insert(QStringLiteral("charset"), provider->charset());
+                entry.insert(QStringLiteral("path"), filePath);
+                entry.insert(QStringLiteral("mtime"), fileModificationTime(filePath));
+                indexedProviders.insert(file, entry);
+                indexedOrder.append(file);
             }
         }
     }
+    m_allLoaded = true;
+
+    QJsonObject index;
+    index.insert(QStringLiteral("version"), s_searchProviderIndexVersion);
+    index.insert(QStringLiteral("language"), indexLanguage());
+    index.insert(QStringLiteral("directories"), indexDirs);
+    index.insert(QStringLiteral("providers"), indexedProviders);
+    index.insert(QStringLiteral("keys"), indexedKeys);
+    index.insert(QStringLiteral("order"), indexedOrder);
+    saveIndex(index);
+}
+
+bool SearchProviderRegistry::loadIndex(const QJsonArray &directories)
+{
+    m_indexFile.setFileName(searchProviderIndexFileName());
+    if (!m_indexFile.open(QIODevice::ReadOnly) || m_indexFile.size() == 0) {
+        m_indexFile.close();
+        return false;
+    }
+    const qint64 size = m_indexFile.size();
+    uchar *data = m_indexFile.map(0, size);
+    if (!data) {
+        m_indexFile.close();
+        return false;
+    }
+
+    bool valid;
+    {
+        // the document refers to the mapped data, which stays mapped while the index is used
+        const QJsonObject index = QJsonDocument::fromRawData(reinterpret_cast<const char *>(data), size).object();
+        valid = index.value(QStringLiteral("version")).toInt() == s_searchProviderIndexVersion
+                && index.value(QStringLiteral("language")).toString() == indexLanguage()
+                && index.value(QStringLiteral("directories")).toArray() == directories
+                && providersUnchanged(index.value(QStringLiteral("providers")).toObject());
+        if (valid) {
+            m_indexedProviders = index.value(QStringLiteral("providers")).toObject();
+            m_indexedKeys = index.value(QStringLiteral("keys")).toObject();
+            m_indexedOrder = index.value(QStringLiteral("order")).toArray();
+        }
+    }
+    if (!valid) {
+        m_indexFile.unmap(data);
+        m_indexFile.close();
+        return false;
+    }
+
+    m_indexData = data;
+    return true;
+}
+
+void SearchProviderRegistry::saveIndex(const QJsonObject &index)
+{
+    const QString fileName = searchProviderIndexFileName();
+    QDir().mkpath(QFileInfo(fileName).absolutePath());
+    QSaveFile file(fileName);
+    if (!file.open(QIODevice::WriteOnly)) {
+        return;
+    }
+    file.write(QJsonDocument(index).toBinaryData());
+    file.commit();
+}
+
+void SearchProviderRegistry::unloadIndex()
+{
+    // nothing may refer to the mapped data once it is gone
+    m_indexedProviders = QJsonObject();
+    m_indexedKeys = QJsonObject();
+    m_indexedOrder = QJsonArray();
+    if (m_indexData) {
+        m_indexFile.unmap(m_indexData);
+        m_indexData = nullptr;
+    }
+    m_indexFile.close();
+}
+
+SearchProvider *SearchProviderRegistry::providerForFile(const QString &file) const
+{
+    if (file.isEmpty()) {
+        return nullptr;
+    }
+    SearchProvider *provider = m_searchProvidersByDesktopName.value(file);
+    if (provider || !m_indexData) {
+        return provider;
+    }
+
+    const QJsonValue value = m_indexedProviders.value(file);
+    if (!value.isObject()) {
+        return nullptr;
+    }
+    const QJsonObject entry = value.toObject();
+    const QJsonArray indexedKeys = entry.value(QStringLiteral("keys")).toArray();
+    QStringList keys;
+    for (const QJsonValue &key : indexedKeys) {
+        keys.append(key.toString());
+    }
+    provider = new SearchProvider(QFileInfo(file).baseName(), entry.value(QStringLiteral("name")).toString(), keys,
+                                  entry.value(QStringLiteral("query")).toString(),
+                                  entry.value(QStringLiteral("charset")).toString());
+    m_searchProvidersByDesktopName.insert(file, provider);
+    return provider;
 }
 
 QList<SearchProvider *> SearchProviderRegistry::findAll()
 {
+    if (!m_allLoaded) {
+        m_searchProviders.clear();
+        const QJsonArray order = m_indexedOrder;
+        for (const QJsonValue &file : order) {
+            if (SearchProvider *provider = providerForFile(file.toString())) {
+                m_searchProviders.append(provider);
+            }
+        }
+        m_allLoaded = true;
+    }
     return m_searchProviders;
 }
 
 SearchProvider* SearchProviderRegistry::findByKey(const QString& key) const
 {
+    if (m_indexData) {
+        return providerForFile(m_indexedKeys.value(key).toString());
+    }
     return m_searchProvidersByKey.value(key);
 }
 
 SearchProvider* SearchProviderRegistry::findByDesktopName(const QString &name) const
 {
-    return m_searchProvidersByDesktopName.value(name + ".desktop");
+    return providerForFile(name + ".desktop");
 }
@@ -22,13 +22,20 @@
 #ifndef SEARCHPROVIDERREGISTRY_H
 #define SEARCHPROVIDERREGISTRY_H
 
+#include <QFile>
+#include <QHash>
+#include <QJsonArray>
+#include <QJsonObject>
 #include <QList>
-#include <QMap>
 
 class SearchProvider;
 
 /**
  * Memory cache for search provider desktop files
+ *
+ * The desktop files are parsed only when the keyword index in the cache
+ * directory is missing or outdated. Otherwise the index is mapped into memory
+ * and a provider is created from it the first time it is asked for.
  */
 class SearchProviderRegistry
 {
@@ -52,10 +59,24 @@ public:
 private:
     void reload();
     QStringList directories() const;
+    bool loadIndex(const QJsonArray &directories);
+    void saveIndex(const QJsonObject &index);
+    void unloadIndex();
+    SearchProvider *providerForFile(const QString &file) const;
 
+    // all providers in the order of the directories, complete once m_allLoaded is set
     QList<SearchProvider *> m_searchProviders;
-    QMap<QString, SearchProvider *> m_searchProvidersByKey;
-    QMap<QString, SearchProvider *> m_searchProvidersByDesktopName;
+    bool m_allLoaded;
+    // owns every provider created so far, by desktop file name
+    mutable QHash<QString, SearchProvider *> m_searchProvidersByDesktopName;
+    QHash<QString, SearchProvider *> m_searchProvidersByKey;
+
+    // the mapped index, when it is used
+    QFile m_indexFile;
+    uchar *m_indexData;
+    QJsonObject m_indexedProviders; // desktop file name -> entry
+    QJsonObject m_indexedKeys; // keyword -> desktop file name
+    QJsonArray m_indexedOrder;
 };
 
 #endif // SEARCHPROVIDERREGISTRY_H
@@ -25,6 +25,11 @@
 #include "../../pathhelpers_p.h"
 
 #include <QDir>
+#include <QElapsedTimer>
+#include <QHash>
+#include <QMutex>
+#include <QRunnable>
+#include <QThreadPool>
 #include <QtDBus>
 #include <QRegularExpression>
 #include <qplatformdefs.h>
@@ -94,6 +99,209 @@ static QString removeArgs( const QString& _cmd )
   return cmd;
 }
 
+namespace {
+struct FileProbe
+{
+    FileProbe() : exists(false), isDir(false), isRegular(false), isExecutable(false) {}
+
+    bool exists;
+    bool isDir;
+    bool isRegular;
+    bool isExecutable;
+};
+}
+
+static FileProbe probeFileNow(const QString &path)
+{
+    FileProbe probe;
+    QT_STATBUF buff;
+    const QByteArray encodedPath = QFile::encodeName(path);
+    if (QT_STAT(encodedPath.constData(), &buff) == 0) {
+        probe.exists = true;
+        probe.isDir = ((buff.st_mode & QT_STAT_MASK) == QT_STAT_DIR);
+        probe.isRegular = ((buff.st_mode & QT_STAT_MASK) == QT_STAT_REG);
+        probe.isExecutable = !probe.isDir && access(encodedPath.constData(), X_OK) == 0;
+    }
+    return probe;
+}
+
+// An executable found in $PATH counts as an existing executable file
+static FileProbe probeExecutableNow(const QString &name)
+{
+    FileProbe probe;
+    if (!QStandardPaths::findExecutable(name).isEmpty()) {
+        probe.exists = true;
+        probe.isRegular = true;
+        probe.isExecutable = true;
+    }
+    return probe;
+}
+
+typedef FileProbe (*ProbeFunction)(const QString &);
+
+static const qint64 s_existingFileLifetime = 10000; // msecs
+static const qint64 s_missingFileLifetime = 2000;
+static const qint64 s_probeDeadline = 5000;
+static const int s_maxProbedFiles = 256;
+static const int s_maxQueuedProbes = 16;
+
+/*
+ * Remembers what was found out about local files for a short while, and finds
+ * out about new ones in the background. Typing into a location bar filters
+ * almost the same text again and again, and a stat() on a stalled network
+ * mount must not block the GUI.
+ *
+ * The probes on a stalled mount can occupy all threads for a long time, so
+ * only a few probes are queued at once, and a path that has not been probed
+ * by its deadline is probed again by a new job; jobs which are overtaken like
+ * this are skipped when their turn comes.
+ */
+class FileProbeCache
+{
+public:
+    explicit FileProbeCache(ProbeFunction probeFunction)
+        : m_probeFunction(probeFunction),
+          m_queuedProbes(0),
+          m_lastProbeId(0)
+    {
+        m_clock.start();
+        // a stalled mount blocks a thread for a long time, do not take them from the global pool
+        m_threadPool.setMaxThreadCount(4);
+        m_threadPool.setExpiryTimeout(10000);
+    }
+
+    // @returns false if @p path is being probed in the background
+    bool lookup(const QString &path, FileProbe *probe)
+    {
+        QMutexLocker locker(&m_mutex);
+        const qint64 now = m_clock.elapsed();
+        QHash<QString, Entry>::ConstIterator it = m_entries.constFind(path);
+        if (it != m_entries.constEnd()) {
+            if (it->pending) {
+                if (now - it->time < s_probeDeadline) {
+                    return false;
+                }
+            } else if (now - it->time < (it->probe.exists ? s_existingFileLifetime : s_missingFileLifetime)) {
+                *probe = it->probe;
+                return true;
+            }
+        }
+
+        // the caller filters again later, when there is room for the probe
+        if (m_queuedProbes >= s_maxQueuedProbes) {
+            return false;
+        }
+
+        if (m_entries.count() >= s_maxProbedFiles) {
+            removeFinishedEntries(now);
+        }
+        Entry &entry = m_entries[path];
+        entry.time = now;
+        entry.pending = true;
+        entry.probeId = ++m_lastProbeId;
+        ++m_queuedProbes;
+        m_threadPool.start(new ProbeJob(this, path, entry.probeId));
+        return false;
+    }
+
+private:
+    struct Entry
+    {
+        Entry() : time(0), pending(false), probeId(0) {}
+
+        FileProbe probe;
+        qint64 time; // when the probe finished, or was queued while pending
+        bool pending;
+        quint64 probeId;
+    };
+
+    class ProbeJob : public QRunnable
+    {
+    public:
+        ProbeJob(FileProbeCache *cache, const QString &path, quint64 probeId)
+            : m_cache(cache), m_path(path), m_probeId(probeId) {}
+
+        void run() override
+        {
+            {
+                QMutexLocker locker(&m_cache->m_mutex);
+                --m_cache->m_queuedProbes;
+                QHash<QString, Entry>::ConstIterator it = m_cache->m_entries.constFind(m_path);
+                if (it == m_cache->m_entries.constEnd() || !it->pending || it->probeId != m_probeId) {
+                    return;
+                }
+            }
+
+            const FileProbe probe = m_cache->m_probeFunction(m_path);
+            QMutexLocker locker(&m_cache->m_mutex);
+            Entry &entry = m_cache->m_entries[m_path];
+            entry.probe = probe;
+            entry.time = m_cache->m_clock.elapsed();
+            entry.pending = false;
+        }
+
+    private:
+        FileProbeCache *m_cache;
+        QString m_path;
+        quint64 m_probeId;
+    };
+
+    void removeFinishedEntries(qint64 now)
+    {
+        QHash<QString, Entry>::Iterator it = m_entries.begin();
+        while (it != m_entries.end()) {
+            if (it->pending && now - it->time < s_probeDeadline) {
+                ++it;
+            } else {
+                it = m_entries.erase(it);
+            }
+        }
+    }
+
+    const ProbeFunction m_probeFunction;
+    QMutex m_mutex;
+    QHash<QString, Entry> m_entries;
+    int m_queuedProbes; // started, but not running yet
+    quint64 m_lastProbeId;
+    QElapsedTimer m_clock;
+    QThreadPool m_threadPool;
+};
+
+static FileProbeCache *fileProbeCache()
+{
+    // Never deleted: destroying the thread pool would wait for probes stuck
+    // on a stalled mount when the application quits.
+    static FileProbeCache *cache = new FileProbeCache(probeFileNow);
+    return cache;
+}
+
+static FileProbeCache *executableProbeCache()
+{
+    // Never deleted, like fileProbeCache(): $PATH can contain a stalled mount too
+    static FileProbeCache *cache = new FileProbeCache(probeExecutableNow);
+    return cache;
+}
+
+// @returns false if the result is not known yet, see KUriFilterData::setAsynchronousFileChecks()
+static bool probeFile(const KUriFilterData &data, const QString &path, FileProbe *probe)
+{
+    if (!data.asynchronousFileChecks()) {
+        *probe = probeFileNow(path);
+        return true;
+    }
+    return fileProbeCache()->lookup(path, probe);
+}
+
+// Same as probeFile() for a command name looked up in $PATH
+static bool probeExecutable(const KUriFilterData &data, const QString &name, FileProbe *probe)
+{
+    if (!data.asynchronousFileChecks()) {
+        *probe = probeExecutableNow(name);
+        return true;
+    }
+    return executableProbeCache()->lookup(name, probe);
+}
+
 static bool isKnownProtocol(const QString &protocol)
 {
     if (KProtocolInfo::isKnownProtocol(protocol) || protocol == QLatin1String("mailto")) {
@@ -128,6 +336,9 @@ bool KShortUriFilter::filterUri( KUriFilterData& data ) const
 
   //QUrl url = data.uri();
   QString cmd = data.typedString();
+  // set when a file could not be checked without waiting
+  bool provisional = false;
+  setProvisional(data, false);
 
   int firstNonSlash = 0;
   while (firstNonSlash < cmd.length() && (cmd.at(firstNonSlash) == '/')) {
@@ -308,7 +519,10 @@ bool KShortUriFilter::filterUri( KUriFilterData& data ) const
     if ( pos > -1 )
     {
       const QString newPath = path.left( pos );
-      if ( QFile::exists( newPath ) )
+      FileProbe probe;
+      if ( !probeFile( data, newPath, &probe ) )
+        provisional = true;
+      else if ( probe.exists )
       {
         ref = path.mid( pos + 1 );
         path = newPath;
@@ -336,7 +550,7 @@ bool KShortUriFilter::filterUri( KUriFilterData& data ) const
                << "canBeLocalAbsolute=" << canBeLocalAbsolute
                << "isLocalFullPath=" << isLocalFullPath;*/
 
-  QT_STATBUF buff;
+  FileProbe probe;
   if ( canBeLocalAbsolute )
   {
     QString abs = QDir::cleanPath( abs_path );
@@ -348,7 +562,11 @@ bool KShortUriFilter::filterUri( KUriFilterData& data ) const
     abs = QDir::cleanPath(abs + '/' + path);
     qCDebug(category) << "checking whether " << abs << " exists.";
     // Check if it exists
-    if(QT_STAT(QFile::encodeName(abs), &buff) == 0) {
+    FileProbe absProbe;
+    if ( !probeFile( data, abs, &absProbe ) ) {
+      provisional = true;
+    } else if ( absProbe.exists ) {
+      probe = absProbe;
       path = abs; // yes -> store as the new cmd
       exists = true;
       isLocalFullPath = true;
@@ -356,7 +574,9 @@ bool KShortUriFilter::filterUri( KUriFilterData& data ) const
   }
 
   if (isLocalFullPath && !exists && !isMalformed) {
-    exists = QT_STAT(QFile::encodeName(path), &buff) == 0;
+    if ( !probeFile( data, path, &probe ) )
+      provisional = true;
+    exists = probe.exists;
 
     if ( !exists ) {
       // Support for name filter (/foo/*.txt), see also KonqMainWindow::detectNameFilter
@@ -366,18 +586,24 @@ bool KShortUriFilter::filterUri( KUriFilterData& data ) const
       {
         QString fileName = path.mid( lastSlash + 1 );
         QString testPath = path.left(lastSlash);
-        if ((fileName.indexOf('*') != -1 || fileName.indexOf('[') != -1 || fileName.indexOf( '?' ) != -1)
-                && QT_STAT(QFile::encodeName(testPath), &buff) == 0) {
-          nameFilter = fileName;
-          qCDebug(category) << "Setting nameFilter to" << nameFilter << "and path to" << testPath;
-          path = testPath;
-          exists = true;
+        FileProbe testProbe;
+        if (fileName.indexOf('*') != -1 || fileName.indexOf('[') != -1 || fileName.indexOf( '?' ) != -1) {
+          if (!probeFile(data, testPath, &testProbe)) {
+            provisional = true;
+          } else if (testProbe.exists) {
+            probe = testProbe;
+            nameFilter = fileName;
+            qCDebug(category) << "Setting nameFilter to" << nameFilter << "and path to" << testPath;
+            path = testPath;
+            exists = true;
+          }
         }
       }
     }
   }
 
   qCDebug(category) << "path =" << path << " isLocalFullPath=" << isLocalFullPath << " exists=" << exists << " url=" << url;
+  setProvisional(data, provisional);
   if( exists )
   {
     QUrl u = QUrl::fromLocalFile(path);
@@ -395,8 +621,8 @@ bool KShortUriFilter::filterUri( KUriFilterData& data ) const
     }
 
     // Can be abs path to file or directory, or to executable with args
-    bool isDir = ((buff.st_mode & QT_STAT_MASK) == QT_STAT_DIR);
-    if( !isDir && access ( QFile::encodeName(path).data(), X_OK) == 0 )
+    const bool isDir = probe.isDir;
+    if( !isDir && probe.isExecutable )
     {
       qCDebug(category) << "Abs path to EXECUTABLE";
       setFilteredUri( data, u );
@@ -405,7 +631,7 @@ bool KShortUriFilter::filterUri( KUriFilterData& data ) const
     }
 
     // Open "uri" as file:/xxx if it is a non-executable local resource.
-    if( isDir || (( buff.st_mode & QT_STAT_MASK ) == QT_STAT_REG) )
+    if( isDir || probe.isRegular )
     {
       qCDebug(category) << "Abs path as local file or directory";
       if ( !nameFilter.isEmpty() )
@@ -428,7 +654,10 @@ bool KShortUriFilter::filterUri( KUriFilterData& data ) const
     QString exe = removeArgs( cmd );
     qCDebug(category) << "findExe with" << exe;
 
-    if (!QStandardPaths::findExecutable( exe ).isNull() )
+    FileProbe exeProbe;
+    if ( !probeExecutable( data, exe, &exeProbe ) )
+      setProvisional( data, true );
+    else if ( exeProbe.isExecutable )
     {
       qCDebug(category) << "EXECUTABLE  exe=" << exe;
       setFilteredUri( data, QUrl::fromLocalFile( exe ));
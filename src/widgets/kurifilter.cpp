@@ -176,6 +176,8 @@ class KUriFilterDataPrivate
 public:
     explicit KUriFilterDataPrivate(const QUrl &u, const QString &typedUrl)
         : checkForExecs(true),
+          asynchronousFileChecks(false),
+          provisional(false),
           wasModified(true),
           uriType(KUriFilterData::Unknown),
           searchFilterOptions(KUriFilterData::SearchFilterOptionNone),
@@ -191,6 +193,8 @@ public:
     void setData(const QUrl &u, const QString &typedUrl)
     {
         checkForExecs = true;
+        asynchronousFileChecks = false;
+        provisional = false;
         wasModified = true;
         uriType = KUriFilterData::Unknown;
         searchFilterOptions = KUriFilterData::SearchFilterOptionNone;
@@ -215,6 +219,8 @@ public:
     {
         wasModified = data->wasModified;
         checkForExecs = data->checkForExecs;
+        asynchronousFileChecks = data->asynchronousFileChecks;
+        provisional = data->provisional;
         uriType = data->uriType;
         searchFilterOptions = data->searchFilterOptions;
 
@@ -235,6 +241,8 @@ public:
     }
 
     bool checkForExecs;
+    bool asynchronousFileChecks;
+    bool provisional;
     bool wasModified;
     KUriFilterData::UriTypes uriType;
     KUriFilterData::SearchFilterOptions searchFilterOptions;
@@ -321,6 +329,16 @@ bool KUriFilterData::checkForExecutables() const
     return d->checkForExecs;
 }
 
+bool KUriFilterData::asynchronousFileChecks() const
+{
+    return d->asynchronousFileChecks;
+}
+
+bool KUriFilterData::isProvisional() const
+{
+    return d->provisional;
+}
+
 QString KUriFilterData::typedString() const
 {
     return d->typedString;
@@ -440,6 +458,11 @@ void KUriFilterData::setCheckForExecutables(bool check)
     d->checkForExecs = check;
 }
 
+void KUriFilterData::setAsynchronousFileChecks(bool asynchronous)
+{
+    d->asynchronousFileChecks = asynchronous;
+}
+
 void KUriFilterData::setAlternateSearchProviders(const QStringList &providers)
 {
     d->alternateSearchProviders = providers;
@@ -537,6 +560,11 @@ void KUriFilterPlugin::setSearchProviders(KUriFilterData &data, const QList<KUri
     }
 }
 
+void KUriFilterPlugin::setProvisional(KUriFilterData &data, bool provisional) const
+{
+    data.d->provisional = provisional;
+}
+
 QString KUriFilterPlugin::iconNameFor(const QUrl &url, KUriFilterData::UriTypes type) const
 {
     return lookupIconNameFor(url, type);
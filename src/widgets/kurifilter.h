@@ -321,6 +321,25 @@ public:
      */
     bool checkForExecutables() const;
 
+    /**
+     * @return true if the filters should not wait for the local file system
+     * when checking whether the supplied uri is a local file.
+     *
+     * @see setAsynchronousFileChecks
+     * @since 5.50
+     */
+    bool asynchronousFileChecks() const;
+
+    /**
+     * @return true if the result of filtering is provisional because the
+     * local file system was still being checked. Filtering the same uri again
+     * a little later gives the final result.
+     *
+     * @see setAsynchronousFileChecks
+     * @since 5.50
+     */
+    bool isProvisional() const;
+
     /**
      * The string as typed by the user, before any URL processing is done.
      */
@@ -501,6 +520,21 @@ public:
      */
     void setCheckForExecutables(bool check);
 
+    /**
+     * Check whether the provided uri is a local file without blocking.
+     *
+     * By default, the filters look at the local file system while filtering,
+     * which can block for a long time on a slow or stalled network mount.
+     * If this is set to true, the filters only use what they found out
+     * recently and look at the file system in the background otherwise.
+     * The result is then marked as provisional, see isProvisional().
+     * This is useful for filtering text on each key press, e.g. in location
+     * bars. The default value is false.
+     *
+     * @since 5.50
+     */
+    void setAsynchronousFileChecks(bool asynchronous);
+
     /**
      * Same as above except the argument is a URL.
      *
@@ -728,6 +762,13 @@ protected:
      */
     void setSearchProviders(KUriFilterData &data, const QList<KUriFilterSearchProvider *> &providers) const;
 
+    /**
+     * Marks the result in @p data as provisional, see KUriFilterData::isProvisional().
+     *
+     * @since 5.50
+     */
+    void setProvisional(KUriFilterData &data, bool provisional) const;
+
     /**
      * Returns the icon name for the given @p url and URI @p type.
      *
@@ -0,0 +1,129 @@
+/*
+   This file is part of the KDE libraries
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License version 2 as published by the Free Software Foundation.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LIB.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+*/
+
+#include <QCoreApplication>
+#include <QCryptographicHash>
+#include <QDataStream>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QTemporaryDir>
+#include <QTextStream>
+
+#include "httpcacheindex.h"
+
+/**
+ * Measures how kio_http_cache_cleaner's index copes with a large cache.
+ *
+ * A synthetic cache of n entries (default 500000) with different use counts
+ * and sizes is created in a temporary directory, or in the directory given as
+ * second argument. Then the time for the first scan, for loading the persisted
+ * index at startup, and for evicting half of the cache is printed, along with
+ * the longest single slice. Note that every entry is a file; make sure there
+ * is enough disk space.
+ *
+ * Usage: httpcachecleanerbenchmark [entries [directory]]
+ */
+
+static const int s_sliceDuration = 100;
+
+static QString cacheFileName(int i)
+{
+    return QString::fromLatin1(QCryptographicHash::hash(QByteArray::number(i), QCryptographicHash::Sha1).toHex());
+}
+
+int main(int argc, char **argv)
+{
+    QCoreApplication app(argc, argv);
+    QTextStream out(stdout);
+
+    const QStringList args = app.arguments();
+    const int entries = args.count() > 1 ? args.at(1).toInt() : 500 * 1000;
+    QTemporaryDir tempDir;
+    const QString dir = args.count() > 2 ? args.at(2) : tempDir.path();
+
+    QElapsedTimer t;
+    t.start();
+    qsrand(42);
+    for (int i = 0; i < entries; i++) {
+        QByteArray data;
+        QDataStream stream(&data, QIODevice::WriteOnly);
+        stream.setVersion(QDataStream::Qt_4_5);
+        stream << quint8('A') << quint8('\n') << quint8(0) << quint8(0);
+        stream << qint32(qrand() % 100);
+        // mostly small files, a few large ones
+        data.resize(36 + (qrand() % 8 == 0 ? qrand() % (256 * 1024) : qrand() % 4096));
+
+        QFile file(dir + QLatin1Char('/') + cacheFileName(i));
+        if (!file.open(QIODevice::WriteOnly) || file.write(data) != data.size()) {
+            out << "could not write " << file.fileName() << endl;
+            return 1;
+        }
+    }
+    out << "populated " << entries << " entries in " << t.elapsed() << " ms" << endl;
+
+    qint64 totalSize;
+    {
+        HttpCacheIndex index(dir);
+        int longestSlice = 0;
+        t.start();
+        index.startScan();
+        forever {
+            QElapsedTimer slice;
+            slice.start();
+            const bool done = index.scanSlice(s_sliceDuration);
+            longestSlice = qMax(longestSlice, int(slice.elapsed()));
+            if (done) {
+                break;
+            }
+        }
+        out << "first scan: " << t.elapsed() << " ms, longest slice " << longestSlice << " ms" << endl;
+        t.start();
+        index.save();
+        out << "saving the index: " << t.elapsed() << " ms" << endl;
+        totalSize = index.totalSize();
+    }
+
+    HttpCacheIndex index(dir);
+    t.start();
+    if (!index.load()) {
+        out << "could not load the index" << endl;
+        return 1;
+    }
+    out << "startup with persisted index: " << t.elapsed() << " ms for " << index.count() << " entries" << endl;
+
+    t.start();
+    index.startEviction(totalSize / 2);
+    out << "building the eviction heap: " << t.elapsed() << " ms" << endl;
+
+    const int before = index.count();
+    int longestSlice = 0;
+    t.start();
+    forever {
+        QElapsedTimer slice;
+        slice.start();
+        const bool done = index.evictSlice(s_sliceDuration);
+        longestSlice = qMax(longestSlice, int(slice.elapsed()));
+        if (done) {
+            break;
+        }
+    }
+    out << "evicting " << before - index.count() << " entries: " << t.elapsed()
+        << " ms, longest slice " << longestSlice << " ms" << endl;
+
+    return 0;
+}
@@ -0,0 +1,149 @@
+/*
+   This file is part of the KDE libraries
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License version 2 as published by the Free Software Foundation.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LIB.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+*/
+
+#include <QCoreApplication>
+#include <QDateTime>
+#include <QElapsedTimer>
+#include <QTemporaryDir>
+#include <QTextStream>
+#include <QThread>
+
+#include <kconfig.h>
+
+#include "kcookiejar.h"
+
+/**
+ * Measures the cookie jar of kded_kcookiejar with a large number of cookies.
+ *
+ * A synthetic jar of 50000 cookies across 5000 domains (or the numbers given
+ * as arguments) is filled, half of them host cookies and half of them domain
+ * cookies with different paths. One in ten cookies expires two seconds after
+ * it was added. Then the time for looking up cookies for random URLs, for
+ * saving and loading the jar, both as text file and as snapshot, for
+ * recording changes in the journal, and for eating the expired cookies is
+ * printed.
+ *
+ * Usage: kcookiejarbenchmark [cookies [domains]]
+ */
+
+static const int s_lookups = 100 * 1000;
+
+static QString host(int domain)
+{
+    return QStringLiteral("www.site%1.example%2.com").arg(domain).arg(domain % 10);
+}
+
+int main(int argc, char **argv)
+{
+    QCoreApplication app(argc, argv);
+    QTextStream out(stdout);
+
+    const QStringList args = app.arguments();
+    const int cookies = args.count() > 1 ? args.at(1).toInt() : 50 * 1000;
+    const int domains = qMax(args.count() > 2 ? args.at(2).toInt() : 5 * 1000, 1);
+
+    KConfig config(QString(), KConfig::SimpleConfig);
+    KCookieJar jar;
+    jar.loadConfig(&config);
+
+    const qint64 now = QDateTime::currentMSecsSinceEpoch() / 1000;
+    const QString paths[] = { QStringLiteral("/"), QStringLiteral("/a"), QStringLiteral("/a/b") };
+    QElapsedTimer t;
+    t.start();
+    for (int i = 0; i < cookies; i++) {
+        const int domain = i % domains;
+        const QString cookieDomain = (i & 1) ? QStringLiteral(".site%1.example%2.com").arg(domain).arg(domain % 10) : QString();
+        const qint64 expireDate = (i % 10 == 0) ? now + 2 : now + 3600;
+        KHttpCookie cookie(host(domain), cookieDomain, paths[i % 3], QStringLiteral("name%1").arg(i),
+                           QStringLiteral("value%1").arg(i), expireDate);
+        jar.addCookie(cookie);
+    }
+    out << "adding " << cookies << " cookies for " << domains << " domains: " << t.elapsed() << " ms" << endl;
+
+    qsrand(42);
+    QStringList urls;
+    urls.reserve(1000);
+    for (int i = 0; i < 1000; i++) {
+        urls.append(QStringLiteral("http://%1/a/b/page%2.html").arg(host(qrand() % domains)).arg(i));
+    }
+
+    int found = 0;
+    t.start();
+    for (int i = 0; i < s_lookups; i++) {
+        found += jar.findCookies(urls.at(i % urls.count()), false, 0).isEmpty() ? 0 : 1;
+    }
+    out << s_lookups << " lookups: " << t.elapsed() << " ms, " << found << " with cookies" << endl;
+
+    // each policy change makes the jar work out the advice for every host again
+    jar.setDomainAdvice(QStringLiteral(".example1.com"), KCookieReject);
+    t.start();
+    for (int i = 0; i < s_lookups; i++) {
+        jar.findCookies(urls.at(i % urls.count()), false, 0);
+    }
+    out << s_lookups << " lookups after a policy change: " << t.elapsed() << " ms" << endl;
+    jar.setDomainAdvice(QStringLiteral(".example1.com"), KCookieDunno);
+
+    QTemporaryDir dir;
+    const QString fileName = dir.path() + QStringLiteral("/cookies");
+    t.start();
+    jar.saveCookies(fileName);
+    out << "saving: " << t.elapsed() << " ms" << endl;
+    {
+        KCookieJar loadedJar;
+        loadedJar.loadConfig(&config);
+        t.start();
+        loadedJar.loadCookies(fileName);
+        out << "loading: " << t.elapsed() << " ms" << endl;
+    }
+
+    const QString snapshotName = dir.path() + QStringLiteral("/cookies.snapshot");
+    jar.openCookieJournal(snapshotName);
+    t.start();
+    const QByteArray snapshot = jar.startCookieCompaction();
+    out << "making a snapshot: " << t.elapsed() << " ms, " << snapshot.size() << " bytes" << endl;
+    t.start();
+    jar.finishCookieCompaction(KCookieJar::writeCookieSnapshot(snapshotName, snapshot));
+    out << "writing the snapshot: " << t.elapsed() << " ms" << endl;
+    t.start();
+    for (int i = 0; i < 1000; i++) {
+        KHttpCookie cookie(host(i % domains), QString(), QStringLiteral("/"), QStringLiteral("journaled%1").arg(i),
+                           QStringLiteral("value%1").arg(i), now + 3600);
+        jar.addCookie(cookie);
+    }
+    out << "adding 1000 cookies with the journal open: " << t.elapsed() << " ms" << endl;
+    {
+        KCookieJar loadedJar;
+        loadedJar.loadConfig(&config);
+        t.start();
+        loadedJar.loadCookieSnapshot(snapshotName);
+        out << "loading the snapshot: " << t.elapsed() << " ms" << endl;
+        t.start();
+        loadedJar.openCookieJournal(snapshotName);
+        out << "replaying the journal: " << t.elapsed() << " ms" << endl;
+    }
+
+    QThread::sleep(3);
+    t.start();
+    jar.eatExpiredCookies();
+    out << "eating the expired cookies: " << t.elapsed() << " ms" << endl;
+    t.start();
+    jar.eatExpiredCookies();
+    out << "looking for expired cookies again: " << t.elapsed() << " ms" << endl;
+
+    return 0;
+}